@@ -0,0 +1,276 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___Blas_h
+#define DependencyTreeRNN___Blas_h
+
+#include <dlfcn.h>
+#include <string>
+
+extern "C" {
+#include <cblas.h>
+}
+
+
+/**
+ * Backends of the linear algebra of the RNN: the BLAS library
+ * linked with the program (e.g., OpenBLAS or MKL, see the Makefile),
+ * or reference loops, which run in the calling thread and do not
+ * depend on the library (e.g., to check or profile the library)
+ */
+enum BlasBackend {
+  c_blasLibrary = 0,
+  c_blasReference
+};
+
+
+/**
+ * Backend used by all the BLAS routines of the process
+ */
+inline BlasBackend &CurrentBlasBackend() {
+  static BlasBackend backend = c_blasLibrary;
+  return backend;
+}
+
+
+/**
+ * Select the backend by its name (library or reference);
+ * returns false if the name is unknown
+ */
+inline bool SetBlasBackend(const std::string &name) {
+  if (name == "library") {
+    CurrentBlasBackend() = c_blasLibrary;
+  } else if (name == "reference") {
+    CurrentBlasBackend() = c_blasReference;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Set the number of threads that the BLAS library uses within
+ * each call, so that it does not compete with the threads of the RNN
+ * (e.g., 1 when several threads train or evaluate the model).
+ * The functions of MKL and OpenBLAS are looked up at run time,
+ * so that the program links with any BLAS library.
+ * Returns false if the library does not let it be controlled.
+ */
+inline bool SetBlasThreads(int numThreads) {
+  const char *const names[] = {"MKL_Set_Num_Threads",
+                               "openblas_set_num_threads"};
+  for (int k = 0; k < 2; k++) {
+    void *function = dlsym(RTLD_DEFAULT, names[k]);
+    if (function != NULL) {
+      reinterpret_cast<void (*)(int)>(function)(numThreads);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+ * Reference loops of the BLAS routines (row-major matrices;
+ * a column-major matrix is the transpose of a row-major one)
+ */
+template <typename Scalar>
+void ReferenceGemv(const enum CBLAS_ORDER order,
+                   const enum CBLAS_TRANSPOSE transA,
+                   int m, int n, Scalar alpha,
+                   const Scalar *a, int lda,
+                   const Scalar *x, int incX,
+                   Scalar beta, Scalar *y, int incY) {
+  bool isTransposed = ((transA != CblasNoTrans) != (order == CblasColMajor));
+  if (order == CblasColMajor) {
+    int swap = m; m = n; n = swap;
+  }
+  // A is now a row-major m x n matrix, multiplied by x or transposed
+  int sizeY = isTransposed ? n : m;
+  int sizeX = isTransposed ? m : n;
+  for (int i = 0; i < sizeY; i++) {
+    y[i * incY] = (beta == 0) ? 0 : beta * y[i * incY];
+  }
+  for (int i = 0; i < m; i++) {
+    const Scalar *row = a + (long long)i * lda;
+    if (isTransposed) {
+      Scalar coeff = alpha * x[i * incX];
+      for (int j = 0; j < n; j++) {
+        y[j * incY] += coeff * row[j];
+      }
+    } else {
+      Scalar sum = 0;
+      for (int j = 0; j < sizeX; j++) {
+        sum += row[j] * x[j * incX];
+      }
+      y[i * incY] += alpha * sum;
+    }
+  }
+}
+template <typename Scalar>
+void ReferenceGemm(const enum CBLAS_ORDER order,
+                   const enum CBLAS_TRANSPOSE transA,
+                   const enum CBLAS_TRANSPOSE transB,
+                   int m, int n, int k, Scalar alpha,
+                   const Scalar *a, int lda,
+                   const Scalar *b, int ldb,
+                   Scalar beta, Scalar *c, int ldc) {
+  if (order == CblasColMajor) {
+    // C' = op(B)' * op(A)' in row-major order
+    ReferenceGemm(CblasRowMajor, transB, transA, n, m, k,
+                  alpha, b, ldb, a, lda, beta, c, ldc);
+    return;
+  }
+  bool isTransposedA = (transA != CblasNoTrans);
+  bool isTransposedB = (transB != CblasNoTrans);
+  for (int i = 0; i < m; i++) {
+    Scalar *rowC = c + (long long)i * ldc;
+    for (int j = 0; j < n; j++) {
+      rowC[j] = (beta == 0) ? 0 : beta * rowC[j];
+    }
+    for (int l = 0; l < k; l++) {
+      Scalar coeff = alpha *
+      (isTransposedA ? a[(long long)l * lda + i] : a[(long long)i * lda + l]);
+      if (isTransposedB) {
+        for (int j = 0; j < n; j++) {
+          rowC[j] += coeff * b[(long long)j * ldb + l];
+        }
+      } else {
+        const Scalar *rowB = b + (long long)l * ldb;
+        for (int j = 0; j < n; j++) {
+          rowC[j] += coeff * rowB[j];
+        }
+      }
+    }
+  }
+}
+
+
+/**
+ * Overloads of the BLAS routines used by the RNN, so that the code
+ * templated over the scalar type calls cblas_d* on doubles
+ * and cblas_s* on floats (or the reference loops,
+ * depending on the backend)
+ */
+
+/**
+ * Matrix-vector product: y <- alpha * A * x + beta * y
+ */
+inline void CblasGemv(const enum CBLAS_ORDER order,
+                      const enum CBLAS_TRANSPOSE transA,
+                      int m, int n, double alpha,
+                      const double *a, int lda,
+                      const double *x, int incX,
+                      double beta, double *y, int incY) {
+  if (CurrentBlasBackend() == c_blasReference) {
+    ReferenceGemv(order, transA, m, n, alpha, a, lda, x, incX, beta, y, incY);
+    return;
+  }
+  cblas_dgemv(order, transA, m, n, alpha, a, lda, x, incX, beta, y, incY);
+}
+inline void CblasGemv(const enum CBLAS_ORDER order,
+                      const enum CBLAS_TRANSPOSE transA,
+                      int m, int n, float alpha,
+                      const float *a, int lda,
+                      const float *x, int incX,
+                      float beta, float *y, int incY) {
+  if (CurrentBlasBackend() == c_blasReference) {
+    ReferenceGemv(order, transA, m, n, alpha, a, lda, x, incX, beta, y, incY);
+    return;
+  }
+  cblas_sgemv(order, transA, m, n, alpha, a, lda, x, incX, beta, y, incY);
+}
+
+
+/**
+ * Matrix-matrix product: C <- alpha * op(A) * op(B) + beta * C
+ */
+inline void CblasGemm(const enum CBLAS_ORDER order,
+                      const enum CBLAS_TRANSPOSE transA,
+                      const enum CBLAS_TRANSPOSE transB,
+                      int m, int n, int k, double alpha,
+                      const double *a, int lda,
+                      const double *b, int ldb,
+                      double beta, double *c, int ldc) {
+  if (CurrentBlasBackend() == c_blasReference) {
+    ReferenceGemm(order, transA, transB, m, n, k,
+                  alpha, a, lda, b, ldb, beta, c, ldc);
+    return;
+  }
+  cblas_dgemm(order, transA, transB, m, n, k,
+              alpha, a, lda, b, ldb, beta, c, ldc);
+}
+inline void CblasGemm(const enum CBLAS_ORDER order,
+                      const enum CBLAS_TRANSPOSE transA,
+                      const enum CBLAS_TRANSPOSE transB,
+                      int m, int n, int k, float alpha,
+                      const float *a, int lda,
+                      const float *b, int ldb,
+                      float beta, float *c, int ldc) {
+  if (CurrentBlasBackend() == c_blasReference) {
+    ReferenceGemm(order, transA, transB, m, n, k,
+                  alpha, a, lda, b, ldb, beta, c, ldc);
+    return;
+  }
+  cblas_sgemm(order, transA, transB, m, n, k,
+              alpha, a, lda, b, ldb, beta, c, ldc);
+}
+
+
+/**
+ * Vector scaling: x <- alpha * x
+ */
+template <typename Scalar>
+void ReferenceScal(int n, Scalar alpha, Scalar *x, int incX) {
+  for (int i = 0; i < n; i++) {
+    x[i * incX] *= alpha;
+  }
+}
+inline void CblasScal(int n, double alpha, double *x, int incX) {
+  if (CurrentBlasBackend() == c_blasReference) {
+    ReferenceScal(n, alpha, x, incX);
+    return;
+  }
+  cblas_dscal(n, alpha, x, incX);
+}
+inline void CblasScal(int n, float alpha, float *x, int incX) {
+  if (CurrentBlasBackend() == c_blasReference) {
+    ReferenceScal(n, alpha, x, incX);
+    return;
+  }
+  cblas_sscal(n, alpha, x, incX);
+}
+
+
+/**
+ * Vector addition: y <- alpha * x + y
+ */
+template <typename Scalar>
+void ReferenceAxpy(int n, Scalar alpha,
+                   const Scalar *x, int incX, Scalar *y, int incY) {
+  for (int i = 0; i < n; i++) {
+    y[i * incY] += alpha * x[i * incX];
+  }
+}
+inline void CblasAxpy(int n, double alpha,
+                      const double *x, int incX, double *y, int incY) {
+  if (CurrentBlasBackend() == c_blasReference) {
+    ReferenceAxpy(n, alpha, x, incX, y, incY);
+    return;
+  }
+  cblas_daxpy(n, alpha, x, incX, y, incY);
+}
+inline void CblasAxpy(int n, float alpha,
+                      const float *x, int incX, float *y, int incY) {
+  if (CurrentBlasBackend() == c_blasReference) {
+    ReferenceAxpy(n, alpha, x, incX, y, incY);
+    return;
+  }
+  cblas_saxpy(n, alpha, x, incX, y, incY);
+}
+
+#endif
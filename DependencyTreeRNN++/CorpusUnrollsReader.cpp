@@ -11,26 +11,121 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <string.h>
 #include <assert.h>
 #include "CorpusUnrollsReader.h"
 #include "ReadJson.h"
 
 using namespace std;
 
+/**
+ * Header of the binary book files, followed by the offsets
+ * of the sentences (numSentences + 1 int), the offsets of the unrolls
+ * (numUnrolls + 1 int), padding to 8 bytes, and the tokens
+ */
+struct BinaryBookHeader {
+  char magic[8];
+  int version;
+  int sizeToken;
+  unsigned long long signature;
+  int numSentences;
+  int numUnrolls;
+  long long numTokens;
+};
+static const char c_binaryBookMagic[8] = {'D', 'T', 'R', 'N', 'N', 'B', 'K', '\0'};
+static const int c_binaryBookVersion = 1;
+
+
+/**
+ * Size of the offsets of a binary book, padded to 8 bytes
+ */
+static size_t BinaryBookOffsetsSize(int numSentences, int numUnrolls) {
+  size_t size = sizeof(int) * ((size_t)numSentences + 1 + numUnrolls + 1);
+  return (size + 7) & ~((size_t)7);
+}
+
+
+/**
+ * Copy a book: a copy of an owned book points to its own storage,
+ * whereas a copy of a view points to the same memory-mapped file
+ */
+BookUnrolls &BookUnrolls::operator=(const BookUnrolls &other) {
+  if (this == &other) {
+    return *this;
+  }
+  _tokenStorage = other._tokenStorage;
+  _unrollOffsetStorage = other._unrollOffsetStorage;
+  _sentenceOffsetStorage = other._sentenceOffsetStorage;
+  _isView = other._isView;
+  if (_isView) {
+    _tokens = other._tokens;
+    _unrollOffsets = other._unrollOffsets;
+    _sentenceOffsets = other._sentenceOffsets;
+  } else {
+    UpdateStoragePointers();
+  }
+  _numSentences = other._numSentences;
+  _sentenceIndex = other._sentenceIndex;
+  _unrollIndex = other._unrollIndex;
+  _tokenIndex = other._tokenIndex;
+  _numTokens = other._numTokens;
+  UpdateCurrentToken();
+  return *this;
+}
+
+
+/**
+ * Exchange the content of two books, without copying the tokens
+ * (the storage pointers remain valid as the vectors swap their buffers)
+ */
+void BookUnrolls::Swap(BookUnrolls &other) {
+  _tokenStorage.swap(other._tokenStorage);
+  _unrollOffsetStorage.swap(other._unrollOffsetStorage);
+  _sentenceOffsetStorage.swap(other._sentenceOffsetStorage);
+  std::swap(_tokens, other._tokens);
+  std::swap(_unrollOffsets, other._unrollOffsets);
+  std::swap(_sentenceOffsets, other._sentenceOffsets);
+  std::swap(_isView, other._isView);
+  std::swap(_currentToken, other._currentToken);
+  std::swap(_sentenceIndex, other._sentenceIndex);
+  std::swap(_unrollIndex, other._unrollIndex);
+  std::swap(_tokenIndex, other._tokenIndex);
+  std::swap(_numSentences, other._numSentences);
+  std::swap(_numTokens, other._numTokens);
+}
+
+
+/**
+ * Return a read-only view over the content of the book,
+ * with its own position in the book (at the first sentence).
+ * The book must remain unchanged while the view is used.
+ */
+BookUnrolls BookUnrolls::View() const {
+  BookUnrolls view;
+  view._tokens = _tokens;
+  view._unrollOffsets = _unrollOffsets;
+  view._sentenceOffsets = _sentenceOffsets;
+  view._isView = true;
+  view._numSentences = _numSentences;
+  view._numTokens = _numTokens;
+  view.ResetSentence();
+  return view;
+}
+
+
 /**
  * Add a token to the book
  */
 void BookUnrolls::AddToken(bool isNewSentence, bool isNewUnroll,
                            int pos, int wordAsContext, int wordAsTarget,
                            double discount, int label) {
+  // A view over a binary book file is read-only
+  assert(!_isView);
   
   // Add a new sentence?
   if (isNewSentence) {
-    Sentence s;
-    _sentences.push_back(s);
-    _numUnrollsInSentence.push_back(0);
-    vector<int> v;
-    _numTokensInUnrollSentence.push_back(v);
+    // The new sentence starts after the last unroll
+    _sentenceOffsetStorage.push_back(_sentenceOffsetStorage.back());
     // Bookkeeping of sentences and unrolls
     _numSentences++;
     _sentenceIndex = _numSentences - 1;
@@ -39,12 +134,11 @@ void BookUnrolls::AddToken(bool isNewSentence, bool isNewUnroll,
   }
   // Add a new unroll?
   if (isNewUnroll) {
-    Unroll u;
-    _sentences[_sentenceIndex].push_back(u);
+    // The new unroll starts after the last token
+    _unrollOffsetStorage.push_back(_unrollOffsetStorage.back());
     // Bookkeeping of unrolls
-    _numUnrollsInSentence[_sentenceIndex]++;
-    _unrollIndex = _numUnrollsInSentence[_sentenceIndex] - 1;
-    _numTokensInUnrollSentence[_sentenceIndex].push_back(0);
+    _sentenceOffsetStorage.back()++;
+    _unrollIndex = NumUnrolls(_sentenceIndex) - 1;
     _tokenIndex = 0;
   }
   // Add a new token
@@ -54,9 +148,105 @@ void BookUnrolls::AddToken(bool isNewSentence, bool isNewUnroll,
   newToken.wordAsTarget = wordAsTarget;
   newToken.discount = discount;
   newToken.label = label;
-  _sentences[_sentenceIndex][_unrollIndex].push_back(newToken);
-  _numTokensInUnrollSentence[_sentenceIndex][_unrollIndex]++;
+  _tokenStorage.push_back(newToken);
+  _unrollOffsetStorage.back()++;
   _numTokens++;
+  UpdateStoragePointers();
+}
+
+
+/**
+ * Write the book to a flat binary file. The signature identifies
+ * the vocabulary used to index the words and labels of the book.
+ * The file is written under a temporary name then renamed,
+ * so that an interrupted compilation never leaves a truncated book.
+ */
+bool BookUnrolls::SaveBinary(const string &filename,
+                             unsigned long long signature) const {
+  string tmpFilename = filename + ".tmp";
+  FILE *fo = fopen(tmpFilename.c_str(), "wb");
+  if (fo == NULL) {
+    cerr << "Cannot write binary book " << tmpFilename << endl;
+    return false;
+  }
+  BinaryBookHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, c_binaryBookMagic, sizeof(header.magic));
+  header.version = c_binaryBookVersion;
+  header.sizeToken = (int)sizeof(Token);
+  header.signature = signature;
+  header.numSentences = _numSentences;
+  header.numUnrolls = _sentenceOffsets[_numSentences];
+  header.numTokens = _numTokens;
+  bool ok = (fwrite(&header, sizeof(header), 1, fo) == 1);
+  // Offsets of the sentences and of the unrolls, then padding
+  size_t numSentenceOffsets = (size_t)header.numSentences + 1;
+  size_t numUnrollOffsets = (size_t)header.numUnrolls + 1;
+  ok = ok && (fwrite(_sentenceOffsets, sizeof(int), numSentenceOffsets, fo)
+              == numSentenceOffsets);
+  ok = ok && (fwrite(_unrollOffsets, sizeof(int), numUnrollOffsets, fo)
+              == numUnrollOffsets);
+  size_t padding = BinaryBookOffsetsSize(header.numSentences, header.numUnrolls)
+  - sizeof(int) * (numSentenceOffsets + numUnrollOffsets);
+  long long zero = 0;
+  ok = ok && (fwrite(&zero, 1, padding, fo) == padding);
+  // Tokens
+  size_t numTokens = (size_t)_numTokens;
+  if (numTokens > 0) {
+    ok = ok && (fwrite(_tokens, sizeof(Token), numTokens, fo) == numTokens);
+  }
+  ok = (fclose(fo) == 0) && ok;
+  if (ok) {
+    ok = (rename(tmpFilename.c_str(), filename.c_str()) == 0);
+  }
+  if (!ok) {
+    cerr << "Failed writing binary book " << filename << endl;
+    remove(tmpFilename.c_str());
+  }
+  return ok;
+}
+
+
+/**
+ * Turn the book into a read-only view over the content
+ * of a (memory-mapped) binary book file. Returns false if the data
+ * is not a valid binary book or if its vocabulary signature differs.
+ */
+bool BookUnrolls::MapBinary(const char *data, size_t size,
+                            unsigned long long signature) {
+  Burn();
+  // Check the header
+  if ((data == NULL) || (size < sizeof(BinaryBookHeader))) {
+    return false;
+  }
+  BinaryBookHeader header;
+  memcpy(&header, data, sizeof(header));
+  if ((memcmp(header.magic, c_binaryBookMagic, sizeof(header.magic)) != 0) ||
+      (header.version != c_binaryBookVersion) ||
+      (header.sizeToken != (int)sizeof(Token)) ||
+      (header.signature != signature) ||
+      (header.numSentences < 0) || (header.numUnrolls < 0) ||
+      (header.numTokens < 0)) {
+    return false;
+  }
+  size_t sizeOffsets =
+  BinaryBookOffsetsSize(header.numSentences, header.numUnrolls);
+  size_t expectedSize = sizeof(header) + sizeOffsets +
+  sizeof(Token) * (size_t)header.numTokens;
+  if (size != expectedSize) {
+    return false;
+  }
+  // Point to the offsets and tokens within the mapped file
+  const char *offsets = data + sizeof(header);
+  _sentenceOffsets = reinterpret_cast<const int *>(offsets);
+  _unrollOffsets = _sentenceOffsets + header.numSentences + 1;
+  _tokens = (header.numTokens > 0) ?
+  reinterpret_cast<const Token *>(offsets + sizeOffsets) : NULL;
+  _isView = true;
+  _numSentences = header.numSentences;
+  _numTokens = (long)header.numTokens;
+  ResetSentence();
+  return true;
 }
 
 
@@ -98,7 +288,7 @@ int BookUnrolls::NextSentence() {
  * Go to the next unroll in the sentence
  */
 int BookUnrolls::NextUnrollInSentence() {
-  int n_unrolls = _numUnrollsInSentence[_sentenceIndex];
+  int n_unrolls = NumUnrolls(_sentenceIndex);
   if (_unrollIndex >= (n_unrolls - 1)) {
     // Return to unroll 0 in the current sentence...
     ResetUnroll();
@@ -122,9 +312,9 @@ int BookUnrolls::NextTokenInUnroll() {
   if (_tokenIndex < 0)
     return -1;
   // Number of tokens in sentence
-  int _numTokens = _numTokensInUnrollSentence[_sentenceIndex][_unrollIndex];
+  int numTokensInUnroll = NumTokens(_sentenceIndex, _unrollIndex);
   // Go to the next token or stop
-  if (_tokenIndex < (_numTokens - 1)) {
+  if (_tokenIndex < (numTokensInUnroll - 1)) {
     _tokenIndex++;
     UpdateCurrentToken();
   } else {
@@ -153,7 +343,7 @@ void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
   
   // Copy the labels as they are
   for (int k = 0; k < other.NumLabels(); k++) {
-    InsertLabel(other.labelsReverse[k]);
+    InsertLabel(other.labels.String(k));
   }
   
   // Initialize a vector of filtered word counts
@@ -169,7 +359,7 @@ void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
   // Note that we start the indexing at 3 because we already stored
   // <unk> and </s>
   for (int k = 2; k < other.NumWords(); k++) {
-    string word = other.vocabularyReverse[k];
+    string word = other.vocabulary.String(k);
     double wordFreq = ceil(other.wordCountsDiscounted[k]);
     if (wordFreq >= _minWordOccurrence) {
       pair<string, double> p(word, wordFreq);
@@ -192,10 +382,8 @@ void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
   
   // Completely clear the corpus word vocabulary
   // (not the labels)
-  vocabulary.clear();
-  vocabularyReverse.clear();
+  vocabulary.Clear();
   wordCountsDiscounted.clear();
-  _vocabSizeWords = 0;
 
   // Now we can set the number of </s> tokens to 0
   // (it never happens, because of the tree parsing)
@@ -208,7 +396,7 @@ void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
     InsertWord(word, wordFreq);
   }
   // Note the OOV tag
-  _oov = vocabulary["<unk>"];
+  _oov = vocabulary.Find("<unk>");
 }
 
 
@@ -218,28 +406,24 @@ void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
 void CorpusUnrolls::CopyVocabulary(CorpusUnrolls &other) {
   
   // Completely clear the corpus word vocabulary and labels
-  labels.clear();
-  labelsReverse.clear();
-  vocabulary.clear();
-  vocabularyReverse.clear();
+  labels.Clear();
+  vocabulary.Clear();
   wordCountsDiscounted.clear();
-  _vocabSizeWords = 0;
-  _vocabSizeLabels = 0;
 
   // Copy the labels as they are
   for (int k = 0; k < other.NumLabels(); k++) {
-    InsertLabel(other.labelsReverse[k]);
+    InsertLabel(other.labels.String(k));
   }
   
   // Insert the words from the other corpus into the vocabulary
   for (int k = 0; k < other.NumWords(); k++) {
-    string word = other.vocabularyReverse[k];
+    string word = other.vocabulary.String(k);
     double wordFreq = other.wordCountsDiscounted[k];
     InsertWord(word, wordFreq);
   }
 
   // Note the OOV tag
-  _oov = vocabulary["<unk>"];
+  _oov = vocabulary.Find("<unk>");
 }
 
 
@@ -252,11 +436,11 @@ void CorpusUnrolls::ExportVocabulary(const string &filename) {
   vocabFile << NumWords() << "\t" << NumLabels() << "\n";
   // Write the labels
   for (int k = 0; k < NumLabels(); k++) {
-    vocabFile << k << "\t" << labelsReverse[k] << "\n";
+    vocabFile << k << "\t" << labels.Data(k) << "\n";
   }
   // Write the words and their discount factors
   for (int k = 0; k < NumWords(); k++) {
-    vocabFile << k << "\t" << vocabularyReverse[k]
+    vocabFile << k << "\t" << vocabulary.Data(k)
     << "\t" << wordCountsDiscounted[k] << "\n";
   }
   vocabFile.close();
@@ -274,13 +458,9 @@ void CorpusUnrolls::ImportVocabulary(const string &filename) {
   assert(vocabFile.is_open());
 
   // Completely clear the corpus word vocabulary and labels
-  labels.clear();
-  labelsReverse.clear();
-  vocabulary.clear();
-  vocabularyReverse.clear();
+  labels.Clear();
+  vocabulary.Clear();
   wordCountsDiscounted.clear();
-  _vocabSizeWords = 0;
-  _vocabSizeLabels = 0;
 
   // Read the header line
   string line;
@@ -323,7 +503,7 @@ void CorpusUnrolls::ImportVocabulary(const string &filename) {
   vocabFile.close();
 
   // Note the OOV tag
-  _oov = vocabulary["<unk>"];
+  _oov = vocabulary.Find("<unk>");
 
   printf("Vocab size: %d\n", NumWords());
   printf("Unknown tag at: %d\n", _oov);
@@ -342,7 +522,8 @@ long CorpusUnrolls::ReadVocabulary(bool mergeLabel) {
     // Open the training file, load it to a JSON structure
     // and add words to the corpus
     ReadJson *train_json =
-    new ReadJson(_bookFilenames[k], *this, true, false, mergeLabel);
+    new ReadJson(_bookFilenames[k], *this, m_currentBook,
+                 true, false, mergeLabel);
     nTokens = m_currentBook.NumTokens();
     // Free the memory
     delete train_json;
@@ -351,19 +532,182 @@ long CorpusUnrolls::ReadVocabulary(bool mergeLabel) {
 }
 
 
+/**
+ * Restore an order of the books and position the corpus
+ * so that a given book is read next
+ */
+bool CorpusUnrolls::RestoreBookOrder(const vector<string> &filenames,
+                                     int nextBook) {
+  vector<string> sortedBooks(_bookFilenames);
+  vector<string> sortedOrder(filenames);
+  sort(sortedBooks.begin(), sortedBooks.end());
+  sort(sortedOrder.begin(), sortedOrder.end());
+  if ((sortedBooks != sortedOrder) ||
+      (nextBook < 0) || (nextBook >= NumBooks())) {
+    return false;
+  }
+  _bookFilenames = filenames;
+  // The next call to NextBook goes to that book
+  _currentBookIndex = (nextBook == 0) ? (NumBooks() - 1) : (nextBook - 1);
+  return true;
+}
+
+
 /**
  * Read the current book into memory
  */
 void CorpusUnrolls::ReadBook(bool mergeLabel) {
+  ReadBookInto(_bookFilenames[_currentBookIndex], mergeLabel, m_currentBook);
+}
+
+
+/**
+ * Read a single sentence, given as the JSON list of its unrolls,
+ * into a book (only looking up the vocabulary).
+ * Returns false if the JSON is malformed.
+ */
+bool CorpusUnrolls::ReadSentenceFromJson(const string &json, bool mergeLabel,
+                                         BookUnrolls &book) {
+  book.Burn();
+  ReadJson reader(json.data(), json.data() + json.size(),
+                  *this, book, mergeLabel);
+  return reader.IsParsed();
+}
+
+
+/**
+ * Go to the next book and start reading it in a background thread,
+ * while the current book is still being used.
+ * The background thread only looks up the vocabulary,
+ * which must not be modified until the book is swapped in.
+ */
+void CorpusUnrolls::PrefetchNextBook(bool mergeLabel) {
+  if (_prefetchThread.joinable()) {
+    _prefetchThread.join();
+  }
+  NextBook();
+  string filename = _bookFilenames[_currentBookIndex];
+  _prefetchThread = thread([this, filename, mergeLabel]() {
+    ReadBookInto(filename, mergeLabel, _prefetchedBook);
+  });
+}
+
+
+/**
+ * Wait for the book read in the background, and hand it over
+ * to the current book (without copying it)
+ */
+void CorpusUnrolls::SwapInPrefetchedBook() {
+  if (_prefetchThread.joinable()) {
+    _prefetchThread.join();
+  }
+  m_currentBook.Swap(_prefetchedBook);
+  _prefetchedBook.Burn();
+}
+
+
+/**
+ * Read a book (from its JSON file or its binary book file) into memory
+ */
+void CorpusUnrolls::ReadBookInto(const string &filename, bool mergeLabel,
+                                 BookUnrolls &book) {
   
   // "Burn" the previous book, if any, to initialize it
-  m_currentBook.Burn();
+  book.Burn();
+
+  // Use the binary book file if it has already been compiled
+  unsigned long long signature = 0;
+  if (!_binaryBookPath.empty()) {
+    signature = VocabularySignature(mergeLabel);
+    if (MapBinaryBook(filename, signature, book)) {
+      cout << "Mapped binary book " << BinaryBookFilename(filename)
+      << " (" << book.NumSentences() << " sentences; "
+      << book.NumTokens() << " tokens)\n";
+      return;
+    }
+  }
+
   // Open the training file, load it to a JSON structure
   // and add words to the corpus
   ReadJson *train_json =
-  new ReadJson(_bookFilenames[_currentBookIndex], *this, false, true, mergeLabel);
+  new ReadJson(filename, *this, book, false, true, mergeLabel);
   // Free the memory
   delete train_json;
+
+  // Compile the book into a binary book file for the next epochs
+  if (!_binaryBookPath.empty()) {
+    string binaryFilename = BinaryBookFilename(filename);
+    if (book.SaveBinary(binaryFilename, signature)) {
+      cout << "Compiled binary book " << binaryFilename << endl;
+    }
+  }
+}
+
+
+/**
+ * Name of the binary book file corresponding to a JSON book
+ */
+string CorpusUnrolls::BinaryBookFilename(const string &filename) const {
+  string basename(filename);
+  size_t sep = filename.find_last_of("\\/");
+  if (sep != string::npos) {
+    basename = filename.substr(sep + 1);
+  }
+  string path(_binaryBookPath);
+  if (!path.empty() && (path[path.size() - 1] != '/')) {
+    path += "/";
+  }
+  return path + basename + ".bin";
+}
+
+
+/**
+ * Map the binary book file corresponding to a JSON book
+ * (if it is valid and up-to-date) into a book view
+ */
+bool CorpusUnrolls::MapBinaryBook(const string &filename,
+                                  unsigned long long signature,
+                                  BookUnrolls &book) {
+  string binaryFilename = BinaryBookFilename(filename);
+  MemoryMappedFile &mapping = _mappedBooks[binaryFilename];
+  if (!mapping.IsOpen() && !mapping.Open(binaryFilename)) {
+    return false;
+  }
+  if (!book.MapBinary(mapping.Data(), mapping.Size(), signature)) {
+    // Stale or invalid binary book: it needs to be compiled again
+    mapping.Close();
+    return false;
+  }
+  // Start paging in the book
+  mapping.WillNeed();
+  return true;
+}
+
+
+/**
+ * Signature of the vocabulary of words and labels
+ * used to index the tokens of the binary book files
+ * (64-bit FNV-1a hash of the words and labels in index order)
+ */
+unsigned long long CorpusUnrolls::VocabularySignature(bool mergeLabel) {
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned long long prime = 1099511628211ULL;
+  // Hash one string, followed by a separator
+  auto hashString = [&hash, prime](const string &str) {
+    for (size_t k = 0; k < str.size(); k++) {
+      hash = (hash ^ (unsigned char)str[k]) * prime;
+    }
+    hash = (hash ^ 0xFF) * prime;
+  };
+  hashString(mergeLabel ? "merged" : "separate");
+  hashString(to_string(_oov));
+  for (int k = 0; k < NumWords(); k++) {
+    hashString(vocabulary.String(k));
+  }
+  for (int k = 0; k < NumLabels(); k++) {
+    hashString(labels.String(k));
+  }
+  return hash;
 }
 
 
@@ -372,27 +716,12 @@ void CorpusUnrolls::ReadBook(bool mergeLabel) {
  */
 int CorpusUnrolls::InsertWord(const string &word, double discount) {
   
-  // Try to find the word
-  int wordIndex = LookUpWord(word);
-  if (wordIndex == _oov) {
-    // Could not find word: insert it to the vocabulary
-    wordIndex = _vocabSizeWords;
-    pair<string, int> kv(word, wordIndex);
-    vocabulary.insert(kv);
-    pair<int, string> kv2(wordIndex, word);
-    vocabularyReverse.insert(kv2);
-    _vocabSizeWords++;
-  } else {
-    wordIndex = vocabulary[word];
-  }
-  
-  // Find the current (dis)count of the word
-  unordered_map<int, double>::iterator it2 =
-  wordCountsDiscounted.find(wordIndex);
-  if (it2 == wordCountsDiscounted.end()) {
-    pair<int, double> kv(wordIndex, discount);
-    wordCountsDiscounted.insert(kv);
+  // Find the word, or insert it at the end of the vocabulary
+  int wordIndex = vocabulary.Insert(word);
+  if (wordIndex == (int)wordCountsDiscounted.size()) {
+    wordCountsDiscounted.push_back(discount);
   } else {
+    // Update the current (dis)count of the word
     wordCountsDiscounted[wordIndex] += discount;
   }
   
@@ -405,23 +734,7 @@ int CorpusUnrolls::InsertWord(const string &word, double discount) {
  * Insert a label into the vocabulary, if new
  */
 int CorpusUnrolls::InsertLabel(const string &label) {
-  
-  // Try to find the label
-  int labelIndex = LookUpLabel(label);
-  if (labelIndex == -1) {
-    // Could not find word: insert it to the vocabulary
-    labelIndex = _vocabSizeLabels;
-    pair<string, int> kv(label, labelIndex);
-    labels.insert(kv);
-    pair<int, string> kv2(labelIndex, label);
-    labelsReverse.insert(kv2);
-    _vocabSizeLabels++;
-  } else {
-    labelIndex = labels[label];
-  }
-  
-  // Simply return the label index
-  return labelIndex;
+  return labels.Insert(label);
 }
 
 
@@ -429,15 +742,8 @@ int CorpusUnrolls::InsertLabel(const string &label) {
  * Look-up a word in the vocabulary
  */
 int CorpusUnrolls::LookUpWord(const string &word) {
-  
-  // Try to find the word
-  int wordIndex = _oov;
-  unordered_map<string, int>::iterator it =
-  vocabulary.find(word);
-  if (it != vocabulary.end()) {
-    wordIndex = vocabulary[word];
-  }
-  return wordIndex;
+  int wordIndex = vocabulary.Find(word);
+  return (wordIndex < 0) ? _oov : wordIndex;
 }
 
 
@@ -445,13 +751,5 @@ int CorpusUnrolls::LookUpWord(const string &word) {
  * Look-up a label in the vocabulary
  */
 int CorpusUnrolls::LookUpLabel(const string &label) {
-  
-  // Try to find the word
-  int labelIndex = -1;
-  unordered_map<string, int>::iterator it =
-  labels.find(label);
-  if (it != labels.end()) {
-    labelIndex = labels[label];
-  }
-  return labelIndex;
+  return labels.Find(label);
 }
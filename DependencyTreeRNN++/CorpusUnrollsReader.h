@@ -11,34 +11,33 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <unordered_map>
 #include <algorithm>
 #include <random>
+#include <thread>
+#include "MemoryMappedFile.h"
+#include "StringTable.h"
 
 /**
- * Basic unit of a text: a token
+ * Basic unit of a text: a token.
+ * The fields are ordered so that the structure has no padding,
+ * as it is stored as is in the binary book files.
  */
 struct Token {
   int pos;
   int wordAsContext;
   int wordAsTarget;
-  double discount;
   int label;
+  double discount;
 };
 
-/**
- * Sentence unroll: a vector of tokens
- */
-typedef std::vector<Token> Unroll;
-
-/**
- * Sentence: a vector of unrolls
- */
-typedef std::vector<Unroll> Sentence;
-
 
 /**
- * Book: a class containing a vector of sentences
+ * Book: a class containing a vector of sentences, each sentence
+ * containing a vector of unrolls, and each unroll a vector of tokens.
+ * The tokens are stored contiguously, along with the offsets
+ * of the unrolls (in tokens) and of the sentences (in unrolls).
+ * The book either owns that storage (when it is parsed from a JSON file)
+ * or is a read-only view over a memory-mapped binary book file.
  */
 class BookUnrolls {
 public:
@@ -49,18 +48,40 @@ public:
   BookUnrolls() { Burn(); }
   ~BookUnrolls() { }
 
+  /**
+   * Copy constructor and assignment operator
+   * (a copy of an owned book points to its own storage)
+   */
+  BookUnrolls(const BookUnrolls &other) { *this = other; }
+  BookUnrolls &operator=(const BookUnrolls &other);
+
+  /**
+   * Exchange the content of two books, without copying the tokens
+   */
+  void Swap(BookUnrolls &other);
+
+  /**
+   * Return a read-only view over the content of the book,
+   * with its own position in the book (at the first sentence).
+   * The book must remain unchanged while the view is used.
+   */
+  BookUnrolls View() const;
+
   /**
    * Wipe-out all content of the book
    */
   void Burn() {
-    _sentences.clear();
-    _numUnrollsInSentence.clear();
-    _numTokensInUnrollSentence.clear();
+    _tokenStorage.clear();
+    _unrollOffsetStorage.assign(1, 0);
+    _sentenceOffsetStorage.assign(1, 0);
+    _isView = false;
+    UpdateStoragePointers();
     _numSentences = 0;
     _sentenceIndex = 0;
     _unrollIndex = 0;
     _tokenIndex = 0;
     _numTokens = 0;
+    _currentToken = NULL;
   }
 
   /**
@@ -70,6 +91,21 @@ public:
                 int pos, int wordAsContext, int wordAsTarget,
                 double discount, int label);
 
+  /**
+   * Write the book to a flat binary file. The signature identifies
+   * the vocabulary used to index the words and labels of the book.
+   */
+  bool SaveBinary(const std::string &filename,
+                  unsigned long long signature) const;
+
+  /**
+   * Turn the book into a read-only view over the content
+   * of a (memory-mapped) binary book file. Returns false if the data
+   * is not a valid binary book or if its vocabulary signature differs.
+   */
+  bool MapBinary(const char *data, size_t size,
+                 unsigned long long signature);
+
   /**
    * Return the number of sentences
    */
@@ -78,12 +114,17 @@ public:
   /**
    * Return the number of unrolls in sentence
    */
-  int NumUnrolls(int k) { return _numUnrollsInSentence[k]; }
+  int NumUnrolls(int k) {
+    return _sentenceOffsets[k + 1] - _sentenceOffsets[k];
+  }
 
   /**
    * Return the number of tokens in unroll of a sentence
    */
-  int NumTokens(int k, int j) { return _numTokensInUnrollSentence[k][j]; }
+  int NumTokens(int k, int j) {
+    int u = _sentenceOffsets[k] + j;
+    return _unrollOffsets[u + 1] - _unrollOffsets[u];
+  }
 
   /**
    * Return the index of the current sentence
@@ -121,8 +162,12 @@ public:
    * Update the current token
    */
   void UpdateCurrentToken() {
-    _currentToken =
-    &(_sentences[_sentenceIndex][_unrollIndex][_tokenIndex]);
+    if (_numTokens == 0) {
+      _currentToken = NULL;
+      return;
+    }
+    int u = _sentenceOffsets[_sentenceIndex] + _unrollIndex;
+    _currentToken = _tokens + _unrollOffsets[u] + _tokenIndex;
   }
 
   /**
@@ -165,13 +210,39 @@ public:
    */
   long NumTokens() { return _numTokens; }
 
+  /**
+   * Is the book a view over a memory-mapped binary book file?
+   */
+  bool IsView() const { return _isView; }
+
 protected:
 
-  // All the sentences of the book
-  std::vector<Sentence> _sentences;
+  /**
+   * Point to the tokens and offsets stored by the book itself
+   */
+  void UpdateStoragePointers() {
+    _tokens = _tokenStorage.empty() ? NULL : &(_tokenStorage[0]);
+    _unrollOffsets = &(_unrollOffsetStorage[0]);
+    _sentenceOffsets = &(_sentenceOffsetStorage[0]);
+  }
+
+  // Storage of all the tokens of the book, of the offsets
+  // of the unrolls (in tokens) and of the offsets of the sentences
+  // (in unrolls), when the book owns its content.
+  // Each vector of offsets ends with the total count.
+  std::vector<Token> _tokenStorage;
+  std::vector<int> _unrollOffsetStorage;
+  std::vector<int> _sentenceOffsetStorage;
 
-  // Copy of the current token
-  Token *_currentToken;
+  // Tokens and offsets of the book, pointing either
+  // to the storage above or to a memory-mapped binary book file
+  const Token *_tokens;
+  const int *_unrollOffsets;
+  const int *_sentenceOffsets;
+  bool _isView;
+
+  // Pointer to the current token
+  const Token *_currentToken;
 
   // Current sentence, unroll and token index
   int _sentenceIndex;
@@ -181,12 +252,6 @@ protected:
   // Number of sentences
   int _numSentences;
 
-  // Number of unrolls in each sentence
-  std::vector<int> _numUnrollsInSentence;
-
-  // Number of tokens in each unroll and sentence
-  std::vector<std::vector<int> > _numTokensInUnrollSentence;
-
   // Total number of tokens
   long _numTokens;
 };
@@ -204,8 +269,6 @@ public:
   CorpusUnrolls() :
   _minWordOccurrence(3),
   _oov(0),
-  _vocabSizeWords(0),
-  _vocabSizeLabels(0),
   _currentBookIndex(-1) {
     // Insert OOV and EOS tokens
     InsertWord("<unk>", 1.0);
@@ -217,7 +280,12 @@ public:
   /**
    * Constructor and destructor
    */
-  ~CorpusUnrolls () { }
+  ~CorpusUnrolls () {
+    // Do not leave a book being read in the background
+    if (_prefetchThread.joinable()) {
+      _prefetchThread.join();
+    }
+  }
 
 public:
   /**
@@ -228,12 +296,12 @@ public:
   /**
    * Size of the vocabulary
    */
-  int NumWords() { return _vocabSizeWords; }
+  int NumWords() { return vocabulary.Size(); }
 
   /**
    * Number of labels
    */
-  int NumLabels() { return _vocabSizeLabels; }
+  int NumLabels() { return labels.Size(); }
 
   /**
    * Look-up a word in the vocabulary
@@ -310,41 +378,127 @@ public:
     std::random_shuffle(_bookFilenames.begin(), _bookFilenames.end());
   }
 
+  /**
+   * Keep only one of numShards disjoint shards of the books
+   * (every numShards-th book, starting with the shard-th one),
+   * e.g., the books trained on by a node of a cluster
+   */
+  void KeepShard(int shard, int numShards) {
+    std::vector<std::string> books;
+    for (size_t k = shard; k < _bookFilenames.size(); k += numShards) {
+      books.push_back(_bookFilenames[k]);
+    }
+    _bookFilenames.swap(books);
+    // The next call to NextBook goes to the first book
+    _currentBookIndex = NumBooks() - 1;
+  }
+
+  /**
+   * Current order of the books
+   */
+  const std::vector<std::string> &BookFilenames() const {
+    return _bookFilenames;
+  }
+
+  /**
+   * Restore an order of the books (e.g., saved in a checkpoint)
+   * and position the corpus so that a given book is read next.
+   * Returns false if the list does not contain the same books.
+   */
+  bool RestoreBookOrder(const std::vector<std::string> &filenames,
+                        int nextBook);
+
   /**
    * Read the current book into memory
    */
   void ReadBook(bool mergeLabel);
 
+  /**
+   * Read a single sentence, given as the JSON list of its unrolls,
+   * into a book (only looking up the vocabulary).
+   * Returns false if the JSON is malformed.
+   */
+  bool ReadSentenceFromJson(const std::string &json, bool mergeLabel,
+                            BookUnrolls &book);
+
+  /**
+   * Go to the next book and start reading it in a background thread,
+   * while the current book is still being used
+   */
+  void PrefetchNextBook(bool mergeLabel);
+
+  /**
+   * Wait for the book read in the background, and hand it over
+   * to the current book (without copying it)
+   */
+  void SwapInPrefetchedBook();
+
+  /**
+   * Set the directory where the books are cached as binary files.
+   * When set, each JSON book is compiled once into a binary book file
+   * that is then memory-mapped instead of being parsed again.
+   */
+  void SetBinaryBookPath(const std::string &path) { _binaryBookPath = path; }
+
+  /**
+   * Signature of the vocabulary of words and labels
+   * used to index the tokens of the binary book files
+   */
+  unsigned long long VocabularySignature(bool mergeLabel);
+
 protected:
 
+  /**
+   * Read a book (from its JSON file or its binary book file) into memory
+   */
+  void ReadBookInto(const std::string &filename, bool mergeLabel,
+                    BookUnrolls &book);
+
+  /**
+   * Name of the binary book file corresponding to a JSON book
+   */
+  std::string BinaryBookFilename(const std::string &filename) const;
+
+  /**
+   * Map the binary book file corresponding to a JSON book
+   * (if it is valid and up-to-date) into a book view
+   */
+  bool MapBinaryBook(const std::string &filename,
+                     unsigned long long signature,
+                     BookUnrolls &book);
+
   // Minimum number of word occurrences not to be OOV
   int _minWordOccurrence;
 
   // Out-of-vocabulary token
   int _oov;
 
-  // Number of words and labels in the vocabulary
-  int _vocabSizeWords;
-  int _vocabSizeLabels;
-
   // Current book
   int _currentBookIndex;
 
   // List of books (filenames)
   std::vector<std::string> _bookFilenames;
 
+  // Directory of the binary book files (empty if not used)
+  std::string _binaryBookPath;
+
+  // Memory-mapped binary book files, kept open across epochs
+  std::map<std::string, MemoryMappedFile> _mappedBooks;
+
+  // Next book, read by a background thread
+  BookUnrolls _prefetchedBook;
+  std::thread _prefetchThread;
+
 public:
 
-  // Vocabulary: map between a string of text and an integer
-  std::unordered_map<std::string, int> vocabulary;
-  std::unordered_map<int, std::string> vocabularyReverse;
+  // Vocabulary: interned words, indexed by their integer ids
+  StringTable vocabulary;
 
-  // Discounted word counts
-  std::unordered_map<int, double> wordCountsDiscounted;
+  // Discounted word counts (indexed by word)
+  std::vector<double> wordCountsDiscounted;
 
-  // Labels: map between a string of text and an integer
-  std::unordered_map<std::string, int> labels;
-  std::unordered_map<int, std::string> labelsReverse;
+  // Labels: interned labels, indexed by their integer ids
+  StringTable labels;
 
   // Current book
   BookUnrolls m_currentBook;
@@ -7,8 +7,10 @@
 #ifndef DependencyTreeRNN___CorpusWordReader_h
 #define DependencyTreeRNN___CorpusWordReader_h
 
+#include <stdio.h>
 #include <fstream>
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <cctype>
 
@@ -25,35 +27,121 @@ class WordReader {
 protected:
   std::ifstream m_file;
   std::string m_line;
+  // Position of the next word in the line
+  size_t m_position;
 
 public:
     
   WordReader(const std::string &filename)
-  : m_file(filename) {
+  : m_file(filename), m_position(0) {
   }
     
 
-  std::string pop_first_word(std::string &s) {
-    const auto p1 = std::find_if(s.begin(), s.end(), notIsSpace);
-    const auto p2 = std::find_if(p1, s.end(), isSpace);
+  /**
+   * Return the word at the current position in the line
+   * and move to the beginning of the next word
+   * (without erasing the beginning of the line)
+   */
+  std::string pop_first_word() {
+    const auto p1 = std::find_if(m_line.begin() + m_position, m_line.end(),
+                                 notIsSpace);
+    const auto p2 = std::find_if(p1, m_line.end(), isSpace);
     const std::string word(p1, p2);
-    s.erase(0, std::find_if(p2, s.end(), notIsSpace) - s.begin());
+    m_position = std::find_if(p2, m_line.end(), notIsSpace) - m_line.begin();
     return word;
   }
     
     
   std::string get_next() {
     std::string result;
-    if (m_line.empty()) {
+    if (m_position >= m_line.size()) {
       if (std::getline(m_file, m_line)) {
         m_line += " </s>";
+        m_position = 0;
       } else {
         return result;
       }
     }
-    result = pop_first_word(m_line);
+    result = pop_first_word();
     return result;
   }
 };
 
+
+/**
+ * Reader of a binary file of feature vectors (the number of features
+ * as an int, then one vector of floats per word), which reads
+ * the file by large blocks rather than one float at a time
+ */
+class FeatureFileReader {
+protected:
+  FILE *m_file;
+  int m_sizeFeature;
+  // Block of values read from the file, and position of the next value
+  std::vector<float> m_block;
+  size_t m_position;
+  size_t m_blockSize;
+
+  // Read the next block of values; returns false at the end of the file
+  bool ReadBlock() {
+    m_position = 0;
+    m_blockSize = fread(&m_block[0], sizeof(float), m_block.size(), m_file);
+    return (m_blockSize > 0);
+  }
+
+public:
+
+  FeatureFileReader()
+  : m_file(NULL), m_sizeFeature(0), m_block(1 << 18), m_position(0),
+  m_blockSize(0) {
+  }
+
+  FeatureFileReader(const FeatureFileReader &) = delete;
+  FeatureFileReader &operator=(const FeatureFileReader &) = delete;
+
+  ~FeatureFileReader() {
+    Close();
+  }
+
+  /**
+   * Open the file and read its number of features (-1 on error)
+   */
+  int Open(const std::string &filename) {
+    Close();
+    m_file = fopen(filename.c_str(), "rb");
+    if ((m_file == NULL) ||
+        (fread(&m_sizeFeature, sizeof(m_sizeFeature), 1, m_file) != 1)) {
+      Close();
+      return -1;
+    }
+    return m_sizeFeature;
+  }
+
+  bool IsOpen() const { return (m_file != NULL); }
+
+  void Close() {
+    if (m_file != NULL) {
+      fclose(m_file);
+    }
+    m_file = NULL;
+    m_position = 0;
+    m_blockSize = 0;
+  }
+
+  /**
+   * Read the next feature vector, of the given size;
+   * returns false at the end of the file
+   */
+  template <typename Scalar>
+  bool Read(Scalar *vec, int size) {
+    for (int a = 0; a < size; a++) {
+      if ((m_position == m_blockSize) && !ReadBlock()) {
+        return false;
+      }
+      vec[a] = m_block[m_position++];
+    }
+    return true;
+  }
+};
+
 #endif
@@ -0,0 +1,178 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___Logger_h
+#define DependencyTreeRNN___Logger_h
+
+#include <stdio.h>
+#include <string>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+/**
+ * Buffered writer of the log files: the lines appended to the log files
+ * are queued and written by a background thread, which keeps each file
+ * open (a single handle per file, until it is closed) and flushes
+ * the files whenever it has written all the lines queued so far.
+ * All the lines are written when the program exits.
+ */
+class LogWriter {
+public:
+
+  /**
+   * Writer shared by the whole program
+   */
+  static LogWriter &Instance() {
+    static LogWriter writer;
+    return writer;
+  }
+
+  /**
+   * Queue text to be appended to a file
+   */
+  void Append(const std::string &filename, const std::string &text) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(LogEntry(filename, text, false));
+    }
+    m_isQueueNotEmpty.notify_one();
+  }
+
+  /**
+   * Close a file once the text queued so far is written to it
+   * (e.g., a file of scores which is not written to anymore)
+   */
+  void Close(const std::string &filename) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(LogEntry(filename, "", true));
+    }
+    m_isQueueNotEmpty.notify_one();
+  }
+
+  /**
+   * Wait until all the text queued so far is written to the files
+   */
+  void Flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_isQueueEmpty.wait(lock, [this] {
+      return m_queue.empty() && !m_isWriting;
+    });
+  }
+
+  /**
+   * Destructor: write the text left in the queue and close the files
+   */
+  ~LogWriter() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_isStopped = true;
+    }
+    m_isQueueNotEmpty.notify_one();
+    m_thread.join();
+    for (auto it = m_files.begin(); it != m_files.end(); ++it) {
+      fclose(it->second);
+    }
+  }
+
+protected:
+
+  /**
+   * Text to append to a file, or request to close it
+   */
+  struct LogEntry {
+    LogEntry(const std::string &name, const std::string &str, bool close)
+    : filename(name), text(str), isClosing(close) { }
+    std::string filename;
+    std::string text;
+    bool isClosing;
+  };
+
+  /**
+   * Constructor: start the background thread
+   */
+  LogWriter() : m_isWriting(false), m_isStopped(false) {
+    m_thread = std::thread(&LogWriter::Run, this);
+  }
+
+  /**
+   * Background thread: write the queued text, one batch at a time
+   */
+  void Run() {
+    std::deque<LogEntry> batch;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+      m_isQueueNotEmpty.wait(lock, [this] {
+        return !m_queue.empty() || m_isStopped;
+      });
+      if (m_queue.empty()) {
+        return;
+      }
+      batch.swap(m_queue);
+      m_isWriting = true;
+      lock.unlock();
+      for (size_t k = 0; k < batch.size(); k++) {
+        const LogEntry &entry = batch[k];
+        if (entry.isClosing) {
+          auto it = m_files.find(entry.filename);
+          if (it != m_files.end()) {
+            fclose(it->second);
+            m_files.erase(it);
+          }
+          continue;
+        }
+        FILE *file = OpenFile(entry.filename);
+        if (file != NULL) {
+          fwrite(entry.text.data(), 1, entry.text.size(), file);
+        }
+      }
+      batch.clear();
+      for (auto it = m_files.begin(); it != m_files.end(); ++it) {
+        fflush(it->second);
+      }
+      lock.lock();
+      m_isWriting = false;
+      if (m_queue.empty()) {
+        m_isQueueEmpty.notify_all();
+      }
+    }
+  }
+
+  /**
+   * Handle of a log file, opened (in append mode) the first time
+   */
+  FILE *OpenFile(const std::string &filename) {
+    auto it = m_files.find(filename);
+    if (it != m_files.end()) {
+      return it->second;
+    }
+    FILE *file = fopen(filename.c_str(), "a");
+    if (file != NULL) {
+      m_files[filename] = file;
+    }
+    return file;
+  }
+
+  // Text queued for the files
+  std::deque<LogEntry> m_queue;
+  std::mutex m_mutex;
+  std::condition_variable m_isQueueNotEmpty;
+  std::condition_variable m_isQueueEmpty;
+  bool m_isWriting;
+  bool m_isStopped;
+
+  // Open log files (only used by the background thread)
+  std::map<std::string, FILE *> m_files;
+
+  // Background thread
+  std::thread m_thread;
+};
+
+#endif
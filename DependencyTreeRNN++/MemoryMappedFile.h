@@ -0,0 +1,108 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___MemoryMappedFile_h
+#define DependencyTreeRNN___MemoryMappedFile_h
+
+#include <string>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/**
+ * Read-only memory mapping of a whole file.
+ * The mapping is released when the object is destroyed or closed.
+ */
+class MemoryMappedFile {
+public:
+
+  /**
+   * Constructor and destructor
+   */
+  MemoryMappedFile() : m_data(NULL), m_size(0), m_isOpen(false) { }
+  ~MemoryMappedFile() { Close(); }
+
+
+  /**
+   * Map a file into memory, read-only. Returns false if the file
+   * cannot be opened or mapped. Empty files are valid (with no data).
+   */
+  bool Open(const std::string &filename) {
+    Close();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat fileStats;
+    if (fstat(fd, &fileStats) != 0) {
+      close(fd);
+      return false;
+    }
+    m_size = (size_t)fileStats.st_size;
+    if (m_size > 0) {
+      void *data = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED) {
+        close(fd);
+        m_size = 0;
+        return false;
+      }
+      m_data = static_cast<const char *>(data);
+    }
+    // The mapping remains valid after the file descriptor is closed
+    close(fd);
+    m_isOpen = true;
+    return true;
+  }
+
+
+  /**
+   * Release the mapping
+   */
+  void Close() {
+    if (m_data != NULL) {
+      munmap(const_cast<char *>(m_data), m_size);
+    }
+    m_data = NULL;
+    m_size = 0;
+    m_isOpen = false;
+  }
+
+
+  /**
+   * Hint the kernel that the whole file will soon be read sequentially
+   */
+  void WillNeed() const {
+    if (m_data != NULL) {
+      madvise(const_cast<char *>(m_data), m_size, MADV_WILLNEED);
+    }
+  }
+
+
+  /**
+   * Accessors to the mapped data
+   */
+  const char *Data() const { return m_data; }
+  size_t Size() const { return m_size; }
+  bool IsOpen() const { return m_isOpen; }
+
+protected:
+
+  // Mapped memory and its size
+  const char *m_data;
+  size_t m_size;
+  bool m_isOpen;
+
+private:
+
+  // A mapping cannot be copied
+  MemoryMappedFile(const MemoryMappedFile &);
+  MemoryMappedFile &operator=(const MemoryMappedFile &);
+};
+
+#endif
@@ -0,0 +1,154 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___PrefixStateTrie_h
+#define DependencyTreeRNN___PrefixStateTrie_h
+
+#include <vector>
+#include "RnnState.h"
+
+
+/**
+ * Prefix trie over the unrolls of a sentence. All unrolls start at ROOT,
+ * so sibling unrolls share their head-word prefixes. Each node of the trie
+ * corresponds to one token of an unroll (identified by its context word,
+ * its label and its target word) and caches the pieces of the RNN state
+ * (hidden layer, feature layer and word history) obtained after having
+ * processed the prefix ending with that token, as well as the
+ * log-probability of the token. Unrolls can then restart
+ * from the deepest cached node instead of from ROOT.
+ * Nodes are recycled from one sentence to the next to avoid reallocations.
+ * The cached activations have the precision of the RNN state.
+ */
+template <typename Scalar>
+class PrefixStateTrieT {
+public:
+
+  /**
+   * Constructor: the trie only contains its root,
+   * which corresponds to the reset state of the RNN.
+   */
+  PrefixStateTrieT() : m_numNodes(0) {
+    Clear();
+  }
+
+
+  /**
+   * Remove all the nodes but the root (e.g., at the end of a sentence).
+   */
+  void Clear() {
+    m_numNodes = 1;
+    if (m_nodes.empty()) {
+      m_nodes.resize(1);
+    }
+    m_nodes[0].firstChild = -1;
+    m_nodes[0].nextSibling = -1;
+  }
+
+
+  /**
+   * Index of the root of the trie
+   */
+  int Root() const { return 0; }
+
+
+  /**
+   * Number of nodes in the trie, including the root
+   */
+  int NumNodes() const { return m_numNodes; }
+
+
+  /**
+   * Look up the child of a node that corresponds to a given token
+   * (context word, label and target word). Returns -1 if not found.
+   */
+  int FindChild(int node, int contextWord, int label, int targetWord) const {
+    int child = m_nodes[node].firstChild;
+    while (child >= 0) {
+      const Node &n = m_nodes[child];
+      if ((n.contextWord == contextWord) && (n.label == label) &&
+          (n.targetWord == targetWord)) {
+        return child;
+      }
+      child = n.nextSibling;
+    }
+    return -1;
+  }
+
+
+  /**
+   * Add a child to a node, corresponding to a given token
+   * (context word, label and target word), and cache the RNN state
+   * after that token has been processed, along with its log-probability.
+   * Returns the index of the new node.
+   */
+  int AddChild(int node, int contextWord, int label, int targetWord,
+               const RnnStateT<Scalar> &state, double logProbability) {
+    if (m_numNodes == (int)m_nodes.size()) {
+      m_nodes.resize(m_numNodes + 1);
+    }
+    int child = m_numNodes++;
+    Node &n = m_nodes[child];
+    n.contextWord = contextWord;
+    n.label = label;
+    n.targetWord = targetWord;
+    n.logProbability = logProbability;
+    n.hidden = state.HiddenLayer;
+    n.feature = state.FeatureLayer;
+    n.wordHistory = state.WordHistory;
+    n.firstChild = -1;
+    n.nextSibling = m_nodes[node].firstChild;
+    m_nodes[node].firstChild = child;
+    return child;
+  }
+
+
+  /**
+   * Restore the RNN state cached at a given node. The hidden layer
+   * is also copied to the recurrent layer, as it would have been
+   * by ForwardPropagateRecurrentConnectionOnly.
+   */
+  void RestoreState(int node, RnnStateT<Scalar> &state) const {
+    const Node &n = m_nodes[node];
+    state.HiddenLayer = n.hidden;
+    state.RecurrentLayer = n.hidden;
+    state.FeatureLayer = n.feature;
+    state.WordHistory = n.wordHistory;
+  }
+
+
+  /**
+   * Log-probability of the token stored at a given node
+   */
+  double LogProbability(int node) const {
+    return m_nodes[node].logProbability;
+  }
+
+protected:
+
+  /**
+   * Node of the trie, storing the token and the cached RNN state
+   */
+  struct Node {
+    int contextWord;
+    int label;
+    int targetWord;
+    double logProbability;
+    std::vector<Scalar> hidden;
+    std::vector<Scalar> feature;
+    std::vector<int> wordHistory;
+    int firstChild;
+    int nextSibling;
+  };
+
+  // Storage of the nodes (the first one is the root)
+  std::vector<Node> m_nodes;
+  // Number of nodes currently in use
+  int m_numNodes;
+};
+typedef PrefixStateTrieT<double> PrefixStateTrie;
+
+#endif
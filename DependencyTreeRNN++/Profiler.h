@@ -0,0 +1,218 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___Profiler_h
+#define DependencyTreeRNN___Profiler_h
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+
+/**
+ * Phases of the training timed by the profiler
+ */
+enum ProfilePhase {
+  c_profileForward = 0,
+  c_profileBackward,
+  c_profileBptt,
+  c_profileNGram,
+  c_profileIO,
+  c_profileValidation,
+  c_numProfilePhases
+};
+static const char *const c_profilePhaseNames[c_numProfilePhases] = {
+  "forward", "backward", "bptt", "ngram", "io", "validation"
+};
+
+
+/**
+ * Time spent by one thread in each phase. Only the thread owning
+ * the counters writes them; the profiler reads them while the thread runs.
+ */
+struct ProfileCounters {
+  ProfileCounters() : currentPhase(-1) {
+    for (int k = 0; k < c_numProfilePhases; k++) {
+      nanoseconds[k] = 0;
+    }
+  }
+
+  /**
+   * Enter a phase (the time spent so far in the current one
+   * is charged to it), and return the phase left
+   */
+  int Enter(int phase) {
+    std::chrono::steady_clock::time_point now =
+    std::chrono::steady_clock::now();
+    int previousPhase = currentPhase;
+    Charge(now);
+    currentPhase = phase;
+    return previousPhase;
+  }
+
+  /**
+   * Leave the current phase and go back to the previous one
+   */
+  void Leave(int previousPhase) {
+    Charge(std::chrono::steady_clock::now());
+    currentPhase = previousPhase;
+  }
+
+  /**
+   * Charge the time since the last change of phase to the current phase
+   */
+  void Charge(std::chrono::steady_clock::time_point now) {
+    if (currentPhase >= 0) {
+      long long elapsed =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastChange).count();
+      nanoseconds[currentPhase].store(
+        nanoseconds[currentPhase].load(std::memory_order_relaxed) + elapsed,
+        std::memory_order_relaxed);
+    }
+    lastChange = now;
+  }
+
+  std::atomic<long long> nanoseconds[c_numProfilePhases];
+  int currentPhase;
+  std::chrono::steady_clock::time_point lastChange;
+};
+
+
+/**
+ * Profiler of the hot paths of the training: the threads time
+ * the phases (forward and back-propagation, BPTT, n-gram updates,
+ * reading the data and validation) with scoped timers,
+ * on their own counters and without any lock.
+ * The time of nested phases is not counted in the enclosing phase.
+ * Disabled by default: the timers then cost a single test.
+ */
+class Profiler {
+public:
+
+  /**
+   * Profiler shared by the whole program
+   */
+  static Profiler &Instance() {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  /**
+   * Is the profiling enabled?
+   */
+  static bool &IsEnabled() {
+    static bool isEnabled = false;
+    return isEnabled;
+  }
+
+  /**
+   * Counters of the calling thread, allocated the first time
+   */
+  ProfileCounters &ThreadCounters() {
+    static thread_local ProfileCounters *counters = NULL;
+    if (counters == NULL) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_counters.push_back(std::unique_ptr<ProfileCounters>(new ProfileCounters()));
+      counters = m_counters.back().get();
+    }
+    return *counters;
+  }
+
+  /**
+   * Time spent in each phase (in seconds, summed over the threads)
+   */
+  std::vector<double> PhaseSeconds() {
+    std::vector<double> seconds(c_numProfilePhases, 0.0);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t k = 0; k < m_counters.size(); k++) {
+      for (int phase = 0; phase < c_numProfilePhases; phase++) {
+        seconds[phase] +=
+        m_counters[k]->nanoseconds[phase].load(std::memory_order_relaxed) * 1e-9;
+      }
+    }
+    return seconds;
+  }
+
+  /**
+   * Row of the profile (CSV): iteration, progress within the iteration,
+   * wall-clock time and words per second, then the time spent
+   * in each phase since the beginning; the header of the columns
+   * is written first when the file is new
+   */
+  std::string FormatRow(const std::string &filename,
+                        int iteration,
+                        const std::string &progress,
+                        double wallSeconds,
+                        double wordsPerSecond) {
+    std::string text;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_filesWithHeader.insert(filename).second) {
+        struct stat info;
+        if ((stat(filename.c_str(), &info) != 0) || (info.st_size == 0)) {
+          text = "iter,progress,seconds,words/sec";
+          for (int phase = 0; phase < c_numProfilePhases; phase++) {
+            text += std::string(",") + c_profilePhaseNames[phase];
+          }
+          text += "\n";
+        }
+      }
+    }
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%d,", iteration);
+    text += buffer + progress;
+    snprintf(buffer, sizeof(buffer), ",%.3f,%.1f", wallSeconds, wordsPerSecond);
+    text += buffer;
+    std::vector<double> seconds = PhaseSeconds();
+    for (int phase = 0; phase < c_numProfilePhases; phase++) {
+      snprintf(buffer, sizeof(buffer), ",%.3f", seconds[phase]);
+      text += buffer;
+    }
+    return text + "\n";
+  }
+
+protected:
+
+  // Counters of all the threads that ever ran a timer
+  std::vector<std::unique_ptr<ProfileCounters> > m_counters;
+  std::mutex m_mutex;
+
+  // Profile files whose header was checked
+  std::set<std::string> m_filesWithHeader;
+};
+
+
+/**
+ * Timer of a phase, from its construction to its destruction
+ * (on the counters of the calling thread), if the profiling is enabled
+ */
+class ScopedTimer {
+public:
+  explicit ScopedTimer(int phase) : m_counters(NULL), m_previousPhase(-1) {
+    if (Profiler::IsEnabled()) {
+      m_counters = &(Profiler::Instance().ThreadCounters());
+      m_previousPhase = m_counters->Enter(phase);
+    }
+  }
+
+  ~ScopedTimer() {
+    if (m_counters != NULL) {
+      m_counters->Leave(m_previousPhase);
+    }
+  }
+
+protected:
+  ProfileCounters *m_counters;
+  int m_previousPhase;
+};
+
+#endif
@@ -5,354 +5,307 @@
 // ACL 2015
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <string>
-#include <fstream>
-#include <streambuf>
-#include <assert.h>
+#include <chrono>
+#include <algorithm>
 #include "ReadJson.h"
 #include "CorpusUnrollsReader.h"
+#include "MemoryMappedFile.h"
 
 using namespace std;
 
 
 /**
- * Trim a word
+ * Skip white spaces
  */
-string const ReadJson::Trim(const string &word) const {
-  assert(word.length() > 1);
-  string res(word);
-  if (res[0] == '"') {
-    res = res.substr(1, res.length()-1);
+static inline const char *SkipSpaces(const char *p, const char *end) {
+  while ((p < end) &&
+         ((*p == ' ') || (*p == '\n') || (*p == '\r') || (*p == '\t'))) {
+    p++;
   }
-  if (res[res.length()-1] == '"') {
-    res = res.substr(0, res.length()-1);
-  }
-  return res;
+  return p;
 }
 
 
 /**
- * Parse a token
+ * Skip white spaces then consume an expected character;
+ * returns NULL if the character is not there
  */
-size_t const ReadJson::ParseToken(const string &json_element, JsonToken &tok) const {
-
-  //cout << "parseToken: " << json_element << endl;
-
-  size_t len = json_element.length();
-  if (len < 14) { return 0; }
-  size_t begin = 0;
-
-  // Avoid situations with empty tokens []
-  if ((json_element[0] == '[') && (json_element[1] == ']'))
-    return 2;
-
-  // Consume the [
-  if (json_element[0] == '[') { begin++; }
-  // Parse the token number
-  size_t end = json_element.find(",", begin);
-  assert(end != string::npos);
-  string pos_string = json_element.substr(begin, end - begin);
-  int token_pos = stoi(pos_string);
-  begin = end + 1;
-  assert(begin < len);
-
-  // Consume the space and the first "
-  if (json_element[begin] == ' ') { begin++; }
-  if (json_element[begin] == '"') { begin++; }
-  // Parse the word and trim the "
-  end = json_element.find("\", ", begin);
-  assert(end != string::npos);
-  end = end + 1;
-  string token_word = json_element.substr(begin, end - begin);
-  if (token_word.length() <= 1) {
-    cout << json_element << endl;
+static inline const char *Consume(const char *p, const char *end, char c) {
+  p = SkipSpaces(p, end);
+  if ((p == end) || (*p != c)) {
+    return NULL;
   }
-  assert(token_word.length() > 1);
-  token_word = Trim(token_word);
-  begin = end + 1;
-  assert(begin < len);
-
-  // Parse the discount
-  end = json_element.find(",", begin);
-  assert(end != string::npos);
-  string discount_string = json_element.substr(begin, end - begin);
-  double token_discount = stod(discount_string);
-  begin = end + 1;
-  assert(begin < len);
-
-  // Consume the space and the first "
-  if (json_element[begin] == ' ') { begin++; }
-  if (json_element[begin] == '"') { begin++; }
-  // Parse the label
-  end = json_element.find("]", begin);
-  assert(end != string::npos);
-  string token_label = json_element.substr(begin, end - begin);
-  assert(token_label.length() > 2);
-  token_label = Trim(token_label);
-
-  // Fill the token
-  tok.pos = token_pos;
-  tok.word = token_word;
-  tok.discount = token_discount;
-  tok.label = token_label;
-
-  //cout << "token: " << token_pos << " " << token_word
-  //     << " " << token_discount << " " << token_label << endl;
-  return end;
+  return p + 1;
 }
 
 
 /**
- * Parse an unroll
+ * Parse a number. Integers (the common case for positions and counts)
+ * are parsed directly; other numbers are handed to strtod.
+ * Returns NULL if there is no number.
  */
-size_t const ReadJson::ParseUnroll(const string &json_unrolls,
-                                   vector<JsonToken> &unroll) const {
-
-  //cout << "parseUnroll: " << json_unrolls << endl;
-
-  size_t end_unroll = json_unrolls.find("]]", 0);
-  assert(end_unroll != string::npos);
+static inline const char *ParseNumber(const char *p, const char *end,
+                                      double &value) {
+  p = SkipSpaces(p, end);
+  const char *start = p;
+  bool isNegative = false;
+  if ((p < end) && ((*p == '-') || (*p == '+'))) {
+    isNegative = (*p == '-');
+    p++;
+  }
+  long long integer = 0;
+  while ((p < end) && (*p >= '0') && (*p <= '9')) {
+    integer = integer * 10 + (*p - '0');
+    p++;
+  }
+  bool isInteger = true;
+  while ((p < end) &&
+         ((*p == '.') || (*p == 'e') || (*p == 'E') || (*p == '-') ||
+          (*p == '+') || ((*p >= '0') && (*p <= '9')))) {
+    isInteger = false;
+    p++;
+  }
+  if (p == start) {
+    return NULL;
+  }
+  if (isInteger) {
+    value = (double)(isNegative ? -integer : integer);
+  } else {
+    char buffer[64];
+    size_t len = std::min((size_t)(p - start), sizeof(buffer) - 1);
+    memcpy(buffer, start, len);
+    buffer[len] = '\0';
+    value = strtod(buffer, NULL);
+  }
+  return p;
+}
 
-  // Avoid situations with empty unrolls []
-  if ((json_unrolls[0] == '[') && (json_unrolls[1] == ']'))
-    return 2;
-  assert(json_unrolls[0] == '[');
-  assert(json_unrolls[1] == '[');
-  string json_tokens(json_unrolls.substr(0, end_unroll + 1));
-  size_t begin = 1;
-  size_t end = end_unroll + 1;
 
-  while (begin < end_unroll + 1) {
-    // Find the next end of the token
-    //cout << "parseToken[" << begin << ", " << end << "]\n" << flush;
-    JsonToken tok;
-    end = ParseToken(json_tokens.substr(begin, end - begin), tok);
-    if (end > 0) {
-      // Store the token in the unroll
-      unroll.push_back(tok);
-      // Go to next token
-      // Consume the ], comma and space
-      begin += end;
-      if (json_tokens[begin] == ']') { begin++; }
-      if (json_tokens[begin] == ',') { begin++; }
-      if (json_tokens[begin] == ' ') { begin++; }
-      end = end_unroll + 1;
-    } else
-      break;
+/**
+ * Parse a string and return its raw content (escape sequences are kept
+ * as they are) between the quotes. Returns NULL if there is no string.
+ */
+static inline const char *ParseString(const char *p, const char *end,
+                                      const char *&str, size_t &len) {
+  p = Consume(p, end, '"');
+  if (p == NULL) {
+    return NULL;
   }
-
-  return end_unroll;
+  const char *start = p;
+  while ((p < end) && (*p != '"')) {
+    // Skip the escaped character
+    if (*p == '\\') {
+      p++;
+    }
+    p++;
+  }
+  if (p >= end) {
+    return NULL;
+  }
+  str = start;
+  len = (size_t)(p - start);
+  return p + 1;
 }
 
 
 /**
- * Parse a sentence
+ * Parse a token starting at its opening bracket;
+ * returns the position after its closing bracket, or NULL.
+ * A token is: [position, "word", discount, "label"]
  */
-size_t const ReadJson::ParseSentence(const string &json_sentences,
-                                     vector<vector<JsonToken>> &sentence) const {
-
-  //cout << "parseSentence: " << json_sentences << endl;
-  assert(json_sentences.length() >= 6);
-  size_t end_sentence = json_sentences.find("]]]", 0);
-  assert(end_sentence != string::npos);
+const char *ReadJson::ParseToken(const char *p, const char *end,
+                                 JsonToken &tok) const {
+  double value = 0;
+  if ((p = Consume(p, end, '[')) == NULL) { return NULL; }
+  if ((p = ParseNumber(p, end, value)) == NULL) { return NULL; }
+  tok.pos = (int)value;
+  if ((p = Consume(p, end, ',')) == NULL) { return NULL; }
+  if ((p = ParseString(p, end, tok.word, tok.wordLength)) == NULL) {
+    return NULL;
+  }
+  if ((p = Consume(p, end, ',')) == NULL) { return NULL; }
+  if ((p = ParseNumber(p, end, tok.discount)) == NULL) { return NULL; }
+  if ((p = Consume(p, end, ',')) == NULL) { return NULL; }
+  if ((p = ParseString(p, end, tok.label, tok.labelLength)) == NULL) {
+    return NULL;
+  }
+  return Consume(p, end, ']');
+}
 
-  // Avoid situations with empty sentences []
-  if ((json_sentences[0] == '[') && (json_sentences[1] == ']'))
-    return 2;
-  assert(json_sentences[0] == '[');
-  assert(json_sentences[1] == '[');
-  assert(json_sentences[2] == '[');
-  string json_unrolls(json_sentences.substr(0, end_sentence + 2));
-  size_t begin = 1;
-  size_t end = end_sentence + 2;
 
-  while (begin < end_sentence + 2) {
-    // Find the next end of the token
-    //cout << "parseUnroll[" << begin << ", " << end << "]\n" << flush;
-    vector<JsonToken> unroll;
-    end = ParseUnroll(json_unrolls.substr(begin, end - begin),
-                      unroll);
-    if (end > 2) {
-      // Store the unroll in the sentence
-      sentence.push_back(unroll);
+/**
+ * Parse a sentence starting at its opening bracket and insert
+ * each token directly into the book and/or the vocabulary;
+ * returns the position after its closing bracket, or NULL.
+ * A sentence is a list of unrolls and an unroll is a list of tokens.
+ */
+const char *ReadJson::ParseSentence(const char *p, const char *end) {
+  if ((p = Consume(p, end, '[')) == NULL) { return NULL; }
+  m_numSentences++;
+  bool isNewSentence = true;
+  // Loop over the unrolls in the sentence
+  while (true) {
+    p = SkipSpaces(p, end);
+    if (p == end) { return NULL; }
+    if (*p == ']') { return p + 1; }
+    if (*p == ',') { p++; continue; }
+    if (*p != '[') { return NULL; }
+    p++;
+    bool isNewUnroll = true;
+    // Loop over the tokens in the unroll
+    while (true) {
+      p = SkipSpaces(p, end);
+      if (p == end) { return NULL; }
+      if (*p == ']') { p++; break; }
+      if (*p == ',') { p++; continue; }
+      JsonToken tok;
+      p = ParseToken(p, end, tok);
+      if (p == NULL) { return NULL; }
+      ProcessToken(tok, isNewSentence, isNewUnroll);
+      // We are no longer at beginning of a sentence or unroll
+      isNewSentence = false;
+      isNewUnroll = false;
     }
-    // Go to the next unroll
-    begin += end;
-    // Consume the ], comma and space
-    if (json_unrolls[begin] == ']') { begin++; }
-    if (json_unrolls[begin] == ']') { begin++; }
-    if (json_unrolls[begin] == ',') { begin++; }
-    if (json_unrolls[begin] == ' ') { begin++; }
-    end = end_sentence + 2;
   }
-
-  return end_sentence;
 }
 
 
 /**
- * Parse a book
+ * Parse a whole book in a single pass over the text buffer
+ * [p, end[ and insert each token directly into the book
+ * and/or the vocabulary. Returns false if the JSON is malformed.
+ * A book is a list of sentences.
  */
-size_t const ReadJson::ParseBook(const string &json_book,
-                                 vector<vector<vector<JsonToken>>> &book) const {
-
-  //cout << "parseBook: " << json_book << endl;
-  assert(json_book.length() >= 8);
-  size_t end_book = json_book.find("]]]]", 0);
-  if (end_book == string::npos) {
-    end_book = json_book.find("]]], []]", 0);
-    if (end_book == string::npos) {
-      end_book = json_book.find("]]], [], []]", 0);
-      assert(end_book != string::npos);
-    }
+bool ReadJson::ParseBook(const char *p, const char *end) {
+  if ((p = Consume(p, end, '[')) == NULL) { return false; }
+  // Loop over the sentences
+  while (true) {
+    p = SkipSpaces(p, end);
+    if (p == end) { return false; }
+    if (*p == ']') { return true; }
+    if (*p == ',') { p++; continue; }
+    if ((p = ParseSentence(p, end)) == NULL) { return false; }
   }
+}
 
-  assert(json_book[0] == '[');
-  size_t begin = 1;
-  if ((json_book[begin] == '[') && (json_book[begin+1] == ']') &&
-      (json_book[begin+2] == ',') && (json_book[begin+3] == ' ')) {
-    begin += 4;
-  }
-  if ((json_book[begin] == '[') && (json_book[begin+1] == ']') &&
-      (json_book[begin+2] == ',') && (json_book[begin+3] == ' ')) {
-    begin += 4;
+
+/**
+ * Process a token: update the vocabulary and add the token to the book
+ */
+void ReadJson::ProcessToken(const JsonToken &tok,
+                            bool isNewSentence, bool isNewUnroll) {
+  // Process the token to get:
+  // its position in sentence,
+  // word, discount and label
+  m_wordAsTarget.assign(tok.word, tok.wordLength);
+  m_label.assign(tok.label, tok.labelLength);
+  double tokenDiscount = 1.0 / tok.discount;
+  bool isLeaf = (m_label.compare("LEAF") == 0);
+
+  // Concatenate word with label, when it is used as context?
+  const string *wordAsContext = &m_wordAsTarget;
+  if (m_mergeLabelWithWord) {
+    m_wordAsContext.assign(m_wordAsTarget);
+    m_wordAsContext.push_back(':');
+    m_wordAsContext.append(m_label);
+    wordAsContext = &m_wordAsContext;
   }
-  assert(json_book[begin] == '[');
-  assert(json_book[begin + 1] == '[');
-  assert(json_book[begin + 2] == '[');
-  string json_sentences(json_book.substr(0, end_book + 3));
-  size_t end = end_book + 3;
 
-  while (begin < end_book + 3) {
-    // Find the next end of the token
-    //cout << "parseSentence[" << begin << ", " << end << "]\n" << flush;
-    vector<vector<JsonToken>> sentence;
-    end = ParseSentence(json_sentences.substr(begin, end - begin),
-                        sentence);
-    if (end > 2) {
-      // Store the sentence
-      book.push_back(sentence);
+  // Shall we insert new words/labels
+  // into the vocabulary?
+  if (m_insertVocab) {
+    if (m_mergeLabelWithWord) {
+      if (isLeaf) {
+        // Insert target word to vocabulary
+        m_corpus.InsertWord(m_wordAsTarget, tokenDiscount);
+      } else {
+        // Insert concatenated context word and label to vocabulary
+        m_corpus.InsertWord(*wordAsContext, tokenDiscount);
+      }
+    } else {
+      // Insert word and label to two different vocabularies
+      m_corpus.InsertWord(*wordAsContext, tokenDiscount);
+      if (!isLeaf) {
+        m_corpus.InsertLabel(m_label);
+      }
     }
-    // Go to next sentence
-    begin += end;
-    // Consume the ], ], ], comma and space
-    if (json_sentences[begin] == ']') { begin++; }
-    if (json_sentences[begin] == ']') { begin++; }
-    if (json_sentences[begin] == ']') { begin++; }
-    if (json_sentences[begin] == ',') { begin++; }
-    if (json_sentences[begin] == ' ') { begin++; }
-    end = end_book + 3;
   }
-
-  return end_book;
+  // Insert new words to the book
+  int wordIndexAsContext = 0, wordIndexAsTarget = 0, labelIndex = 0;
+  if (m_mergeLabelWithWord) {
+    wordIndexAsContext = m_corpus.LookUpWord(*wordAsContext);
+    wordIndexAsTarget = m_corpus.LookUpWord(m_wordAsTarget);
+  } else {
+    wordIndexAsContext = m_corpus.LookUpWord(*wordAsContext);
+    wordIndexAsTarget = wordIndexAsContext;
+    labelIndex = m_corpus.LookUpLabel(m_label);
+  }
+  m_book.AddToken(isNewSentence, isNewUnroll,
+                 tok.pos, wordIndexAsContext, wordIndexAsTarget,
+                 tokenDiscount, labelIndex);
 }
 
 
 /**
  * Constructor: read a text file in JSON format.
  * If required, insert words and labels to the vocabulary.
- * If required, insert tokens into the current book.
+ * If required, insert tokens into the book.
  */
 ReadJson::ReadJson(const string &filename,
                    CorpusUnrolls &corpus,
+                   BookUnrolls &book,
                    bool insert_vocab,
                    bool read_book,
-                   bool merge_label_with_word) {
+                   bool merge_label_with_word)
+: m_corpus(corpus), m_book(book), m_insertVocab(insert_vocab),
+m_mergeLabelWithWord(merge_label_with_word), m_numSentences(0),
+m_isParsed(false) {
 
   cout << "Reading book " << filename << "..." << endl;
-  ifstream t(filename);
-  string book_text((istreambuf_iterator<char>(t)),
-                   istreambuf_iterator<char>());
-
-  vector<vector<vector<JsonToken>>> sentences;
-  cout << "Parsing book " << filename << "..." << endl;
-  ParseBook(book_text, sentences);
-  cout << "Parsing done.\n";
-
-  // Pointer to the current book
-  BookUnrolls *book = &(corpus.m_currentBook);
-
-  // First, iterate over sentences
-  int numSentences = 0;
-
-  for (int idx_sentence = 0; idx_sentence < sentences.size(); idx_sentence++) {
-
-    int numUnrollsInThatSentence = 0;
-    bool isNewSentence = true;
-
-    // Second, iterate over unrolls in each sentence
-    vector<vector<JsonToken>> unrolls = sentences[idx_sentence];
-    for (int idx_unroll = 0; idx_unroll < unrolls.size(); idx_unroll++) {
-      bool isNewUnroll = true;
-
-      // Third, iterate over tokens in each unroll
-      vector<JsonToken> tokens = unrolls[idx_unroll];
-      for (int idx_token = 0; idx_token < tokens.size(); idx_token++) {
-
-        // Process the token to get:
-        // its position in sentence,
-        // word, discount and label
-        string tokenWordAsTarget = tokens[idx_token].word;
-        string tokenLabel = tokens[idx_token].label;
-        int tokenPos = tokens[idx_token].pos;
-        double tokenDiscount = 1.0 / (tokens[idx_token].discount);
-        string tokenWordAsContext(tokenWordAsTarget);
-
-        // Concatenate word with label, when it is used as context?
-        if (merge_label_with_word) {
-          tokenWordAsContext += ":" + tokenLabel;
-        }
+  MemoryMappedFile file;
+  if (!file.Open(filename)) {
+    cerr << "Cannot open book " << filename << endl;
+    return;
+  }
 
-        // Shall we insert new words/labels
-        // into the vocabulary?
-        if (insert_vocab) {
-          if (merge_label_with_word) {
-            if (tokenLabel == "LEAF") {
-              // Insert target word to vocabulary
-              corpus.InsertWord(tokenWordAsTarget, tokenDiscount);
-            } else {
-              // Insert concatenated context word and label to vocabulary
-              corpus.InsertWord(tokenWordAsContext, tokenDiscount);
-            }
-          } else {
-            // Insert word and label to two different vocabularies
-            corpus.InsertWord(tokenWordAsContext, tokenDiscount);
-            if (tokenLabel != "LEAF") {
-              corpus.InsertLabel(tokenLabel);
-            }
-          }
-        }
-        // Insert new words to the book
-        int wordIndexAsContext = 0, wordIndexAsTarget = 0, labelIndex = 0;
-        if (merge_label_with_word) {
-          wordIndexAsContext = corpus.LookUpWord(tokenWordAsContext);
-          wordIndexAsTarget = corpus.LookUpWord(tokenWordAsTarget);
-        } else {
-          wordIndexAsContext = corpus.LookUpWord(tokenWordAsContext);
-          wordIndexAsTarget = wordIndexAsContext;
-          labelIndex = corpus.LookUpLabel(tokenLabel);
-        }
-        book->AddToken(isNewSentence, isNewUnroll,
-                       tokenPos, wordIndexAsContext, wordIndexAsTarget,
-                       tokenDiscount, labelIndex);
-        // We are no longer at beginning of a sentence or unroll
-        isNewSentence = false;
-        isNewUnroll = false;
-      }
-      tokens.clear();
-      numUnrollsInThatSentence++;
-    }
-    unrolls.clear();
-    numSentences++;
+  // Parse the book directly from the memory-mapped file
+  auto start = chrono::steady_clock::now();
+  bool ok = ParseBook(file.Data(), file.Data() + file.Size());
+  m_isParsed = ok;
+  double duration = chrono::duration<double>(chrono::steady_clock::now()
+                                             - start).count();
+  if (!ok) {
+    cerr << "Malformed JSON in book " << filename << endl;
   }
-  sentences.clear();
-  book_text.clear();
+  double sizeMB = file.Size() / 1048576.0;
   cout << "ReadJSON: " << filename << endl;
-  cout << "          (" << numSentences << " sentences, including empty ones; ";
-  cout << book->NumTokens() << " tokens)\n";
+  cout << "          (" << m_numSentences << " sentences, including empty ones; ";
+  cout << book.NumTokens() << " tokens; ";
+  cout << sizeMB << " MB parsed at "
+  << ((duration > 0) ? (sizeMB / duration) : 0) << " MB/s)\n";
   if (insert_vocab) {
     cout << "          Corpus now contains " << corpus.NumWords()
     << " words and " << corpus.NumLabels() << " labels\n";
   }
 }
+
+
+/**
+ * Constructor: parse a single sentence (the JSON list of its unrolls)
+ * from a text buffer [begin, end[, e.g., a request of the scoring server,
+ * into the book, without inserting words and labels to the vocabulary.
+ */
+ReadJson::ReadJson(const char *begin, const char *end,
+                   CorpusUnrolls &corpus,
+                   BookUnrolls &book,
+                   bool merge_label_with_word)
+: m_corpus(corpus), m_book(book), m_insertVocab(false),
+m_mergeLabelWithWord(merge_label_with_word), m_numSentences(0),
+m_isParsed(false) {
+  const char *p = ParseSentence(begin, end);
+  m_isParsed = (p != NULL) && (SkipSpaces(p, end) == end);
+}
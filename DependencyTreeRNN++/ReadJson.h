@@ -7,69 +7,108 @@
 #ifndef DependencyTreeRNN___readjson_h
 #define DependencyTreeRNN___readjson_h
 
-#include <vector>
+#include <string>
 #include "CorpusUnrollsReader.h"
 
 using namespace std;
 
+
+/**
+ * Token as it appears in the JSON file: the word and label are
+ * not copied but point to the (memory-mapped) text of the book
+ */
 struct JsonToken {
   int pos;
-  string word;
+  const char *word;
+  size_t wordLength;
   double discount;
-  string label;
+  const char *label;
+  size_t labelLength;
 };
 
 
 class ReadJson {
 public:
-  
+
   /**
    * Constructor: read a text file in JSON format.
    * If required, insert words and labels to the vocabulary.
-   * If required, insert tokens into the current book.
+   * If required, insert tokens into the book.
    */
   ReadJson(const string &filename,
            CorpusUnrolls &corpus,
+           BookUnrolls &book,
            bool insert_vocab,
            bool read_book,
            bool merge_label_with_word);
-  
+
+  /**
+   * Constructor: parse a single sentence (the JSON list of its unrolls)
+   * from a text buffer [begin, end[, e.g., a request of the scoring server,
+   * into the book, without inserting words and labels to the vocabulary.
+   */
+  ReadJson(const char *begin, const char *end,
+           CorpusUnrolls &corpus,
+           BookUnrolls &book,
+           bool merge_label_with_word);
+
   /**
    * Destructor
    */
   ~ReadJson() { }
 
-protected:
-  
-
   /**
-   * Trim a word
+   * Was the JSON text well-formed?
    */
-  string const Trim(const string &word) const;
+  bool IsParsed() const { return m_isParsed; }
+
+protected:
 
   /**
-   * Parse a token
+   * Parse a whole book in a single pass over the text buffer
+   * [begin, end[ and insert each token directly into the book
+   * and/or the vocabulary. Returns false if the JSON is malformed.
    */
-  size_t const ParseToken(const string &json_element,
-                          JsonToken &tok) const;
+  bool ParseBook(const char *begin, const char *end);
 
   /**
-   * Parse an unroll
+   * Parse a sentence starting at its opening bracket and insert
+   * each token directly into the book and/or the vocabulary;
+   * returns the position after its closing bracket, or NULL.
    */
-  size_t const ParseUnroll(const string &json_unrolls,
-                           vector<JsonToken> &unroll) const;
+  const char *ParseSentence(const char *p, const char *end);
 
   /**
-   * Parse a sentence
+   * Parse a token starting at its opening bracket;
+   * returns the position after its closing bracket, or NULL.
    */
-  size_t const ParseSentence(const string &json_sentences,
-                             vector<vector<JsonToken>> &sentence) const;
+  const char *ParseToken(const char *p, const char *end,
+                         JsonToken &tok) const;
 
   /**
-   * Parse a book
+   * Process a token: update the vocabulary and add the token to the book
    */
-  size_t const ParseBook(const string &json_book,
-                         vector<vector<vector<JsonToken>>> &book) const;
+  void ProcessToken(const JsonToken &tok,
+                    bool isNewSentence, bool isNewUnroll);
+
+  // Corpus (vocabulary) and book being filled
+  CorpusUnrolls &m_corpus;
+  BookUnrolls &m_book;
+
+  // What do we do with the tokens?
+  bool m_insertVocab;
+  bool m_mergeLabelWithWord;
+
+  // Number of sentences, including empty ones
+  int m_numSentences;
+
+  // Was the JSON text well-formed?
+  bool m_isParsed;
+
+  // Buffers reused from one token to the next
+  string m_wordAsTarget;
+  string m_wordAsContext;
+  string m_label;
 };
 
 #endif
@@ -0,0 +1,592 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#include "CommandLineParser.h"
+#include "ReadJson.h"
+#include "RnnDependencyTreeLib.h"
+#include "RnnServer.h"
+#include "Blas.h"
+
+using namespace std;
+
+
+/**
+ * Dependency labels of the synthetic books
+ */
+static const char *const c_benchmarkLabels[] = {
+  "nsubj", "det", "amod", "dobj", "prep", "pobj", "advmod", "cc", "conj",
+  "punct", "aux"
+};
+static const int c_numBenchmarkLabels = 11;
+
+
+/**
+ * Generator of pseudo-random numbers with a fixed seed (xorshift),
+ * independent from rand(), which initializes the weights
+ */
+class BenchmarkRandom {
+public:
+  BenchmarkRandom(unsigned long long seed) : m_state(seed) { }
+
+  // Integer in [0, n[
+  int Next(int n) {
+    m_state ^= m_state << 13;
+    m_state ^= m_state >> 7;
+    m_state ^= m_state << 17;
+    return (int)((m_state >> 11) % (unsigned long long)n);
+  }
+
+  // Index of a word among n words sorted by frequency
+  // (log-uniform, roughly following Zipf's law)
+  int NextWord(int n) {
+    double u = Next(1 << 30) / (double)(1 << 30);
+    int word = (int)exp(u * log((double)n + 1)) - 1;
+    return min(max(word, 0), n - 1);
+  }
+
+protected:
+  unsigned long long m_state;
+};
+
+
+/**
+ * Write a synthetic book of dependency parse trees in JSON:
+ * each sentence (of 3 to 18 words) gets a random tree,
+ * unrolled from the root to each leaf, and each token is discounted
+ * by the number of unrolls going through it
+ */
+static long WriteSyntheticBook(const string &filename,
+                               int numSentences,
+                               int sizeVocabulary,
+                               BenchmarkRandom &random) {
+  FILE *fo = fopen(filename.c_str(), "w");
+  if (fo == NULL) {
+    cerr << "Cannot write the book " << filename << endl;
+    exit(1);
+  }
+  long numTokens = 0;
+  fprintf(fo, "[");
+  for (int s = 0; s < numSentences; s++) {
+    int n = 3 + random.Next(16);
+    vector<int> words(n), heads(n, -1), labels(n, 0), counts(n, 0);
+    vector<vector<int> > children(n);
+    for (int k = 0; k < n; k++) {
+      words[k] = random.NextWord(sizeVocabulary);
+      if (k > 0) {
+        heads[k] = random.Next(k);
+        labels[k] = random.Next(c_numBenchmarkLabels);
+        children[heads[k]].push_back(k);
+      }
+    }
+    // Paths from the root to each leaf, in depth-first order
+    vector<vector<int> > paths;
+    vector<pair<int, vector<int> > > stack(1, make_pair(0, vector<int>()));
+    while (!stack.empty()) {
+      int node = stack.back().first;
+      vector<int> path = stack.back().second;
+      stack.pop_back();
+      path.push_back(node);
+      if (children[node].empty()) {
+        paths.push_back(path);
+      }
+      for (int c = (int)children[node].size() - 1; c >= 0; c--) {
+        stack.push_back(make_pair(children[node][c], path));
+      }
+    }
+    for (size_t p = 0; p < paths.size(); p++) {
+      for (size_t k = 0; k < paths[p].size(); k++) {
+        counts[paths[p][k]]++;
+      }
+    }
+    fprintf(fo, (s > 0) ? ", [" : "[");
+    for (size_t p = 0; p < paths.size(); p++) {
+      fprintf(fo, (p > 0) ? ", [" : "[");
+      for (size_t k = 0; k < paths[p].size(); k++) {
+        int t = paths[p][k];
+        const char *label = (k + 1 == paths[p].size()) ?
+        "LEAF" : c_benchmarkLabels[labels[paths[p][k + 1]]];
+        fprintf(fo, "%s[%d, \"w%d\", %d, \"%s\"]", (k > 0) ? ", " : "",
+                t, words[t], counts[t], label);
+        numTokens++;
+      }
+      fprintf(fo, "]");
+    }
+    fprintf(fo, "]");
+  }
+  fprintf(fo, "]\n");
+  fclose(fo);
+  return numTokens;
+}
+
+
+/**
+ * Peak resident set size of the process so far, in megabytes
+ */
+static double PeakResidentSetSize() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+  return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+
+/**
+ * Median of the measurements of repeated runs
+ */
+static double Median(vector<double> values) {
+  sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+
+/**
+ * Parse a comma-separated list of integers
+ */
+static vector<int> ParseList(const string &str) {
+  vector<int> values;
+  stringstream stream(str);
+  string item;
+  while (getline(stream, item, ',')) {
+    if (!item.empty()) {
+      values.push_back(atoi(item.c_str()));
+    }
+  }
+  return values;
+}
+
+
+/**
+ * Configuration of a synthetic model
+ */
+struct BenchmarkConfig {
+  int sizeHidden;
+  int numClasses;
+  int sizeDirectMillions;
+  int orderDirect;
+  int numBpttSteps;
+  int bpttBlockSize;
+};
+
+
+/**
+ * Results of the benchmarks, one CSV row per measurement, written
+ * in a stable order and format so that two runs can be diffed
+ */
+class BenchmarkReport {
+public:
+  BenchmarkReport(FILE *output) : m_output(output) {
+    fprintf(m_output, "benchmark,hidden,classes,direct,order,bptt,vocabulary,"
+            "calls,ns/call,calls/sec,peak_rss_mb\n");
+    fflush(m_output);
+  }
+
+  void Row(const string &benchmark,
+           const BenchmarkConfig *config,
+           int sizeVocabulary,
+           long numCalls,
+           double nanosecondsPerCall) {
+    if (config != NULL) {
+      fprintf(m_output, "%s,%d,%d,%d,%d,%d/%d,%d,",
+              benchmark.c_str(), config->sizeHidden, config->numClasses,
+              config->sizeDirectMillions, config->orderDirect,
+              config->numBpttSteps, config->bpttBlockSize, sizeVocabulary);
+    } else {
+      fprintf(m_output, "%s,-,-,-,-,-,%d,", benchmark.c_str(), sizeVocabulary);
+    }
+    fprintf(m_output, "%ld,%.1f,%.0f,%.1f\n", numCalls, nanosecondsPerCall,
+            1e9 / nanosecondsPerCall, PeakResidentSetSize());
+    fflush(m_output);
+  }
+
+protected:
+  FILE *m_output;
+};
+
+
+/**
+ * Tree-dependent RNN trained and evaluated on synthetic books,
+ * giving the benchmarks access to the steps of the training
+ */
+class RnnBenchmarkModel : public RnnTreeLM {
+public:
+  RnnBenchmarkModel(const string &filename)
+  : RnnTreeLM(filename, false, false) { }
+
+  /**
+   * Time the steps of the training on a stream of words: forward
+   * propagation, outputs of the target class, shift of the BPTT memory
+   * and back-propagation (ns per call, one value per step)
+   */
+  void TimeTrainingSteps(const vector<int> &words, vector<double> &nanoseconds) {
+    TrainingWorker worker(m_state, m_bpttVectors, 0);
+    RnnState &state = worker.state;
+    ResetHiddenRnnStateAndWordHistory(state);
+    nanoseconds.assign(4, 0.0);
+    int contextWord = 0;
+    for (size_t k = 0; k < words.size(); k++) {
+      int word = words[k];
+      chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+      ForwardPropagateOneStep(contextWord, word, state);
+      chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+      ComputeRnnOutputsForGivenClass(m_vocab.WordIndex2Class(word), state);
+      chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+      worker.bptt.Shift(contextWord);
+      chrono::steady_clock::time_point t3 = chrono::steady_clock::now();
+      BackPropagateErrorsThenOneStepGradientDescent(contextWord, word,
+                                                    m_learningRate,
+                                                    worker.wordCounter,
+                                                    state, worker.bptt);
+      chrono::steady_clock::time_point t4 = chrono::steady_clock::now();
+      nanoseconds[0] += chrono::duration<double, nano>(t1 - t0).count();
+      nanoseconds[1] += chrono::duration<double, nano>(t2 - t1).count();
+      nanoseconds[2] += chrono::duration<double, nano>(t3 - t2).count();
+      nanoseconds[3] += chrono::duration<double, nano>(t4 - t3).count();
+      worker.wordCounter++;
+      ForwardPropagateRecurrentConnectionOnly(state);
+      ForwardPropagateWordHistory(state, contextWord, word);
+      contextWord = word;
+      // Independent sentences of 20 words
+      if ((k % 20) == 19) {
+        ResetHiddenRnnStateAndWordHistory(state);
+        worker.bptt.Reset();
+        contextWord = 0;
+      }
+    }
+    for (int k = 0; k < 4; k++) {
+      nanoseconds[k] /= words.size();
+    }
+  }
+
+  /**
+   * Parse the JSON training books (without the binary book cache);
+   * returns the number of tokens
+   */
+  long ParseBooks() {
+    long numTokens = 0;
+    const vector<string> &books = m_corpusTrain.BookFilenames();
+    for (size_t k = 0; k < books.size(); k++) {
+      BookUnrolls book;
+      ReadJson reader(books[k], m_corpusTrain, book, false, true, false);
+      numTokens += book.NumTokens();
+    }
+    return numTokens;
+  }
+
+  /**
+   * Train one epoch on the training books, with a single thread
+   * (reading each book, then training on it); returns the number of tokens
+   */
+  long TrainEpoch() {
+    TrainingWorker worker(m_state, m_bpttVectors, 0);
+    atomic<long> numWordsTrained(0);
+    mutex logMutex;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    long numTokens = 0;
+    BookUnrolls book;
+    for (int k = 0; k < m_corpusTrain.NumBooks(); k++) {
+      m_corpusTrain.NextBook();
+      m_corpusTrain.ReadBook(m_typeOfDepLabels == 1);
+      book.Swap(m_corpusTrain.m_currentBook);
+      numTokens += book.NumTokens();
+      TrainOnBook(book, k, worker, numWordsTrained, 0, start, logMutex);
+    }
+    return numTokens;
+  }
+
+  /**
+   * Number of tokens of the validation books
+   */
+  long NumValidationTokens() {
+    long numTokens = 0;
+    for (int k = 0; k < m_corpusValidTest.NumBooks(); k++) {
+      m_corpusValidTest.NextBook();
+      m_corpusValidTest.ReadBook(m_typeOfDepLabels == 1);
+      numTokens += m_corpusValidTest.m_currentBook.NumTokens();
+    }
+    return numTokens;
+  }
+
+  /**
+   * Evaluate the model on the validation books
+   */
+  void Evaluate() {
+    vector<double> sentenceScores;
+    double logProbability, perplexity, entropy, accuracy;
+    TestRnnModel(m_validationFile, "", sentenceScores,
+                 logProbability, perplexity, entropy, accuracy);
+  }
+};
+
+
+/**
+ * Remove the files of the working directory, and the directory
+ */
+static void RemoveDirectory(const string &dirname) {
+  DIR *dir = opendir(dirname.c_str());
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    string name = entry->d_name;
+    if ((name != ".") && (name != "..")) {
+      remove((dirname + "/" + name).c_str());
+    }
+  }
+  closedir(dir);
+  rmdir(dirname.c_str());
+}
+
+
+/**
+ * Benchmark suite of the hot paths of the RNN, on synthetic models
+ * (micro-benchmarks of the training steps, parsing and loading)
+ * and on synthetic books (training epoch and evaluation).
+ * The results are written to the standard output, the logs of the
+ * library to the standard error (and discarded unless verbose).
+ */
+int main(int argc, char *argv[]) {
+  CommandLineParser parser;
+  parser.Register("hidden", "string",
+                  "Comma-separated sizes of the hidden layer", "50,100,200,300");
+  parser.Register("class", "int", "Number of word classes", "250");
+  parser.Register("direct", "string",
+                  "Comma-separated sizes of the hash table of direct n-gram connections, in millions of entries", "0,1000,2000");
+  parser.Register("direct-order", "string",
+                  "Comma-separated orders of the direct n-gram connections", "3,4");
+  parser.Register("bptt", "int", "Number of steps of BPTT", "4");
+  parser.Register("bptt-block", "int", "Number of steps between two BPTT", "10");
+  parser.Register("vocabulary", "int",
+                  "Number of word types of the synthetic books", "10000");
+  parser.Register("books", "int", "Number of synthetic training books", "4");
+  parser.Register("sentences", "int", "Number of sentences per book", "500");
+  parser.Register("steps", "int",
+                  "Number of words of the micro-benchmarks of the training steps", "2000");
+  parser.Register("repeat", "int",
+                  "Number of runs of each benchmark (the median is reported)", "3");
+  parser.Register("workdir", "string",
+                  "Directory where the synthetic books and models are written", "/tmp");
+  parser.Register("blas", "string",
+                  "Backend of the matrix products: library or reference", "library");
+  parser.Register("verbose", "bool",
+                  "Keep the logs of the library (on the standard error)", "false");
+  if ((argc > 1) && !parser.Parse(argv, argc)) {
+    return 1;
+  }
+  string hiddenList, directList, orderList, workPath;
+  parser.Get("hidden", hiddenList);
+  parser.Get("direct", directList);
+  parser.Get("direct-order", orderList);
+  parser.Get("workdir", workPath);
+  int numClasses = 250, numBpttSteps = 4, bpttBlockSize = 10;
+  int sizeVocabulary = 10000, numBooks = 4, numSentences = 500;
+  int numSteps = 2000, numRepeats = 3;
+  bool isVerbose = false;
+  parser.Get("class", numClasses);
+  parser.Get("bptt", numBpttSteps);
+  parser.Get("bptt-block", bpttBlockSize);
+  parser.Get("vocabulary", sizeVocabulary);
+  parser.Get("books", numBooks);
+  parser.Get("sentences", numSentences);
+  parser.Get("steps", numSteps);
+  parser.Get("repeat", numRepeats);
+  parser.Get("verbose", isVerbose);
+  string blasBackendName = "library";
+  parser.Get("blas", blasBackendName);
+  if (!SetBlasBackend(blasBackendName)) {
+    cerr << "The backend of the matrix products must be library or reference"
+    << endl;
+    return 1;
+  }
+  vector<int> sizesHidden = ParseList(hiddenList);
+  vector<int> sizesDirect = ParseList(directList);
+  vector<int> ordersDirect = ParseList(orderList);
+  if (sizesHidden.empty() || sizesDirect.empty() || ordersDirect.empty() ||
+      (numBooks < 1) || (numSentences < 1) || (numSteps < 1) ||
+      (numRepeats < 1) || (sizeVocabulary < 1)) {
+    cerr << "The lists of sizes and the numbers of books, sentences, steps "
+    << "and runs must not be empty" << endl;
+    return 1;
+  }
+  for (size_t k = 0; k < ordersDirect.size(); k++) {
+    if ((ordersDirect[k] < 1) || (ordersDirect[k] > c_maxNGramOrder)) {
+      cerr << "Direct n-gram order must be within 1 and "
+      << c_maxNGramOrder << endl;
+      return 1;
+    }
+  }
+
+  // The results go to the standard output, the logs to the standard error
+  FILE *output = fdopen(RnnServer::DetachStandardOutput(), "w");
+  BenchmarkReport report(output);
+
+  // Synthetic books, the same for every run
+  string workTemplate = workPath + "/RnnBenchmark.XXXXXX";
+  vector<char> workName(workTemplate.begin(), workTemplate.end());
+  workName.push_back('\0');
+  if (mkdtemp(&workName[0]) == NULL) {
+    cerr << "Cannot create a directory in " << workPath << endl;
+    return 1;
+  }
+  string workDir(&workName[0]);
+  BenchmarkRandom random(1);
+  vector<string> trainBooks;
+  for (int b = 0; b < numBooks; b++) {
+    trainBooks.push_back(workDir + "/book" + ConvString(b) + ".json");
+    WriteSyntheticBook(trainBooks.back(), numSentences, sizeVocabulary, random);
+  }
+  // Validation book of 5-best lists (like the sentence completion
+  // questions), with the index of the correct candidate of each list
+  string validBook = workDir + "/valid.json";
+  int numValidLists = max(numSentences / 25, 1);
+  WriteSyntheticBook(validBook, 5 * numValidLists, sizeVocabulary, random);
+  string validLabels = workDir + "/valid.labels";
+  FILE *labelFile = fopen(validLabels.c_str(), "w");
+  for (int k = 0; k < numValidLists; k++) {
+    fprintf(labelFile, "%d\n", random.Next(5));
+  }
+  fclose(labelFile);
+
+  // Discard the logs of the library, unless verbose
+  if (!isVerbose) {
+    cout.setstate(ios::badbit);
+  }
+
+  bool isFirstModel = true;
+  for (size_t h = 0; h < sizesHidden.size(); h++) {
+    for (size_t d = 0; d < sizesDirect.size(); d++) {
+      // Without direct connections, the order does not matter
+      size_t numOrders = (sizesDirect[d] > 0) ? ordersDirect.size() : 1;
+      for (size_t o = 0; o < numOrders; o++) {
+        BenchmarkConfig config;
+        config.sizeHidden = sizesHidden[h];
+        config.numClasses = numClasses;
+        config.sizeDirectMillions = sizesDirect[d];
+        config.orderDirect = (sizesDirect[d] > 0) ? ordersDirect[o] : 0;
+        config.numBpttSteps = numBpttSteps;
+        config.bpttBlockSize = bpttBlockSize;
+
+        // Synthetic model, with the vocabulary of the books
+        string modelFile = workDir + "/m.model";
+        RnnBenchmarkModel model(modelFile);
+        for (size_t b = 0; b < trainBooks.size(); b++) {
+          model.AddBookTrain(trainBooks[b]);
+        }
+        model.AddBookTestValid(validBook);
+        model.SetValidFile(validBook);
+        model.SetSentenceLabelsFile(validLabels);
+        model.SetMinWordOccurrence(1);
+        model.SetDependencyLabelType(2);
+        model.LearnVocabularyFromTrainFile(numClasses);
+        int sizeModelVocabulary = model.GetVocabularySize();
+        model.InitializeRnnModel(sizeModelVocabulary,
+                                 config.sizeHidden,
+                                 model.GetLabelSize(),
+                                 numClasses,
+                                 0,
+                                 config.sizeDirectMillions * 1000000LL,
+                                 config.orderDirect);
+        model.SetLearningRate(0.1);
+        model.SetNumStepsBPTT(numBpttSteps);
+        model.SetBPTTBlock(bpttBlockSize);
+        model.SetIndependent(true);
+
+        // Parsing the JSON books does not depend on the model
+        if (isFirstModel) {
+          vector<double> times;
+          long numTokens = 0;
+          for (int r = 0; r < numRepeats; r++) {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            numTokens = model.ParseBooks();
+            times.push_back(SecondsSince(start) * 1e9 / numTokens);
+          }
+          report.Row("parse_book", NULL, sizeModelVocabulary,
+                     numTokens, Median(times));
+          isFirstModel = false;
+        }
+
+        // Steps of the training, on words drawn from the vocabulary
+        vector<int> words(numSteps);
+        BenchmarkRandom randomWords(7);
+        for (int k = 0; k < numSteps; k++) {
+          words[k] = randomWords.NextWord(sizeModelVocabulary);
+        }
+        vector<vector<double> > stepTimes(4);
+        for (int r = 0; r < numRepeats; r++) {
+          vector<double> nanoseconds;
+          model.TimeTrainingSteps(words, nanoseconds);
+          for (int k = 0; k < 4; k++) {
+            stepTimes[k].push_back(nanoseconds[k]);
+          }
+        }
+        report.Row("forward_step", &config, sizeModelVocabulary,
+                   numSteps, Median(stepTimes[0]));
+        report.Row("class_outputs", &config, sizeModelVocabulary,
+                   numSteps, Median(stepTimes[1]));
+        report.Row("bptt_shift", &config, sizeModelVocabulary,
+                   numSteps, Median(stepTimes[2]));
+        report.Row("backward_step", &config, sizeModelVocabulary,
+                   numSteps, Median(stepTimes[3]));
+
+        // Training epoch and evaluation on the synthetic books
+        vector<double> times;
+        long numTokens = 0;
+        for (int r = 0; r < numRepeats; r++) {
+          chrono::steady_clock::time_point start = chrono::steady_clock::now();
+          numTokens = model.TrainEpoch();
+          times.push_back(SecondsSince(start) * 1e9 / numTokens);
+        }
+        report.Row("train_epoch", &config, sizeModelVocabulary,
+                   numTokens, Median(times));
+        times.clear();
+        numTokens = model.NumValidationTokens();
+        for (int r = 0; r < numRepeats; r++) {
+          chrono::steady_clock::time_point start = chrono::steady_clock::now();
+          model.Evaluate();
+          times.push_back(SecondsSince(start) * 1e9 / numTokens);
+        }
+        report.Row("eval", &config, sizeModelVocabulary,
+                   numTokens, Median(times));
+
+        // Loading the model file
+        model.SaveRnnModelToFile();
+        times.clear();
+        for (int r = 0; r < numRepeats; r++) {
+          chrono::steady_clock::time_point start = chrono::steady_clock::now();
+          RnnLM loaded(modelFile, true);
+          times.push_back(SecondsSince(start) * 1e9);
+        }
+        report.Row("load_model", &config, sizeModelVocabulary,
+                   1, Median(times));
+      }
+    }
+  }
+
+  cout.clear();
+  LogWriter::Instance().Flush();
+  RemoveDirectory(workDir);
+  fclose(output);
+  return 0;
+}
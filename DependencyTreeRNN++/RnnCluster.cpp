@@ -0,0 +1,555 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "Utils.h"
+#include "RnnCluster.h"
+
+using namespace std;
+
+
+/**
+ * Greeting sent by each node when it connects to the first node
+ */
+static const int c_clusterMagic = 0x524e4e43;
+
+/**
+ * Number of attempts (one per second) to connect to the first node,
+ * which may not be listening yet
+ */
+static const int c_maxConnectionAttempts = 300;
+
+
+/**
+ * Constructor: rank of this node among numNodes nodes,
+ * and address of the first node (host and TCP port)
+ */
+RnnCluster::RnnCluster(int rank, int numNodes, const string &host, int port)
+: m_rank(rank), m_numNodes(numNodes), m_host(host), m_port(port),
+m_sockets(numNodes, -1) {
+}
+
+
+/**
+ * Destructor: close the connections
+ */
+RnnCluster::~RnnCluster() {
+  for (size_t k = 0; k < m_sockets.size(); k++) {
+    if (m_sockets[k] >= 0) {
+      close(m_sockets[k]);
+    }
+  }
+}
+
+
+/**
+ * Connect the nodes: the first node listens on the port and
+ * waits for all the other ones, which send their rank and
+ * the description of their model; the first node answers
+ * whether it is the same as its own.
+ */
+bool RnnCluster::Connect(const string &description) {
+  vector<char> ownDescription(description.begin(), description.end());
+  int isReused = 1;
+  int isNoDelay = 1;
+
+  if (IsMaster()) {
+    if (m_numNodes == 1) {
+      return true;
+    }
+    int fdSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (fdSocket < 0) {
+      cerr << "Cluster: cannot create a socket\n";
+      return false;
+    }
+    setsockopt(fdSocket, SOL_SOCKET, SO_REUSEADDR, &isReused, sizeof(isReused));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((unsigned short)m_port);
+    if ((bind(fdSocket, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+        (listen(fdSocket, m_numNodes) < 0)) {
+      cerr << "Cluster: cannot listen on port " << m_port << endl;
+      close(fdSocket);
+      return false;
+    }
+    Log("Cluster: waiting for " + ConvString(m_numNodes - 1) +
+        " nodes on port " + ConvString(m_port) + "\n");
+
+    int numConnected = 1;
+    while (numConnected < m_numNodes) {
+      int fdNode = accept(fdSocket, NULL, NULL);
+      if (fdNode < 0) {
+        continue;
+      }
+      setsockopt(fdNode, IPPROTO_TCP, TCP_NODELAY, &isNoDelay, sizeof(isNoDelay));
+      int greeting[2] = {0, -1};
+      vector<char> nodeDescription;
+      if (!ReceiveAll(fdNode, greeting, sizeof(greeting)) ||
+          !ReceiveVector(fdNode, nodeDescription) ||
+          (greeting[0] != c_clusterMagic)) {
+        cerr << "Cluster: invalid greeting, connection ignored\n";
+        close(fdNode);
+        continue;
+      }
+      int rank = greeting[1];
+      int isAccepted = ((rank > 0) && (rank < m_numNodes) &&
+                        (m_sockets[rank] < 0) &&
+                        (nodeDescription == ownDescription)) ? 1 : 0;
+      SendAll(fdNode, &isAccepted, sizeof(isAccepted));
+      if (!isAccepted) {
+        cerr << "Cluster: node " << rank
+             << " rejected (duplicate rank or different model)\n";
+        close(fdNode);
+        continue;
+      }
+      m_sockets[rank] = fdNode;
+      numConnected++;
+      Log("Cluster: node " + ConvString(rank) + " connected\n");
+    }
+    close(fdSocket);
+    return true;
+  }
+
+  // Connect to the first node, waiting for it to listen
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses = NULL;
+  if (getaddrinfo(m_host.c_str(), to_string(m_port).c_str(),
+                  &hints, &addresses) != 0) {
+    cerr << "Cluster: unknown host " << m_host << endl;
+    return false;
+  }
+  int fdNode = -1;
+  for (int attempt = 0; attempt < c_maxConnectionAttempts; attempt++) {
+    fdNode = socket(AF_INET, SOCK_STREAM, 0);
+    if ((fdNode >= 0) &&
+        (connect(fdNode, addresses->ai_addr, addresses->ai_addrlen) == 0)) {
+      break;
+    }
+    if (fdNode >= 0) {
+      close(fdNode);
+      fdNode = -1;
+    }
+    sleep(1);
+  }
+  freeaddrinfo(addresses);
+  if (fdNode < 0) {
+    cerr << "Cluster: cannot connect to " << m_host << ":" << m_port << endl;
+    return false;
+  }
+  setsockopt(fdNode, IPPROTO_TCP, TCP_NODELAY, &isNoDelay, sizeof(isNoDelay));
+  int greeting[2] = {c_clusterMagic, m_rank};
+  int isAccepted = 0;
+  if (!SendAll(fdNode, greeting, sizeof(greeting)) ||
+      !SendVector(fdNode, ownDescription) ||
+      !ReceiveAll(fdNode, &isAccepted, sizeof(isAccepted)) ||
+      !isAccepted) {
+    cerr << "Cluster: rejected by the first node (duplicate rank or different model)\n";
+    close(fdNode);
+    return false;
+  }
+  m_sockets[0] = fdNode;
+  Log("Cluster: node " + ConvString(m_rank) + " connected to " +
+      m_host + ":" + ConvString(m_port) + "\n");
+  return true;
+}
+
+
+/**
+ * Copy the weights of the first node to all the other nodes
+ * (in double precision, and only the blocks of direct n-gram
+ * connections which are not zero), which is where
+ * the averaging starts from
+ */
+bool RnnCluster::BroadcastWeights(RnnWeights &weights) {
+  vector<vector<double> *> dense = DenseBlocks(weights);
+  if (IsMaster()) {
+    // Blocks of direct n-gram connections which are not zero
+    vector<long long> blocks;
+    long long sizeDirect = (long long)(weights.DirectNGram.size());
+    for (long long start = 0; start < sizeDirect;
+         start += c_directNGramSyncBlockSize) {
+      long long end = min(start + c_directNGramSyncBlockSize, sizeDirect);
+      for (long long k = start; k < end; k++) {
+        if (weights.DirectNGram[k] != 0) {
+          blocks.push_back(start >> c_directNGramSyncBlockShift);
+          break;
+        }
+      }
+    }
+    vector<float> values;
+    GatherDirectNGram(weights, blocks, values);
+    for (int rank = 1; rank < m_numNodes; rank++) {
+      for (size_t k = 0; k < dense.size(); k++) {
+        if (!SendVector(m_sockets[rank], *(dense[k]))) {
+          cerr << "Cluster: lost node " << rank << endl;
+          return false;
+        }
+      }
+      if (!SendVector(m_sockets[rank], blocks) ||
+          !SendVector(m_sockets[rank], values)) {
+        cerr << "Cluster: lost node " << rank << endl;
+        return false;
+      }
+    }
+  } else {
+    for (size_t k = 0; k < dense.size(); k++) {
+      size_t size = dense[k]->size();
+      if (!ReceiveVector(m_sockets[0], *(dense[k])) ||
+          (dense[k]->size() != size)) {
+        cerr << "Cluster: cannot receive the weights\n";
+        return false;
+      }
+    }
+    vector<long long> blocks;
+    vector<float> values;
+    if (!ReceiveVector(m_sockets[0], blocks) ||
+        !ReceiveVector(m_sockets[0], values)) {
+      cerr << "Cluster: cannot receive the weights\n";
+      return false;
+    }
+    fill(weights.DirectNGram.begin(), weights.DirectNGram.end(), 0.0f);
+    ScatterDirectNGram(weights, blocks, values);
+  }
+
+  // The averaging starts from these weights
+  m_reference.clear();
+  for (size_t k = 0; k < dense.size(); k++) {
+    m_reference.insert(m_reference.end(), dense[k]->begin(), dense[k]->end());
+  }
+  return true;
+}
+
+
+/**
+ * Average the weights of all the nodes: the first node receives
+ * the changes of the weight matrices of each node since the last
+ * averaging and the blocks of direct n-gram connections each node
+ * updated, and sends back the average change of the weight matrices
+ * and the average value of the blocks (over the nodes which updated
+ * them). All the nodes, including the first one, then apply the same
+ * single-precision changes, so that they keep the same weights.
+ */
+bool RnnCluster::AverageWeights(RnnWeights &weights,
+                                vector<unsigned char> &touchedBlocks) {
+  // A single node keeps its weights as they are
+  if (m_numNodes == 1) {
+    fill(touchedBlocks.begin(), touchedBlocks.end(), 0);
+    return true;
+  }
+  vector<vector<double> *> dense = DenseBlocks(weights);
+
+  // Changes of the weight matrices since the last averaging
+  vector<float> changes(m_reference.size());
+  size_t idx = 0;
+  for (size_t k = 0; k < dense.size(); k++) {
+    const vector<double> &block = *(dense[k]);
+    for (size_t j = 0; j < block.size(); j++, idx++) {
+      changes[idx] = (float)(block[j] - m_reference[idx]);
+    }
+  }
+  // Blocks of direct n-gram connections updated by this node
+  vector<long long> blocks;
+  for (size_t b = 0; b < touchedBlocks.size(); b++) {
+    if (touchedBlocks[b]) {
+      blocks.push_back((long long)b);
+    }
+  }
+  vector<float> values;
+  GatherDirectNGram(weights, blocks, values);
+
+  if (IsMaster()) {
+    // Sum the changes of the weight matrices, and the values of the
+    // blocks of direct n-gram connections with the number of nodes
+    // which updated each of them
+    vector<double> sumChanges(changes.begin(), changes.end());
+    unordered_map<long long, size_t> blockSlots;
+    vector<long long> sumBlocks;
+    vector<double> sumValues;
+    vector<int> numUpdates;
+    long long sizeDirect = (long long)(weights.DirectNGram.size());
+    auto accumulateBlocks = [&](const vector<long long> &nodeBlocks,
+                                const vector<float> &nodeValues) {
+      size_t offset = 0;
+      for (size_t b = 0; b < nodeBlocks.size(); b++) {
+        auto it = blockSlots.find(nodeBlocks[b]);
+        size_t slot = 0;
+        if (it == blockSlots.end()) {
+          slot = sumBlocks.size();
+          blockSlots[nodeBlocks[b]] = slot;
+          sumBlocks.push_back(nodeBlocks[b]);
+          sumValues.resize(sumValues.size() + c_directNGramSyncBlockSize, 0.0);
+          numUpdates.push_back(0);
+        } else {
+          slot = it->second;
+        }
+        long long start = nodeBlocks[b] << c_directNGramSyncBlockShift;
+        long long length =
+        min((long long)c_directNGramSyncBlockSize, sizeDirect - start);
+        for (long long k = 0; k < length; k++) {
+          sumValues[slot * c_directNGramSyncBlockSize + k] +=
+          nodeValues[offset + k];
+        }
+        offset += length;
+        numUpdates[slot]++;
+      }
+    };
+    accumulateBlocks(blocks, values);
+    for (int rank = 1; rank < m_numNodes; rank++) {
+      vector<float> nodeChanges;
+      vector<long long> nodeBlocks;
+      vector<float> nodeValues;
+      if (!ReceiveVector(m_sockets[rank], nodeChanges) ||
+          !ReceiveVector(m_sockets[rank], nodeBlocks) ||
+          !ReceiveVector(m_sockets[rank], nodeValues) ||
+          (nodeChanges.size() != changes.size())) {
+        cerr << "Cluster: lost node " << rank << endl;
+        return false;
+      }
+      for (size_t k = 0; k < changes.size(); k++) {
+        sumChanges[k] += nodeChanges[k];
+      }
+      accumulateBlocks(nodeBlocks, nodeValues);
+    }
+
+    // Average changes, and average values of the blocks (in block order)
+    for (size_t k = 0; k < changes.size(); k++) {
+      changes[k] = (float)(sumChanges[k] / m_numNodes);
+    }
+    blocks = sumBlocks;
+    sort(blocks.begin(), blocks.end());
+    values.clear();
+    for (size_t b = 0; b < blocks.size(); b++) {
+      size_t slot = blockSlots[blocks[b]];
+      long long start = blocks[b] << c_directNGramSyncBlockShift;
+      long long length =
+      min((long long)c_directNGramSyncBlockSize, sizeDirect - start);
+      for (long long k = 0; k < length; k++) {
+        values.push_back((float)(sumValues[slot * c_directNGramSyncBlockSize + k] /
+                                 numUpdates[slot]));
+      }
+    }
+    for (int rank = 1; rank < m_numNodes; rank++) {
+      if (!SendVector(m_sockets[rank], changes) ||
+          !SendVector(m_sockets[rank], blocks) ||
+          !SendVector(m_sockets[rank], values)) {
+        cerr << "Cluster: lost node " << rank << endl;
+        return false;
+      }
+    }
+  } else {
+    if (!SendVector(m_sockets[0], changes) ||
+        !SendVector(m_sockets[0], blocks) ||
+        !SendVector(m_sockets[0], values) ||
+        !ReceiveVector(m_sockets[0], changes) ||
+        !ReceiveVector(m_sockets[0], blocks) ||
+        !ReceiveVector(m_sockets[0], values) ||
+        (changes.size() != m_reference.size())) {
+      cerr << "Cluster: lost the first node\n";
+      return false;
+    }
+  }
+
+  // Apply the average changes to the weight matrices
+  idx = 0;
+  for (size_t k = 0; k < dense.size(); k++) {
+    vector<double> &block = *(dense[k]);
+    for (size_t j = 0; j < block.size(); j++, idx++) {
+      m_reference[idx] += changes[idx];
+      block[j] = m_reference[idx];
+    }
+  }
+  ScatterDirectNGram(weights, blocks, values);
+  fill(touchedBlocks.begin(), touchedBlocks.end(), 0);
+  return true;
+}
+
+
+/**
+ * Sum values (e.g., statistics of the training) over all the nodes
+ */
+bool RnnCluster::SumValues(vector<double> &values) {
+  if (IsMaster()) {
+    for (int rank = 1; rank < m_numNodes; rank++) {
+      vector<double> nodeValues;
+      if (!ReceiveVector(m_sockets[rank], nodeValues) ||
+          (nodeValues.size() != values.size())) {
+        cerr << "Cluster: lost node " << rank << endl;
+        return false;
+      }
+      for (size_t k = 0; k < values.size(); k++) {
+        values[k] += nodeValues[k];
+      }
+    }
+    return BroadcastValues(values);
+  }
+  if (!SendVector(m_sockets[0], values)) {
+    cerr << "Cluster: lost the first node\n";
+    return false;
+  }
+  return BroadcastValues(values);
+}
+
+
+/**
+ * Copy values (e.g., decisions of the first node) to all the nodes
+ */
+bool RnnCluster::BroadcastValues(vector<double> &values) {
+  if (IsMaster()) {
+    for (int rank = 1; rank < m_numNodes; rank++) {
+      if (!SendVector(m_sockets[rank], values)) {
+        cerr << "Cluster: lost node " << rank << endl;
+        return false;
+      }
+    }
+    return true;
+  }
+  size_t size = values.size();
+  if (!ReceiveVector(m_sockets[0], values) || (values.size() != size)) {
+    cerr << "Cluster: lost the first node\n";
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Send a buffer on a connection; return false if the connection is lost
+ */
+bool RnnCluster::SendAll(int fd, const void *data, size_t size) {
+  const char *buffer = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t numSent = send(fd, buffer, size, MSG_NOSIGNAL);
+    if (numSent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buffer += numSent;
+    size -= numSent;
+  }
+  return true;
+}
+
+
+/**
+ * Receive a buffer on a connection; return false if the connection is lost
+ */
+bool RnnCluster::ReceiveAll(int fd, void *data, size_t size) {
+  char *buffer = static_cast<char *>(data);
+  while (size > 0) {
+    ssize_t numReceived = recv(fd, buffer, size, 0);
+    if (numReceived < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (numReceived == 0) {
+      return false;
+    }
+    buffer += numReceived;
+    size -= numReceived;
+  }
+  return true;
+}
+
+
+/**
+ * Send a vector, preceded by its number of elements
+ */
+template <typename T>
+bool RnnCluster::SendVector(int fd, const vector<T> &values) {
+  unsigned long long size = values.size();
+  return SendAll(fd, &size, sizeof(size)) &&
+  (values.empty() || SendAll(fd, &values[0], values.size() * sizeof(T)));
+}
+
+
+/**
+ * Receive a vector, preceded by its number of elements
+ */
+template <typename T>
+bool RnnCluster::ReceiveVector(int fd, vector<T> &values) {
+  unsigned long long size = 0;
+  if (!ReceiveAll(fd, &size, sizeof(size))) {
+    return false;
+  }
+  values.resize(size);
+  return values.empty() || ReceiveAll(fd, &values[0], size * sizeof(T));
+}
+
+
+/**
+ * Weight matrices, in the order in which they are exchanged
+ */
+vector<vector<double> *> RnnCluster::DenseBlocks(RnnWeights &weights) {
+  vector<vector<double> *> blocks;
+  blocks.push_back(&(weights.Input2Hidden));
+  blocks.push_back(&(weights.Recurrent2Hidden));
+  blocks.push_back(&(weights.Features2Hidden));
+  blocks.push_back(&(weights.Features2Output));
+  blocks.push_back(&(weights.Hidden2Output));
+  blocks.push_back(&(weights.Compress2Output));
+  return blocks;
+}
+
+
+/**
+ * Values of blocks of direct n-gram connections, one block after the other
+ */
+void RnnCluster::GatherDirectNGram(const RnnWeights &weights,
+                                   const vector<long long> &blocks,
+                                   vector<float> &values) const {
+  long long sizeDirect = (long long)(weights.DirectNGram.size());
+  values.clear();
+  for (size_t b = 0; b < blocks.size(); b++) {
+    long long start = blocks[b] << c_directNGramSyncBlockShift;
+    long long end = min(start + c_directNGramSyncBlockSize, sizeDirect);
+    values.insert(values.end(),
+                  weights.DirectNGram.begin() + start,
+                  weights.DirectNGram.begin() + end);
+  }
+}
+
+
+/**
+ * Copy the values of blocks of direct n-gram connections in place
+ */
+void RnnCluster::ScatterDirectNGram(RnnWeights &weights,
+                                    const vector<long long> &blocks,
+                                    const vector<float> &values) const {
+  long long sizeDirect = (long long)(weights.DirectNGram.size());
+  size_t offset = 0;
+  for (size_t b = 0; b < blocks.size(); b++) {
+    long long start = blocks[b] << c_directNGramSyncBlockShift;
+    long long end = min(start + c_directNGramSyncBlockSize, sizeDirect);
+    if ((start >= sizeDirect) || (offset + (end - start) > values.size())) {
+      break;
+    }
+    copy(values.begin() + offset, values.begin() + offset + (end - start),
+         weights.DirectNGram.begin() + start);
+    offset += end - start;
+  }
+}
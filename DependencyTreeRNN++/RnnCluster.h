@@ -0,0 +1,133 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___RnnCluster_h
+#define DependencyTreeRNN___RnnCluster_h
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "RnnWeights.h"
+
+
+/**
+ * Nodes of a data-parallel training, connected by plain TCP:
+ * the first node (rank 0) listens on a port and each other node
+ * keeps a connection to it. Every node trains (with its threads)
+ * on its own copy of the weights, and the nodes periodically
+ * average their weights through the first node: the changes
+ * of the weight matrices since the last averaging are exchanged
+ * in single precision, and the direct n-gram connections only
+ * for the blocks of connections updated since then (each block
+ * is averaged over the nodes which updated it).
+ * The nodes are expected to share the same architecture
+ * (the binary values are exchanged in the native byte order).
+ */
+class RnnCluster {
+public:
+
+  /**
+   * Constructor: rank of this node among numNodes nodes,
+   * and address of the first node (host and TCP port)
+   */
+  RnnCluster(int rank, int numNodes, const std::string &host, int port);
+
+  /**
+   * Destructor: close the connections
+   */
+  ~RnnCluster();
+
+  int GetRank() const { return m_rank; }
+
+  int GetNumNodes() const { return m_numNodes; }
+
+  /**
+   * Is this node the first one, which coordinates the others?
+   */
+  bool IsMaster() const { return m_rank == 0; }
+
+  /**
+   * Connect the nodes: the first node waits for all the other ones.
+   * The description of the model (vocabulary and dimensions)
+   * must be the same on all the nodes.
+   */
+  bool Connect(const std::string &description);
+
+  /**
+   * Copy the weights of the first node to all the other nodes,
+   * which is where the averaging starts from
+   */
+  bool BroadcastWeights(RnnWeights &weights);
+
+  /**
+   * Average the weights of all the nodes (the same weights
+   * are then used by all the nodes) and clear the marks
+   * of the blocks of direct n-gram connections updated by this node
+   */
+  bool AverageWeights(RnnWeights &weights,
+                      std::vector<unsigned char> &touchedBlocks);
+
+  /**
+   * Sum values (e.g., statistics of the training) over all the nodes
+   */
+  bool SumValues(std::vector<double> &values);
+
+  /**
+   * Copy values (e.g., decisions of the first node) to all the nodes
+   */
+  bool BroadcastValues(std::vector<double> &values);
+
+protected:
+
+  /**
+   * Send or receive a buffer on a connection;
+   * return false if the connection is lost
+   */
+  bool SendAll(int fd, const void *data, size_t size);
+  bool ReceiveAll(int fd, void *data, size_t size);
+
+  /**
+   * Send or receive a vector, preceded by its number of elements
+   */
+  template <typename T>
+  bool SendVector(int fd, const std::vector<T> &values);
+  template <typename T>
+  bool ReceiveVector(int fd, std::vector<T> &values);
+
+  /**
+   * Weight matrices, in the order in which they are exchanged
+   */
+  std::vector<std::vector<double> *> DenseBlocks(RnnWeights &weights);
+
+  /**
+   * Blocks of direct n-gram connections: indices of the blocks
+   * and values of their connections (the last block may be shorter)
+   */
+  void GatherDirectNGram(const RnnWeights &weights,
+                         const std::vector<long long> &blocks,
+                         std::vector<float> &values) const;
+  void ScatterDirectNGram(RnnWeights &weights,
+                          const std::vector<long long> &blocks,
+                          const std::vector<float> &values) const;
+
+  // Rank of this node and number of nodes
+  int m_rank;
+  int m_numNodes;
+
+  // Address of the first node
+  std::string m_host;
+  int m_port;
+
+  // Connections: to the first node, or (on the first node)
+  // to each other node, indexed by rank (-1 for the first node)
+  std::vector<int> m_sockets;
+
+  // Weight matrices after the last averaging, from which
+  // the changes of the weights are computed
+  std::vector<double> m_reference;
+};
+
+#endif
@@ -42,10 +42,17 @@
 #include <map>
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <assert.h>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <algorithm>
 #include "ReadJson.h"
 #include "RnnState.h"
 #include "CorpusUnrollsReader.h"
+#include "PrefixStateTrie.h"
 #include "RnnDependencyTreeLib.h"
 
 // Include BLAS
@@ -112,37 +119,42 @@ bool RnnTreeLM::AssignVocabularyFromCorpora(int numClasses) {
 
   // Create an empty vocabulary structure for words
   m_vocab = Vocabulary(numClasses);
-  // The first word needs to be end-of-sentence? TBD...
-  m_vocab.AddWordToVocabulary("</s>");
-  // Copy the words currently in the corpus
-  // and insert them into the vocabulary of the RNN
-  // and to the maps: word <-> index
+  // The first word needs to be end-of-sentence, followed by the words
+  // currently in the corpus: the vocabulary of the RNN references
+  // the string table of the training corpus instead of copying it
+  int eos = m_corpusTrain.vocabulary.Find("</s>");
+  if (eos < 0) {
+    printf("Error: the vocabulary of the corpus does not contain </s>\n");
+    return false;
+  }
+  vector<int> wordIds(1, eos);
   for (int k = 0; k < m_corpusTrain.NumWords(); k++) {
-    // Get the word
-    string word = m_corpusTrain.vocabularyReverse[k];
-    // Lookup it up in the vocabulary and add to vocabulary if required
-    m_vocab.AddWordToVocabulary(word);
-    // Store the count of words in the vocabulary
-    double count = m_corpusTrain.wordCountsDiscounted[k];
-    m_vocab.SetWordCount(word, (int)round(count));
+    if (k != eos) {
+      wordIds.push_back(k);
+    }
+  }
+  m_vocab.ShareWords(m_corpusTrain.vocabulary, wordIds);
+  // Store the count of words in the vocabulary
+  for (int index = 0; index < (int)wordIds.size(); index++) {
+    double count = m_corpusTrain.wordCountsDiscounted[wordIds[index]];
+    m_vocab.m_wordCounts[index] = (int)round(count);
   }
   // Note that we do not sort the words by frequency, as they are already sorted
 
   // Assign the words to classes
-  m_vocab.AssignWordsToClasses();
+  AssignWordsToClasses();
 
   // Note the <unk> (OOV) tag
   m_oov = m_vocab.SearchWordInVocabulary("<unk>");
 
-  // Create an empty vocabulary structure for labels
+  // Create a vocabulary structure for labels that references
+  // the labels currently in the corpus, in the same order
   m_labels = Vocabulary(1);
-  // Copy the labels currently in the corpus
+  vector<int> labelIds(m_corpusTrain.NumLabels());
   for (int k = 0; k < m_corpusTrain.NumLabels(); k++) {
-    // Get the word
-    string label = m_corpusTrain.labelsReverse[k];
-    // Lookup it up in the vocabulary of labels and add it if needed
-    m_labels.AddWordToVocabulary(label);
+    labelIds[k] = k;
   }
+  m_labels.ShareWords(m_corpusTrain.labels, labelIds);
 
   printf("Vocab size: %d\n", GetVocabularySize());
   printf("Unknown tag at: %d\n", m_oov);
@@ -154,7 +166,8 @@ bool RnnTreeLM::AssignVocabularyFromCorpora(int numClasses) {
 /**
  * Reset the vector of feature labels
  */
-void RnnTreeLM::ResetFeatureLabelVector(RnnState &state) const {
+template <typename Scalar>
+void RnnTreeLM::ResetFeatureLabelVector(RnnStateT<Scalar> &state) const {
   state.FeatureLayer.assign(GetFeatureSize(), 0.0);
 }
 
@@ -162,7 +175,9 @@ void RnnTreeLM::ResetFeatureLabelVector(RnnState &state) const {
 /**
  * Update the vector of feature labels
  */
-void RnnTreeLM::UpdateFeatureLabelVector(int label, RnnState &state) const {
+template <typename Scalar>
+void RnnTreeLM::UpdateFeatureLabelVector(int label,
+                                         RnnStateT<Scalar> &state) const {
   // Time-decay the previous labels using weight gamma
   int sizeFeatures = GetFeatureSize();
   for (int a = 0; a < sizeFeatures; a++) {
@@ -175,20 +190,331 @@ void RnnTreeLM::UpdateFeatureLabelVector(int label, RnnState &state) const {
 }
 
 
+/**
+ * Train the RNN on one book, using the state of a training thread.
+ * The weights are shared with the other threads and updated without locks.
+ */
+void RnnTreeLM::TrainOnBook(BookUnrolls &book,
+                            int idxBook,
+                            TrainingWorker &worker,
+                            atomic<long> &numWordsTrained,
+                            long numWordsBefore,
+                            chrono::steady_clock::time_point start,
+                            mutex &logMutex) {
+  RnnState &state = worker.state;
+  string logFilename = m_rnnModelFile + ".log.txt";
+  long wordCounterBefore = worker.wordCounter;
+  // Tree of the unrolls of the current sentence (with tree training)
+  UnrollTree tree;
+
+  // Loop over the sentences in that book
+  book.ResetSentence();
+  for (int idxSentence = 0; idxSentence < book.NumSentences(); idxSentence++) {
+    // Initialize a map of log-likelihoods for each token
+    unordered_map<int, double> logProbSentence;
+
+    if (m_useTreeTraining) {
+      // Forward and backward passes over the tree of the unrolls
+      TrainOnSentenceTree(book, idxSentence, worker, tree);
+    } else {
+      // Loop over the unrolls in each sentence
+      book.ResetUnroll();
+      int numUnrolls = book.NumUnrolls(idxSentence);
+      for (int idxUnroll = 0; idxUnroll < numUnrolls; idxUnroll++) {
+        // Reset the state of the neural net before each unroll
+        ResetHiddenRnnStateAndWordHistory(state);
+        // Reset the dependency label features
+        // at the beginning of each unroll
+        ResetFeatureLabelVector(state);
+
+        // At the beginning of an unroll,
+        // the last word is reset to </s> (end of sentence)
+        // and the last label is reset to 0 (root)
+        int contextWord = 0;
+        int contextLabel = 0;
+
+        // Loop over the tokens in the sentence unroll
+        bool ok = true;
+        while (ok) {
+
+          // Get the current word, discount and label
+          int tokenNumber = book.CurrentTokenNumberInSentence();
+          int nextContextWord = book.CurrentTokenWordAsContext();
+          int targetWord = book.CurrentTokenWordAsTarget();
+          double discount = book.CurrentTokenDiscount();
+          int targetLabel = book.CurrentTokenLabel();
+
+          // Update the feature matrix with the last dependency label
+          if (m_typeOfDepLabels == 2) {
+            UpdateFeatureLabelVector(contextLabel, state);
+          }
+
+          // Run one step of the RNN to predict word
+          // from contextWord, contextLabel and the last hidden state
+          // (on the sampled words of its class, with a sampled softmax)
+          {
+            ScopedTimer timer(c_profileForward);
+            SampleWordsInTargetClass(targetWord, worker);
+            ForwardPropagateOneStep(contextWord, targetWord, state);
+          }
+
+          // For perplexity, we do not count OOV words...
+          if ((targetWord >= 0) && (targetWord != m_oov)) {
+            // Compute the log-probability of the current word
+            double logProbabilityWord =
+            log10(GetWordProbability(state, targetWord));
+
+            // Did we see already that word token (at that position)
+            // in the sentence?
+            if (logProbSentence.find(tokenNumber) == logProbSentence.end()) {
+              // No: store the log-likelihood of that word
+              logProbSentence[tokenNumber] = logProbabilityWord;
+              // Contribute the log-likelihood to the sentence and corpus
+              worker.logProbability += logProbabilityWord;
+              worker.numUniqueWords++;
+            }
+            worker.wordCounter++;
+          }
+
+          // Safety check (that log-likelihood does not diverge)
+          assert(!(worker.logProbability != worker.logProbability));
+
+          // Shift memory needed for BPTT to next time step
+          worker.bptt.Shift(contextWord);
+
+          // Back-propagate the error and run one step of
+          // stochastic gradient descent (SGD) using optional
+          // back-propagation through time (BPTT).
+          // The learning rate is discounted to handle
+          // multiple occurrences of the same word
+          // in the dependency parse tree
+          BackPropagateErrorsThenOneStepGradientDescent(contextWord,
+                                                        targetWord,
+                                                        m_learningRate * discount,
+                                                        worker.wordCounter,
+                                                        state,
+                                                        worker.bptt);
+
+          // Store the current state s(t) at the end of the input layer
+          // vector so that it can be used as s(t-1) at the next step
+          ForwardPropagateRecurrentConnectionOnly(state);
+
+          // Rotate the word history by one: the current context word
+          // (potentially enriched by dependency label information)
+          // will be used at next iteration as input to the RNN
+          ForwardPropagateWordHistory(state, contextWord, nextContextWord);
+          // Update the last label
+          contextLabel = targetLabel;
+
+          // Go to the next word
+          ok = (book.NextTokenInUnroll() >= 0);
+        } // Loop over tokens in the unroll of a sentence
+        book.NextUnrollInSentence();
+
+        // Reset the BPTT at every unroll
+        worker.bptt.Reset();
+
+      } // Loop over unrolls of a sentence
+    }
+
+    // Count the words trained on, across threads
+    numWordsTrained += (worker.wordCounter - wordCounterBefore);
+    wordCounterBefore = worker.wordCounter;
+
+    // Verbose (the entropy is estimated on that thread only)
+    if (((idxSentence % 1000) == 0) && (idxSentence > 0)) {
+      double entropy =
+      -worker.logProbability/log10((double)2) / worker.numUniqueWords;
+      double perplexity =
+      ExponentiateBase10(-worker.logProbability / (double)worker.numUniqueWords);
+      lock_guard<mutex> lock(logMutex);
+      Log("Iter," + ConvString(m_iteration) +
+          ",Alpha," + ConvString(m_learningRate) +
+          ",Book," + ConvString(idxBook) +
+          ",TRAINent," + ConvString(entropy) +
+          ",TRAINppx," + ConvString(perplexity) +
+          ",words/sec," +
+          ConvString((numWordsTrained - numWordsBefore) /
+                     SecondsSince(start)) + "\n",
+          logFilename);
+      LogProfile(ConvString(idxBook),
+                 (numWordsTrained - numWordsBefore) / SecondsSince(start));
+    }
+
+    // Reset the table of word token probabilities
+    logProbSentence.clear();
+
+    book.NextSentence();
+  } // Loop over sentences in the book
+}
+
+
+/**
+ * Train the RNN on one sentence of a book, over the tree of its unrolls.
+ * The unrolls are first merged into a tree, where each step is run
+ * only once for all the unrolls that share the prefix ending with it:
+ * the forward pass restores the state of the parent step,
+ * and computes and backpropagates the errors of the outputs.
+ * Each step is weighted by the inverse of the number of steps
+ * predicting the same token, instead of using the discount of the token.
+ * The gradients of all the unrolls are then backpropagated through time
+ * together, and the weights of the hidden layer updated once per sentence.
+ */
+void RnnTreeLM::TrainOnSentenceTree(BookUnrolls &book,
+                                    int idxSentence,
+                                    TrainingWorker &worker,
+                                    UnrollTree &tree) {
+  RnnState &state = worker.state;
+
+  // Merge the unrolls of the sentence into a tree:
+  // each step is predicted from the context word and label
+  // of the previous token (</s> and root at the beginning of the unroll)
+  tree.Clear();
+  book.ResetUnroll();
+  int numUnrolls = book.NumUnrolls(idxSentence);
+  for (int idxUnroll = 0; idxUnroll < numUnrolls; idxUnroll++) {
+    int node = tree.Root();
+    int contextWord = 0;
+    int contextLabel = 0;
+    bool ok = true;
+    while (ok) {
+      node = tree.FindOrAddChild(node,
+                                 book.CurrentTokenNumberInSentence(),
+                                 contextWord,
+                                 contextLabel,
+                                 book.CurrentTokenWordAsTarget());
+      contextWord = book.CurrentTokenWordAsContext();
+      contextLabel = book.CurrentTokenLabel();
+      ok = (book.NextTokenInUnroll() >= 0);
+    }
+    book.NextUnrollInSentence();
+  }
+  tree.ComputeWeights();
+
+  // The root stores the reset state of the neural net
+  // and of the dependency label features
+  ResetHiddenRnnStateAndWordHistory(state);
+  ResetFeatureLabelVector(state);
+  UnrollTree::Node &root = tree.GetNode(tree.Root());
+  root.hidden = state.HiddenLayer;
+  root.feature = state.FeatureLayer;
+  root.wordHistory = state.WordHistory;
+
+  // Forward pass over the steps (parents first)
+  unordered_map<int, double> logProbSentence;
+  int sizeHidden = GetHiddenSize();
+  for (int k = tree.Root() + 1; k < tree.NumNodes(); k++) {
+    UnrollTree::Node &node = tree.GetNode(k);
+    const UnrollTree::Node &parent = tree.GetNode(node.parent);
+    int targetWord = node.targetWord;
+
+    // Restore the state after the parent step, then add the input word
+    // to the word history (after the first step only)
+    // and update the feature matrix with the input label
+    state.RecurrentLayer = parent.hidden;
+    state.FeatureLayer = parent.feature;
+    state.WordHistory = parent.wordHistory;
+    if (node.parent != tree.Root()) {
+      int lastWord = 0;
+      ForwardPropagateWordHistory(state, lastWord, node.inputWord);
+    }
+    if (m_typeOfDepLabels == 2) {
+      UpdateFeatureLabelVector(node.inputLabel, state);
+    }
+
+    // Run one step of the RNN to predict word
+    // from the input word and label and the state of the parent step
+    // (on the sampled words of its class, with a sampled softmax)
+    {
+      ScopedTimer timer(c_profileForward);
+      SampleWordsInTargetClass(targetWord, worker);
+      ForwardPropagateOneStep(node.inputWord, targetWord, state);
+    }
+
+    // For perplexity, we do not count OOV words...
+    if ((targetWord >= 0) && (targetWord != m_oov)) {
+      // Compute the log-probability of the current word
+      double logProbabilityWord =
+      log10(GetWordProbability(state, targetWord));
+
+      // Did we see already that word token (at that position)
+      // in the sentence?
+      if (logProbSentence.find(node.position) == logProbSentence.end()) {
+        logProbSentence[node.position] = logProbabilityWord;
+        worker.logProbability += logProbabilityWord;
+        worker.numUniqueWords++;
+      }
+      worker.wordCounter++;
+    }
+
+    // Safety check (that log-likelihood does not diverge)
+    assert(!(worker.logProbability != worker.logProbability));
+
+    // Back-propagate the errors of the outputs (weighted by the step)
+    // and keep the gradient w.r.t. the hidden layer for BPTT
+    node.wordCounter = worker.wordCounter;
+    BackPropagateOutputErrors(targetWord,
+                              m_learningRate * node.weight,
+                              worker.wordCounter,
+                              state);
+    vector<double> &gradient = tree.GetGradient(k, 0, sizeHidden);
+    for (int a = 0; a < sizeHidden; a++) {
+      gradient[a] = node.weight * state.HiddenGradient[a];
+    }
+
+    // Store the state of that step for its children
+    node.hidden = state.HiddenLayer;
+    node.feature = state.FeatureLayer;
+    node.wordHistory = state.WordHistory;
+  }
+
+  // Backward pass over the steps (children first)
+  BackPropagateThroughUnrollTree(tree, m_learningRate, worker.bptt);
+}
+
+
 /**
  * Train a Recurrent Neural Network model on a test file
- * using the JSON trees of dependency parse
+ * using the JSON trees of dependency parse.
+ * With several threads, each thread trains on its own books,
+ * with its own state, and all update the same weights (Hogwild).
  */
 bool RnnTreeLM::TrainRnnModel() {
+  // The weights of memory-mapped model files are read-only
+  if (IsModelMapped()) {
+    cerr << "Cannot train a memory-mapped model, convert it first\n";
+    return false;
+  }
   // Reset the log-likelihood to ginourmous value
-  double lastValidLogProbability = -1E37;
-  double lastValidAccuracy = 0;
-  double bestValidLogProbability = -1E37;
-  double bestValidAccuracy = 0;
+  TreeTrainingPosition progress;
   // Word counter, saved at the end of last training session
   m_wordCounter = m_currentPosTrainFile;
+  // In a cluster, each node trains on its own shard of the books,
+  // and only the first node validates the model and saves it
+  int maxShardBooks = m_corpusTrain.NumBooks();
+  if (m_cluster != NULL) {
+    if (!JoinCluster(maxShardBooks)) {
+      return false;
+    }
+  }
   // Keep track of the initial learning rate
   m_initialLearningRate = m_learningRate;
+  m_trainingStart = chrono::steady_clock::now();
+
+  // Resume the training from the last checkpoint, if any,
+  // starting with the next book of its epoch
+  int firstBook = 0;
+  if (m_checkpointInterval > 0) {
+    TreeTrainingPosition position;
+    if (ResumeFromCheckpoint(position)) {
+      firstBook = position.nextBook;
+      progress.lastValidLogProbability = position.lastValidLogProbability;
+      progress.lastValidAccuracy = position.lastValidAccuracy;
+      progress.bestValidLogProbability = position.bestValidLogProbability;
+      progress.bestValidAccuracy = position.bestValidAccuracy;
+      m_wordCounter = m_currentPosTrainFile;
+    }
+  }
 
   // Log file
   string logFilename = m_rnnModelFile + ".log.txt";
@@ -197,242 +523,802 @@ bool RnnTreeLM::TrainRnnModel() {
   
   bool loopEpochs = true;
   while (loopEpochs) {
-    // Reset the log-likelihood of the current iteration
-    double trainLogProbability = 0.0;
-    // Unique word counter (count only once each word token in a sentence)
-    int uniqueWordCounter = 0;
-    // Shuffle the order of the books
-    m_corpusTrain.ShuffleBooks();
+    // Shuffle the order of the books (unless an epoch is resumed)
+    if (firstBook == 0) {
+      m_corpusTrain.ShuffleBooks();
+    }
 
-    // Print current epoch and learning rate
-    Log("Iter: " + ConvString(m_iteration) +
-        " Alpha: " + ConvString(m_learningRate) + "\n");
-    
-    // Reset everything, including word history
-    ResetAllRnnActivations(m_state);
+    // Reset everything and start the training threads
+    TreeTrainingEpoch epoch;
+    StartEpoch(epoch);
+    vector<TrainingWorker> &workers = epoch.workers;
+    // The threads take turns taking the next book
+    int numBooksTaken = firstBook;
+    mutex &bookMutex = epoch.mutex;
+    // Books trained on: all the books before the first one not trained on
+    // yet are done, which is where a checkpoint resumes the epoch
+    vector<bool> isBookTrained(m_corpusTrain.NumBooks(), false);
+    int numBooksTrained = firstBook;
+    int numBooksSinceCheckpoint = 0;
+    mutex checkpointMutex;
+    // The books are trained on in rounds, after each of which
+    // the nodes of a cluster average their weights: all the nodes
+    // train for the same number of rounds (a single round otherwise)
+    int numBooksPerRound = m_corpusTrain.NumBooks();
+    int numRounds = 1;
+    if (m_cluster != NULL) {
+      numBooksPerRound =
+      (m_clusterSyncBooks > 0) ? m_clusterSyncBooks : max(maxShardBooks, 1);
+      numRounds =
+      max(1, (maxShardBooks + numBooksPerRound - 1) / numBooksPerRound);
+    }
     
     // Loop over the books
-    clock_t start = clock();
     Log(ConvString(m_corpusTrain.NumBooks()) + " books to train on\n");
-    for (int idxBook = 0; idxBook < m_corpusTrain.NumBooks(); idxBook++) {
-      // Read the next book (training file)
-      m_corpusTrain.NextBook();
-      m_corpusTrain.ReadBook(m_typeOfDepLabels == 1);
-      BookUnrolls book = m_corpusTrain.m_currentBook;
-      
-      // Loop over the sentences in that book
-      book.ResetSentence();
-      for (int idxSentence = 0; idxSentence < book.NumSentences(); idxSentence++) {
-        // Initialize a map of log-likelihoods for each token
-        unordered_map<int, double> logProbSentence;
-        
-        // Loop over the unrolls in each sentence
-        book.ResetUnroll();
-        int numUnrolls = book.NumUnrolls(idxSentence);
-        for (int idxUnroll = 0; idxUnroll < numUnrolls; idxUnroll++) {
-          // Reset the state of the neural net before each unroll
-          ResetHiddenRnnStateAndWordHistory(m_state);
-          // Reset the dependency label features
-          // at the beginning of each unroll
-          ResetFeatureLabelVector(m_state);
-          
-          // At the beginning of an unroll,
-          // the last word is reset to </s> (end of sentence)
-          // and the last label is reset to 0 (root)
-          int contextWord = 0;
-          int contextLabel = 0;
-          
-          // Loop over the tokens in the sentence unroll
-          bool ok = true;
-          while (ok) {
-
-            // Get the current word, discount and label
-            int tokenNumber = book.CurrentTokenNumberInSentence();
-            int nextContextWord = book.CurrentTokenWordAsContext();
-            int targetWord = book.CurrentTokenWordAsTarget();
-            double discount = book.CurrentTokenDiscount();
-            int targetLabel = book.CurrentTokenLabel();
-
-            // Update the feature matrix with the last dependency label
-            if (m_typeOfDepLabels == 2) {
-              UpdateFeatureLabelVector(contextLabel, m_state);
+    // Start reading the first book (training file) in the background
+    if (m_corpusTrain.NumBooks() > 0) {
+      m_corpusTrain.PrefetchNextBook(m_typeOfDepLabels == 1);
+    }
+    for (int round = 0; round < numRounds; round++) {
+      int lastBookOfRound =
+      min(m_corpusTrain.NumBooks(), (round + 1) * numBooksPerRound);
+      RunInParallel(m_numThreads, [&](int idxWorker) {
+        TrainingWorker &worker = workers[idxWorker];
+        BookUnrolls book;
+        while (true) {
+          // Take over the book read in the background, and start reading
+          // the next book while training on this one
+          int idxBook = 0;
+          {
+            lock_guard<mutex> lock(bookMutex);
+            if (numBooksTaken >= lastBookOfRound) {
+              break;
             }
+            ScopedTimer timer(c_profileIO);
+            idxBook = numBooksTaken++;
+            m_corpusTrain.SwapInPrefetchedBook();
+            if (idxBook + 1 < m_corpusTrain.NumBooks()) {
+              m_corpusTrain.PrefetchNextBook(m_typeOfDepLabels == 1);
+            }
+            book.Swap(m_corpusTrain.m_currentBook);
+          }
 
-            // Run one step of the RNN to predict word
-            // from contextWord, contextLabel and the last hidden state
-            ForwardPropagateOneStep(contextWord, targetWord, m_state);
-
-            // For perplexity, we do not count OOV words...
-            if ((targetWord >= 0) && (targetWord != m_oov)) {
-              // Compute the log-probability of the current word
-              int outputNodeClass =
-              m_vocab.WordIndex2Class(targetWord) + GetVocabularySize();
-              double condProbaClass = m_state.OutputLayer[outputNodeClass];
-              double condProbaWordGivenClass = m_state.OutputLayer[targetWord];
-              double logProbabilityWord =
-              log10(condProbaClass * condProbaWordGivenClass);
-
-              // Did we see already that word token (at that position)
-              // in the sentence?
-              if (logProbSentence.find(tokenNumber) == logProbSentence.end()) {
-                // No: store the log-likelihood of that word
-                logProbSentence[tokenNumber] = logProbabilityWord;
-                // Contribute the log-likelihood to the sentence and corpus
-                trainLogProbability += logProbabilityWord;
-                uniqueWordCounter++;
-              }
-              m_wordCounter++;
+          // Train on that book, updating the shared weights
+          TrainOnBook(book, idxBook, worker, epoch.numWordsTrained,
+                      epoch.numWordsBefore, epoch.start, bookMutex);
+
+          // Clear memory
+          book.Burn();
+
+          // Every few books, save a checkpoint in the background
+          int nextBook = -1;
+          {
+            lock_guard<mutex> lock(bookMutex);
+            isBookTrained[idxBook] = true;
+            while ((numBooksTrained < m_corpusTrain.NumBooks()) &&
+                   isBookTrained[numBooksTrained]) {
+              numBooksTrained++;
+            }
+            numBooksSinceCheckpoint++;
+            if ((m_checkpointInterval > 0) &&
+                (numBooksSinceCheckpoint >= m_checkpointInterval) &&
+                (numBooksTrained < m_corpusTrain.NumBooks())) {
+              numBooksSinceCheckpoint = 0;
+              nextBook = numBooksTrained;
             }
-            
-            // Safety check (that log-likelihood does not diverge)
-            assert(!(trainLogProbability != trainLogProbability));
-
-            // Shift memory needed for BPTT to next time step
-            m_bpttVectors.Shift(contextWord);
-
-            // Discount the learning rate to handle
-            // multiple occurrences of the same word
-            // in the dependency parse tree
-            double alphaBackup = m_learningRate;
-            m_learningRate *= discount;
-            
-            // Back-propagate the error and run one step of
-            // stochastic gradient descent (SGD) using optional
-            // back-propagation through time (BPTT)
-            BackPropagateErrorsThenOneStepGradientDescent(contextWord, targetWord);
-
-            // Undiscount the learning rate
-            m_learningRate = alphaBackup;
-            
-            // Store the current state s(t) at the end of the input layer
-            // vector so that it can be used as s(t-1) at the next step
-            ForwardPropagateRecurrentConnectionOnly(m_state);
-            
-            // Rotate the word history by one: the current context word
-            // (potentially enriched by dependency label information)
-            // will be used at next iteration as input to the RNN
-            ForwardPropagateWordHistory(m_state, contextWord, nextContextWord);
-            // Update the last label
-            contextLabel = targetLabel;
-
-            // Go to the next word
-            ok = (book.NextTokenInUnroll() >= 0);
-          } // Loop over tokens in the unroll of a sentence
-          book.NextUnrollInSentence();
-
-          // Reset the BPTT at every unroll
-          m_bpttVectors.Reset();
-
-        } // Loop over unrolls of a sentence
-        
-        // Verbose
-        if (((idxSentence % 1000) == 0) && (idxSentence > 0)) {
-          clock_t now = clock();
-          double entropy =
-          -trainLogProbability/log10((double)2) / uniqueWordCounter;
-          double perplexity =
-          ExponentiateBase10(-trainLogProbability / (double)uniqueWordCounter);
-          Log("Iter," + ConvString(m_iteration) +
-              ",Alpha," + ConvString(m_learningRate) +
-              ",Book," + ConvString(idxBook) +
-              ",TRAINent," + ConvString(entropy) +
-              ",TRAINppx," + ConvString(perplexity) +
-              ",words/sec," +
-              ConvString(1000000 * (m_wordCounter/((double)(now-start)))) + "\n",
-              logFilename);
+          }
+          if (nextBook >= 0) {
+            lock_guard<mutex> lock(checkpointMutex);
+            m_currentPosTrainFile = epoch.numWordsTrained;
+            TreeTrainingPosition position = progress;
+            position.nextBook = nextBook;
+            if (SaveSnapshotInBackground(false,
+                                         FormatTrainingPosition(position),
+                                         true)) {
+              Log("Saving a checkpoint before book " +
+                  ConvString(nextBook) + "\n", logFilename);
+            }
+          }
         }
-        
-        // Reset the table of word token probabilities
-        logProbSentence.clear();
+      });
+      // Average the weights of the nodes of the cluster
+      if ((m_cluster != NULL) &&
+          !m_cluster->AverageWeights(m_weights, m_directNGramTouched)) {
+        return false;
+      }
+    }
+    firstBook = 0;
+
+    // Validate the model, and decide whether to go on training
+    if (!FinishEpoch(epoch, progress, loopEpochs)) {
+      return false;
+    }
+  }
+  WaitForSnapshot();
+  // The training is over: it does not resume from the last checkpoint
+  if (m_checkpointInterval > 0) {
+    RemoveCheckpoint();
+  }
+  
+  return true;
+}
 
-        book.NextSentence();
-      } // loop over sentences for one epoch
 
-      // Clear memory
-      book.Burn();
-    } // loop over books for one epoch
-    
-    // Verbose the iteration
-    double trainEntropy = -trainLogProbability/log10((double)2) / uniqueWordCounter;
-    double trainPerplexity =
-    ExponentiateBase10(-trainLogProbability / (double)uniqueWordCounter);
-    clock_t now = clock();
-    Log("Iter," + ConvString(m_iteration) +
-        ",Alpha," + ConvString(m_learningRate) +
-        ",Book,ALL" +
-        ",TRAINent," + ConvString(trainEntropy) +
-        ",TRAINppx," + ConvString(trainPerplexity) +
-        ",words/sec," +
-        ConvString(1000000 * (m_wordCounter/((double)(now-start)))) + "\n",
-        logFilename);
-
-    // Validation
-    vector<double> sentenceScores;
-    double validLogProbability, validPerplexity, validEntropy, validAccuracy;
-    TestRnnModel(m_validationFile,
-                 m_featureValidationFile,
-                 sentenceScores,
-                 validLogProbability,
-                 validPerplexity,
-                 validEntropy,
-                 validAccuracy);
+/**
+ * Start an epoch: print the epoch and learning rate, reset the state
+ * (including the word history) and give each training thread
+ * its own copy of the state and of the BPTT memory
+ */
+void RnnTreeLM::StartEpoch(TreeTrainingEpoch &epoch) {
+  // Print current epoch and learning rate
+  Log("Iter: " + ConvString(m_iteration) +
+      " Alpha: " + ConvString(m_learningRate) + "\n");
+  
+  // Reset everything, including word history
+  ResetAllRnnActivations(m_state);
+
+  // Each training thread owns its copy of the state and of the BPTT memory
+  epoch.workers.assign(m_numThreads,
+                       TrainingWorker(m_state, m_bpttVectors, m_wordCounter));
+  PrepareSampledSoftmax(epoch.workers);
+  // Total number of words trained on, across threads
+  epoch.numWordsBefore = m_wordCounter;
+  epoch.numWordsTrained = m_wordCounter;
+  epoch.start = chrono::steady_clock::now();
+}
+
+
+/**
+ * Finish an epoch: log the training scores of all the threads
+ * (and of all the nodes of a cluster), validate the model, decide
+ * the learning rate of the next epoch (or to stop the training),
+ * and save the best model so far in the background.
+ * In a cluster, the first node validates the model and decides
+ * for all the nodes. Returns false if the cluster is lost.
+ */
+bool RnnTreeLM::FinishEpoch(TreeTrainingEpoch &epoch,
+                            TreeTrainingPosition &progress,
+                            bool &loopEpochs) {
+  string logFilename = m_rnnModelFile + ".log.txt";
+  bool isMaster = (m_cluster == NULL) || m_cluster->IsMaster();
+  vector<TrainingWorker> &workers = epoch.workers;
+
+  // Gather the counters of all the threads (and of all the nodes),
+  // and keep the state of the first thread
+  m_wordCounter = epoch.numWordsTrained;
+  double trainLogProbability = 0.0;
+  long uniqueWordCounter = 0;
+  for (size_t k = 0; k < workers.size(); k++) {
+    trainLogProbability += workers[k].logProbability;
+    uniqueWordCounter += workers[k].numUniqueWords;
+  }
+  m_state = workers[0].state;
+  m_bpttVectors = workers[0].bptt;
+  double numWordsEpoch = (double)(m_wordCounter - epoch.numWordsBefore);
+  if (m_cluster != NULL) {
+    vector<double> statistics(3);
+    statistics[0] = trainLogProbability;
+    statistics[1] = (double)uniqueWordCounter;
+    statistics[2] = numWordsEpoch;
+    if (!m_cluster->SumValues(statistics)) {
+      return false;
+    }
+    trainLogProbability = statistics[0];
+    uniqueWordCounter = (long)statistics[1];
+    numWordsEpoch = statistics[2];
+  }
+  
+  // Verbose the iteration
+  double trainEntropy = -trainLogProbability/log10((double)2) / uniqueWordCounter;
+  double trainPerplexity =
+  ExponentiateBase10(-trainLogProbability / (double)uniqueWordCounter);
+  Log("Iter," + ConvString(m_iteration) +
+      ",Alpha," + ConvString(m_learningRate) +
+      ",Book,ALL" +
+      ",TRAINent," + ConvString(trainEntropy) +
+      ",TRAINppx," + ConvString(trainPerplexity) +
+      ",words/sec," +
+      ConvString(numWordsEpoch / SecondsSince(epoch.start)) +
+      "\n",
+      logFilename);
+  LogProfile("ALL", numWordsEpoch / SecondsSince(epoch.start));
+
+  // Validation (only on the first node of a cluster,
+  // which decides for all the nodes when to reduce the learning rate)
+  vector<double> sentenceScores;
+  double validLogProbability = 0, validPerplexity = 0;
+  double validEntropy = 0, validAccuracy = 0;
+  if (isMaster) {
+    {
+      ScopedTimer timer(c_profileValidation);
+      TestRnnModel(m_validationFile,
+                   m_featureValidationFile,
+                   sentenceScores,
+                   validLogProbability,
+                   validPerplexity,
+                   validEntropy,
+                   validAccuracy);
+    }
+    LogProfile("valid", 0);
     Log("Iter," + ConvString(m_iteration) +
         ",Alpha," + ConvString(m_learningRate) +
         ",VALIDacc," + ConvString(validAccuracy) +
         ",VALIDent," + ConvString(validEntropy) +
         ",VALIDppx," + ConvString(validPerplexity) +
         ",words/sec,0\n", logFilename);
+  }
 
-    // Reset the position in the training file
-    m_wordCounter = 0;
-    m_currentPosTrainFile = 0;
-    trainLogProbability = 0;
-
-    // Shall we start reducing the learning rate?
-    if (m_correctSentenceLabels.size() > 0) {
-      // ... based on accuracy of the validation set
-      if ((validAccuracy * m_minLogProbaImprovement < lastValidAccuracy)
-          && (m_iteration > 4)) {
-        m_doStartReducingLearningRate = true;
+  // Reset the position in the training file
+  m_wordCounter = 0;
+  m_currentPosTrainFile = 0;
+
+  // Shall we start reducing the learning rate?
+  if (m_correctSentenceLabels.size() > 0) {
+    // ... based on accuracy of the validation set
+    if ((validAccuracy * m_minLogProbaImprovement < progress.lastValidAccuracy)
+        && (m_iteration > 4)) {
+      m_doStartReducingLearningRate = true;
+    }
+  } else {
+    // ... based on log-probability of the validation set
+    if ((validLogProbability * m_minLogProbaImprovement <
+         progress.lastValidLogProbability)
+        && (m_iteration > 4)) {
+      m_doStartReducingLearningRate = true;
+    }
+  }
+  if (m_doStartReducingLearningRate) {
+    m_learningRate /= 1.5;
+  }
+  // We need to stop at some point!
+  if (m_learningRate < 0.0001) {
+    loopEpochs = false;
+  }
+  // The nodes of a cluster follow the decisions of the first node
+  if (m_cluster != NULL) {
+    vector<double> decisions(3);
+    decisions[0] = m_learningRate;
+    decisions[1] = m_doStartReducingLearningRate ? 1 : 0;
+    decisions[2] = loopEpochs ? 1 : 0;
+    if (!m_cluster->BroadcastValues(decisions)) {
+      return false;
+    }
+    m_learningRate = decisions[0];
+    m_doStartReducingLearningRate = (decisions[1] > 0);
+    loopEpochs = (decisions[2] > 0);
+  }
+
+  if (loopEpochs) {
+    // Store last value of accuracy and log-probability
+    progress.lastValidLogProbability = validLogProbability;
+    progress.lastValidAccuracy = validAccuracy;
+    m_iteration++;
+    bool isBestModel = (validAccuracy > progress.bestValidAccuracy);
+    if (isBestModel) {
+      progress.bestValidAccuracy = validAccuracy;
+      progress.bestValidLogProbability = validLogProbability;
+    }
+    // Save a checkpoint at the beginning of the next epoch
+    string checkpointPosition;
+    if (m_checkpointInterval > 0) {
+      TreeTrainingPosition position = progress;
+      position.nextBook = 0;
+      checkpointPosition = FormatTrainingPosition(position);
+    }
+    // Save the best model, in the background
+    if (isMaster && (isBestModel || !checkpointPosition.empty())) {
+      SaveSnapshotInBackground(isBestModel, checkpointPosition, false);
+    }
+    if (isMaster && isBestModel) {
+      Log("Saving the best model so far (validation accuracy " +
+          ConvString(progress.bestValidAccuracy) + ", log-probability " +
+          ConvString(progress.bestValidLogProbability) + ")\n", logFilename);
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Train several models on the same JSON trees of dependency parse,
+ * reading each book only once for all the models. The books
+ * (in the order of the corpus of the first model) are read by groups
+ * of as many books as the largest number of threads of a model,
+ * the next group being read in the background while the models
+ * train on the current group, all the models at the same time
+ * (each one with its own threads, taking turns on the books).
+ * Each model validates itself at the end of every epoch,
+ * and stops training on its own.
+ */
+bool RnnTreeLM::TrainRnnModels(const vector<RnnTreeLM *> &models) {
+  if (models.empty()) {
+    return false;
+  }
+  // The first model reads the books for all the models
+  CorpusUnrolls &corpus = models[0]->m_corpusTrain;
+  bool mergeLabel = (models[0]->m_typeOfDepLabels == 1);
+
+  for (size_t k = 0; k < models.size(); k++) {
+    RnnTreeLM &model = *models[k];
+    // The weights of memory-mapped model files are read-only
+    if (model.IsModelMapped()) {
+      cerr << "Cannot train a memory-mapped model, convert it first\n";
+      return false;
+    }
+    if ((model.m_cluster != NULL) ||
+        (model.m_typeOfDepLabels != models[0]->m_typeOfDepLabels) ||
+        (model.GetVocabularySize() != models[0]->GetVocabularySize())) {
+      cerr << "Models trained together must share the vocabulary"
+      << " and the type of labels, and not be in a cluster\n";
+      return false;
+    }
+    string logFilename = model.m_rnnModelFile + ".log.txt";
+    // The position within an epoch is shared by all the models
+    if (model.m_checkpointInterval > 0) {
+      Log("No checkpoints when training several models\n", logFilename);
+      model.m_checkpointInterval = 0;
+    }
+    // Word counter, saved at the end of last training session
+    model.m_wordCounter = model.m_currentPosTrainFile;
+    // Keep track of the initial learning rate
+    model.m_initialLearningRate = model.m_learningRate;
+    model.m_trainingStart = chrono::steady_clock::now();
+    Log("Starting training tree-dependent LM using list of books " +
+        model.m_trainFile + " (model " + ConvString((int)k + 1) +
+        " of " + ConvString((int)models.size()) + ")...\n", logFilename);
+  }
+
+  // Models still training, and their validation scores
+  vector<RnnTreeLM *> active(models);
+  vector<TreeTrainingPosition> progress(models.size());
+  vector<size_t> indices(models.size());
+  for (size_t k = 0; k < models.size(); k++) {
+    indices[k] = k;
+  }
+  while (!active.empty()) {
+    // Shuffle the order of the books
+    corpus.ShuffleBooks();
+
+    // Reset everything and start the training threads of each model
+    vector<unique_ptr<TreeTrainingEpoch> > epochs(active.size());
+    int numBooksPerGroup = 1;
+    for (size_t k = 0; k < active.size(); k++) {
+      epochs[k].reset(new TreeTrainingEpoch());
+      active[k]->StartEpoch(*epochs[k]);
+      numBooksPerGroup = max(numBooksPerGroup, active[k]->m_numThreads);
+    }
+    int numBooks = corpus.NumBooks();
+    Log(ConvString(numBooks) + " books to train on\n");
+
+    // Read the first group of books, then the next group in the background
+    // while the models train on the current one
+    vector<BookUnrolls> group, nextGroup;
+    auto readGroup = [&](int firstBook, vector<BookUnrolls> &books) {
+      ScopedTimer timer(c_profileIO);
+      books.resize(min(numBooksPerGroup, numBooks - firstBook));
+      for (size_t j = 0; j < books.size(); j++) {
+        corpus.PrefetchNextBook(mergeLabel);
+        corpus.SwapInPrefetchedBook();
+        books[j].Swap(corpus.m_currentBook);
       }
-    } else {
-      // ... based on log-probability of the validation set
-      if ((validLogProbability * m_minLogProbaImprovement < lastValidLogProbability)
-          && (m_iteration > 4)) {
-        m_doStartReducingLearningRate = true;
+    };
+    readGroup(0, group);
+    for (int firstBook = 0; firstBook < numBooks;
+         firstBook += numBooksPerGroup) {
+      int nextBook = firstBook + numBooksPerGroup;
+      thread loader;
+      if (nextBook < numBooks) {
+        loader = thread(readGroup, nextBook, ref(nextGroup));
+      }
+
+      // Each model trains with its threads on all the books of the group
+      RunInParallel((int)active.size(), [&](int idxModel) {
+        RnnTreeLM &model = *active[idxModel];
+        TreeTrainingEpoch &epoch = *epochs[idxModel];
+        atomic<int> numBooksTaken(0);
+        RunInParallel(model.m_numThreads, [&](int idxWorker) {
+          int idx = 0;
+          while ((idx = numBooksTaken++) < (int)group.size()) {
+            // Each thread reads the book through its own view
+            BookUnrolls book = group[idx].View();
+            model.TrainOnBook(book, firstBook + idx, epoch.workers[idxWorker],
+                              epoch.numWordsTrained, epoch.numWordsBefore,
+                              epoch.start, epoch.mutex);
+          }
+        });
+      });
+
+      // Take over the group read in the background (clearing the memory)
+      if (loader.joinable()) {
+        loader.join();
       }
+      group.swap(nextGroup);
+      nextGroup.clear();
     }
-    if (m_doStartReducingLearningRate) {
-      m_learningRate /= 1.5;
-    }
-    // We need to stop at some point!
-    if (m_learningRate < 0.0001) {
-      loopEpochs = false;
-    }
-
-    if (loopEpochs) {
-      // Store last value of accuracy and log-probability
-      lastValidLogProbability = validLogProbability;
-      lastValidAccuracy = validAccuracy;
-      validLogProbability = 0;
-      m_iteration++;
-      // Save the best model
-      if (validAccuracy > bestValidAccuracy) {
-        SaveRnnModelToFile();
-        SaveWordEmbeddings(m_rnnModelFile + ".word_embeddings.txt");
-        Log("Saved the best model so far\n", logFilename);
-        bestValidAccuracy = validAccuracy;
-        bestValidLogProbability = validLogProbability;
+
+    // Validate each model, and decide whether it goes on training
+    vector<char> loopEpochs(active.size(), 1);
+    vector<char> finished(active.size(), 1);
+    RunInParallel((int)active.size(), [&](int idxModel) {
+      bool loop = true;
+      finished[idxModel] =
+        active[idxModel]->FinishEpoch(*epochs[idxModel],
+                                      progress[indices[idxModel]], loop);
+      loopEpochs[idxModel] = loop;
+    });
+    // Stop the training if the epoch of any model failed
+    if (find(finished.begin(), finished.end(), 0) != finished.end()) {
+      for (size_t k = 0; k < models.size(); k++) {
+        models[k]->WaitForSnapshot();
+      }
+      return false;
+    }
+    vector<RnnTreeLM *> stillActive;
+    vector<size_t> stillIndices;
+    for (size_t k = 0; k < active.size(); k++) {
+      if (loopEpochs[k]) {
+        stillActive.push_back(active[k]);
+        stillIndices.push_back(indices[k]);
       }
     }
+    active.swap(stillActive);
+    indices.swap(stillIndices);
   }
-  
+  for (size_t k = 0; k < models.size(); k++) {
+    models[k]->WaitForSnapshot();
+  }
+  return true;
+}
+
+
+/**
+ * Join the cluster: keep the shard of the books of this node
+ * (every n-th book of the list of training books), check that all
+ * the nodes train the same model (vocabulary and dimensions),
+ * and start from the weights and training parameters of the first node.
+ * The checkpoints of a single trainer are not used in a cluster.
+ */
+bool RnnTreeLM::JoinCluster(int &maxShardBooks) {
+  int numNodes = m_cluster->GetNumNodes();
+  int rank = m_cluster->GetRank();
+  maxShardBooks = (m_corpusTrain.NumBooks() + numNodes - 1) / numNodes;
+  m_corpusTrain.KeepShard(rank, numNodes);
+  if (m_checkpointInterval > 0) {
+    Log("Cluster: checkpoints are not saved when training in a cluster\n");
+    m_checkpointInterval = 0;
+  }
+
+  // Description of the model, which must be the same on all the nodes
+  ostringstream description;
+  description << "vocabulary " << m_vocab.Signature()
+  << " labels " << m_typeOfDepLabels << " " << GetLabelSize()
+  << " input " << GetInputSize() << " hidden " << GetHiddenSize()
+  << " feature " << GetFeatureSize() << " compress " << GetCompressSize()
+  << " output " << GetOutputSize()
+  << " direct " << m_weights.DirectNGram.size()
+  << " order " << GetOrderDirectConnection();
+  if (!m_cluster->Connect(description.str()) ||
+      !m_cluster->BroadcastWeights(m_weights)) {
+    return false;
+  }
+
+  // Training parameters of the first node (e.g., of a model resumed there)
+  vector<double> parameters(3);
+  parameters[0] = m_learningRate;
+  parameters[1] = m_doStartReducingLearningRate ? 1 : 0;
+  parameters[2] = m_iteration;
+  if (!m_cluster->BroadcastValues(parameters)) {
+    return false;
+  }
+  m_learningRate = parameters[0];
+  m_doStartReducingLearningRate = (parameters[1] > 0);
+  m_iteration = (int)parameters[2];
+
+  // Blocks of direct n-gram connections updated between averagings
+  m_directNGramTouched.assign((m_weights.DirectNGram.size() >>
+                               c_directNGramSyncBlockShift) + 1, 0);
+  Log("Cluster: node " + ConvString(rank) + " of " + ConvString(numNodes) +
+      ", training on " + ConvString(m_corpusTrain.NumBooks()) + " books\n");
   return true;
 }
 
 
 /**
- * Test a Recurrent Neural Network model on a test file
+ * Position of the trainer, as saved next to the checkpoints
+ * (the checkpoint model is identified by the vocabulary,
+ * the iteration and the word counter)
+ */
+string RnnTreeLM::FormatTrainingPosition(const TreeTrainingPosition &position) const {
+  ostringstream text;
+  text.precision(17);
+  text << "vocabulary signature: " << m_vocab.Signature() << "\n";
+  text << "number of finished iterations: " << m_iteration << "\n";
+  text << "current position in training data: " << m_currentPosTrainFile << "\n";
+  text << "next book: " << position.nextBook << "\n";
+  text << "last validation log-probability: "
+  << position.lastValidLogProbability << "\n";
+  text << "last validation accuracy: " << position.lastValidAccuracy << "\n";
+  text << "best validation log-probability: "
+  << position.bestValidLogProbability << "\n";
+  text << "best validation accuracy: " << position.bestValidAccuracy << "\n";
+  const vector<string> &books = m_corpusTrain.BookFilenames();
+  text << "number of books: " << books.size() << "\n";
+  for (size_t k = 0; k < books.size(); k++) {
+    text << books[k] << "\n";
+  }
+  return text.str();
+}
+
+
+/**
+ * Load the last checkpoint and the position of the trainer, if any
+ */
+bool RnnTreeLM::ResumeFromCheckpoint(TreeTrainingPosition &position) {
+  string filename = CheckpointFilename();
+  ifstream positionFile(filename + ".txt");
+  if (!positionFile.is_open()) {
+    return false;
+  }
+  // Read the value after the colon on each line of the header
+  string line;
+  auto readValue = [&positionFile, &line]() -> istringstream {
+    getline(positionFile, line);
+    size_t colon = line.find(": ");
+    return istringstream((colon == string::npos) ? "" : line.substr(colon + 2));
+  };
+  size_t numBooks = 0;
+  bool isRead =
+  (readValue() >> position.vocabularySignature) &&
+  (readValue() >> position.iteration) &&
+  (readValue() >> position.currentPosTrainFile) &&
+  (readValue() >> position.nextBook) &&
+  (readValue() >> position.lastValidLogProbability) &&
+  (readValue() >> position.lastValidAccuracy) &&
+  (readValue() >> position.bestValidLogProbability) &&
+  (readValue() >> position.bestValidAccuracy) &&
+  (readValue() >> numBooks);
+  position.books.clear();
+  while (isRead && (position.books.size() < numBooks) &&
+         getline(positionFile, line)) {
+    position.books.push_back(line);
+  }
+  if (!isRead || (position.books.size() != numBooks)) {
+    Log("Ignoring the invalid checkpoint " + filename + "\n");
+    return false;
+  }
+  if (position.vocabularySignature != m_vocab.Signature()) {
+    Log("Ignoring the checkpoint " + filename +
+        ", trained with another vocabulary\n");
+    return false;
+  }
+  if (!m_corpusTrain.RestoreBookOrder(position.books, position.nextBook)) {
+    Log("Ignoring the checkpoint " + filename +
+        ", trained on other books\n");
+    return false;
+  }
+
+  // Load the weights and the progress of the training from the checkpoint
+  string modelFilename = m_rnnModelFile;
+  m_rnnModelFile = filename;
+  LoadRnnModelFromFile();
+  m_rnnModelFile = modelFilename;
+  if (m_iteration != position.iteration) {
+    // The position was saved with the checkpoint of the previous epoch
+    // (the training stopped while the next checkpoint was being saved):
+    // restart the epoch of the checkpoint model from its first book
+    position.nextBook = 0;
+    m_currentPosTrainFile = 0;
+    m_corpusTrain.RestoreBookOrder(position.books, 0);
+  }
+  // Otherwise, if the position was saved with an earlier checkpoint
+  // of the same epoch, a few books are simply trained on again
+  Log("Resuming the training from checkpoint " + filename +
+      " at iteration " + ConvString(m_iteration) +
+      ", book " + ConvString(position.nextBook) + "\n");
+  return true;
+}
+
+
+/**
+ * Log the score of a token in debug mode, as a single formatted line:
+ * token number, word index, log-probability, context word and label,
+ * target word (and annotation) and classes of the target and context words
+ */
+void RnnTreeLM::LogDebugToken(int tokenNumber,
+                              int targetWord,
+                              double logProbabilityWord,
+                              int contextWord,
+                              int contextLabel,
+                              const char *annotation,
+                              bool isOov) const {
+  string context = m_vocab.Word2WordIndex(contextWord);
+  string label = m_corpusValidTest.labels.String(contextLabel);
+  string target = m_vocab.Word2WordIndex(targetWord);
+  vector<char> line(128 + context.size() + label.size() + target.size() +
+                    strlen(annotation));
+  if (isOov) {
+    // Out-of-vocabulary words have probability 0 and index -1
+    snprintf(&line[0], line.size(), "%d\t-1\t0\t%s\t%s\t%s\t-1\t-1\n",
+             tokenNumber, context.c_str(), label.c_str(), target.c_str());
+  } else {
+    snprintf(&line[0], line.size(), "%d\t%d\t%f\t%s\t%s\t%s%s\t%d\t%d\n",
+             tokenNumber, targetWord, logProbabilityWord,
+             context.c_str(), label.c_str(), target.c_str(), annotation,
+             m_vocab.WordIndex2Class(targetWord),
+             m_vocab.WordIndex2Class(contextWord));
+  }
+  Log(&line[0]);
+}
+
+
+/**
+ * Score the word tokens of one sentence (over all its unrolls),
+ * using the state and prefix trie of an evaluation thread
+ * (the weights are only read). The book is positioned on that sentence.
+ */
+template <typename Scalar>
+void RnnTreeLM::TestOnBookSentence(BookUnrolls &book,
+                                   int idxSentence,
+                                   RnnStateT<Scalar> &state,
+                                   PrefixStateTrieT<Scalar> &prefixTrie,
+                                   SentenceEvaluation &evaluation) {
+  // Initialize a map of log-likelihoods for each token
+  unordered_map<int, double> logProbSentence;
+  // Reset the trie of cached unroll prefixes
+  prefixTrie.Clear();
+
+  // Loop over the unrolls in each sentence
+  book.ResetUnroll();
+  int numUnrolls = book.NumUnrolls(idxSentence);
+  if (m_debugMode) { Log("    New unroll\n"); }
+  for (int idxUnroll = 0; idxUnroll < numUnrolls; idxUnroll++)
+  {
+    // Reset the state of the neural net before each unroll
+    ResetHiddenRnnStateAndWordHistory(state);
+    // Reset the dependency label features
+    // at the beginning of each unroll
+    ResetFeatureLabelVector(state);
+
+    // At the beginning of an unroll,
+    // the last word is reset to </s> (end of sentence)
+    // and the last label is reset to 0 (root)
+    int contextWord = 0;
+    int contextLabel = 0;
+
+    // Position in the prefix trie, and are we still
+    // following a prefix that has already been computed?
+    int trieNode = prefixTrie.Root();
+    bool isPrefixCached = m_usePrefixCache;
+
+    // Loop over the tokens in the sentence unroll
+    bool ok = true;
+    while (ok) {
+      // Get the current word, discount and label
+      int tokenNumber = book.CurrentTokenNumberInSentence();
+      int nextContextWord = book.CurrentTokenWordAsContext();
+      int targetWord = book.CurrentTokenWordAsTarget();
+      int targetLabel = book.CurrentTokenLabel();
+      evaluation.numTokensProcessed++;
+
+      if (isPrefixCached) {
+        int child = prefixTrie.FindChild(trieNode, nextContextWord,
+                                         targetLabel, targetWord);
+        if (child >= 0) {
+          // The prefix up to the current token has already been computed
+          // in a previous unroll of that sentence: simply account for
+          // the word token if it has not been seen at that position
+          // (and log it, as if it had been computed again)
+          evaluation.numTokensCached++;
+          trieNode = child;
+          if ((targetWord >= 0) && (targetWord != m_oov)) {
+            double logProbabilityWord = prefixTrie.LogProbability(child);
+            if (logProbSentence.find(tokenNumber) == logProbSentence.end()) {
+              logProbSentence[tokenNumber] = logProbabilityWord;
+              evaluation.logProbabilities.push_back(logProbabilityWord);
+              if (m_debugMode) {
+                LogDebugToken(tokenNumber, targetWord, logProbabilityWord,
+                              contextWord, contextLabel, "");
+              }
+            } else if (m_debugMode) {
+              LogDebugToken(tokenNumber, targetWord, logProbabilityWord,
+                            contextWord, contextLabel, "(seen)");
+            }
+          } else {
+            if (m_debugMode) {
+              LogDebugToken(tokenNumber, targetWord, 0, contextWord,
+                            contextLabel, "", true);
+            }
+            evaluation.numUnk++;
+          }
+          contextWord = nextContextWord;
+          contextLabel = targetLabel;
+          ok = (book.NextTokenInUnroll() >= 0);
+          continue;
+        }
+        // The remainder of the unroll needs to be computed,
+        // starting from the state cached at the deepest node
+        isPrefixCached = false;
+        if (trieNode != prefixTrie.Root()) {
+          prefixTrie.RestoreState(trieNode, state);
+        }
+      }
+
+      if (m_typeOfDepLabels == 2) {
+        // Update the feature matrix with the last dependency label
+        UpdateFeatureLabelVector(contextLabel, state);
+      }
+
+      // Run one step of the RNN to predict word
+      // from contextWord, contextLabel and the last hidden state
+      ForwardPropagateOneStep(contextWord, targetWord, state);
+
+      // For perplexity, we do not count OOV words...
+      double logProbabilityWord = 0;
+      if ((targetWord >= 0) && (targetWord != m_oov)) {
+        // Compute the log-probability of the current word
+        logProbabilityWord = log10(GetWordProbability(state, targetWord));
+
+        // Did we see already that word token (at that position)
+        // in the sentence?
+        if (logProbSentence.find(tokenNumber) == logProbSentence.end()) {
+          // No: store the log-likelihood of that word
+          logProbSentence[tokenNumber] = logProbabilityWord;
+          // Contribute the log-likelihood to the sentence and corpus
+          evaluation.logProbabilities.push_back(logProbabilityWord);
+
+          // Verbose
+          if (m_debugMode) {
+            LogDebugToken(tokenNumber, targetWord, logProbabilityWord,
+                          contextWord, contextLabel, "");
+          }
+        } else {
+          // We have already use the word's log-probability in the score
+          // but let's make a safety check
+          assert(logProbSentence[tokenNumber] == logProbabilityWord);
+          if (m_debugMode) {
+            LogDebugToken(tokenNumber, targetWord, logProbabilityWord,
+                          contextWord, contextLabel, "(seen)");
+          }
+        }
+      } else {
+        if (m_debugMode) {
+          // Out-of-vocabulary words have probability 0 and index -1
+          LogDebugToken(tokenNumber, targetWord, 0, contextWord, contextLabel,
+                        "", true);
+        }
+        evaluation.numUnk++;
+      }
+
+      // Store the current state s(t) at the end of the input layer vector
+      // so that it can be used as s(t-1) at the next step
+      ForwardPropagateRecurrentConnectionOnly(state);
+
+      // Rotate the word history by one: the current context word
+      // (potentially enriched by dependency label information)
+      // will be used at next iteration as input to the RNN
+      ForwardPropagateWordHistory(state, contextWord, nextContextWord);
+      // Update the last label
+      contextLabel = targetLabel;
+
+      // Cache the state after the current token in the prefix trie
+      if (m_usePrefixCache) {
+        trieNode = prefixTrie.AddChild(trieNode, nextContextWord,
+                                       targetLabel, targetWord,
+                                       state, logProbabilityWord);
+      }
+
+      // Go to the next word
+      ok = (book.NextTokenInUnroll() >= 0);
+    } // Loop over tokens in the unroll of a sentence
+    book.NextUnrollInSentence();
+  } // Loop over unrolls of a sentence
+}
+
+
+/**
+ * Test a Recurrent Neural Network model on a test file.
+ * The sentences are scored in parallel, each thread
+ * with its own state, and their scores are gathered in order.
  */
 bool RnnTreeLM::TestRnnModel(const string &testFile,
                              const string &featureFile,
@@ -442,6 +1328,10 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
                              double &entropy,
                              double &accuracy) {
   Log("RnnTreeLM::testNet()\n");
+  // The weights of memory-mapped model files exist only in single precision
+  if (IsModelMapped()) {
+    m_useFloat32 = true;
+  }
   
   // Scores file
   string scoresFilename = m_rnnModelFile + ".scores.";
@@ -466,146 +1356,86 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
   
   // Since we just set s(1)=0, this will set the state s(t-1) to 0 as well...
   ForwardPropagateRecurrentConnectionOnly(m_state);
-  
+
+  // Each evaluation thread has its own state and prefix trie caching
+  // the RNN states along the unrolls of a sentence,
+  // and the weights are shared.
+  // The float32 engine uses single-precision states and weights.
+  int numThreads = NumEvaluationThreads(true);
+  vector<RnnState> states;
+  vector<PrefixStateTrie> prefixTries;
+  vector<RnnStateT<float> > statesFloat;
+  vector<PrefixStateTrieT<float> > prefixTriesFloat;
+  if (m_useFloat32) {
+    UpdateSinglePrecisionWeights();
+    statesFloat.assign(numThreads, RnnStateT<float>(m_state));
+    prefixTriesFloat.resize(numThreads);
+  } else {
+    states.assign(numThreads, m_state);
+    prefixTries.resize(numThreads);
+  }
+  // Counters of forward steps saved by the cache
+  long numTokensProcessed = 0;
+  long numTokensCached = 0;
+
   // Loop over the books
   if (m_debugMode) { Log("New book\n"); }
+  m_corpusValidTest.PrefetchNextBook(m_typeOfDepLabels == 1);
   for (int idxBook = 0; idxBook < m_corpusValidTest.NumBooks(); idxBook++) {
-    // Read the next book
-    m_corpusValidTest.NextBook();
-    m_corpusValidTest.ReadBook(m_typeOfDepLabels == 1);
-    BookUnrolls book = m_corpusValidTest.m_currentBook;
-    
-    // Loop over the sentences in the book
-    book.ResetSentence();
+    // Take over the book read in the background,
+    // and start reading the next one
+    m_corpusValidTest.SwapInPrefetchedBook();
+    if (idxBook + 1 < m_corpusValidTest.NumBooks()) {
+      m_corpusValidTest.PrefetchNextBook(m_typeOfDepLabels == 1);
+    }
+    BookUnrolls &book = m_corpusValidTest.m_currentBook;
+
+    // Score the sentences in the book: each unroll starts from
+    // a reset state, so that the sentences are independent
+    // and each thread can score the next sentence
+    int numSentences = book.NumSentences();
+    vector<SentenceEvaluation> evaluations(numSentences);
+    atomic<int> nextSentence(0);
     if (m_debugMode) { Log("  New sentence\n"); }
-    for (int idxSentence = 0; idxSentence < book.NumSentences(); idxSentence++) {
-      // Initialize a map of log-likelihoods for each token
-      unordered_map<int, double> logProbSentence;
-      // Reset the log-likelihood of the sentence
+    RunInParallel(numThreads, [&](int idxWorker) {
+      // Own position in the book
+      BookUnrolls view = book.View();
+      int idxSentence;
+      while ((idxSentence = nextSentence++) < numSentences) {
+        view.GoToSentence(idxSentence);
+        if (m_useFloat32) {
+          TestOnBookSentence(view, idxSentence, statesFloat[idxWorker],
+                             prefixTriesFloat[idxWorker],
+                             evaluations[idxSentence]);
+        } else {
+          TestOnBookSentence(view, idxSentence, states[idxWorker],
+                             prefixTries[idxWorker], evaluations[idxSentence]);
+        }
+      }
+    });
+
+    // Gather the scores in the order of the sentences
+    for (int idxSentence = 0; idxSentence < numSentences; idxSentence++) {
+      SentenceEvaluation &evaluation = evaluations[idxSentence];
       double sentenceLogProbability = 0.0;
-      
-      // Loop over the unrolls in each sentence
-      book.ResetUnroll();
-      int numUnrolls = book.NumUnrolls(idxSentence);
-      if (m_debugMode) { Log("    New unroll\n"); }
-      for (int idxUnroll = 0; idxUnroll < numUnrolls; idxUnroll++)
-      {
-        // Reset the state of the neural net before each unroll
-        ResetHiddenRnnStateAndWordHistory(m_state);
-        // Reset the dependency label features
-        // at the beginning of each unroll
-        ResetFeatureLabelVector(m_state);
-        
-        // At the beginning of an unroll,
-        // the last word is reset to </s> (end of sentence)
-        // and the last label is reset to 0 (root)
-        int contextWord = 0;
-        int contextLabel = 0;
-        
-        // Loop over the tokens in the sentence unroll
-        bool ok = true;
-        while (ok) {
-          // Get the current word, discount and label
-          int tokenNumber = book.CurrentTokenNumberInSentence();
-          int nextContextWord = book.CurrentTokenWordAsContext();
-          int targetWord = book.CurrentTokenWordAsTarget();
-          int targetLabel = book.CurrentTokenLabel();
-          
-          if (m_typeOfDepLabels == 2) {
-            // Update the feature matrix with the last dependency label
-            UpdateFeatureLabelVector(contextLabel, m_state);
-          }
-          
-          // Run one step of the RNN to predict word
-          // from contextWord, contextLabel and the last hidden state
-          ForwardPropagateOneStep(contextWord, targetWord, m_state);
-          
-          // For perplexity, we do not count OOV words...
-          if ((targetWord >= 0) && (targetWord != m_oov)) {
-            // Compute the log-probability of the current word
-            int outputNodeClass =
-            m_vocab.WordIndex2Class(targetWord) + GetVocabularySize();
-            double condProbaClass =
-            m_state.OutputLayer[outputNodeClass];
-            double condProbaWordGivenClass =
-            m_state.OutputLayer[targetWord];
-            double logProbabilityWord =
-            log10(condProbaClass * condProbaWordGivenClass);
-            
-            // Did we see already that word token (at that position)
-            // in the sentence?
-            if (logProbSentence.find(tokenNumber) == logProbSentence.end()) {
-              // No: store the log-likelihood of that word
-              logProbSentence[tokenNumber] = logProbabilityWord;
-              // Contribute the log-likelihood to the sentence and corpus
-              logProbability += logProbabilityWord;
-              sentenceLogProbability += logProbabilityWord;
-              uniqueWordCounter++;
-              
-              // Verbose
-              if (m_debugMode) {
-                Log(ConvString(tokenNumber) + "\t" +
-                    ConvString(targetWord) + "\t" +
-                    ConvString(logProbabilityWord) + "\t" +
-                    m_vocab.Word2WordIndex(contextWord) + "\t" +
-                    m_corpusValidTest.labelsReverse[contextLabel] + "\t" +
-                    m_vocab.Word2WordIndex(targetWord) + "\t" +
-                    ConvString(m_vocab.WordIndex2Class(targetWord)) + "\t" +
-                    ConvString(m_vocab.WordIndex2Class(contextWord)) + "\n");
-              }
-            } else {
-              // We have already use the word's log-probability in the score
-              // but let's make a safety check
-              assert(logProbSentence[tokenNumber] == logProbabilityWord);
-              if (m_debugMode) {
-                Log(ConvString(tokenNumber) + "\t" +
-                    ConvString(targetWord) + "\t" +
-                    ConvString(logProbabilityWord) + "\t" +
-                    m_vocab.Word2WordIndex(contextWord) + "\t" +
-                    m_corpusValidTest.labelsReverse[contextLabel] + "\t" +
-                    m_vocab.Word2WordIndex(targetWord) + "(seen)\t" +
-                    ConvString(m_vocab.WordIndex2Class(targetWord)) + "\t" +
-                    ConvString(m_vocab.WordIndex2Class(contextWord)) + "\n");
-              }
-            }
-          } else {
-            if (m_debugMode) {
-              // Out-of-vocabulary words have probability 0 and index -1
-              Log(ConvString(tokenNumber) + "\t-1\t0\t" +
-                  m_vocab.Word2WordIndex(contextWord) + "\t" +
-                  m_corpusValidTest.labelsReverse[contextLabel] + "\t" +
-                  m_vocab.Word2WordIndex(targetWord) + "\t-1\t-1\n");
-            }
-            numUnk++;
-          }
-          
-          // Store the current state s(t) at the end of the input layer vector
-          // so that it can be used as s(t-1) at the next step
-          ForwardPropagateRecurrentConnectionOnly(m_state);
-          
-          // Rotate the word history by one: the current context word
-          // (potentially enriched by dependency label information)
-          // will be used at next iteration as input to the RNN
-          ForwardPropagateWordHistory(m_state, contextWord, nextContextWord);
-          // Update the last label
-          contextLabel = targetLabel;
-          
-          // Go to the next word
-          ok = (book.NextTokenInUnroll() >= 0);
-        } // Loop over tokens in the unroll of a sentence
-        book.NextUnrollInSentence();
-      } // Loop over unrolls of a sentence
-      
-      // Reset the table of word token probabilities
-      logProbSentence.clear();
+      for (size_t k = 0; k < evaluation.logProbabilities.size(); k++) {
+        double logProbabilityWord = evaluation.logProbabilities[k];
+        logProbability += logProbabilityWord;
+        sentenceLogProbability += logProbabilityWord;
+        uniqueWordCounter++;
+      }
+      numUnk += evaluation.numUnk;
+      numTokensProcessed += evaluation.numTokensProcessed;
+      numTokensCached += evaluation.numTokensCached;
+
       // Store the log-probability of the sentence
       sentenceScores.push_back(sentenceLogProbability);
       Log(ConvString(sentenceLogProbability) + "\n", scoresFilename);
-
-      book.NextSentence();
-    } // Loop over sentences
+    }
   } // Loop over books
-  
+  LogWriter::Instance().Close(scoresFilename);
+  m_state = m_useFloat32 ? RnnState(statesFloat[0]) : states[0];
+
   // Log file
   string logFilename = m_rnnModelFile + ".test.log.txt";
 
@@ -622,6 +1452,13 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
     -logProbability / log10((double)2) / uniqueWordCounter;
   Log("PPL net (perplexity without OOV): " + ConvString(perplexity) + "\n",
       logFilename);
+  if (m_usePrefixCache) {
+    double hitRate = (numTokensProcessed == 0) ? 0 :
+      (double)numTokensCached / numTokensProcessed;
+    Log("Prefix cache: " + ConvString(numTokensCached) + " out of " +
+        ConvString(numTokensProcessed) + " tokens reused (hit rate " +
+        ConvString(hitRate * 100) + "%)\n", logFilename);
+  }
 
   // Load the labels
   LoadCorrectSentenceLabels(m_fileCorrectSentenceLabels);
@@ -632,3 +1469,81 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
 
   return true;
 }
+
+
+/**
+ * Prepare the evaluation states and prefix tries
+ * of the threads of the scoring server
+ */
+void RnnTreeLM::PrepareScoringWorkers(int numWorkers) {
+  // The weights of memory-mapped model files exist only in single precision
+  if (IsModelMapped()) {
+    m_useFloat32 = true;
+  }
+  ResetAllRnnActivations(m_state);
+  ForwardPropagateRecurrentConnectionOnly(m_state);
+
+  // Each thread of the server has its own state and prefix trie,
+  // and the weights are shared
+  m_scoringStates.clear();
+  m_scoringStatesFloat.clear();
+  m_scoringPrefixTries.clear();
+  m_scoringPrefixTriesFloat.clear();
+  if (m_useFloat32) {
+    UpdateSinglePrecisionWeights();
+    m_scoringStatesFloat.assign(numWorkers, RnnStateT<float>(m_state));
+    m_scoringPrefixTriesFloat.resize(numWorkers);
+  } else {
+    m_scoringStates.assign(numWorkers, m_state);
+    m_scoringPrefixTries.resize(numWorkers);
+  }
+}
+
+
+/**
+ * Score a batch of requests of the scoring server (each one the JSON
+ * list of the unrolls of a sentence), using the evaluation state
+ * and prefix trie of one of its threads. The unrolls of a sentence
+ * are forward-propagated one after the other (sharing their prefixes
+ * when the prefix cache is used).
+ */
+void RnnTreeLM::ScoreRequests(const vector<ScoringRequest *> &requests,
+                              int idxWorker) {
+  BookUnrolls book;
+  for (size_t k = 0; k < requests.size(); k++) {
+    ScoringRequest &request = *(requests[k]);
+    if (request.unrolls.empty()) {
+      request.error = "the model expects the unrolls of a sentence";
+      continue;
+    }
+    // Parse the unrolls, only looking up the vocabulary
+    if (!m_corpusValidTest.ReadSentenceFromJson(request.unrolls,
+                                                m_typeOfDepLabels == 1,
+                                                book) ||
+        (book.NumSentences() != 1)) {
+      request.error = "malformed unrolls";
+      continue;
+    }
+    ScoreBookSentence(book, 0, idxWorker, request.evaluation);
+  }
+}
+
+
+/**
+ * Score a sentence of a book (e.g., read once for an ensemble of models
+ * sharing the vocabulary), using the evaluation state and prefix trie
+ * of one of the threads of the scoring server
+ */
+void RnnTreeLM::ScoreBookSentence(BookUnrolls &book,
+                                  int idxSentence,
+                                  int idxWorker,
+                                  SentenceEvaluation &evaluation) {
+  book.GoToSentence(idxSentence);
+  if (m_useFloat32) {
+    TestOnBookSentence(book, idxSentence, m_scoringStatesFloat[idxWorker],
+                       m_scoringPrefixTriesFloat[idxWorker], evaluation);
+  } else {
+    TestOnBookSentence(book, idxSentence, m_scoringStates[idxWorker],
+                       m_scoringPrefixTries[idxWorker], evaluation);
+  }
+}
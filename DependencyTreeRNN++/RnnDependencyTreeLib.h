@@ -37,9 +37,56 @@
 #ifndef __DependencyTreeRNN____RnnDependencyTreeLib__
 #define __DependencyTreeRNN____RnnDependencyTreeLib__
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include "RnnLib.h"
 #include "RnnTraining.h"
 #include "CorpusUnrollsReader.h"
+#include "PrefixStateTrie.h"
+#include "RnnCluster.h"
+
+/**
+ * Position of the training on dependency parse trees within an epoch,
+ * saved next to each checkpoint of the model: order of the books,
+ * next book to train on (all the books before it have been trained on),
+ * and validation scores of the previous epochs. The vocabulary signature,
+ * iteration and word counter identify the checkpoint model.
+ */
+struct TreeTrainingPosition {
+  TreeTrainingPosition()
+  : vocabularySignature(0), iteration(0), currentPosTrainFile(0),
+  nextBook(0), lastValidLogProbability(-1E37), lastValidAccuracy(0),
+  bestValidLogProbability(-1E37), bestValidAccuracy(0) { }
+
+  unsigned long long vocabularySignature;
+  int iteration;
+  long currentPosTrainFile;
+  int nextBook;
+  double lastValidLogProbability;
+  double lastValidAccuracy;
+  double bestValidLogProbability;
+  double bestValidAccuracy;
+  std::vector<std::string> books;
+};
+
+
+/**
+ * Epoch of the training on dependency parse trees of one model:
+ * training threads (each with its own state and BPTT memory),
+ * lock of the books and of the log, and words trained on so far
+ * (across threads) since the start of the epoch.
+ */
+struct TreeTrainingEpoch {
+  TreeTrainingEpoch() : numWordsBefore(0), numWordsTrained(0) { }
+
+  std::vector<TrainingWorker> workers;
+  std::mutex mutex;
+  long numWordsBefore;
+  std::atomic<long> numWordsTrained;
+  std::chrono::steady_clock::time_point start;
+};
+
 
 class RnnTreeLM : public RnnLMTraining {
 public:
@@ -52,9 +99,11 @@ public:
   // otherwise simply set its filename
   : RnnLMTraining(filename, doLoadModel, debugMode),
   // Parameters set by default (can be overriden when loading the model)
-  m_typeOfDepLabels(0), m_labels(1) {
+  m_typeOfDepLabels(0), m_labels(1), m_usePrefixCache(false),
+  m_useTreeTraining(false), m_cluster(NULL), m_clusterSyncBooks(0) {
     // If we use dependency labels, do not connect them to the outputs
     m_useFeatures2Output = false;
+    SelectKernels();
     std::cout << "RnnTreeLM\n";
   }
   
@@ -78,6 +127,19 @@ public:
     AssignVocabularyFromCorpora(numClasses);
   }
 
+  /**
+   * Copy the vocabulary learnt by another model on the same corpus
+   * (e.g., to train several models on the same stream of books),
+   * export it next to the model and compute the word classes.
+   */
+  void CopyVocabularyFrom(RnnTreeLM &other, int numClasses) {
+    m_corpusTrain.CopyVocabulary(other.m_corpusTrain);
+    m_corpusValidTest.CopyVocabulary(other.m_corpusTrain);
+    m_numTrainWords = other.m_numTrainWords;
+    m_corpusTrain.ExportVocabulary(m_rnnModelFile + ".vocab.txt");
+    AssignVocabularyFromCorpora(numClasses);
+  }
+
   /**
    * Return the number of labels (features) used in the dependency parsing.
    */
@@ -93,6 +155,42 @@ public:
     m_typeOfDepLabels = type;
   }
 
+  /**
+   * Set whether the evaluation caches the RNN states of the prefixes
+   * shared by the unrolls of a sentence (which gives identical scores)
+   */
+  void SetPrefixCache(bool val) {
+    m_usePrefixCache = val;
+  }
+
+  /**
+   * Set whether the training runs once over the tree of the unrolls
+   * of each sentence (shared prefixes are processed once, and the gradients
+   * of all the unrolls are backpropagated together) instead of
+   * over each unroll in turn
+   */
+  void SetTreeTraining(bool val) {
+    m_useTreeTraining = val;
+  }
+
+  /**
+   * Train as one node of a cluster, on a shard of the books,
+   * averaging the weights of the nodes every few books
+   * of each node (0 = once per epoch)
+   */
+  void SetCluster(RnnCluster *cluster, int syncBooks) {
+    m_cluster = cluster;
+    m_clusterSyncBooks = syncBooks;
+  }
+
+  /**
+   * Set the directory where the JSON books are cached as binary books
+   */
+  void SetBinaryBookPath(const std::string &path) {
+    m_corpusTrain.SetBinaryBookPath(path);
+    m_corpusValidTest.SetBinaryBookPath(path);
+  }
+
   /**
    * Set the minimum number of word occurrences
    */
@@ -122,6 +220,17 @@ public:
    * of dependency parse
    */
   bool TrainRnnModel();
+
+  /**
+   * Train several models (e.g., with different hyper-parameters)
+   * on the same JSON trees of dependency parse, reading each book
+   * only once for all the models: the books of the first model
+   * are read by groups, in the background, and each model trains
+   * with its own threads on the current group of books.
+   * Each model keeps its learning rate schedule and stops on its own.
+   * The models must share the vocabulary and the type of labels.
+   */
+  static bool TrainRnnModels(const std::vector<RnnTreeLM *> &models);
   
   /**
    * Function that tests the RNN on JSON trees
@@ -135,6 +244,37 @@ public:
                     double &entropy,
                     double &accuracy);
 
+  /**
+   * Prepare the evaluation states and prefix tries
+   * of the threads of the scoring server
+   */
+  void PrepareScoringWorkers(int numWorkers);
+
+  /**
+   * Score a batch of requests of the scoring server (each one the JSON
+   * list of the unrolls of a sentence), using the evaluation state
+   * and prefix trie of one of its threads
+   */
+  void ScoreRequests(const std::vector<ScoringRequest *> &requests,
+                     int idxWorker);
+
+  /**
+   * Score a sentence of a book (e.g., read once for an ensemble of models
+   * sharing the vocabulary), using the evaluation state and prefix trie
+   * of one of the threads of the scoring server
+   */
+  void ScoreBookSentence(BookUnrolls &book,
+                         int idxSentence,
+                         int idxWorker,
+                         SentenceEvaluation &evaluation);
+
+  /**
+   * Corpus of the validation or test books, and type of dependency labels
+   * used to read them
+   */
+  CorpusUnrolls &GetTestCorpus() { return m_corpusValidTest; }
+  int GetDependencyLabelType() const { return m_typeOfDepLabels; }
+
 protected:
 
   // Corpora
@@ -150,12 +290,85 @@ protected:
 
   // Label vocabulary representation (label -> index of the label)
   std::unordered_map<std::string, int> m_mapLabel2Index;
+
+  // Do we cache the states along unroll prefixes during evaluation?
+  bool m_usePrefixCache;
+
+  // Prefix tries of the threads of the scoring server
+  std::vector<PrefixStateTrie> m_scoringPrefixTries;
+  std::vector<PrefixStateTrieT<float> > m_scoringPrefixTriesFloat;
+
+  // Do we train over the trees of the unrolls of the sentences?
+  bool m_useTreeTraining;
+
+  // Cluster of nodes training together (NULL if training alone),
+  // and number of books of each node between averagings of the weights
+  RnnCluster *m_cluster;
+  int m_clusterSyncBooks;
+
+  // Join the cluster: keep the shard of the books of this node,
+  // and start from the weights and training parameters of the first node
+  // (maxShardBooks is set to the largest number of books of a node)
+  bool JoinCluster(int &maxShardBooks);
+
+  // Start an epoch: reset the state and start the training threads
+  void StartEpoch(TreeTrainingEpoch &epoch);
+
+  // Finish an epoch: validate the model and decide whether to go on
+  // training (loopEpochs) and with which learning rate;
+  // returns false if the cluster is lost
+  bool FinishEpoch(TreeTrainingEpoch &epoch,
+                   TreeTrainingPosition &progress,
+                   bool &loopEpochs);
   
+  // Position of the trainer, as saved next to the checkpoints
+  std::string FormatTrainingPosition(const TreeTrainingPosition &position) const;
+
+  // Load the last checkpoint and the position of the trainer, if any;
+  // returns false if there is no valid checkpoint
+  bool ResumeFromCheckpoint(TreeTrainingPosition &position);
+
+  // Train on one book, using the state of a training thread
+  void TrainOnBook(BookUnrolls &book,
+                   int idxBook,
+                   TrainingWorker &worker,
+                   std::atomic<long> &numWordsTrained,
+                   long numWordsBefore,
+                   std::chrono::steady_clock::time_point start,
+                   std::mutex &logMutex);
+
+  // Train on one sentence of a book over the tree of its unrolls,
+  // using the state of a training thread
+  void TrainOnSentenceTree(BookUnrolls &book,
+                           int idxSentence,
+                           TrainingWorker &worker,
+                           UnrollTree &tree);
+
+  // Log the score of a token in debug mode, as a single formatted line
+  void LogDebugToken(int tokenNumber,
+                     int targetWord,
+                     double logProbabilityWord,
+                     int contextWord,
+                     int contextLabel,
+                     const char *annotation,
+                     bool isOov = false) const;
+
+  // Score one sentence, using the state and prefix trie
+  // of an evaluation thread
+  template <typename Scalar>
+  void TestOnBookSentence(BookUnrolls &book,
+                          int idxSentence,
+                          RnnStateT<Scalar> &state,
+                          PrefixStateTrieT<Scalar> &prefixTrie,
+                          SentenceEvaluation &evaluation);
+
   // Reset the vector of feature labels
-  void ResetFeatureLabelVector(RnnState &state) const;
+  template <typename Scalar>
+  void ResetFeatureLabelVector(RnnStateT<Scalar> &state) const;
   
   // Update the vector of feature labels
-  void UpdateFeatureLabelVector(int label, RnnState &state) const;
+  template <typename Scalar>
+  void UpdateFeatureLabelVector(int label, RnnStateT<Scalar> &state) const;
 
   // Assign the vocabulary from the corpora to the model,
   // and compute the word classes.
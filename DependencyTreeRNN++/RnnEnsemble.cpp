@@ -0,0 +1,263 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <stdio.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include "Utils.h"
+#include "Logger.h"
+#include "RnnEnsemble.h"
+
+using namespace std;
+
+
+// Number of sentences of the test file scored at once by a thread
+static const int c_ensembleChunkSize = 64;
+
+
+/**
+ * Add a model trained on dependency parse trees,
+ * with its test books already added to its test corpus
+ */
+void RnnEnsemble::AddTreeModel(RnnTreeLM *model) {
+  m_models.push_back(model);
+  m_treeModels.push_back(model);
+  m_testFiles.push_back("");
+}
+
+
+/**
+ * Add a model trained on sequential text, with its test file
+ * (one sentence per line, as for TestRnnModel)
+ */
+void RnnEnsemble::AddSequentialModel(RnnLMTraining *model,
+                                     const string &testFile) {
+  m_models.push_back(model);
+  m_treeModels.push_back(NULL);
+  m_testFiles.push_back(testFile);
+}
+
+
+/**
+ * Score the test sentences with all the models, then log the
+ * log-probability, perplexity and accuracy (on the n-best lists
+ * of the sentence labels file) of each model and of the ensemble,
+ * and write the scores of the ensemble (one sentence per line)
+ */
+bool RnnEnsemble::TestEnsemble(const string &sentenceLabelsFile,
+                               const string &scoresFilename) {
+  size_t numModels = m_models.size();
+  if (numModels == 0) {
+    return false;
+  }
+  // Each model has its own evaluation state for every thread
+  for (size_t k = 0; k < numModels; k++) {
+    m_models[k]->PrepareScoringWorkers(m_numThreads);
+  }
+  m_sentenceScores.assign(numModels, vector<double>());
+  m_numWords.assign(numModels, 0);
+  m_numUnk.assign(numModels, 0);
+
+  // Group the models which read the same test data the same way,
+  // and score each group on a single read of its test data
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<bool> isScored(numModels, false);
+  for (size_t k = 0; k < numModels; k++) {
+    if (isScored[k]) {
+      continue;
+    }
+    vector<size_t> group;
+    for (size_t j = k; j < numModels; j++) {
+      bool isSameData = false;
+      if ((m_treeModels[k] != NULL) && (m_treeModels[j] != NULL)) {
+        RnnTreeLM &model = *m_treeModels[k];
+        RnnTreeLM &other = *m_treeModels[j];
+        bool mergeLabel = (model.GetDependencyLabelType() == 1);
+        isSameData =
+        (model.GetDependencyLabelType() == other.GetDependencyLabelType()) &&
+        (model.GetTestCorpus().BookFilenames() ==
+         other.GetTestCorpus().BookFilenames()) &&
+        (model.GetTestCorpus().VocabularySignature(mergeLabel) ==
+         other.GetTestCorpus().VocabularySignature(mergeLabel));
+      } else if ((m_treeModels[k] == NULL) && (m_treeModels[j] == NULL)) {
+        isSameData = (m_testFiles[k] == m_testFiles[j]);
+      }
+      if (!isScored[j] && isSameData) {
+        group.push_back(j);
+        isScored[j] = true;
+      }
+    }
+    Log("Scoring " + ConvString((int)group.size()) + " models on " +
+        ((m_treeModels[k] != NULL) ? string("test books") : m_testFiles[k]) +
+        "...\n");
+    if (m_treeModels[k] != NULL) {
+      ScoreTreeModels(group);
+    } else {
+      ScoreSequentialModels(group);
+    }
+  }
+  Log("Scored all the models in " + ConvString(SecondsSince(start)) +
+      " seconds\n");
+
+  // Load the labels of the n-best lists
+  vector<int> correctLabels;
+  ifstream labelStream(sentenceLabelsFile);
+  int label = 0;
+  while (labelStream >> label) {
+    correctLabels.push_back(label);
+  }
+
+  // Log-probability, perplexity and accuracy of each model
+  size_t numSentences = m_sentenceScores[0].size();
+  vector<double> ensembleScores(numSentences, 0.0);
+  for (size_t k = 0; k < numModels; k++) {
+    const vector<double> &scores = m_sentenceScores[k];
+    if (scores.size() != numSentences) {
+      cerr << "Model " << m_models[k]->GetModelFilename() << " scored "
+      << scores.size() << " sentences instead of " << numSentences << "\n";
+      return false;
+    }
+    double logProbability = 0.0;
+    for (size_t j = 0; j < numSentences; j++) {
+      logProbability += scores[j];
+      ensembleScores[j] += scores[j];
+    }
+    double perplexity = (m_numWords[k] == 0) ? 0 :
+    pow(10.0, -logProbability / (double)m_numWords[k]);
+    string text = "Model " + m_models[k]->GetModelFilename() +
+    ": log probability " + ConvString(logProbability) +
+    ", number of words " + ConvString((int)m_numWords[k]) +
+    " (" + ConvString((int)m_numUnk[k]) + " <unk>), PPL " +
+    ConvString(perplexity);
+    if (!correctLabels.empty() && (numSentences % correctLabels.size() == 0)) {
+      double accuracy = m_models[k]->AccuracyNBestList(scores, correctLabels);
+      text += ", accuracy " + ConvString(accuracy * 100) + "%";
+    }
+    Log(text + "\n");
+  }
+
+  // Scores and accuracy of the ensemble
+  for (size_t j = 0; j < numSentences; j++) {
+    Log(ConvString(ensembleScores[j]) + "\n", scoresFilename);
+  }
+  LogWriter::Instance().Close(scoresFilename);
+  Log("Wrote the scores of the ensemble to " + scoresFilename + "\n");
+  if (!correctLabels.empty() && (numSentences % correctLabels.size() == 0)) {
+    double accuracy =
+    m_models[0]->AccuracyNBestList(ensembleScores, correctLabels);
+    Log("Ensemble of " + ConvString((int)numModels) + " models: accuracy " +
+        ConvString(accuracy * 100) + "% on " +
+        ConvString((int)numSentences) + " sentences\n");
+  }
+  return true;
+}
+
+
+/**
+ * Score the test books with tree models which read them the same way
+ * (same books, vocabulary and type of labels), reading each book once:
+ * the threads take turns on the pairs of sentence and model
+ */
+void RnnEnsemble::ScoreTreeModels(const vector<size_t> &group) {
+  CorpusUnrolls &corpus = m_treeModels[group[0]]->GetTestCorpus();
+  bool mergeLabel = (m_treeModels[group[0]]->GetDependencyLabelType() == 1);
+  int numModels = (int)group.size();
+
+  // Loop over the books, reading the next one in the background
+  corpus.PrefetchNextBook(mergeLabel);
+  for (int idxBook = 0; idxBook < corpus.NumBooks(); idxBook++) {
+    corpus.SwapInPrefetchedBook();
+    if (idxBook + 1 < corpus.NumBooks()) {
+      corpus.PrefetchNextBook(mergeLabel);
+    }
+    BookUnrolls &book = corpus.m_currentBook;
+
+    int numTasks = book.NumSentences() * numModels;
+    vector<SentenceEvaluation> evaluations(numTasks);
+    atomic<int> nextTask(0);
+    RunInParallel(m_numThreads, [&](int idxWorker) {
+      // Own position in the book
+      BookUnrolls view = book.View();
+      int idxTask;
+      while ((idxTask = nextTask++) < numTasks) {
+        RnnTreeLM &model = *m_treeModels[group[idxTask % numModels]];
+        model.ScoreBookSentence(view, idxTask / numModels, idxWorker,
+                                evaluations[idxTask]);
+      }
+    });
+
+    // Gather the scores in the order of the sentences
+    for (int idxTask = 0; idxTask < numTasks; idxTask++) {
+      AddSentenceEvaluation(group[idxTask % numModels], evaluations[idxTask]);
+    }
+  }
+}
+
+
+/**
+ * Score the test file with sequential models, reading the file once:
+ * the threads take turns on the pairs of chunk of sentences and model,
+ * each model looking up the words in its own vocabulary
+ */
+void RnnEnsemble::ScoreSequentialModels(const vector<size_t> &group) {
+  // Read the sentences, one per line
+  vector<string> sentences;
+  ifstream testStream(m_testFiles[group[0]]);
+  string line;
+  while (getline(testStream, line)) {
+    sentences.push_back(line);
+  }
+  int numSentences = (int)sentences.size();
+  int numModels = (int)group.size();
+  int numChunks = (numSentences + c_ensembleChunkSize - 1) / c_ensembleChunkSize;
+
+  int numTasks = numChunks * numModels;
+  vector<SentenceEvaluation> evaluations(numSentences * numModels);
+  atomic<int> nextTask(0);
+  RunInParallel(m_numThreads, [&](int idxWorker) {
+    int idxTask;
+    while ((idxTask = nextTask++) < numTasks) {
+      int idxModel = idxTask % numModels;
+      int first = (idxTask / numModels) * c_ensembleChunkSize;
+      int last = min(numSentences, first + c_ensembleChunkSize);
+      vector<ScoringRequest> requests(last - first);
+      vector<ScoringRequest *> pointers(last - first);
+      for (int j = first; j < last; j++) {
+        requests[j - first].text = sentences[j];
+        pointers[j - first] = &requests[j - first];
+      }
+      m_models[group[idxModel]]->ScoreRequests(pointers, idxWorker);
+      for (int j = first; j < last; j++) {
+        SentenceEvaluation &evaluation =
+        evaluations[(size_t)j * numModels + idxModel];
+        evaluation.logProbabilities.swap(requests[j - first].evaluation.logProbabilities);
+        evaluation.numUnk = requests[j - first].evaluation.numUnk;
+      }
+    }
+  });
+
+  // Gather the scores in the order of the sentences
+  for (size_t k = 0; k < evaluations.size(); k++) {
+    AddSentenceEvaluation(group[k % numModels], evaluations[k]);
+  }
+}
+
+
+/**
+ * Add the evaluation of the next sentence to the scores of a model
+ */
+void RnnEnsemble::AddSentenceEvaluation(size_t idxModel,
+                                        const SentenceEvaluation &evaluation) {
+  double sentenceLogProbability = 0.0;
+  for (size_t k = 0; k < evaluation.logProbabilities.size(); k++) {
+    sentenceLogProbability += evaluation.logProbabilities[k];
+  }
+  m_sentenceScores[idxModel].push_back(sentenceLogProbability);
+  m_numWords[idxModel] += (long)evaluation.logProbabilities.size();
+  m_numUnk[idxModel] += evaluation.numUnk;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___RnnEnsemble_h
+#define DependencyTreeRNN___RnnEnsemble_h
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "RnnTraining.h"
+#include "RnnDependencyTreeLib.h"
+
+
+/**
+ * Ensemble of models (trained on dependency parse trees or on sequential
+ * text) scoring the same test sentences in one process: the score
+ * of a sentence for the ensemble is the sum of its log-probabilities
+ * under each model, as with ensemble.py.
+ * The test data is read once for all the models that read it the same way:
+ * the books once for the tree models sharing the vocabulary
+ * and the type of labels, and the text file once for the sequential models.
+ * The sentences are scored with all the models by the same threads,
+ * each model having its own evaluation state for every thread
+ * (memory-mapped models are evaluated in place, in single precision).
+ */
+class RnnEnsemble {
+public:
+
+  /**
+   * Constructor: number of threads scoring the sentences
+   */
+  RnnEnsemble(int numThreads) : m_numThreads(numThreads < 1 ? 1 : numThreads) { }
+
+  /**
+   * Add a model trained on dependency parse trees,
+   * with its test books already added to its test corpus
+   */
+  void AddTreeModel(RnnTreeLM *model);
+
+  /**
+   * Add a model trained on sequential text, with its test file
+   * (one sentence per line, as for TestRnnModel)
+   */
+  void AddSequentialModel(RnnLMTraining *model, const std::string &testFile);
+
+  /**
+   * Score the test sentences with all the models, then log the
+   * log-probability, perplexity and accuracy (on the n-best lists
+   * of the sentence labels file) of each model and of the ensemble,
+   * and write the scores of the ensemble (one sentence per line)
+   */
+  bool TestEnsemble(const std::string &sentenceLabelsFile,
+                    const std::string &scoresFilename);
+
+protected:
+
+  /**
+   * Score the test books with tree models which read them the same way
+   * (same books, vocabulary and type of labels), reading each book once
+   */
+  void ScoreTreeModels(const std::vector<size_t> &group);
+
+  /**
+   * Score the test file with sequential models, reading the file once
+   */
+  void ScoreSequentialModels(const std::vector<size_t> &group);
+
+  /**
+   * Add the evaluation of the next sentence to the scores of a model
+   */
+  void AddSentenceEvaluation(size_t idxModel,
+                             const SentenceEvaluation &evaluation);
+
+  // Number of threads scoring the sentences
+  int m_numThreads;
+
+  // Models of the ensemble (the tree models are also listed as such,
+  // and the sequential models with their test file)
+  std::vector<RnnLMTraining *> m_models;
+  std::vector<RnnTreeLM *> m_treeModels;
+  std::vector<std::string> m_testFiles;
+
+  // Log-probability of each sentence under each model,
+  // number of words scored and of <unk> words of each model
+  std::vector<std::vector<double> > m_sentenceScores;
+  std::vector<long> m_numWords;
+  std::vector<long> m_numUnk;
+};
+
+#endif
@@ -48,10 +48,7 @@
 #include "Utils.h"
 #include "RnnLib.h"
 #include "CorpusWordReader.h"
-// Include BLAS
-extern "C" {
-#include <cblas.h>
-}
+#include "Blas.h"
 
 using namespace std;
 
@@ -99,7 +96,7 @@ bool RnnLM::LoadTopicModelFeatureMatrix() {
     if (numTopics == 0) {
       numTopics = topicVector.size();
       m_featureMatrix.assign(numTopics, 10000.0);
-      m_featureMatrix.assign(vocabSize * numTopics, 0.0);
+      m_featureMatrix.assign((size_t)vocabSize * numTopics, 0.0);
     }
 
     // Find the index of the word...
@@ -107,8 +104,9 @@ bool RnnLM::LoadTopicModelFeatureMatrix() {
     if (wordIndex < 0 || wordIndex >= vocabSize)
       continue;
     // ... and store the topic vector for that word
+    // (contiguous in the matrix, stored word by word)
     for (int a = 0; a < topicVector.size(); a++)
-      m_featureMatrix[wordIndex + a * vocabSize] = topicVector[a];
+      m_featureMatrix[(size_t)wordIndex * numTopics + a] = topicVector[a];
   }
   return true;
 }
@@ -128,7 +126,8 @@ bool RnnLM::InitializeRnnModel(int sizeVocabulary,
                                int sizeClasses,
                                int sizeCompress,
                                long long sizeDirectConnection,
-                               int orderDirectConnection) {
+                               int orderDirectConnection,
+                               bool doAllocateWeights) {
   if (!m_featureMatrixFile.empty()) {
     // feature matrix file was set
     m_featureMatrixUsed = 1;
@@ -148,13 +147,15 @@ bool RnnLM::InitializeRnnModel(int sizeVocabulary,
   m_weights.Clear();
   m_weights = RnnWeights(sizeVocabulary, sizeHidden, sizeFeature,
                          sizeClasses, sizeCompress,
-                         sizeDirectConnection);
+                         sizeDirectConnection, doAllocateWeights);
 
   // BPTT vectors (as in Back-Propagation Through Time)
   // will be used during training
   m_bpttVectors = RnnBptt(sizeVocabulary, sizeHidden, sizeFeature,
                           m_numBpttSteps, m_bpttBlockSize);
 
+  // Select the kernels for that configuration
+  SelectKernels();
   return true;
 }
 
@@ -211,11 +212,14 @@ m_currentPosTrainFile(0),
 m_usesClassFile(false),
 // Independent sentences (queries)
 m_areSentencesIndependent(true),
-// Temporary allocation of weights, states and BPTT vectors, vocabulary
-m_weights(1, 1, 0, 1, 0, 0),
+// Temporary allocation of vocabulary, states, weights and BPTT vectors
+// (in the order of declaration)
+m_vocab(1),
 m_state(1, 1, 0, 1, 0, 0, 0),
-m_bpttVectors(1, 1, 0, 0, 0),
-m_vocab(1) {
+m_weights(1, 1, 0, 1, 0, 0),
+m_weightsFloat(m_weights),
+m_bpttVectors(1, 1, 0, 0, 0) {
+  SelectKernels();
   // Load the RNN model?
   if (doLoadModel) {
     std::cout << "RnnLM\n";
@@ -233,6 +237,24 @@ void RnnLM::LoadRnnModelFromFile() {
     throw new runtime_error("Did not find file " + m_rnnModelFile);
   }
 
+  // Release the weights of a previously mapped model
+  if (IsModelMapped()) {
+    m_weightsFloat = RnnWeightsT<float>(m_weights);
+    m_mappedModel.Close();
+  }
+
+  // Memory-mapped model files start with a magic string
+  char magic[sizeof(c_mappedModelMagic)] = {0};
+  if ((fread(magic, 1, sizeof(magic), fi) == sizeof(magic)) &&
+      (memcmp(magic, c_mappedModelMagic, sizeof(magic)) == 0)) {
+    LoadMappedRnnModelFromFile(fi);
+    fclose(fi);
+    ResetHiddenRnnStateAndWordHistory(m_state, m_bpttVectors);
+    m_isModelLoaded = true;
+    return;
+  }
+  rewind(fi);
+
   GoToDelimiterInFile(':', fi);
   int ver = m_rnnModelVersion;
   fscanf(fi, "%d", &ver);
@@ -381,10 +403,13 @@ void RnnLM::LoadRnnModelFromFile() {
   // Read the weights of the RNN
   m_weights.Load(fi);
 
-  // Read the feature matrix
+  // Read the feature matrix (stored topic by topic in the file)
+  // and transpose it to be stored word by word
   if (m_featureMatrixUsed) {
-    ReadBinaryMatrix(fi, sizeFeature, sizeVocabulary, m_featureMatrix);
-    m_featureMatrix.resize(GetVocabularySize() * sizeFeature);
+    vector<double> featureMatrixInFile((size_t)sizeVocabulary * sizeFeature);
+    ReadBinaryMatrix(fi, sizeVocabulary, sizeFeature, featureMatrixInFile);
+    TransposeMatrix(&featureMatrixInFile[0], sizeFeature, sizeVocabulary,
+                    m_featureMatrix);
   }
   fclose(fi);
 
@@ -394,12 +419,105 @@ void RnnLM::LoadRnnModelFromFile() {
 }
 
 
+/**
+ * Load a memory-mapped model file: the header and the vocabulary are read,
+ * the hidden layer activations and the feature matrix are copied, and
+ * the single-precision weights are used in place from the mapping.
+ */
+void RnnLM::LoadMappedRnnModelFromFile(FILE *fi) {
+  MappedModelHeader header;
+  rewind(fi);
+  if ((fread(&header, sizeof(header), 1, fi) != 1) ||
+      (header.version != c_mappedModelVersion)) {
+    throw new runtime_error("Unknown version of file " + m_rnnModelFile);
+  }
+
+  // Read the training and validation file names and the vocabulary
+  char buffer[8192];
+  fseek(fi, header.offsetText, SEEK_SET);
+  GoToDelimiterInFile(':', fi);
+  fscanf(fi, "%s", buffer);
+  if (!m_isTrainFileSet) {
+    m_trainFile = buffer;
+  }
+  GoToDelimiterInFile(':', fi);
+  fscanf(fi, "%s", buffer);
+  m_validationFile = buffer;
+  GoToDelimiterInFile(':', fi);
+  m_vocab = Vocabulary(fi, header.sizeVocabulary, header.sizeClasses);
+
+  // Training parameters and progress
+  m_featureMatrixUsed = header.featureMatrixUsed;
+  m_featureGammaCoeff = header.featureGammaCoeff;
+  m_numBpttSteps = header.numBpttSteps;
+  m_bpttBlockSize = header.bpttBlockSize;
+  m_iteration = header.iteration;
+  m_numTrainWords = header.numTrainWords;
+  m_currentPosTrainFile = header.currentPosTrainFile;
+  m_usesClassFile = (header.usesClassFile > 0);
+  m_areSentencesIndependent = (header.areSentencesIndependent > 0);
+  m_initialLearningRate = header.initialLearningRate;
+  m_learningRate = header.learningRate;
+  m_doStartReducingLearningRate = (header.doStartReducingLearningRate > 0);
+
+  // Allocate the RNN here, but not the weights
+  int a = m_featureMatrixUsed;
+  m_featureMatrixUsed = 0;
+  InitializeRnnModel(header.sizeVocabulary,
+                     header.sizeHidden,
+                     header.sizeFeature,
+                     header.sizeClasses,
+                     header.sizeCompress,
+                     header.sizeDirectConnection,
+                     header.orderDirectConnection,
+                     false);
+  m_featureMatrixUsed = a;
+
+  // Map the file and use the weights in place
+  if (!m_mappedModel.Open(m_rnnModelFile)) {
+    throw new runtime_error("Cannot map file " + m_rnnModelFile);
+  }
+  const char *data = m_mappedModel.Data();
+  size_t size = m_mappedModel.Size();
+  Log("Mapping " + ConvString(size) + " bytes of weights...\n");
+  m_weightsFloat = RnnWeightsT<float>(header.sizeVocabulary,
+                                      header.sizeHidden,
+                                      header.sizeFeature,
+                                      header.sizeClasses,
+                                      header.sizeCompress,
+                                      header.sizeDirectConnection,
+                                      false);
+  if (!m_weightsFloat.Map(data, size, header.offsetWeights)) {
+    throw new runtime_error("Corrupted file " + m_rnnModelFile);
+  }
+
+  // Copy the activations on the hidden layer and the feature matrix
+  size_t sizeHidden = header.sizeHidden * sizeof(float);
+  size_t sizeFeatureMatrix = m_featureMatrixUsed ?
+  (size_t)header.sizeFeature * header.sizeVocabulary * sizeof(float) : 0;
+  if ((header.offsetHiddenLayer + sizeHidden > size) ||
+      (header.offsetFeatureMatrix + sizeFeatureMatrix > size)) {
+    throw new runtime_error("Corrupted file " + m_rnnModelFile);
+  }
+  const float *hidden =
+  reinterpret_cast<const float *>(data + header.offsetHiddenLayer);
+  m_state.HiddenLayer.assign(hidden, hidden + header.sizeHidden);
+  if (m_featureMatrixUsed) {
+    const float *features =
+    reinterpret_cast<const float *>(data + header.offsetFeatureMatrix);
+    TransposeMatrix(features, header.sizeFeature, header.sizeVocabulary,
+                    m_featureMatrix);
+  }
+}
+
+
 /**
  * Erase the hidden layer state and the word history.
  * Needed when processing sentences/queries in independent mode.
  * Updates the RnnState object.
  */
-void RnnLM::ResetHiddenRnnStateAndWordHistory(RnnState &state) const {
+template <typename Scalar>
+void RnnLM::ResetHiddenRnnStateAndWordHistory(RnnStateT<Scalar> &state) const {
   // Set hidden unit activations to 1.0
   state.HiddenLayer.assign(GetHiddenSize(), 1.0);
   // Copy the hidden layer to the input (i.e., recurrent connection)
@@ -417,13 +535,15 @@ void RnnLM::ResetHiddenRnnStateAndWordHistory(RnnState &state,
   // Reset the BPTT history and hidden layer activation and gradient
   if (m_numBpttSteps > 0) {
     for (int a = 1; a < m_numBpttSteps + m_bpttBlockSize; a++) {
-      bpttState.History[a] = 0;
+      bpttState.WordAt(a) = 0;
     }
     int sizeHidden = GetHiddenSize();
     for (int a = m_numBpttSteps + m_bpttBlockSize - 1; a > 1; a--) {
+      double *bpttHiddenLayer = bpttState.HiddenLayerAt(a);
+      double *bpttHiddenGradient = bpttState.HiddenGradientAt(a);
       for (int b = 0; b < sizeHidden; b++) {
-        bpttState.HiddenLayer[a * sizeHidden + b] = 0;
-        bpttState.HiddenGradient[a * sizeHidden + b] = 0;
+        bpttHiddenLayer[b] = 0;
+        bpttHiddenGradient[b] = 0;
       }
     }
   }
@@ -435,7 +555,8 @@ void RnnLM::ResetHiddenRnnStateAndWordHistory(RnnState &state,
  * Needed when processing sentences/queries in independent mode.
  * Updates the RnnState object.
  */
-void RnnLM::ResetWordHistory(RnnState &state) const {
+template <typename Scalar>
+void RnnLM::ResetWordHistory(RnnStateT<Scalar> &state) const {
   state.WordHistory.assign(c_maxNGramOrder, 0);
 }
 void RnnLM::ResetWordHistory(RnnState &state,
@@ -445,7 +566,7 @@ void RnnLM::ResetWordHistory(RnnState &state,
   // Reset the word history in the BPTT
   if (m_numBpttSteps > 0) {
     for (int a = 0; a < m_numBpttSteps+m_bpttBlockSize; a++) {
-      bpttState.History[a] = 0;
+      bpttState.WordAt(a) = 0;
     }
   }
 }
@@ -470,6 +591,18 @@ void RnnLM::SaveHiddenRnnState(const RnnState &stateFrom,
 }
 
 
+/**
+ * Forward-propagate the RNN through one full step, using the kernel
+ * selected for the configuration of the model (see SelectKernels)
+ */
+template <typename Scalar>
+void RnnLM::ForwardPropagateOneStep(int lastWord,
+                                    int word,
+                                    RnnStateT<Scalar> &state) {
+  (this->*GetForwardKernel<Scalar>())(lastWord, word, state);
+}
+
+
 /**
  * Forward-propagate the RNN through one full step, starting from
  * the lastWord w(t) and the previous hidden state activation s(t-1),
@@ -480,23 +613,25 @@ void RnnLM::SaveHiddenRnnState(const RnnState &stateFrom,
  * x = V * s(t) + G * f(t) + n-gram_connections
  * y(t) = softmax_class(x) * softmax_word_given_class(x)
  * Updates the RnnState object (but not the weights).
+ * The configuration of the model is given by the template parameters:
+ * the size of the hidden layer is a constant unless SizeHidden is 0.
  */
-void RnnLM::ForwardPropagateOneStep(int lastWord,
-                                    int word,
-                                    RnnState &state) {
+template <typename Scalar, int SizeHidden, bool HasCompress,
+          int FeatureMode, bool HasDirect>
+void RnnLM::ForwardPropagateOneStepKernel(int lastWord,
+                                          int word,
+                                          RnnStateT<Scalar> &state) {
   // Nothing to do when the word is OOV
   if (word == -1) {
     return;
   }
-
-  // The previous word (lastWord) is the input w(t) to the RN
-  if (lastWord != -1) {
-    state.InputLayer[lastWord] = 1;
-  }
+  const RnnWeightsT<Scalar> &weights = GetWeights<Scalar>();
+  const bool hasFeatures2Output =
+  (FeatureMode == c_kernelFeatures2HiddenAndOutput);
 
   // Erase activations of the hidden s(t) and hidden compression c(t) layers
-  int sizeHidden = GetHiddenSize();
-  int sizeCompress = GetCompressSize();
+  const int sizeHidden = (SizeHidden > 0) ? SizeHidden : GetHiddenSize();
+  const int sizeCompress = HasCompress ? GetCompressSize() : 0;
   state.HiddenLayer.assign(sizeHidden, 0.0);
   state.CompressLayer.assign(sizeCompress, 0.0);
 
@@ -509,25 +644,27 @@ void RnnLM::ForwardPropagateOneStep(int lastWord,
   int sizeInput = GetInputSize();
   MultiplyMatrixXvectorBlas(state.HiddenLayer,
                             state.RecurrentLayer,
-                            m_weights.Recurrent2Hidden,
+                            weights.GetRecurrent2Hidden(),
                             sizeHidden,
                             0,
-                            sizeHidden);
+                            sizeHidden,
+                            0);
 
   // Forward-propagate w(t) -> s(t)
   // from the one-hot word representation w(t) at time t
   // to the hidden layer s(t) at time t
   // Operation: s(t) <- s(t) + U * w(t)
   // Note that we add to s(t) which is already non-zero.
+  // The previous word (lastWord) is the one-hot input w(t) to the RNN,
+  // so U * w(t) is simply the column of U for that word.
   if (lastWord != -1) {
+    const Scalar *input2Hidden = weights.GetInput2Hidden();
     for (int b = 0; b < sizeHidden; b++) {
-      state.HiddenLayer[b] +=
-      state.InputLayer[lastWord] * m_weights.Input2Hidden[lastWord + b * sizeInput];
+      state.HiddenLayer[b] += input2Hidden[lastWord + b * sizeInput];
     }
   }
 
-  int sizeFeature = GetFeatureSize();
-  if (sizeFeature > 0) {
+  if (FeatureMode != c_kernelNoFeatures) {
     // Forward-propagate f(t) -> s(t)
     // from the feature vector f(t) at time t
     // to the hidden layer s(t) at time t
@@ -535,21 +672,20 @@ void RnnLM::ForwardPropagateOneStep(int lastWord,
     // Note that we add to s(t) which is already non-zero.
     MultiplyMatrixXvectorBlas(state.HiddenLayer,
                               state.FeatureLayer,
-                              m_weights.Features2Hidden,
-                              sizeFeature,
+                              weights.GetFeatures2Hidden(),
+                              GetFeatureSize(),
                               0,
-                              sizeHidden);
+                              sizeHidden,
+                              0);
   }
 
   // Apply the sigmoid transfer function to the hidden values s(t)
   // At this point, we have computed: z = W * s(t-1) + U * w(t) + F * f(t)
   // Operation: 1 / (1 + exp(-z))
   // We obtain: s(t) = sigmoid(W * s(t-1) + U * w(t) + F * f(t))
-  for (int a = 0; a < sizeHidden; a++) {
-    state.HiddenLayer[a] = LogisticSigmoid(state.HiddenLayer[a]);
-  }
+  LogisticSigmoidInPlace(&state.HiddenLayer[0], sizeHidden);
 
-  if (sizeCompress > 0) {
+  if (HasCompress) {
     // Forward-propagate s(t) -> c(t)
     // from the hidden layer s(t) at time t
     // to the second (compression) hidden layer c(t) at time t
@@ -557,137 +693,111 @@ void RnnLM::ForwardPropagateOneStep(int lastWord,
     // TODO: check where CompressLayer was reset (should be)
     MultiplyMatrixXvectorBlas(state.CompressLayer,
                               state.HiddenLayer,
-                              m_weights.Hidden2Output,
+                              weights.GetHidden2Output(),
                               sizeHidden,
                               0,
-                              sizeCompress);
+                              sizeCompress,
+                              0);
     // Apply the sigmoid transfer function to the hidden values c(t)
     // Operation: 1 / (1 + exp(-z))
     // We obtain: c(t) = sigmoid(C * s(t))
-    for (int a = 0; a < sizeCompress; a++) {
-      state.CompressLayer[a] = LogisticSigmoid(state.CompressLayer[a]);
-    }
+    LogisticSigmoidInPlace(&state.CompressLayer[0], sizeCompress);
+  }
+
+  // Compute the n-gram context of the class outputs
+  if (HasDirect) {
+    ComputeDirectNGramHashes(&state.WordHistory[0], -1,
+                             state.NGrams.classHashes);
   }
 
-  // Reset the output layer (segment that encodes the class probabilities)
+  // Compute the class outputs, using the output kernel on the segment
+  // of the output layer that encodes the class probabilities:
+  // y(t) = softmax(V * s(t) + G * f(t) + n-gram features)
+  // (or V * c(t) with a compression layer)
+  // Note that this operation is done only on the class outputs,
+  // not on the word vocabulary per class outputs
   int sizeOutput = GetOutputSize();
   int sizeVocabulary = GetVocabularySize();
-  for (int b = sizeVocabulary; b < sizeOutput; b++) {
-    state.OutputLayer[b] = 0;
-  }
+  ComputeOutputBlockKernel<Scalar, HasCompress, hasFeatures2Output, HasDirect>
+  (state, -1, sizeVocabulary, sizeOutput,
+   &state.OutputLayer[state.ClassOutputIndex(0)]);
 
-  if (sizeCompress > 0) {
-    // Forward-propagate c(t) -> y(t)
-    // from the second hidden (compression) layer c(t) at time t
-    // to the output layer y(t) at time t
-    // Operation: y(t) <- V * c(t)
-    // Note that this operation is done only on the class outputs,
-    // not on the word vocabulary per class outputs
-    MultiplyMatrixXvectorBlas(state.OutputLayer,
-                              state.CompressLayer,
-                              m_weights.Compress2Output,
-                              sizeCompress,
-                              sizeVocabulary,
-                              sizeOutput);
-  } else {
-    // Forward-propagate s(t) -> y(t)
-    // from the hidden layer s(t) at time t
-    // to the output layer y(t) at time t
-    // Operation: y(t) <- V * s(t)
-    // Note that this operation is done only on the class outputs,
-    // not on the word vocabulary per class outputs
-    MultiplyMatrixXvectorBlas(state.OutputLayer,
-                              state.HiddenLayer,
-                              m_weights.Hidden2Output,
-                              sizeHidden,
-                              sizeVocabulary,
-                              sizeOutput);
-  }
+  // What is the target class of the desired word?
+  int targetClass = m_vocab.WordIndex2Class(word);
 
-  if ((sizeFeature > 0) && m_useFeatures2Output) {
-    // Forward-propagate f(t) -> y(t)
-    // from the feature layer f(t) at time t
-    // to the output layer y(t) at time t
-    // Operation: y(t) <- y(t) + G * f(t)
-    // Note that this operation is done only on the class outputs,
-    // not on the word vocabulary per class outputs
-    MultiplyMatrixXvectorBlas(state.OutputLayer,
-                              state.FeatureLayer,
-                              m_weights.Features2Output,
-                              sizeFeature,
-                              sizeVocabulary,
-                              sizeOutput);
-  }
+  // Now, we need to compute the softmax for the words in that target class
+  // (this will update the state)
+  ComputeRnnOutputsForGivenClassKernel<Scalar, HasCompress,
+                                       hasFeatures2Output, HasDirect>
+  (targetClass, state);
+}
 
-  // Apply direct connections to classes
-  // TODO: this is a horrible mess, but the problem is that models
-  // trained with this weird hashing function would be incompatible
-  // with models trained with a proper hash table (unordered_map),
-  // possibly sorted by the n-gram frequency.
-  // It would be nice to make that change (and perhaps retrain old models).
-  int sizeDirectConnection = GetNumDirectConnection();
-  int sizeDirectConnectionBy2 = sizeDirectConnection / 2;
-  int orderDirectConnection = GetOrderDirectConnection();
-  if (sizeDirectConnection > 0) {
-    // this will hold pointers to m_weightDataMain.weightsDirect
-    // that contains hash parameters
-    unsigned long long hash[c_maxNGramOrder];
-    for (int a = 0; a < orderDirectConnection; a++) {
-      hash[a] = 0;
-    }
-    for (int a = 0; a < orderDirectConnection; a++) {
-      int b = 0;
-      if (a > 0) {
-        if (state.WordHistory[a-1] == -1) {
-          // if OOV was in history, do not use this N-gram feature and higher orders
-          break;
-        }
-      }
-      hash[a] = c_Primes[0] * c_Primes[1];
-      for (b = 1; b <= a; b++) {
-        hash[a] += c_Primes[(a * c_Primes[b] + b) % c_PrimesSize] *
-        (unsigned long long)(state.WordHistory[b-1] + 1);
-        // update hash value based on words from the history
-      }
-      // make sure that starting hash index is in the first half
-      // of m_weightDataMain.weightsDirect
-      // (second part is reserved for history->words features)
-      hash[a] = hash[a] % sizeDirectConnectionBy2;
-    }
-    for (int a = sizeVocabulary; a < sizeOutput; a++) {
-      for (int b = 0; b < orderDirectConnection; b++) {
-        if (hash[b]) {
-          // apply current parameter and move to the next one
-          state.OutputLayer[a] += m_weights.DirectNGram[hash[b]];
-          hash[b]++;
-        } else {
-          break;
-        }
-      }
-    }
-  }
 
-  // Apply the softmax transfer function to the hidden values s(t)
-  // At this point, we have computed: x = V * s(t) + G * f(t)
-  // Operation: exp(x_v) / sum_v exp(x_v)
-  // We obtain: y(t) = softmax(V * s(t) + G * f(t) + n-gram features)
-  // Note that this softmax is computed here only for classes, not words
-  double sum = 0.0;
-  for (int a = sizeVocabulary; a < sizeOutput; a++) {
-    double val = SafeExponentiate(state.OutputLayer[a]);
-    sum += val;
-    state.OutputLayer[a] = val;
-  }
-  for (int a = sizeVocabulary; a < sizeOutput; a++) {
-    state.OutputLayer[a] /= sum;
+/**
+ * Use of the feature vectors by the model: none, connected
+ * to the hidden layer, or to the hidden layer and to the outputs
+ */
+int RnnLM::GetFeatureKernelMode() const {
+  if (GetFeatureSize() == 0) {
+    return c_kernelNoFeatures;
   }
+  return m_useFeatures2Output ?
+  c_kernelFeatures2HiddenAndOutput : c_kernelFeatures2Hidden;
+}
 
-  // What is the target class of the desired word?
-  int targetClass = m_vocab.WordIndex2Class(word);
 
-  // Now, we need to compute the softmax for the words in that target class
-  // (this will update the state)
-  ComputeRnnOutputsForGivenClass(targetClass, state);
+/**
+ * Forward kernel for a given size of the hidden layer (0 for any size),
+ * for the rest of the configuration of the model
+ */
+template <typename Scalar, int SizeHidden>
+typename RnnLM::ForwardKernel<Scalar>::Type
+RnnLM::SelectForwardKernel(bool hasCompress,
+                           int featureMode,
+                           bool hasDirect) const {
+#define FORWARD_KERNEL(compress, features, direct) \
+&RnnLM::ForwardPropagateOneStepKernel<Scalar, SizeHidden, compress, features, direct>
+  static const typename ForwardKernel<Scalar>::Type
+  kernels[2][c_numFeatureKernelModes][2] = {
+    {{FORWARD_KERNEL(false, c_kernelNoFeatures, false),
+      FORWARD_KERNEL(false, c_kernelNoFeatures, true)},
+     {FORWARD_KERNEL(false, c_kernelFeatures2Hidden, false),
+      FORWARD_KERNEL(false, c_kernelFeatures2Hidden, true)},
+     {FORWARD_KERNEL(false, c_kernelFeatures2HiddenAndOutput, false),
+      FORWARD_KERNEL(false, c_kernelFeatures2HiddenAndOutput, true)}},
+    {{FORWARD_KERNEL(true, c_kernelNoFeatures, false),
+      FORWARD_KERNEL(true, c_kernelNoFeatures, true)},
+     {FORWARD_KERNEL(true, c_kernelFeatures2Hidden, false),
+      FORWARD_KERNEL(true, c_kernelFeatures2Hidden, true)},
+     {FORWARD_KERNEL(true, c_kernelFeatures2HiddenAndOutput, false),
+      FORWARD_KERNEL(true, c_kernelFeatures2HiddenAndOutput, true)}}
+  };
+#undef FORWARD_KERNEL
+  return kernels[hasCompress][featureMode][hasDirect];
+}
+
+
+/**
+ * Select the forward kernels (in double and single precision)
+ * specialized on the configuration of the model
+ */
+void RnnLM::SelectKernels() {
+  bool hasCompress = (GetCompressSize() > 0);
+  int featureMode = GetFeatureKernelMode();
+  bool hasDirect = (GetNumDirectConnection() > 0);
+#define SELECT_FORWARD_KERNELS(sizeHidden) \
+m_forwardKernel = \
+SelectForwardKernel<double, sizeHidden>(hasCompress, featureMode, hasDirect); \
+m_forwardKernelFloat = \
+SelectForwardKernel<float, sizeHidden>(hasCompress, featureMode, hasDirect);
+  switch (GetHiddenSize()) {
+    case 50: SELECT_FORWARD_KERNELS(50); break;
+    case 100: SELECT_FORWARD_KERNELS(100); break;
+    case 200: SELECT_FORWARD_KERNELS(200); break;
+    case 300: SELECT_FORWARD_KERNELS(300); break;
+    default: SELECT_FORWARD_KERNELS(0); break;
+  }
+#undef SELECT_FORWARD_KERNELS
 }
 
 
@@ -700,8 +810,36 @@ void RnnLM::ForwardPropagateOneStep(int lastWord,
  * but for a specific targetClass.
  * Updates the RnnState object (but not the weights).
  */
+template <typename Scalar>
 void RnnLM::ComputeRnnOutputsForGivenClass(int targetClass,
-                                           RnnState &state) {
+                                           RnnStateT<Scalar> &state) {
+  typedef void (RnnLM::*Kernel)(int, RnnStateT<Scalar> &) const;
+  static const Kernel kernels[2][2][2] = {
+    {{&RnnLM::ComputeRnnOutputsForGivenClassKernel<Scalar, false, false, false>,
+      &RnnLM::ComputeRnnOutputsForGivenClassKernel<Scalar, false, false, true>},
+     {&RnnLM::ComputeRnnOutputsForGivenClassKernel<Scalar, false, true, false>,
+      &RnnLM::ComputeRnnOutputsForGivenClassKernel<Scalar, false, true, true>}},
+    {{&RnnLM::ComputeRnnOutputsForGivenClassKernel<Scalar, true, false, false>,
+      &RnnLM::ComputeRnnOutputsForGivenClassKernel<Scalar, true, false, true>},
+     {&RnnLM::ComputeRnnOutputsForGivenClassKernel<Scalar, true, true, false>,
+      &RnnLM::ComputeRnnOutputsForGivenClassKernel<Scalar, true, true, true>}}
+  };
+  int featureMode = GetFeatureKernelMode();
+  (this->*kernels[GetCompressSize() > 0]
+   [featureMode == c_kernelFeatures2HiddenAndOutput]
+   [GetNumDirectConnection() > 0])(targetClass, state);
+}
+
+
+/**
+ * Kernel of ComputeRnnOutputsForGivenClass, specialized on the configuration
+ * of the model (compression layer, feature vectors connected to the outputs
+ * and direct n-gram connections)
+ */
+template <typename Scalar, bool HasCompress, bool HasFeatures2Output,
+          bool HasDirect>
+void RnnLM::ComputeRnnOutputsForGivenClassKernel(int targetClass,
+                                                 RnnStateT<Scalar> &state) const {
   // How many words in that target class?
   int targetClassCount = m_vocab.SizeTargetClass(targetClass);
   // At which index in output layer y(t) position do the words
@@ -712,135 +850,715 @@ void RnnLM::ComputeRnnOutputsForGivenClass(int targetClass,
   // THIS WILL WORK ONLY IF CLASSES ARE CONTINUALLY DEFINED IN VOCABULARY
   // (i.e., class 10 = words 11 12 13; not 11 12 16)
 
-  // Reset the outputs in y(t) for that class
-  for (int c = 0; c < targetClassCount; c++) {
-    state.OutputLayer[m_vocab.GetNthWordInClass(targetClass, c)] = 0;
+  // Compute the n-gram context of the words of the target class
+  if (HasDirect) {
+    ComputeDirectNGramHashes(&state.WordHistory[0], targetClass,
+                             state.NGrams.wordHashes);
   }
 
-  int sizeCompress = GetCompressSize();
+  // When training with a sampled softmax, only the outputs
+  // of the sampled words of the class are computed
+  if (!state.SampledWords.empty()) {
+    ComputeSampledOutputsKernel<Scalar, HasCompress, HasFeatures2Output,
+                                HasDirect>(targetClass, state);
+    return;
+  }
+
+  // Compute the outputs in y(t) for that class, using the output kernel
+  // on the segment of the output layer that encodes the words of that class:
+  // y(t) = softmax(V * s(t) + G * f(t) + n-gram features)
+  // (or V * c(t) with a compression layer)
+  state.SetTargetClassOutputs(minIndexWithinClass, targetClassCount);
+  ComputeOutputBlockKernel<Scalar, HasCompress, HasFeatures2Output, HasDirect>
+  (state, targetClass, minIndexWithinClass, maxIndexWithinClass,
+   &state.OutputLayer[state.WordOutputIndex(minIndexWithinClass)]);
+}
+
+
+/**
+ * Kernel of the sampled softmax over the words of the target class
+ * (training states only, whose output layer covers the whole vocabulary).
+ * Each sampled word gets the output that the full kernel would compute,
+ * minus the logarithm of its expected number in the sample,
+ * and the softmax is taken over the sampled words only.
+ */
+template <typename Scalar, bool HasCompress, bool HasFeatures2Output,
+          bool HasDirect>
+void RnnLM::ComputeSampledOutputsKernel(int targetClass,
+                                        RnnStateT<Scalar> &state) const {
+  const RnnWeightsT<Scalar> &weights = GetWeights<Scalar>();
+  int minIndexWithinClass = m_vocab.GetNthWordInClass(targetClass, 0);
+  const vector<Scalar> &inputs =
+  HasCompress ? state.CompressLayer : state.HiddenLayer;
+  const Scalar *outputWeights = HasCompress ?
+  weights.GetCompress2Output() : weights.GetHidden2Output();
+  int sizeInputs = HasCompress ? GetCompressSize() : GetHiddenSize();
+  int sizeFeature = GetFeatureSize();
+  int orderDirectConnection = GetOrderDirectConnection();
+
+  int numSampled = static_cast<int>(state.SampledWords.size());
+  for (int k = 0; k < numSampled; k++) {
+    int word = state.SampledWords[k];
+    // Operation: y_w <- V_w * s(t) + G_w * f(t)
+    const Scalar *row = outputWeights + (long long)word * sizeInputs;
+    Scalar output = 0;
+    for (int a = 0; a < sizeInputs; a++) {
+      output += row[a] * inputs[a];
+    }
+    if (HasFeatures2Output) {
+      const Scalar *rowFeatures =
+      weights.GetFeatures2Output() + (long long)word * sizeFeature;
+      for (int a = 0; a < sizeFeature; a++) {
+        output += rowFeatures[a] * state.FeatureLayer[a];
+      }
+    }
+    // The n-grams of the word start where the n-grams of the first word
+    // of the class start, shifted by the position of the word in the class
+    if (HasDirect) {
+      unsigned long long hash[c_maxNGramOrder];
+      int position = word - minIndexWithinClass;
+      for (int b = 0; b < orderDirectConnection; b++) {
+        hash[b] =
+        state.NGrams.wordHashes[b] ? (state.NGrams.wordHashes[b] + position) : 0;
+      }
+      AddDirectNGramConnections(&output, 1, hash, true);
+    }
+    state.OutputLayer[word] = output - state.SampledLogCounts[k];
+  }
+
+  // Apply the softmax over the sampled words (as SoftmaxInPlace)
+  double sum = 0.0;
+  for (int k = 0; k < numSampled; k++) {
+    int word = state.SampledWords[k];
+    Scalar val = state.OutputLayer[word];
+    val = (val > 50) ? 50 : ((val < -50) ? -50 : val);
+    val = exp(val);
+    sum += val;
+    state.OutputLayer[word] = val;
+  }
+  for (int k = 0; k < numSampled; k++) {
+    state.OutputLayer[state.SampledWords[k]] /= sum;
+  }
+}
+
+
+/**
+ * Forward-propagate B independent sequences through one full step
+ * in lockstep, as ForwardPropagateOneStep does for one sequence.
+ * Sequence b goes from lastWords[b] and its previous hidden state
+ * (row b of the batch) to the outputs for words[b]; there are
+ * as many sequences as words. The products with the recurrent,
+ * feature, compression and class output weights are matrix-matrix
+ * products over the whole batch, and the word outputs are computed
+ * with one product for each group of sequences sharing a target class.
+ * Sequences whose word is OOV (-1) keep their state, as in
+ * ForwardPropagateOneStep.
+ * Updates the RnnBatchState object (but not the weights).
+ */
+template <typename Scalar>
+void RnnLM::ForwardPropagateBatch(const vector<int> &lastWords,
+                                  const vector<int> &words,
+                                  RnnBatchStateT<Scalar> &batch) {
+  int numSequences = static_cast<int>(words.size());
+  if (numSequences == 0) {
+    return;
+  }
+  const RnnWeightsT<Scalar> &weights = GetWeights<Scalar>();
+  assert(numSequences <= batch.MaxNumSequences());
+  int sizeInput = GetInputSize();
   int sizeHidden = GetHiddenSize();
+  int sizeFeature = GetFeatureSize();
+  int sizeCompress = GetCompressSize();
+  int sizeVocabulary = GetVocabularySize();
+  int sizeOutput = GetOutputSize();
+  int sizeClasses = sizeOutput - sizeVocabulary;
+
+  // Forward-propagate S(t-1) -> S(t) for all the sequences
+  // Operation: S(t) <- S(t-1) * W'
+  MultiplyBatchXmatrixBlas(batch.HiddenLayer,
+                           batch.RecurrentLayer,
+                           weights.GetRecurrent2Hidden(),
+                           0.0,
+                           numSequences,
+                           sizeHidden,
+                           0,
+                           sizeHidden);
+
+  // Forward-propagate w(t) -> s(t) for each sequence
+  // Operation: s(t) <- s(t) + U * w(t)
+  // (w(t) is one-hot, so this is the column of U for the last word)
+  const Scalar *input2Hidden = weights.GetInput2Hidden();
+  for (int k = 0; k < numSequences; k++) {
+    int lastWord = lastWords[k];
+    if (lastWord != -1) {
+      Scalar *hidden = &batch.HiddenLayer[k * sizeHidden];
+      for (int b = 0; b < sizeHidden; b++) {
+        hidden[b] += input2Hidden[lastWord + b * sizeInput];
+      }
+    }
+  }
+
+  if (sizeFeature > 0) {
+    // Forward-propagate F(t) -> S(t)
+    // Operation: S(t) <- S(t) + F(t) * F'
+    MultiplyBatchXmatrixBlas(batch.HiddenLayer,
+                             batch.FeatureLayer,
+                             weights.GetFeatures2Hidden(),
+                             1.0,
+                             numSequences,
+                             sizeFeature,
+                             0,
+                             sizeHidden);
+  }
+
+  // Apply the sigmoid transfer function to the hidden values S(t)
+  LogisticSigmoidInPlace(&batch.HiddenLayer[0], numSequences * sizeHidden);
+
+  // The sequences with an OOV word do not move
+  for (int k = 0; k < numSequences; k++) {
+    if (words[k] == -1) {
+      copy(batch.RecurrentLayer.begin() + k * sizeHidden,
+           batch.RecurrentLayer.begin() + (k + 1) * sizeHidden,
+           batch.HiddenLayer.begin() + k * sizeHidden);
+    }
+  }
+
   if (sizeCompress > 0) {
-    // Forward-propagate c(t) -> y(t)
-    // from the second hidden (compression) layer c(t) at time t
-    // to the output layer y(t) at time t
-    // Operation: y(t) <- V * c(t)
-    // Note that this operation is done only on the words
-    // in the class-specific vocabulary
-    MultiplyMatrixXvectorBlas(state.OutputLayer,
-                              state.CompressLayer,
-                              m_weights.Compress2Output,
-                              sizeCompress,
-                              minIndexWithinClass,
-                              maxIndexWithinClass);
+    // Forward-propagate S(t) -> C(t)
+    // Operation: C(t) <- sigmoid(S(t) * C')
+    MultiplyBatchXmatrixBlas(batch.CompressLayer,
+                             batch.HiddenLayer,
+                             weights.GetHidden2Output(),
+                             0.0,
+                             numSequences,
+                             sizeHidden,
+                             0,
+                             sizeCompress);
+    LogisticSigmoidInPlace(&batch.CompressLayer[0],
+                           numSequences * sizeCompress);
+    // Forward-propagate C(t) -> Y(t) on the class outputs
+    // Operation: Y(t) <- C(t) * V'
+    MultiplyBatchXmatrixBlas(batch.ClassLayer,
+                             batch.CompressLayer,
+                             weights.GetCompress2Output(),
+                             0.0,
+                             numSequences,
+                             sizeCompress,
+                             sizeVocabulary,
+                             sizeOutput);
   } else {
-    // Forward-propagate s(t) -> y(t)
-    // from the hidden layer s(t) at time t
-    // to the output layer y(t) at time t
-    // Operation: y(t) <- V * s(t)
-    // Note that this operation is done only on the words
-    // in the class-specific vocabulary
-    MultiplyMatrixXvectorBlas(state.OutputLayer,
-                              state.HiddenLayer,
-                              m_weights.Hidden2Output,
-                              sizeHidden,
-                              minIndexWithinClass,
-                              maxIndexWithinClass);
+    // Forward-propagate S(t) -> Y(t) on the class outputs
+    // Operation: Y(t) <- S(t) * V'
+    MultiplyBatchXmatrixBlas(batch.ClassLayer,
+                             batch.HiddenLayer,
+                             weights.GetHidden2Output(),
+                             0.0,
+                             numSequences,
+                             sizeHidden,
+                             sizeVocabulary,
+                             sizeOutput);
   }
 
-  int sizeFeature = GetFeatureSize();
   if ((sizeFeature > 0) && m_useFeatures2Output) {
-    // Forward-propagate f(t) -> y(t)
-    // from the feature layer f(t) at time t
-    // to the output layer y(t) at time t
-    // Operation: y(t) <- y(t) + G * f(t)
-    // Note that this operation is done only on the words
-    // in the class-specific vocabulary
-    MultiplyMatrixXvectorBlas(state.OutputLayer,
-                              state.FeatureLayer,
-                              m_weights.Features2Output,
-                              sizeFeature,
-                              minIndexWithinClass,
-                              maxIndexWithinClass);
+    // Forward-propagate F(t) -> Y(t) on the class outputs
+    // Operation: Y(t) <- Y(t) + F(t) * G'
+    MultiplyBatchXmatrixBlas(batch.ClassLayer,
+                             batch.FeatureLayer,
+                             weights.GetFeatures2Output(),
+                             1.0,
+                             numSequences,
+                             sizeFeature,
+                             sizeVocabulary,
+                             sizeOutput);
   }
 
-  // Apply direct connections to words
+  // Apply direct connections to classes, then the softmax on the classes
   int sizeDirectConnection = GetNumDirectConnection();
-  int sizeDirectConnectionBy2 = sizeDirectConnection / 2;
-  int orderDirectConnection = GetOrderDirectConnection();
-  if (sizeDirectConnection > 0) {
-    unsigned long long hash[c_maxNGramOrder];
-    for (int a = 0; a < orderDirectConnection; a++) {
-      hash[a] = 0;
+  for (int k = 0; k < numSequences; k++) {
+    Scalar *outputs = &batch.ClassLayer[k * sizeClasses];
+    if (sizeDirectConnection > 0) {
+      unsigned long long hash[c_maxNGramOrder];
+      ComputeDirectNGramHashes(&batch.WordHistory[k * c_maxNGramOrder],
+                               -1, hash);
+      AddDirectNGramConnections(outputs, sizeClasses, hash, false);
     }
-    for (int a = 0; a < orderDirectConnection; a++) {
-      int b = 0;
-      if ((a > 0) && (state.WordHistory[a-1] == -1)) {
-        break;
-      }
-      hash[a] = c_Primes[0] * c_Primes[1] * (unsigned long long)(targetClass+1);
-      for (b = 1; b <= a; b++) {
-        hash[a] += c_Primes[(a * c_Primes[b] + b) % c_PrimesSize] *
-        (unsigned long long)(state.WordHistory[b-1] + 1);
+    SoftmaxInPlace(outputs, sizeClasses);
+  }
+
+  // Group the sequences by target class
+  vector<int> &order = batch.GroupedSequences;
+  order.clear();
+  for (int k = 0; k < numSequences; k++) {
+    if (words[k] != -1) {
+      batch.TargetClass[k] = m_vocab.WordIndex2Class(words[k]);
+      order.push_back(k);
+    }
+  }
+  sort(order.begin(), order.end(), [&batch](int i, int j) {
+    return (batch.TargetClass[i] < batch.TargetClass[j]) ||
+    ((batch.TargetClass[i] == batch.TargetClass[j]) && (i < j));
+  });
+
+  // Compute the word outputs of each group of sequences
+  // that share the same target class
+  const vector<Scalar> &inputs =
+  (sizeCompress > 0) ? batch.CompressLayer : batch.HiddenLayer;
+  const Scalar *outputWeights = (sizeCompress > 0) ?
+  weights.GetCompress2Output() : weights.GetHidden2Output();
+  int sizeInputs = (sizeCompress > 0) ? sizeCompress : sizeHidden;
+  int sizeMaxClass = batch.GetMaxClassSize();
+  size_t idxGroupStart = 0;
+  while (idxGroupStart < order.size()) {
+    int targetClass = batch.TargetClass[order[idxGroupStart]];
+    size_t idxGroupEnd = idxGroupStart + 1;
+    while ((idxGroupEnd < order.size()) &&
+           (batch.TargetClass[order[idxGroupEnd]] == targetClass)) {
+      idxGroupEnd++;
+    }
+    int sizeGroup = static_cast<int>(idxGroupEnd - idxGroupStart);
+    int targetClassCount = m_vocab.SizeTargetClass(targetClass);
+    int minIndexWithinClass = m_vocab.GetNthWordInClass(targetClass, 0);
+    // THIS WILL WORK ONLY IF CLASSES ARE CONTINUALLY DEFINED IN VOCABULARY
+
+    // Forward-propagate S(t) -> Y(t) (or C(t) -> Y(t))
+    // on the words of the target class, for all the sequences of the group
+    // Operation: Y(t) <- S(t) * V'
+    GatherBatchRows(inputs, sizeInputs, order, idxGroupStart, sizeGroup,
+                    batch.GroupedInputs);
+    CblasGemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+              sizeGroup, targetClassCount, sizeInputs,
+              1.0, &batch.GroupedInputs[0], sizeInputs,
+              outputWeights + minIndexWithinClass * sizeInputs, sizeInputs,
+              0.0, &batch.GroupedOutputs[0], sizeMaxClass);
+    if ((sizeFeature > 0) && m_useFeatures2Output) {
+      // Forward-propagate F(t) -> Y(t)
+      // Operation: Y(t) <- Y(t) + F(t) * G'
+      GatherBatchRows(batch.FeatureLayer, sizeFeature,
+                      order, idxGroupStart, sizeGroup,
+                      batch.GroupedInputs);
+      CblasGemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                sizeGroup, targetClassCount, sizeFeature,
+                1.0, &batch.GroupedInputs[0], sizeFeature,
+                weights.GetFeatures2Output() + minIndexWithinClass * sizeFeature,
+                sizeFeature,
+                1.0, &batch.GroupedOutputs[0], sizeMaxClass);
+    }
+
+    for (int g = 0; g < sizeGroup; g++) {
+      int k = order[idxGroupStart + g];
+      Scalar *outputs = &batch.WordLayer[k * sizeMaxClass];
+      copy(batch.GroupedOutputs.begin() + g * sizeMaxClass,
+           batch.GroupedOutputs.begin() + g * sizeMaxClass + targetClassCount,
+           outputs);
+
+      // Apply direct connections to words
+      if (sizeDirectConnection > 0) {
+        unsigned long long hash[c_maxNGramOrder];
+        ComputeDirectNGramHashes(&batch.WordHistory[k * c_maxNGramOrder],
+                                 targetClass, hash);
+        AddDirectNGramConnections(outputs, targetClassCount, hash, true);
       }
+
+      // Apply the softmax on the words of the target class
+      SoftmaxInPlace(outputs, targetClassCount);
+    }
+    idxGroupStart = idxGroupEnd;
+  }
+}
+
+
+/**
+ * Return the probability of a word (class probability times
+ * the probability of the word within its class) for one sequence
+ * of the batch, after ForwardPropagateBatch was called on that word.
+ */
+template <typename Scalar>
+double RnnLM::GetWordProbabilityInBatch(const RnnBatchStateT<Scalar> &batch,
+                                        int idxSequence,
+                                        int word) const {
+  int targetClass = m_vocab.WordIndex2Class(word);
+  assert(targetClass == batch.TargetClass[idxSequence]);
+  int minIndexWithinClass = m_vocab.GetNthWordInClass(targetClass, 0);
+  double condProbaClass =
+  batch.ClassLayer[idxSequence * batch.GetNumClasses() + targetClass];
+  double condProbaWordGivenClass =
+  batch.WordLayer[idxSequence * batch.GetMaxClassSize() +
+                  word - minIndexWithinClass];
+  return condProbaClass * condProbaWordGivenClass;
+}
+
+
+/**
+ * Erase the hidden layer state and the word history
+ * of one sequence of the batch.
+ */
+template <typename Scalar>
+void RnnLM::ResetHiddenRnnStateAndWordHistory(RnnBatchStateT<Scalar> &batch,
+                                              int idxSequence) const {
+  int sizeHidden = GetHiddenSize();
+  fill(batch.HiddenLayer.begin() + idxSequence * sizeHidden,
+       batch.HiddenLayer.begin() + (idxSequence + 1) * sizeHidden, 1.0);
+  fill(batch.RecurrentLayer.begin() + idxSequence * sizeHidden,
+       batch.RecurrentLayer.begin() + (idxSequence + 1) * sizeHidden, 1.0);
+  fill(batch.WordHistory.begin() + idxSequence * c_maxNGramOrder,
+       batch.WordHistory.begin() + (idxSequence + 1) * c_maxNGramOrder, 0);
+}
+
+
+/**
+ * Copies the hidden layer activations of the first sequences
+ * of the batch to their recurrent connections.
+ */
+template <typename Scalar>
+void RnnLM::ForwardPropagateRecurrentConnectionOnly(RnnBatchStateT<Scalar> &batch,
+                                                    int numSequences) const {
+  int sizeHidden = GetHiddenSize();
+  copy(batch.HiddenLayer.begin(),
+       batch.HiddenLayer.begin() + numSequences * sizeHidden,
+       batch.RecurrentLayer.begin());
+}
+
+
+/**
+ * Shift the word history of one sequence of the batch by one
+ * and update its last word.
+ */
+template <typename Scalar>
+void RnnLM::ForwardPropagateWordHistory(RnnBatchStateT<Scalar> &batch,
+                                        int idxSequence,
+                                        int &lastWord,
+                                        const int word) const {
+  lastWord = word;
+  int *wordHistory = &batch.WordHistory[idxSequence * c_maxNGramOrder];
+  for (int a = c_maxNGramOrder - 1; a > 0; a--) {
+    wordHistory[a] = wordHistory[a-1];
+  }
+  wordHistory[0] = lastWord;
+}
+
+
+/**
+ * Compute the starting indices, in the direct n-gram connections,
+ * of the n-grams of the word history: for the class outputs if
+ * targetClass is -1 (first half of the connections), or for the words
+ * of a target class (second half). The n-grams stop at the first OOV
+ * in the history, and their following indices are set to 0.
+ */
+void RnnLM::ComputeDirectNGramHashes(const int *wordHistory,
+                                     int targetClass,
+                                     unsigned long long *hash) const {
+  int sizeDirectConnectionBy2 = GetNumDirectConnection() / 2;
+  int orderDirectConnection = GetOrderDirectConnection();
+  for (int a = 0; a < orderDirectConnection; a++) {
+    hash[a] = 0;
+  }
+  for (int a = 0; a < orderDirectConnection; a++) {
+    if ((a > 0) && (wordHistory[a-1] == -1)) {
+      // if OOV was in history, do not use this N-gram feature and higher orders
+      break;
+    }
+    hash[a] = c_Primes[0] * c_Primes[1];
+    if (targetClass >= 0) {
+      hash[a] *= (unsigned long long)(targetClass+1);
+    }
+    for (int b = 1; b <= a; b++) {
+      // update hash value based on words from the history
+      hash[a] += c_Primes[(a * c_Primes[b] + b) % c_PrimesSize] *
+      (unsigned long long)(wordHistory[b-1] + 1);
+    }
+    if (targetClass < 0) {
+      // make sure that starting hash index is in the first half
+      // of m_weightDataMain.weightsDirect
+      // (second part is reserved for history->words features)
+      hash[a] = hash[a] % sizeDirectConnectionBy2;
+    } else {
       hash[a] = (hash[a] % sizeDirectConnectionBy2) + sizeDirectConnectionBy2;
     }
-    for (int c = 0; c < targetClassCount; c++) {
-      int a = m_vocab.GetNthWordInClass(targetClass, c);
-      for (int b = 0; b < orderDirectConnection; b++) {
-        if (hash[b]) {
-          state.OutputLayer[a] += m_weights.DirectNGram[hash[b]];
-          hash[b]++;
-          hash[b] = hash[b] % sizeDirectConnection;
-        } else {
-          break;
-        }
+  }
+}
+
+
+/**
+ * Prefetch the cache lines of the direct n-gram connections that
+ * AddDirectNGramConnections reads for a block of outputs. These reads are
+ * scattered at random in a large table, so the prefetches are issued
+ * before the matrix-vector products of the output kernel.
+ */
+template <typename Scalar>
+void RnnLM::PrefetchDirectNGramConnections(int size,
+                                           const unsigned long long *hash,
+                                           bool isWordBlock) const {
+  const int sizeCacheLine = 64;
+  const RnnWeightsT<Scalar> &weights = GetWeights<Scalar>();
+  // Table of connections, in its storage precision
+  const char *directNGram;
+  size_t sizeConnection;
+  switch (weights.GetDirectNGramPrecision()) {
+    case c_directNGramFloat16:
+      directNGram = reinterpret_cast<const char *>(weights.GetDirectNGramFloat16());
+      sizeConnection = sizeof(unsigned short);
+      break;
+    case c_directNGramInt8:
+      directNGram = reinterpret_cast<const char *>(weights.GetDirectNGramInt8());
+      sizeConnection = sizeof(signed char);
+      break;
+    default:
+      directNGram = reinterpret_cast<const char *>(weights.GetDirectNGram());
+      sizeConnection = sizeof(float);
+      break;
+  }
+  long long sizeDirectConnection = GetNumDirectConnection();
+  int orderDirectConnection = GetOrderDirectConnection();
+  for (int b = 0; (b < orderDirectConnection) && hash[b]; b++) {
+    long long idxTo = min(sizeDirectConnection, (long long)hash[b] + size);
+    const char *from = directNGram + hash[b] * sizeConnection;
+    const char *to = directNGram + idxTo * sizeConnection;
+    for (const char *line = from; line < to; line += sizeCacheLine) {
+      __builtin_prefetch(line);
+    }
+  }
+}
+
+
+/**
+ * Add the direct n-gram connections to a contiguous block of outputs.
+ * The n-gram of order b adds DirectNGram[hash[b] + c] to output c,
+ * since the indices of consecutive outputs are consecutive. For the words
+ * of a class (isWordBlock), as with the original hashing, the index of
+ * an n-gram that reaches the end of the direct connections wraps around
+ * to 0, which disables that n-gram and the higher orders for the outputs
+ * that remain. Each order is thus added on a contiguous range of outputs
+ * (vectorized), one order after another, so that each output still sums
+ * its n-grams in the same order. Quantized connections are dequantized
+ * on the fly.
+ */
+template <typename Scalar>
+void RnnLM::AddDirectNGramConnections(Scalar *outputs,
+                                      int size,
+                                      const unsigned long long *hash,
+                                      bool isWordBlock) const {
+  const RnnWeightsT<Scalar> &weights = GetWeights<Scalar>();
+  DirectNGramPrecision precision = weights.GetDirectNGramPrecision();
+  long long sizeDirectConnection = GetNumDirectConnection();
+  int orderDirectConnection = GetOrderDirectConnection();
+  // Number of outputs to which the n-grams of the current order apply
+  long long numOutputs = size;
+  for (int b = 0; b < orderDirectConnection; b++) {
+    if (!hash[b]) {
+      // OOV in the history: no n-gram of that order or higher
+      break;
+    }
+    if (isWordBlock) {
+      numOutputs = min(numOutputs, sizeDirectConnection - (long long)hash[b]);
+    }
+    if (precision == c_directNGramFloat16) {
+      const unsigned short *connections =
+      weights.GetDirectNGramFloat16() + hash[b];
+      for (int c = 0; c < numOutputs; c++) {
+        outputs[c] += HalfToFloat(connections[c]);
+      }
+    } else if (precision == c_directNGramInt8) {
+      const signed char *connections = weights.GetDirectNGramInt8();
+      const float *scales = weights.GetDirectNGramScales();
+      for (int c = 0; c < numOutputs; c++) {
+        long long k = hash[b] + c;
+        outputs[c] += connections[k] * scales[k >> c_directNGramInt8BlockShift];
+      }
+    } else {
+      const float *connections = weights.GetDirectNGram() + hash[b];
+      for (int c = 0; c < numOutputs; c++) {
+        outputs[c] += connections[c];
       }
     }
   }
+}
 
-  // Apply the softmax transfer function to the hidden values s(t)
-  // At this point, we have computed: x = V * s(t) + G * f(t)
-  // Operation: exp(x_v) / sum_v exp(x_v)
-  // We obtain: y(t) = softmax(V * s(t) + G * f(t) + n-gram features)
-  // Note that this operation is done only on the words
-  // in the class-specific vocabulary
-  double sum = 0;
-  for (int c = 0; c < targetClassCount; c++) {
-    int wordIndex = m_vocab.GetNthWordInClass(targetClass, c);
-    double val = SafeExponentiate(state.OutputLayer[wordIndex]);
-    sum += val;
-    state.OutputLayer[wordIndex] = val;
+
+/**
+ * Output kernel on a contiguous block of outputs, i.e., the classes
+ * (targetClass = -1) or the words of a target class, corresponding
+ * to the rows [idxFrom, idxTo[ of the output weights
+ * (this works because the words of a class are contiguous).
+ * Computes, into outputs[0, idxTo - idxFrom[:
+ * x = V * s(t) + G * f(t) + n-gram_connections
+ * y = softmax(x)
+ * where s(t) is replaced by c(t) when there is a compression layer.
+ * Used by the training and the evaluation.
+ */
+template <typename Scalar>
+void RnnLM::ComputeOutputBlock(const RnnStateT<Scalar> &state,
+                               int targetClass,
+                               int idxFrom,
+                               int idxTo,
+                               Scalar *outputs) const {
+  typedef void (RnnLM::*Kernel)(const RnnStateT<Scalar> &,
+                                int, int, int, Scalar *) const;
+  static const Kernel kernels[2][2][2] = {
+    {{&RnnLM::ComputeOutputBlockKernel<Scalar, false, false, false>,
+      &RnnLM::ComputeOutputBlockKernel<Scalar, false, false, true>},
+     {&RnnLM::ComputeOutputBlockKernel<Scalar, false, true, false>,
+      &RnnLM::ComputeOutputBlockKernel<Scalar, false, true, true>}},
+    {{&RnnLM::ComputeOutputBlockKernel<Scalar, true, false, false>,
+      &RnnLM::ComputeOutputBlockKernel<Scalar, true, false, true>},
+     {&RnnLM::ComputeOutputBlockKernel<Scalar, true, true, false>,
+      &RnnLM::ComputeOutputBlockKernel<Scalar, true, true, true>}}
+  };
+  int featureMode = GetFeatureKernelMode();
+  (this->*kernels[GetCompressSize() > 0]
+   [featureMode == c_kernelFeatures2HiddenAndOutput]
+   [GetNumDirectConnection() > 0])(state, targetClass, idxFrom, idxTo, outputs);
+}
+
+
+/**
+ * Kernel of ComputeOutputBlock, specialized on the configuration
+ * of the model (compression layer, feature vectors connected to the outputs
+ * and direct n-gram connections)
+ */
+template <typename Scalar, bool HasCompress, bool HasFeatures2Output,
+          bool HasDirect>
+void RnnLM::ComputeOutputBlockKernel(const RnnStateT<Scalar> &state,
+                                     int targetClass,
+                                     int idxFrom,
+                                     int idxTo,
+                                     Scalar *outputs) const {
+  const RnnWeightsT<Scalar> &weights = GetWeights<Scalar>();
+  int size = idxTo - idxFrom;
+  bool isWordBlock = (targetClass >= 0);
+  const unsigned long long *hash =
+  isWordBlock ? state.NGrams.wordHashes : state.NGrams.classHashes;
+  if (HasDirect) {
+    PrefetchDirectNGramConnections<Scalar>(size, hash, isWordBlock);
+  }
+
+  // Forward-propagate s(t) -> y(t) (or c(t) -> y(t))
+  // Operation: y(t) <- V * s(t) (or V * c(t))
+  const vector<Scalar> &inputs =
+  HasCompress ? state.CompressLayer : state.HiddenLayer;
+  const Scalar *outputWeights = HasCompress ?
+  weights.GetCompress2Output() : weights.GetHidden2Output();
+  int sizeInputs = HasCompress ? GetCompressSize() : GetHiddenSize();
+  CblasGemv(CblasRowMajor, CblasNoTrans,
+            size, sizeInputs,
+            1.0, outputWeights + idxFrom * sizeInputs, sizeInputs,
+            &inputs[0], 1,
+            0.0, outputs, 1);
+
+  if (HasFeatures2Output) {
+    // Forward-propagate f(t) -> y(t)
+    // Operation: y(t) <- y(t) + G * f(t)
+    int sizeFeature = GetFeatureSize();
+    CblasGemv(CblasRowMajor, CblasNoTrans,
+              size, sizeFeature,
+              1.0, weights.GetFeatures2Output() + idxFrom * sizeFeature,
+              sizeFeature,
+              &state.FeatureLayer[0], 1,
+              1.0, outputs, 1);
   }
-  for (int c = 0; c < targetClassCount; c++) {
-    int wordIndex = m_vocab.GetNthWordInClass(targetClass, c);
-    state.OutputLayer[wordIndex] /= sum;
+
+  // Apply direct connections
+  // TODO: this is a horrible mess, but the problem is that models
+  // trained with this weird hashing function would be incompatible
+  // with models trained with a proper hash table (unordered_map),
+  // possibly sorted by the n-gram frequency.
+  // It would be nice to make that change (and perhaps retrain old models).
+  if (HasDirect) {
+    AddDirectNGramConnections(outputs, size, hash, isWordBlock);
   }
+
+  // Apply the softmax transfer function
+  // Operation: exp(x_v) / sum_v exp(x_v)
+  SoftmaxInPlace(outputs, size);
 }
 
 
+/**
+ * Matrix-matrix multiplication routine, the batched version of
+ * MultiplyMatrixXvectorBlas. Computes Y <- beta * Y + X * A',
+ * (i.e. multiplies each row x of X by A) where A is of size N x M,
+ * X is of size B x M and Y is of size B x N.
+ * The operation can done on a contiguous subset of rows
+ * i in [idxAFrom, idxATo[ of matrix A, in which case
+ * Y is of size B x (idxATo - idxAFrom).
+ */
+template <typename Scalar>
+void RnnLM::MultiplyBatchXmatrixBlas(vector<Scalar> &matrixY,
+                                     const vector<Scalar> &matrixX,
+                                     const Scalar *matrixA,
+                                     double beta,
+                                     int numRows,
+                                     int widthMatrix,
+                                     int idxAFrom,
+                                     int idxATo) const {
+  int heightMatrix = idxATo - idxAFrom;
+  CblasGemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+            numRows, heightMatrix, widthMatrix,
+            1.0, &matrixX[0], widthMatrix,
+            matrixA + idxAFrom * widthMatrix, widthMatrix,
+            beta, &matrixY[0], heightMatrix);
+}
+
+
+/**
+ * Copy the rows of a batch matrix that correspond to a group
+ * of sequences (order[idxFrom] to order[idxFrom + numRows - 1])
+ * to the first rows of another matrix.
+ */
+template <typename Scalar>
+void RnnLM::GatherBatchRows(const vector<Scalar> &matrix,
+                            int width,
+                            const vector<int> &order,
+                            size_t idxFrom,
+                            int numRows,
+                            vector<Scalar> &rows) const {
+  for (int g = 0; g < numRows; g++) {
+    int k = order[idxFrom + g];
+    copy(matrix.begin() + k * width,
+         matrix.begin() + (k + 1) * width,
+         rows.begin() + g * width);
+  }
+}
+
+
+/**
+ * Return the probability of a word (class probability times
+ * the probability of the word within its class), after
+ * ForwardPropagateOneStep was called on that word.
+ */
+template <typename Scalar>
+double RnnLM::GetWordProbability(const RnnStateT<Scalar> &state,
+                                 int word) const {
+  int targetClass = m_vocab.WordIndex2Class(word);
+  double condProbaClass = state.OutputLayer[state.ClassOutputIndex(targetClass)];
+  double condProbaWordGivenClass = state.OutputLayer[state.WordOutputIndex(word)];
+  return condProbaClass * condProbaWordGivenClass;
+}
+
 /**
  * Matrix-vector multiplication routine, somewhat accelerated using loop
  * unrolling over 8 registers. Computes y <- y + A * x, (i.e. adds A * x to y)
  * where A is of size N x M, x is of length M and y is of length N.
  * The operation can done on a contiguous subset of indices
- * i in [idxYFrom, idxYTo[ of vector y
- * and on a contiguous subset of indices j in [idxXFrom, idxXTo[ of vector x.
+ * i in [idxYFrom, idxYTo[ of vector y, whose results are stored
+ * in y starting at index idxYFirst (e.g., in a compact output layer).
  */
-void RnnLM::MultiplyMatrixXvectorBlas(vector<double> &vectorY,
-                                      vector<double> &vectorX,
-                                      vector<double> &matrixA,
+template <typename Scalar>
+void RnnLM::MultiplyMatrixXvectorBlas(vector<Scalar> &vectorY,
+                                      const vector<Scalar> &vectorX,
+                                      const Scalar *matrixA,
                                       int widthMatrix,
                                       int idxYFrom,
-                                      int idxYTo) const {
-  double *vecX = &vectorX[0];
+                                      int idxYTo,
+                                      int idxYFirst) const {
+  const Scalar *vecX = &vectorX[0];
   int idxAFrom = idxYFrom * widthMatrix;
-  double *matA = &matrixA[idxAFrom];
+  const Scalar *matA = matrixA + idxAFrom;
   int heightMatrix = idxYTo - idxYFrom;
-  double *vecY = &vectorY[idxYFrom];
-  cblas_dgemv(CblasRowMajor, CblasNoTrans,
-              heightMatrix, widthMatrix, 1.0, matA, widthMatrix,
-              vecX, 1,
-              1.0, vecY, 1);
+  Scalar *vecY = &vectorY[idxYFirst];
+  CblasGemv(CblasRowMajor, CblasNoTrans,
+            heightMatrix, widthMatrix, 1.0, matA, widthMatrix,
+            vecX, 1,
+            1.0, vecY, 1);
 }
 
 
@@ -848,7 +1566,8 @@ void RnnLM::MultiplyMatrixXvectorBlas(vector<double> &vectorY,
  * Copies the hidden layer activation s(t) to the recurrent connections.
  * That copy will become s(t-1) at the next call of ForwardPropagateOneStep
  */
-void RnnLM::ForwardPropagateRecurrentConnectionOnly(RnnState &state) const {
+template <typename Scalar>
+void RnnLM::ForwardPropagateRecurrentConnectionOnly(RnnStateT<Scalar> &state) const {
   state.RecurrentLayer = state.HiddenLayer;
 }
 
@@ -856,14 +1575,11 @@ void RnnLM::ForwardPropagateRecurrentConnectionOnly(RnnState &state) const {
 /**
  * Shift the word history by one and update last word.
  */
-void RnnLM::ForwardPropagateWordHistory(RnnState &state,
+template <typename Scalar>
+void RnnLM::ForwardPropagateWordHistory(RnnStateT<Scalar> &state,
                                         int &lastWord,
                                         const int word) const {
-  // Delete the previous activation of the input layer for lastWord
-  if (lastWord != -1) {
-    state.InputLayer[lastWord] = 0;
-  }
-  // Update lastWord
+  // Update lastWord (the next one-hot input)
   lastWord = word;
   // Shift the word history
   for (int a = c_maxNGramOrder - 1; a > 0; a--) {
@@ -881,20 +1597,20 @@ void RnnLM::ForwardPropagateWordHistory(RnnState &state,
  * (exponentially decaying) function of the topic model vectors
  * for each word in the history.
  */
+template <typename Scalar>
 void RnnLM::UpdateFeatureVectorUsingTopicModel(int word,
-                                               RnnState &state) const {
+                                               RnnStateT<Scalar> &state) const {
   // Safety check
   if (word < 0) {
     return;
   }
 
   // Check if the features for this word were defined
-  if (m_featureMatrix[word] >= 1000) {
+  int sizeFeature = GetFeatureSize();
+  const double *topics = &m_featureMatrix[(size_t)word * sizeFeature];
+  if (topics[0] >= 1000) {
     return;
   }
-
-  int sizeFeature = GetFeatureSize();
-  int sizeVocabulary = GetVocabularySize();
   if (m_areSentencesIndependent && (word == 0)) {
     // Reset the feature vector at the beginning of each sentence
     state.FeatureLayer.assign(sizeFeature, 0);
@@ -902,11 +1618,91 @@ void RnnLM::UpdateFeatureVectorUsingTopicModel(int word,
 
   // The feature vector f is updated using exponential decay:
   // f(t) = gamma * f(t-1) +  (1 - gamma) * Z_word
-  // where Z_word is the topic model word representation for the word.
+  // where Z_word is the topic model word representation for the word,
+  // stored contiguously in the feature matrix.
+  double gamma = m_featureGammaCoeff;
   double oneMinusGamma = (1 - m_featureGammaCoeff);
+  Scalar *features = &state.FeatureLayer[0];
   for (int a = 0; a < sizeFeature; a++) {
-    state.FeatureLayer[a] =
-    state.FeatureLayer[a] * m_featureGammaCoeff
-    + m_featureMatrix[a * sizeVocabulary + word] * oneMinusGamma;
+    features[a] = features[a] * gamma + topics[a] * oneMinusGamma;
+  }
+}
+
+
+/**
+ * Update the single-precision copy of the weights used by
+ * the float32 engine, e.g., after loading or training the model.
+ * The direct n-gram connections are not copied: the single-precision
+ * weights use those of the double-precision weights in place.
+ */
+void RnnLM::UpdateSinglePrecisionWeights() {
+  // The weights of a memory-mapped model are already in single precision
+  if (IsModelMapped()) {
+    return;
   }
+  m_weightsFloat = RnnWeightsT<float>(m_weights, true);
 }
+
+
+/**
+ * Quantize the direct n-gram connections used for inference: those of
+ * the double-precision weights (used in place by the single-precision
+ * weights, see UpdateSinglePrecisionWeights) or those of a memory-mapped model.
+ */
+void RnnLM::QuantizeDirectNGram(DirectNGramPrecision precision) {
+  if ((GetNumDirectConnection() == 0) ||
+      (precision == c_directNGramFloat32)) {
+    return;
+  }
+  bool isMapped = IsModelMapped();
+  long long memoryBefore = isMapped ?
+  m_weightsFloat.GetDirectNGramMemory() : m_weights.GetDirectNGramMemory();
+  double maxError = isMapped ?
+  m_weightsFloat.QuantizeDirectNGram(precision) :
+  m_weights.QuantizeDirectNGram(precision);
+  long long memory = isMapped ?
+  m_weightsFloat.GetDirectNGramMemory() : m_weights.GetDirectNGramMemory();
+  // The single-precision weights use the quantized connections in place
+  if (!isMapped && m_weightsFloat.IsDirectNGramInPlace()) {
+    UpdateSinglePrecisionWeights();
+  }
+  Log("Quantized " + ConvString(GetNumDirectConnection()) +
+      " direct n-gram connections from " + ConvString(memoryBefore) +
+      " to " + ConvString(memory) + " bytes, largest error " +
+      ConvString(maxError) + "\n");
+}
+
+
+// The forward-propagation engine exists in double precision
+// (training and default evaluation) and in single precision
+#define INSTANTIATE_RNNLM_ENGINE(Scalar) \
+template void RnnLM::ResetHiddenRnnStateAndWordHistory(RnnStateT<Scalar> &) const; \
+template void RnnLM::ResetWordHistory(RnnStateT<Scalar> &) const; \
+template void RnnLM::ForwardPropagateOneStep(int, int, RnnStateT<Scalar> &); \
+template void RnnLM::ComputeRnnOutputsForGivenClass(int, RnnStateT<Scalar> &); \
+template double RnnLM::GetWordProbability(const RnnStateT<Scalar> &, int) const; \
+template void RnnLM::ForwardPropagateBatch(const vector<int> &, \
+                                           const vector<int> &, \
+                                           RnnBatchStateT<Scalar> &); \
+template double RnnLM::GetWordProbabilityInBatch(const RnnBatchStateT<Scalar> &, \
+                                                 int, int) const; \
+template void RnnLM::ResetHiddenRnnStateAndWordHistory(RnnBatchStateT<Scalar> &, \
+                                                       int) const; \
+template void RnnLM::ForwardPropagateRecurrentConnectionOnly(RnnBatchStateT<Scalar> &, \
+                                                             int) const; \
+template void RnnLM::ForwardPropagateWordHistory(RnnBatchStateT<Scalar> &, \
+                                                 int, int &, const int) const; \
+template void RnnLM::ForwardPropagateRecurrentConnectionOnly(RnnStateT<Scalar> &) const; \
+template void RnnLM::ForwardPropagateWordHistory(RnnStateT<Scalar> &, \
+                                                 int &, const int) const; \
+template void RnnLM::UpdateFeatureVectorUsingTopicModel(int, \
+                                                        RnnStateT<Scalar> &) const; \
+template void RnnLM::ComputeOutputBlock(const RnnStateT<Scalar> &, \
+                                        int, int, int, Scalar *) const; \
+template void RnnLM::MultiplyMatrixXvectorBlas(vector<Scalar> &, \
+                                               const vector<Scalar> &, \
+                                               const Scalar *, \
+                                               int, int, int, int) const;
+INSTANTIATE_RNNLM_ENGINE(double)
+INSTANTIATE_RNNLM_ENGINE(float)
+#undef INSTANTIATE_RNNLM_ENGINE
@@ -37,6 +37,7 @@
 #ifndef __DependencyTreeRNN____rnnlmlib__
 #define __DependencyTreeRNN____rnnlmlib__
 
+#include <cmath>
 #include <vector>
 #include <map>
 #include <set>
@@ -47,9 +48,70 @@
 #include "RnnState.h"
 #include "RnnWeights.h"
 #include "CorpusWordReader.h"
+#include "MemoryMappedFile.h"
 #include "Vocabulary.h"
 
 
+/**
+ * Magic string and version of the memory-mapped model file format
+ */
+const char c_mappedModelMagic[8] = {'R', 'N', 'N', 'L', 'M', 'M', 'A', 'P'};
+const int c_mappedModelVersion = 1;
+
+
+/**
+ * Use of the feature vectors by the kernels specialized
+ * on the configuration of the model: no features, features connected
+ * to the hidden layer only, or to the hidden layer and to the outputs
+ */
+enum FeatureKernelMode {
+  c_kernelNoFeatures = 0,
+  c_kernelFeatures2Hidden,
+  c_kernelFeatures2HiddenAndOutput,
+  c_numFeatureKernelModes
+};
+
+
+/**
+ * Fixed binary header of a memory-mapped model file. It is followed by
+ * a text section (training and validation file names, then the vocabulary,
+ * as in the other model format) and by the hidden layer activations,
+ * the blocks of weights and the optional feature matrix, all stored
+ * as floats in native byte order and aligned on c_weightBlockAlignment
+ * bytes, so that the weights can be used in place by the float32 engine.
+ */
+struct MappedModelHeader {
+  char magic[8];
+  int version;
+  // Dimensions of the network
+  int sizeVocabulary;
+  int sizeHidden;
+  int sizeFeature;
+  int sizeClasses;
+  int sizeCompress;
+  int orderDirectConnection;
+  // Training parameters and progress
+  int numBpttSteps;
+  int bpttBlockSize;
+  int iteration;
+  int featureMatrixUsed;
+  int usesClassFile;
+  int areSentencesIndependent;
+  int doStartReducingLearningRate;
+  long long sizeDirectConnection;
+  long long numTrainWords;
+  long long currentPosTrainFile;
+  double featureGammaCoeff;
+  double initialLearningRate;
+  double learningRate;
+  // Offsets of the sections, in bytes from the start of the file
+  unsigned long long offsetText;
+  unsigned long long offsetHiddenLayer;
+  unsigned long long offsetFeatureMatrix;
+  unsigned long long offsetWeights[c_numWeightBlocks];
+};
+
+
 /**
  * Main class storing the RNN model
  */
@@ -64,10 +126,25 @@ public:
         bool doLoadModel);
 
   /**
-   * Load the model.
+   * Load the model. Memory-mapped model files (see MappedModelHeader)
+   * are recognized and their weights are used in place, read-only.
    */
   void LoadRnnModelFromFile();
 
+  /**
+   * Are the weights used in place from a memory-mapped model file?
+   * They then exist only in single precision (m_weightsFloat),
+   * and the model can only be evaluated with the float32 engine.
+   */
+  bool IsModelMapped() const { return m_weightsFloat.IsMapped(); }
+
+  /**
+   * Quantize the direct n-gram connections of the weights used for
+   * inference, to save memory (see RnnWeightsT::QuantizeDirectNGram).
+   * The model cannot be trained or saved afterwards.
+   */
+  void QuantizeDirectNGram(DirectNGramPrecision precision);
+
   /**
    * Return the number of words/entity tokens in the vocabulary.
    */
@@ -117,6 +194,11 @@ public:
    */
   int GetNumClasses() const { return m_weights.GetNumClasses(); }
 
+  /**
+   * Return the filename of the model
+   */
+  const std::string &GetModelFilename() const { return m_rnnModelFile; }
+
 protected:
 
   /**
@@ -145,20 +227,209 @@ protected:
     return (1 / (1 + SafeExponentiate(-val)));
   }
 
+  /**
+   * Apply the logistic sigmoid function to a vector of values, in place.
+   * Same as LogisticSigmoid, but written as a simple loop over
+   * contiguous values, so that the exponentials are vectorized.
+   */
+  template <typename Scalar>
+  void LogisticSigmoidInPlace(Scalar *values, int size) const
+  {
+    for (int a = 0; a < size; a++) {
+      Scalar val = -values[a];
+      val = (val > 50) ? 50 : ((val < -50) ? -50 : val);
+      values[a] = 1 / (1 + std::exp(val));
+    }
+  }
+
+  /**
+   * Apply the softmax function to a vector of values, in place,
+   * exponentiating as SafeExponentiate does. The exponentials
+   * and their sum are computed in one vectorized pass
+   * (the sum is accumulated in double precision).
+   */
+  template <typename Scalar>
+  void SoftmaxInPlace(Scalar *values, int size) const
+  {
+    double sum = 0.0;
+    for (int a = 0; a < size; a++) {
+      Scalar val = values[a];
+      val = (val > 50) ? 50 : ((val < -50) ? -50 : val);
+      val = std::exp(val);
+      sum += val;
+      values[a] = val;
+    }
+    for (int a = 0; a < size; a++) {
+      values[a] /= sum;
+    }
+  }
+
   /**
    * Matrix-vector multiplication routine, somewhat accelerated using loop
    * unrolling over 8 registers. Computes y <- y + A * x, (i.e. adds A * x to y)
    * where A is of size N x M, x is of length M and y is of length N.
    * The operation can done on a contiguous subset of indices
-   * i in [idxYFrom, idxYTo[ of vector y
-   * and on a contiguous subset of indices j in [idxXFrom, idxXTo[ of vector x.
+   * i in [idxYFrom, idxYTo[ of vector y, whose results are stored
+   * in y starting at index idxYFirst (e.g., in a compact output layer).
    */
-  void MultiplyMatrixXvectorBlas(std::vector<double> &vectorY,
-                                 std::vector<double> &vectorX,
-                                 std::vector<double> &matrixA,
+  template <typename Scalar>
+  void MultiplyMatrixXvectorBlas(std::vector<Scalar> &vectorY,
+                                 const std::vector<Scalar> &vectorX,
+                                 const Scalar *matrixA,
                                  int widthMatrix,
                                  int idxYFrom,
-                                 int idxYTo) const;
+                                 int idxYTo,
+                                 int idxYFirst) const;
+
+  /**
+   * Matrix-matrix multiplication routine, the batched version of
+   * MultiplyMatrixXvectorBlas. Computes Y <- beta * Y + X * A',
+   * where A is of size N x M, X is of size B x M and Y is of size B x N,
+   * on a contiguous subset of rows i in [idxAFrom, idxATo[ of matrix A.
+   */
+  template <typename Scalar>
+  void MultiplyBatchXmatrixBlas(std::vector<Scalar> &matrixY,
+                                const std::vector<Scalar> &matrixX,
+                                const Scalar *matrixA,
+                                double beta,
+                                int numRows,
+                                int widthMatrix,
+                                int idxAFrom,
+                                int idxATo) const;
+
+  /**
+   * Copy the rows of a batch matrix that correspond to a group
+   * of sequences to the first rows of another matrix.
+   */
+  template <typename Scalar>
+  void GatherBatchRows(const std::vector<Scalar> &matrix,
+                       int width,
+                       const std::vector<int> &order,
+                       size_t idxFrom,
+                       int numRows,
+                       std::vector<Scalar> &rows) const;
+
+  /**
+   * Compute the starting indices, in the direct n-gram connections,
+   * of the n-grams of the word history, for the class outputs
+   * (targetClass = -1) or for the words of a target class.
+   */
+  void ComputeDirectNGramHashes(const int *wordHistory,
+                                int targetClass,
+                                unsigned long long *hash) const;
+
+  /**
+   * Add the direct n-gram connections, starting at the indices
+   * given by ComputeDirectNGramHashes, to a contiguous block of outputs
+   * (the classes, or the words of a target class if isWordBlock),
+   * or only prefetch the cache lines of those connections.
+   */
+  template <typename Scalar>
+  void PrefetchDirectNGramConnections(int size,
+                                      const unsigned long long *hash,
+                                      bool isWordBlock) const;
+  template <typename Scalar>
+  void AddDirectNGramConnections(Scalar *outputs,
+                                 int size,
+                                 const unsigned long long *hash,
+                                 bool isWordBlock) const;
+
+  /**
+   * Output kernel on a contiguous block of outputs, i.e., the classes
+   * (targetClass = -1) or the words of a target class, corresponding
+   * to the rows [idxFrom, idxTo[ of the output weights, using
+   * the n-gram context of the state. Computes:
+   * y = softmax(V * s(t) + G * f(t) + n-gram_connections)
+   * (or V * c(t) with a compression layer) into outputs[0, idxTo - idxFrom[.
+   */
+  template <typename Scalar>
+  void ComputeOutputBlock(const RnnStateT<Scalar> &state,
+                          int targetClass,
+                          int idxFrom,
+                          int idxTo,
+                          Scalar *outputs) const;
+
+  /**
+   * Return the weights used by the engine of a given precision:
+   * the model weights (double) or their single-precision copy (float).
+   */
+  template <typename Scalar>
+  const RnnWeightsT<Scalar> &GetWeights() const;
+
+  /**
+   * Kernels of the forward propagation, specialized at compile time
+   * on the configuration of the model: size of the hidden layer
+   * (SizeHidden, or 0 for any size), compression layer, use
+   * of the feature vectors (FeatureKernelMode) and direct n-gram
+   * connections, so that they do not test the configuration
+   * at every word and their loops over the hidden layer have
+   * a constant number of iterations. Same as ForwardPropagateOneStep,
+   * ComputeRnnOutputsForGivenClass and ComputeOutputBlock.
+   */
+  template <typename Scalar, int SizeHidden, bool HasCompress,
+            int FeatureMode, bool HasDirect>
+  void ForwardPropagateOneStepKernel(int lastWord,
+                                     int word,
+                                     RnnStateT<Scalar> &state);
+  template <typename Scalar, bool HasCompress, bool HasFeatures2Output,
+            bool HasDirect>
+  void ComputeRnnOutputsForGivenClassKernel(int targetClass,
+                                            RnnStateT<Scalar> &state) const;
+  template <typename Scalar, bool HasCompress, bool HasFeatures2Output,
+            bool HasDirect>
+  void ComputeOutputBlockKernel(const RnnStateT<Scalar> &state,
+                                int targetClass,
+                                int idxFrom,
+                                int idxTo,
+                                Scalar *outputs) const;
+
+  /**
+   * Output kernel on the sampled words of the target class of a training
+   * state (sampled softmax): computes the outputs of these words only,
+   * normalized over them after subtracting the logarithms of their
+   * expected numbers in the sample, i.e., for each sampled word w:
+   * y_w = softmax_w(V_w * s(t) + G_w * f(t) + n-gram_connections_w
+   *                 - log E[count(w)])
+   */
+  template <typename Scalar, bool HasCompress, bool HasFeatures2Output,
+            bool HasDirect>
+  void ComputeSampledOutputsKernel(int targetClass,
+                                   RnnStateT<Scalar> &state) const;
+
+  /**
+   * Type of the forward kernels of a given precision
+   */
+  template <typename Scalar>
+  struct ForwardKernel {
+    typedef void (RnnLM::*Type)(int, int, RnnStateT<Scalar> &);
+  };
+
+  /**
+   * Forward kernels of a given precision for a given size
+   * of the hidden layer, for the rest of the configuration
+   */
+  template <typename Scalar, int SizeHidden>
+  typename ForwardKernel<Scalar>::Type
+  SelectForwardKernel(bool hasCompress, int featureMode, bool hasDirect) const;
+
+  /**
+   * Return the forward kernel selected for the engine of a given precision
+   */
+  template <typename Scalar>
+  typename ForwardKernel<Scalar>::Type GetForwardKernel() const;
+
+  /**
+   * Use of the feature vectors by the model (FeatureKernelMode)
+   */
+  int GetFeatureKernelMode() const;
+
+  /**
+   * Select the kernels specialized on the configuration of the model,
+   * once it is initialized or loaded (and whenever it changes).
+   * The hidden layers of 50, 100, 200 and 300 units have their own
+   * kernels, and the other sizes share generic kernels.
+   */
+  virtual void SelectKernels();
 
 public:
 
@@ -172,6 +443,11 @@ public:
    */
   bool GoToDelimiterInFile(int delim, FILE *fi) const;
 
+  /**
+   * Load a memory-mapped model file, whose header was recognized.
+   */
+  void LoadMappedRnnModelFromFile(FILE *fi);
+
   /**
    * Function used to initialize the RNN model to the specified dimensions
    * of the layers and weight vectors. This is done at construction
@@ -179,6 +455,7 @@ public:
    * It is not thread safe yet because there is this file (m_featureMatrixFile)
    * that contains the topic model for the words (LDA-style, see the paper),
    * that is loaded by the function. It also modifies the vocabulary hash tables.
+   * The weights are not allocated if !doAllocateWeights.
    */
   bool InitializeRnnModel(int sizeInput,
                           int sizeHidden,
@@ -186,14 +463,16 @@ public:
                           int sizeClasses,
                           int sizeCompress,
                           long long sizeDirectConnection,
-                          int orderDirectConnection);
+                          int orderDirectConnection,
+                          bool doAllocateWeights = true);
 
   /**
    * Erase the hidden layer state and the word history.
    * Needed when processing sentences/queries in independent mode.
    * Updates the RnnState object.
    */
-  void ResetHiddenRnnStateAndWordHistory(RnnState &state) const;
+  template <typename Scalar>
+  void ResetHiddenRnnStateAndWordHistory(RnnStateT<Scalar> &state) const;
   void ResetHiddenRnnStateAndWordHistory(RnnState &state,
                                          RnnBptt &bpttState) const;
 
@@ -202,7 +481,8 @@ public:
    * Needed when processing sentences/queries in independent mode.
    * Updates the RnnState object.
    */
-  void ResetWordHistory(RnnState &state) const;
+  template <typename Scalar>
+  void ResetWordHistory(RnnStateT<Scalar> &state) const;
   void ResetWordHistory(RnnState &state,
                         RnnBptt &bpttState) const;
 
@@ -216,10 +496,12 @@ public:
    * x = V * s(t) + G * f(t) + n-gram_connections
    * y(t) = softmax_class(x) * softmax_word_given_class(x)
    * Updates the RnnState object (but not the weights).
+   * Calls the forward kernel selected for the configuration of the model.
    */
+  template <typename Scalar>
   void ForwardPropagateOneStep(int lastWord,
                                int word,
-                               RnnState &state);
+                               RnnStateT<Scalar> &state);
 
   /**
    * Given a target word class, compute the conditional distribution
@@ -230,19 +512,79 @@ public:
    * but for a specific targetClass.
    * Updates the RnnState object (but not the weights).
    */
+  template <typename Scalar>
   void ComputeRnnOutputsForGivenClass(const int targetClass,
-                                      RnnState &state);
+                                      RnnStateT<Scalar> &state);
+
+  /**
+   * Return the probability of a word (class probability times
+   * the probability of the word within its class), after
+   * ForwardPropagateOneStep was called on that word.
+   */
+  template <typename Scalar>
+  double GetWordProbability(const RnnStateT<Scalar> &state, int word) const;
+
+  /**
+   * Forward-propagate B independent sequences through one full step
+   * in lockstep: sequence b goes from lastWords[b] and its previous
+   * hidden state (row b of the batch) to the outputs for words[b].
+   * The hidden, compression and class output layers are computed with
+   * matrix-matrix products over the batch, and the word outputs with
+   * one product per group of sequences sharing the same target class.
+   * Updates the RnnBatchState object (but not the weights).
+   */
+  template <typename Scalar>
+  void ForwardPropagateBatch(const std::vector<int> &lastWords,
+                             const std::vector<int> &words,
+                             RnnBatchStateT<Scalar> &batch);
+
+  /**
+   * Return the probability of a word for one sequence of the batch,
+   * after ForwardPropagateBatch was called on that word.
+   */
+  template <typename Scalar>
+  double GetWordProbabilityInBatch(const RnnBatchStateT<Scalar> &batch,
+                                   int idxSequence,
+                                   int word) const;
+
+  /**
+   * Erase the hidden layer state and the word history
+   * of one sequence of the batch.
+   */
+  template <typename Scalar>
+  void ResetHiddenRnnStateAndWordHistory(RnnBatchStateT<Scalar> &batch,
+                                         int idxSequence) const;
+
+  /**
+   * Copies the hidden layer activations of the first numSequences
+   * sequences of the batch to their recurrent connections.
+   */
+  template <typename Scalar>
+  void ForwardPropagateRecurrentConnectionOnly(RnnBatchStateT<Scalar> &batch,
+                                               int numSequences) const;
+
+  /**
+   * Shift the word history of one sequence of the batch by one
+   * and update its last word.
+   */
+  template <typename Scalar>
+  void ForwardPropagateWordHistory(RnnBatchStateT<Scalar> &batch,
+                                   int idxSequence,
+                                   int &lastWord,
+                                   const int word) const;
 
   /**
    * Copies the hidden layer activation s(t) to the recurrent connections.
    * That copy will become s(t-1) at the next call of ForwardPropagateOneStep
    */
-  void ForwardPropagateRecurrentConnectionOnly(RnnState &state) const;
+  template <typename Scalar>
+  void ForwardPropagateRecurrentConnectionOnly(RnnStateT<Scalar> &state) const;
 
   /**
    * Shift the word history by one and update last word.
    */
-  void ForwardPropagateWordHistory(RnnState &state,
+  template <typename Scalar>
+  void ForwardPropagateWordHistory(RnnStateT<Scalar> &state,
                                    int &lastWord,
                                    const int word) const;
 
@@ -257,7 +599,9 @@ public:
    * be appropriate for short queries, since the topic feature
    * will be continuously reset.
    */
-  void UpdateFeatureVectorUsingTopicModel(int word, RnnState &state) const;
+  template <typename Scalar>
+  void UpdateFeatureVectorUsingTopicModel(int word,
+                                          RnnStateT<Scalar> &state) const;
 
   /**
    * This is currently unused, and we might not use topic model features at all.
@@ -273,6 +617,14 @@ public:
    */
   bool LoadTopicModelFeatureMatrix();
 
+  /**
+   * Update the single-precision copy of the weights used by
+   * the float32 engine (to be called when the weights have changed,
+   * or have been reallocated: the direct n-gram connections are used
+   * in place from the double-precision weights).
+   */
+  void UpdateSinglePrecisionWeights();
+
   // Simply copy the hidden activations and gradients, as well as
   // the word history, from one state object to another state object.
   void SaveHiddenRnnState(const RnnState &stateFrom,
@@ -299,10 +651,21 @@ public:
   // (e.g., NextWord). Of course, the training algorithm will change them.
   RnnWeights m_weights;
 
+  // Single-precision copy of the weights, used by the float32 engine
+  // (see UpdateSinglePrecisionWeights), which shares the direct n-gram
+  // connections of m_weights, or weights used in place
+  // from a memory-mapped model file.
+  RnnWeightsT<float> m_weightsFloat;
+
   // These BPTT data are not used when the RNN model is run,
   // only during training, but it was easier to store them here.
   RnnBptt m_bpttVectors;
 
+  // Forward kernels of the double- and single-precision engines,
+  // specialized on the configuration of the model (see SelectKernels)
+  ForwardKernel<double>::Type m_forwardKernel;
+  ForwardKernel<float>::Type m_forwardKernelFloat;
+
 protected:
 
   /**
@@ -327,6 +690,12 @@ protected:
   std::string m_rnnModelFile;
   int m_rnnModelVersion;
 
+  /**
+   * Mapping of a memory-mapped model file, shared read-only
+   * with the other processes that map the same file
+   */
+  MemoryMappedFile m_mappedModel;
+
   /**
    * Topic features
    */
@@ -341,7 +710,9 @@ protected:
    * This is used for the second way how to add features
    * into the RNN: only matrix W * T is specified,
    * where W = number of words (m_vocabSize)
-   * and T = number of topics (m_featureSize)
+   * and T = number of topics (m_featureSize),
+   * stored word by word so that the topics of a word are contiguous
+   * (the model files store it topic by topic)
    */
   std::vector<double> m_featureMatrix;
 
@@ -376,4 +747,42 @@ protected:
   bool m_areSentencesIndependent;
 };
 
+
+/**
+ * Weights used by the double-precision engine
+ */
+template <>
+inline const RnnWeightsT<double> &RnnLM::GetWeights<double>() const {
+  return m_weights;
+}
+
+
+/**
+ * Weights used by the single-precision engine
+ */
+template <>
+inline const RnnWeightsT<float> &RnnLM::GetWeights<float>() const {
+  return m_weightsFloat;
+}
+
+
+/**
+ * Forward kernel of the double-precision engine
+ */
+template <>
+inline RnnLM::ForwardKernel<double>::Type
+RnnLM::GetForwardKernel<double>() const {
+  return m_forwardKernel;
+}
+
+
+/**
+ * Forward kernel of the single-precision engine
+ */
+template <>
+inline RnnLM::ForwardKernel<float>::Type
+RnnLM::GetForwardKernel<float>() const {
+  return m_forwardKernelFloat;
+}
+
 #endif /* defined(__DependencyTreeRNN____rnnlmlib__) */
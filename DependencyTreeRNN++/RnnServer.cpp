@@ -0,0 +1,571 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Utils.h"
+#include "RnnServer.h"
+
+using namespace std;
+
+
+/**
+ * Skip white spaces
+ */
+static inline size_t SkipSpaces(const string &text, size_t p) {
+  while ((p < text.size()) &&
+         ((text[p] == ' ') || (text[p] == '\t') ||
+          (text[p] == '\r') || (text[p] == '\n'))) {
+    p++;
+  }
+  return p;
+}
+
+
+/**
+ * Find the end of the JSON value (string, number, literal,
+ * array or object) starting at position p;
+ * returns string::npos if the value is malformed.
+ */
+static size_t SkipJsonValue(const string &text, size_t p) {
+  p = SkipSpaces(text, p);
+  if (p >= text.size()) {
+    return string::npos;
+  }
+  int depth = 0;
+  bool isInString = false;
+  size_t start = p;
+  for (; p < text.size(); p++) {
+    char c = text[p];
+    if (isInString) {
+      if (c == '\\') {
+        p++;
+      } else if (c == '"') {
+        isInString = false;
+        if (depth == 0) {
+          return p + 1;
+        }
+      }
+    } else if (c == '"') {
+      isInString = true;
+    } else if ((c == '[') || (c == '{')) {
+      depth++;
+    } else if ((c == ']') || (c == '}')) {
+      if (depth == 0) {
+        // End of the enclosing array or object
+        return (p == start) ? string::npos : p;
+      }
+      if (--depth == 0) {
+        return p + 1;
+      }
+    } else if ((depth == 0) &&
+               ((c == ',') || (c == ' ') || (c == '\t') ||
+                (c == '\r') || (c == '\n'))) {
+      return p;
+    }
+  }
+  return ((depth == 0) && !isInString) ? p : string::npos;
+}
+
+
+/**
+ * Append a unicode code point to a string, in UTF-8
+ */
+static void AppendUtf8(unsigned int code, string &str) {
+  if (code < 0x80) {
+    str.push_back((char)code);
+  } else if (code < 0x800) {
+    str.push_back((char)(0xC0 | (code >> 6)));
+    str.push_back((char)(0x80 | (code & 0x3F)));
+  } else if (code < 0x10000) {
+    str.push_back((char)(0xE0 | (code >> 12)));
+    str.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+    str.push_back((char)(0x80 | (code & 0x3F)));
+  } else {
+    str.push_back((char)(0xF0 | (code >> 18)));
+    str.push_back((char)(0x80 | ((code >> 12) & 0x3F)));
+    str.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+    str.push_back((char)(0x80 | (code & 0x3F)));
+  }
+}
+
+
+/**
+ * Decode the JSON string between positions [begin, end[
+ * (including its quotes); returns false if it is malformed
+ */
+static bool DecodeJsonString(const string &text, size_t begin, size_t end,
+                             string &str) {
+  str.clear();
+  if ((end - begin < 2) || (text[begin] != '"') || (text[end - 1] != '"')) {
+    return false;
+  }
+  for (size_t p = begin + 1; p < end - 1; p++) {
+    if (text[p] != '\\') {
+      str.push_back(text[p]);
+      continue;
+    }
+    p++;
+    switch (text[p]) {
+      case 'b': str.push_back('\b'); break;
+      case 'f': str.push_back('\f'); break;
+      case 'n': str.push_back('\n'); break;
+      case 'r': str.push_back('\r'); break;
+      case 't': str.push_back('\t'); break;
+      case 'u': {
+        if (p + 4 >= end - 1) {
+          return false;
+        }
+        unsigned int code =
+        (unsigned int)strtoul(text.substr(p + 1, 4).c_str(), NULL, 16);
+        p += 4;
+        // Surrogate pair
+        if ((code >= 0xD800) && (code < 0xDC00) && (p + 6 < end - 1) &&
+            (text[p + 1] == '\\') && (text[p + 2] == 'u')) {
+          unsigned int low =
+          (unsigned int)strtoul(text.substr(p + 3, 4).c_str(), NULL, 16);
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          p += 6;
+        }
+        AppendUtf8(code, str);
+        break;
+      }
+      default: str.push_back(text[p]); break;
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Account for the latency (in milliseconds) of a request:
+ * bin k holds the latencies within [10^(k/100), 10^((k+1)/100)[
+ * microseconds (the first and last bins also hold the ones beyond)
+ */
+void LatencyHistogram::Add(double latency) {
+  int bin = 0;
+  if (latency > 0.001) {
+    bin = (int)(log10(latency / 0.001) * c_binsPerDecade);
+    bin = (bin < c_numBins) ? bin : (c_numBins - 1);
+  }
+  counts[bin]++;
+  numRequests++;
+  totalLatency += latency;
+  maxLatency = (latency > maxLatency) ? latency : maxLatency;
+}
+
+
+/**
+ * Latency of the request of a given rank (from 0, by increasing latency),
+ * at the upper end of its bin (but not beyond the largest latency)
+ */
+double LatencyHistogram::LatencyAt(long rank) const {
+  long numBelow = 0;
+  for (int bin = 0; bin < c_numBins; bin++) {
+    numBelow += counts[bin];
+    if (numBelow > rank) {
+      double latency = 0.001 * pow(10.0, (bin + 1) / (double)c_binsPerDecade);
+      return (latency < maxLatency) ? latency : maxLatency;
+    }
+  }
+  return maxLatency;
+}
+
+
+/**
+ * Constructor: the model must be loaded; the evaluation states
+ * of the threads are allocated once.
+ */
+RnnServer::RnnServer(RnnLMTraining &model,
+                     int numWorkers,
+                     int batchSize,
+                     int maxQueueSize)
+: m_model(model),
+m_numWorkers((numWorkers < 1) ? 1 : numWorkers),
+m_batchSize((batchSize < 1) ? 1 : batchSize),
+m_maxQueueSize((maxQueueSize < 1) ? 1 : maxQueueSize),
+m_isStopped(false), m_numErrors(0), m_numBatches(0),
+m_start(chrono::steady_clock::now()) {
+  // A client that disconnects makes the writes of its responses fail
+  // (instead of killing the server with SIGPIPE)
+  signal(SIGPIPE, SIG_IGN);
+  m_model.PrepareScoringWorkers(m_numWorkers);
+  for (int k = 0; k < m_numWorkers; k++) {
+    m_workers.push_back(thread(&RnnServer::RunWorker, this, k));
+  }
+  Log("Scoring server: " + ConvString(m_numWorkers) + " threads, batches of " +
+      ConvString(m_batchSize) + " requests, queue of " +
+      ConvString(m_maxQueueSize) + " requests\n");
+}
+
+
+/**
+ * Destructor: stop the threads of the server
+ * once the queued requests are scored
+ */
+RnnServer::~RnnServer() {
+  {
+    lock_guard<mutex> lock(m_queueMutex);
+    m_isStopped = true;
+  }
+  m_isQueueNotEmpty.notify_all();
+  for (size_t k = 0; k < m_workers.size(); k++) {
+    m_workers[k].join();
+  }
+}
+
+
+/**
+ * Keep the standard output for the responses of the server:
+ * returns a copy of it, and the logs go to the standard error instead.
+ */
+int RnnServer::DetachStandardOutput() {
+  cout << flush;
+  fflush(stdout);
+  int fdOutput = dup(STDOUT_FILENO);
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+  // The logs are not flushed by each call to Log(): write them line by line
+  setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+  return fdOutput;
+}
+
+
+/**
+ * Serve the requests read on a stream (e.g., standard input)
+ * until its end, and write the responses to another stream
+ */
+bool RnnServer::ServeStream(int fdInput, int fdOutput) {
+  FILE *input = fdopen(fdInput, "r");
+  FILE *output = fdopen(fdOutput, "w");
+  if ((input == NULL) || (output == NULL)) {
+    cerr << "Scoring server: cannot open the input or output stream\n";
+    return false;
+  }
+  ServerConnection connection(output);
+  ServeConnection(input, connection);
+  fclose(output);
+  LogLatencyStatistics();
+  return true;
+}
+
+
+/**
+ * Serve the requests of the clients connecting to a TCP port,
+ * each client read by its own thread (does not return unless
+ * the port cannot be opened)
+ */
+bool RnnServer::ServeSocket(int port) {
+  int fdSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (fdSocket < 0) {
+    cerr << "Scoring server: cannot create a socket\n";
+    return false;
+  }
+  int isReused = 1;
+  setsockopt(fdSocket, SOL_SOCKET, SO_REUSEADDR, &isReused, sizeof(isReused));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons((unsigned short)port);
+  if ((bind(fdSocket, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+      (listen(fdSocket, 64) < 0)) {
+    cerr << "Scoring server: cannot listen on port " << port << endl;
+    close(fdSocket);
+    return false;
+  }
+  Log("Scoring server listening on port " + ConvString(port) + "\n");
+
+  while (true) {
+    int fdClient = accept(fdSocket, NULL, NULL);
+    if (fdClient < 0) {
+      continue;
+    }
+    // Each client is read by its own thread, and its requests
+    // are batched with those of the other clients
+    thread([this, fdClient]() {
+      int fdOutput = dup(fdClient);
+      FILE *input = fdopen(fdClient, "r");
+      FILE *output = fdopen(fdOutput, "w");
+      if ((input != NULL) && (output != NULL)) {
+        ServerConnection connection(output);
+        ServeConnection(input, connection);
+        LogLatencyStatistics();
+      }
+      if (output != NULL) { fclose(output); } else { close(fdOutput); }
+      if (input != NULL) { fclose(input); } else { close(fdClient); }
+    }).detach();
+  }
+  return true;
+}
+
+
+/**
+ * Read the requests of a client, one per line, and queue them;
+ * returns when the client is done and all its requests are answered
+ */
+void RnnServer::ServeConnection(FILE *input, ServerConnection &connection) {
+  char *buffer = NULL;
+  size_t sizeBuffer = 0;
+  ssize_t length;
+  while ((length = getline(&buffer, &sizeBuffer, input)) >= 0) {
+    string line(buffer, length);
+    // Stop reading from a client which can no longer receive responses
+    {
+      lock_guard<mutex> lock(connection.mutex);
+      if (connection.isClosed) {
+        break;
+      }
+    }
+    if (SkipSpaces(line, 0) == line.size()) {
+      continue;
+    }
+    ScoringRequest *request = new ScoringRequest();
+    request->arrival = chrono::steady_clock::now();
+    request->connection = &connection;
+    // By default, the requests are identified by their line number
+    request->id = to_string(connection.numRequests);
+    connection.numRequests++;
+    {
+      lock_guard<mutex> lock(connection.mutex);
+      connection.numPending++;
+    }
+    if (ParseRequest(line, *request)) {
+      PushRequest(request);
+    } else {
+      SendResponse(*request);
+      delete request;
+    }
+  }
+  free(buffer);
+
+  // Wait for the responses to all the requests of the client
+  unique_lock<mutex> lock(connection.mutex);
+  connection.isIdle.wait(lock, [&connection]() {
+    return (connection.numPending == 0);
+  });
+}
+
+
+/**
+ * Parse a line of JSON into a request; returns false
+ * (with an error message) if the request is malformed.
+ * A request is an object with an optional "id" (any JSON value)
+ * and either a "sentence" (string) or "unrolls" (list of unrolls).
+ */
+bool RnnServer::ParseRequest(const string &line,
+                             ScoringRequest &request) const {
+  size_t p = SkipSpaces(line, 0);
+  if ((p >= line.size()) || (line[p] != '{')) {
+    request.error = "the request is not a JSON object";
+    return false;
+  }
+  p++;
+  bool hasSentence = false;
+  while (true) {
+    p = SkipSpaces(line, p);
+    if (p >= line.size()) {
+      request.error = "malformed JSON request";
+      return false;
+    }
+    if (line[p] == '}') {
+      break;
+    }
+    if (line[p] == ',') {
+      p++;
+      continue;
+    }
+    // Key
+    size_t endKey = SkipJsonValue(line, p);
+    string key;
+    if ((endKey == string::npos) || !DecodeJsonString(line, p, endKey, key)) {
+      request.error = "malformed JSON request";
+      return false;
+    }
+    p = SkipSpaces(line, endKey);
+    if ((p >= line.size()) || (line[p] != ':')) {
+      request.error = "malformed JSON request";
+      return false;
+    }
+    // Value
+    p = SkipSpaces(line, p + 1);
+    size_t endValue = SkipJsonValue(line, p);
+    if (endValue == string::npos) {
+      request.error = "malformed JSON request";
+      return false;
+    }
+    if (key == "id") {
+      request.id = line.substr(p, endValue - p);
+    } else if (key == "sentence") {
+      if (!DecodeJsonString(line, p, endValue, request.text)) {
+        request.error = "the sentence must be a JSON string";
+        return false;
+      }
+      hasSentence = true;
+    } else if (key == "unrolls") {
+      request.unrolls = line.substr(p, endValue - p);
+      hasSentence = true;
+    }
+    p = endValue;
+  }
+  if (!hasSentence) {
+    request.error = "the request has no sentence or unrolls";
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Queue a request, waiting while the queue is full
+ */
+void RnnServer::PushRequest(ScoringRequest *request) {
+  {
+    unique_lock<mutex> lock(m_queueMutex);
+    m_isQueueNotFull.wait(lock, [this]() {
+      return ((int)(m_queue.size()) < m_maxQueueSize);
+    });
+    m_queue.push_back(request);
+  }
+  m_isQueueNotEmpty.notify_one();
+}
+
+
+/**
+ * Take up to a batch of requests from the queue, waiting while
+ * it is empty. Returns false when the server stops.
+ */
+bool RnnServer::PopRequests(vector<ScoringRequest *> &requests) {
+  requests.clear();
+  {
+    unique_lock<mutex> lock(m_queueMutex);
+    m_isQueueNotEmpty.wait(lock, [this]() {
+      return (m_isStopped || !m_queue.empty());
+    });
+    if (m_queue.empty()) {
+      return false;
+    }
+    // Do not wait for the batch to be full: the requests queued
+    // while the threads are busy make up the next batches
+    while (!m_queue.empty() && ((int)(requests.size()) < m_batchSize)) {
+      requests.push_back(m_queue.front());
+      m_queue.pop_front();
+    }
+  }
+  m_isQueueNotFull.notify_all();
+  return true;
+}
+
+
+/**
+ * Thread of the server: score the batches of requests
+ */
+void RnnServer::RunWorker(int idxWorker) {
+  vector<ScoringRequest *> requests;
+  while (PopRequests(requests)) {
+    m_model.ScoreRequests(requests, idxWorker);
+    {
+      lock_guard<mutex> lock(m_statsMutex);
+      m_numBatches++;
+    }
+    for (size_t k = 0; k < requests.size(); k++) {
+      SendResponse(*(requests[k]));
+      delete requests[k];
+    }
+  }
+}
+
+
+/**
+ * Write the response to a request on its connection,
+ * and account for its latency
+ */
+void RnnServer::SendResponse(ScoringRequest &request) {
+  double latency =
+  chrono::duration<double, milli>(chrono::steady_clock::now()
+                                  - request.arrival).count();
+  char buffer[256];
+  string response = "{\"id\": " + request.id;
+  if (request.error.empty()) {
+    const SentenceEvaluation &evaluation = request.evaluation;
+    double logProbability = 0.0;
+    for (size_t k = 0; k < evaluation.logProbabilities.size(); k++) {
+      logProbability += evaluation.logProbabilities[k];
+    }
+    snprintf(buffer, sizeof(buffer),
+             ", \"logprob\": %.6f, \"words\": %d, \"unk\": %ld"
+             ", \"latency_ms\": %.3f}\n",
+             logProbability, (int)(evaluation.logProbabilities.size()),
+             evaluation.numUnk, latency);
+  } else {
+    snprintf(buffer, sizeof(buffer),
+             ", \"error\": \"%s\", \"latency_ms\": %.3f}\n",
+             request.error.c_str(), latency);
+  }
+  response += buffer;
+
+  {
+    lock_guard<mutex> lock(m_statsMutex);
+    m_latencies.Add(latency);
+    if (!request.error.empty()) {
+      m_numErrors++;
+    }
+  }
+  ServerConnection &connection = *(request.connection);
+  lock_guard<mutex> lock(connection.mutex);
+  if (!connection.isClosed &&
+      ((fputs(response.c_str(), connection.output) < 0) ||
+       (fflush(connection.output) != 0))) {
+    connection.isClosed = true;
+    Log("Scoring server: cannot write to the client, "
+        "dropping its remaining responses\n");
+  }
+  if (--connection.numPending == 0) {
+    connection.isIdle.notify_all();
+  }
+}
+
+
+/**
+ * Log the number of requests and statistics of their latency
+ */
+void RnnServer::LogLatencyStatistics() {
+  LatencyHistogram latencies;
+  long numErrors, numBatches;
+  {
+    lock_guard<mutex> lock(m_statsMutex);
+    latencies = m_latencies;
+    numErrors = m_numErrors;
+    numBatches = m_numBatches;
+  }
+  double duration =
+  chrono::duration<double>(chrono::steady_clock::now() - m_start).count();
+  long n = latencies.numRequests;
+  if (n == 0) {
+    Log("Scoring server: no requests\n");
+    return;
+  }
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer),
+           "Scoring server: %ld requests (%ld errors) in %ld batches, "
+           "%.1f requests/s; latency (ms): mean %.3f, median %.3f, "
+           "90%% %.3f, 99%% %.3f, max %.3f\n",
+           n, numErrors, numBatches,
+           (duration > 0) ? (n / duration) : 0.0, latencies.totalLatency / n,
+           latencies.LatencyAt(n / 2),
+           latencies.LatencyAt((long)(0.9 * (n - 1))),
+           latencies.LatencyAt((long)(0.99 * (n - 1))), latencies.maxLatency);
+  Log(buffer);
+}
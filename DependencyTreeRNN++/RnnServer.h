@@ -0,0 +1,192 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___RnnServer_h
+#define DependencyTreeRNN___RnnServer_h
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "RnnTraining.h"
+
+
+/**
+ * Client of the scoring server: the responses to its requests
+ * are written, one per line, as soon as they are scored
+ */
+struct ServerConnection {
+  ServerConnection(FILE *out)
+  : output(out), isClosed(false), numPending(0), numRequests(0) { }
+
+  // Stream of the responses, shared by the threads of the server,
+  // and has a write failed (e.g., the client disconnected)?
+  // The responses of a closed connection are dropped.
+  FILE *output;
+  bool isClosed;
+  std::mutex mutex;
+  // Number of requests still being scored, and signal when there are none
+  int numPending;
+  std::condition_variable isIdle;
+  // Number of requests read on that connection
+  long numRequests;
+};
+
+
+/**
+ * Statistics of the latency of the requests, in a histogram
+ * of logarithmic bins (100 per decade from 1 microsecond), so that
+ * their memory and the cost of a report do not grow with the number
+ * of requests; the percentiles are exact within a bin (2.3%).
+ */
+struct LatencyHistogram {
+  LatencyHistogram()
+  : counts(c_numBins, 0), numRequests(0), totalLatency(0), maxLatency(0) { }
+
+  /**
+   * Account for the latency (in milliseconds) of a request
+   */
+  void Add(double latency);
+
+  /**
+   * Latency of the request of a given rank (from 0, by increasing latency),
+   * at the upper end of its bin
+   */
+  double LatencyAt(long rank) const;
+
+  static const int c_binsPerDecade = 100;
+  static const int c_numBins = 1000;
+
+  std::vector<long> counts;
+  long numRequests;
+  double totalLatency;
+  double maxLatency;
+};
+
+
+/**
+ * Long-lived scoring server: the model is loaded once and then scores
+ * sentences (or the unrolls of dependency parse trees) sent as
+ * line-delimited JSON requests, e.g.:
+ *   {"id": 7, "sentence": "the cat sat on the mat"}
+ *   {"id": 8, "unrolls": [[[0, "cat", 1, "ROOT"], ...], ...]}
+ * Each response is a line of JSON with the log10-probability
+ * of the sentence (ending with </s>) and the latency of the request:
+ *   {"id": 7, "logprob": -12.3456, "words": 7, "unk": 0, "latency_ms": 1.2}
+ * The requests of all the clients go through a bounded queue;
+ * each thread of the server takes up to a batch of requests at a time,
+ * which are forward-propagated together.
+ */
+class RnnServer {
+public:
+
+  /**
+   * Constructor: the model must be loaded; the evaluation states
+   * of the threads are allocated once.
+   */
+  RnnServer(RnnLMTraining &model,
+            int numWorkers,
+            int batchSize,
+            int maxQueueSize);
+
+  /**
+   * Destructor: stop the threads of the server
+   */
+  ~RnnServer();
+
+  /**
+   * Serve the requests read on a stream (e.g., standard input)
+   * until its end, and write the responses to another stream
+   */
+  bool ServeStream(int fdInput, int fdOutput);
+
+  /**
+   * Serve the requests of the clients connecting to a TCP port,
+   * each client read by its own thread (does not return unless
+   * the port cannot be opened)
+   */
+  bool ServeSocket(int port);
+
+  /**
+   * Log the number of requests and statistics of their latency
+   */
+  void LogLatencyStatistics();
+
+  /**
+   * Keep the standard output for the responses of the server:
+   * returns a copy of it, and the logs go to the standard error instead.
+   */
+  static int DetachStandardOutput();
+
+protected:
+
+  /**
+   * Read the requests of a client, one per line, and queue them;
+   * returns when the client is done and all its requests are answered
+   */
+  void ServeConnection(FILE *input, ServerConnection &connection);
+
+  /**
+   * Parse a line of JSON into a request; returns false
+   * (with an error message) if the request is malformed
+   */
+  bool ParseRequest(const std::string &line,
+                    ScoringRequest &request) const;
+
+  /**
+   * Queue a request, waiting while the queue is full
+   */
+  void PushRequest(ScoringRequest *request);
+
+  /**
+   * Take up to a batch of requests from the queue, waiting while
+   * it is empty. Returns false when the server stops.
+   */
+  bool PopRequests(std::vector<ScoringRequest *> &requests);
+
+  /**
+   * Thread of the server: score the batches of requests
+   */
+  void RunWorker(int idxWorker);
+
+  /**
+   * Write the response to a request on its connection,
+   * and account for its latency
+   */
+  void SendResponse(ScoringRequest &request);
+
+  // Model scoring the requests
+  RnnLMTraining &m_model;
+
+  // Number of threads, requests taken per batch and queued requests
+  int m_numWorkers;
+  int m_batchSize;
+  int m_maxQueueSize;
+
+  // Bounded queue of requests
+  std::deque<ScoringRequest *> m_queue;
+  std::mutex m_queueMutex;
+  std::condition_variable m_isQueueNotFull;
+  std::condition_variable m_isQueueNotEmpty;
+  bool m_isStopped;
+
+  // Threads scoring the requests
+  std::vector<std::thread> m_workers;
+
+  // Latency of the requests (in milliseconds), number of errors,
+  // number of batches and time at which the server started
+  std::mutex m_statsMutex;
+  LatencyHistogram m_latencies;
+  long m_numErrors;
+  long m_numBatches;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+#endif
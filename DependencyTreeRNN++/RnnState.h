@@ -49,77 +49,170 @@ const int c_maxNGramOrder = 20;
 
 
 /**
- * State vectors in the RNN model, storing per-word and per-class activations
+ * N-gram context of the current time step: the starting indices,
+ * in the direct n-gram connections, of the n-grams of the word history,
+ * for the class outputs and for the words of the target class
+ * (0 for the orders that are not used). It is computed once per step
+ * by the forward propagation and reused by the backpropagation.
  */
-class RnnState {
+struct NGramContext {
+  unsigned long long classHashes[c_maxNGramOrder];
+  unsigned long long wordHashes[c_maxNGramOrder];
+};
+
+
+/**
+ * State vectors in the RNN model, storing per-word and per-class activations.
+ * The input word w(t) is one-hot, so it is simply given by its index
+ * (the last word) and never stored as a vector. By default, the state
+ * is an inference-only state: the output layer stores the outputs of the
+ * classes followed by those of the words in the current target class,
+ * and there are no gradients. AllocateTrainingBuffers turns it into
+ * a training state, with gradients and an output layer over the whole
+ * vocabulary (words first, then classes).
+ * The activations are stored as doubles (RnnState) or as floats,
+ * for the single-precision engine.
+ */
+template <typename Scalar>
+class RnnStateT {
 public:
 
   /**
    * Constructor
    */
-  RnnState(int sizeVocabulary,
-           int sizeHidden,
-           int sizeFeature,
-           int sizeClasses,
-           int sizeCompress,
-           long long sizeDirectConnection,
-           int orderDirectConnection)
-  : m_orderDirectConnection(orderDirectConnection) {
-    int sizeInput = sizeVocabulary;
-    int sizeOutput = sizeVocabulary + sizeClasses;
+  RnnStateT(int sizeVocabulary,
+            int sizeHidden,
+            int sizeFeature,
+            int sizeClasses,
+            int sizeCompress,
+            long long sizeDirectConnection,
+            int orderDirectConnection)
+  : m_orderDirectConnection(orderDirectConnection),
+  m_sizeVocabulary(sizeVocabulary), m_sizeClasses(sizeClasses),
+  m_isTrainingState(false), m_wordOutputShift(0) {
     WordHistory.assign(c_maxNGramOrder, 0);
-    InputLayer.assign(sizeInput, 0.0);
-    InputGradient.assign(sizeInput, 0.0);
     RecurrentLayer.assign(sizeHidden, 0.0);
-    RecurrentGradient.assign(sizeHidden, 0.0);
     HiddenLayer.assign(sizeHidden, 0.0);
-    HiddenGradient.assign(sizeHidden, 0.0);
     FeatureLayer.assign(sizeFeature, 0.0);
-    FeatureGradient.assign(sizeFeature, 0.0);
-    OutputLayer.assign(sizeOutput, 0.0);
-    OutputGradient.assign(sizeOutput, 0.0);
+    OutputLayer.assign(sizeClasses, 0.0);
     CompressLayer.assign(sizeCompress, 0.0);
-    CompressGradient.assign(sizeCompress, 0.0);
+    NGrams = NGramContext();
+  }
+
+  /**
+   * Conversion from a state of another precision
+   * (only the activations are converted, into an inference-only state)
+   */
+  template <typename OtherScalar>
+  explicit RnnStateT(const RnnStateT<OtherScalar> &other)
+  : FeatureLayer(other.FeatureLayer.begin(), other.FeatureLayer.end()),
+  RecurrentLayer(other.RecurrentLayer.begin(), other.RecurrentLayer.end()),
+  HiddenLayer(other.HiddenLayer.begin(), other.HiddenLayer.end()),
+  CompressLayer(other.CompressLayer.begin(), other.CompressLayer.end()),
+  OutputLayer(other.GetNumClasses(), 0.0),
+  WordHistory(other.WordHistory),
+  NGrams(other.NGrams),
+  m_orderDirectConnection(other.GetOrderDirectConnection()),
+  m_sizeVocabulary(other.GetInputSize()),
+  m_sizeClasses(other.GetNumClasses()),
+  m_isTrainingState(false), m_wordOutputShift(0) {
   }
 
-  // Input layer (i.e., words)
-  std::vector<double> InputLayer;
   // Input feature layer (e.g., topics)
-  std::vector<double> FeatureLayer;
+  std::vector<Scalar> FeatureLayer;
   // Hidden layer at previous time step
-  std::vector<double> RecurrentLayer;
+  std::vector<Scalar> RecurrentLayer;
   // Hidden layer
-  std::vector<double> HiddenLayer;
+  std::vector<Scalar> HiddenLayer;
   // Second (compression) hidden layer
-  std::vector<double> CompressLayer;
+  std::vector<Scalar> CompressLayer;
   // Output layer
-  std::vector<double> OutputLayer;
+  std::vector<Scalar> OutputLayer;
 
-  // Gradient to the words in input layer
-  std::vector<double> InputGradient;
-  // Gradient to the features in input layer
-  std::vector<double> FeatureGradient;
   // Gradient to the hidden state at previous time step
-  std::vector<double> RecurrentGradient;
+  std::vector<Scalar> RecurrentGradient;
   // Gradient to the hidden layer
-  std::vector<double> HiddenGradient;
+  std::vector<Scalar> HiddenGradient;
   // Gradient to the second (compression) hidden layer
-  std::vector<double> CompressGradient;
+  std::vector<Scalar> CompressGradient;
   // Gradient to the output layer
-  std::vector<double> OutputGradient;
+  std::vector<Scalar> OutputGradient;
 
   // Word history
   std::vector<int> WordHistory;
 
+  // Direct n-gram connections used at the current time step
+  NGramContext NGrams;
+
+  // Words of the target class whose outputs are computed when
+  // training with a sampled softmax (the target word, then the
+  // sampled words), and the logarithm of their expected number
+  // in the sample; empty for the exact softmax
+  std::vector<int> SampledWords;
+  std::vector<Scalar> SampledLogCounts;
+
 
   /**
-   * Return the number of units in the input (word) layer.
+   * Allocate the gradients and the output layer over the whole
+   * vocabulary, which are needed to train the RNN.
+   */
+  void AllocateTrainingBuffers() {
+    if (m_isTrainingState) {
+      return;
+    }
+    int sizeOutput = GetOutputSize();
+    m_isTrainingState = true;
+    m_wordOutputShift = 0;
+    OutputLayer.assign(sizeOutput, 0.0);
+    RecurrentGradient.assign(GetHiddenSize(), 0.0);
+    HiddenGradient.assign(GetHiddenSize(), 0.0);
+    CompressGradient.assign(GetCompressSize(), 0.0);
+    OutputGradient.assign(sizeOutput, 0.0);
+  }
+
+
+  /**
+   * Is this a training state (with gradients)?
+   */
+  bool IsTrainingState() const { return m_isTrainingState; }
+
+
+  /**
+   * Return the index in the output layer of the output of a class.
+   */
+  int ClassOutputIndex(int wordClass) const {
+    return m_isTrainingState ? (m_sizeVocabulary + wordClass) : wordClass;
+  }
+
+
+  /**
+   * Return the index in the output layer of the output of a word
+   * in the current target class.
    */
-  int GetInputSize() const {
-    return static_cast<int>(InputLayer.size());
+  int WordOutputIndex(int word) const { return word + m_wordOutputShift; }
+
+
+  /**
+   * Make room in the output layer for the words of a new target class,
+   * given its first word and its number of words.
+   */
+  void SetTargetClassOutputs(int firstWord, int numWords) {
+    if (m_isTrainingState) {
+      return;
+    }
+    m_wordOutputShift = m_sizeClasses - firstWord;
+    if (static_cast<int>(OutputLayer.size()) < m_sizeClasses + numWords) {
+      OutputLayer.resize(m_sizeClasses + numWords, 0.0);
+    }
   }
 
 
+  /**
+   * Return the number of units in the input (word) layer.
+   */
+  int GetInputSize() const { return m_sizeVocabulary; }
+
+
   /**
    * Return the number of units in the input (word) layer.
    */
@@ -145,11 +238,16 @@ public:
 
 
   /**
-   * Return the number of units in the output layer.
+   * Return the number of units in the output layer
+   * (in a training state).
    */
-  int GetOutputSize() const {
-    return static_cast<int>(OutputLayer.size());
-  }
+  int GetOutputSize() const { return m_sizeVocabulary + m_sizeClasses; }
+
+
+  /**
+   * Return the number of word classes.
+   */
+  int GetNumClasses() const { return m_sizeClasses; }
 
 
   /**
@@ -159,21 +257,182 @@ public:
 
 protected:
   int m_orderDirectConnection;
+  // Number of words and classes
+  int m_sizeVocabulary;
+  int m_sizeClasses;
+  // Does the state have gradients and all the outputs?
+  bool m_isTrainingState;
+  // Shift between the index of a word in the current target class
+  // and the index of its output
+  int m_wordOutputShift;
+};
+typedef RnnStateT<double> RnnState;
+
+
+/**
+ * State matrices of B sequences that are forward-propagated in lockstep
+ * by the RNN model: each row of a matrix stores the activations of one
+ * sequence, so that the products with the weights are matrix-matrix
+ * products. Only the outputs of the target class of each sequence
+ * are stored (the classes are assumed to be contiguous in the vocabulary).
+ */
+template <typename Scalar>
+class RnnBatchStateT {
+public:
+
+  /**
+   * Constructor
+   */
+  RnnBatchStateT(int maxNumSequences,
+                 int sizeHidden,
+                 int sizeFeature,
+                 int sizeClasses,
+                 int sizeCompress,
+                 int sizeMaxClass)
+  : m_maxNumSequences(maxNumSequences), m_sizeHidden(sizeHidden),
+  m_sizeFeature(sizeFeature), m_sizeClasses(sizeClasses),
+  m_sizeCompress(sizeCompress), m_sizeMaxClass(sizeMaxClass) {
+    WordHistory.assign(maxNumSequences * c_maxNGramOrder, 0);
+    FeatureLayer.assign(maxNumSequences * sizeFeature, 0.0);
+    RecurrentLayer.assign(maxNumSequences * sizeHidden, 0.0);
+    HiddenLayer.assign(maxNumSequences * sizeHidden, 0.0);
+    CompressLayer.assign(maxNumSequences * sizeCompress, 0.0);
+    ClassLayer.assign(maxNumSequences * sizeClasses, 0.0);
+    WordLayer.assign(maxNumSequences * sizeMaxClass, 0.0);
+    TargetClass.assign(maxNumSequences, 0);
+    GroupedSequences.reserve(maxNumSequences);
+    int sizeInputs = std::max(std::max(sizeHidden, sizeCompress), sizeFeature);
+    GroupedInputs.assign(maxNumSequences * sizeInputs, 0.0);
+    GroupedOutputs.assign(maxNumSequences * sizeMaxClass, 0.0);
+  }
+
+  // Input feature layer (e.g., topics), B x F
+  std::vector<Scalar> FeatureLayer;
+  // Hidden layer at previous time step, B x H
+  std::vector<Scalar> RecurrentLayer;
+  // Hidden layer, B x H
+  std::vector<Scalar> HiddenLayer;
+  // Second (compression) hidden layer, B x C
+  std::vector<Scalar> CompressLayer;
+  // Output layer over the classes, B x number of classes
+  std::vector<Scalar> ClassLayer;
+  // Output layer over the words of the target class
+  // of each sequence, B x size of the largest class
+  std::vector<Scalar> WordLayer;
+  // Target class of each sequence
+  std::vector<int> TargetClass;
+  // Word history, B x c_maxNGramOrder
+  std::vector<int> WordHistory;
+
+  // Sequences sorted by target class, and inputs and word outputs
+  // of a group of sequences sharing the same target class
+  std::vector<int> GroupedSequences;
+  std::vector<Scalar> GroupedInputs;
+  std::vector<Scalar> GroupedOutputs;
+
+
+  /**
+   * Return the maximum number of sequences in the batch.
+   */
+  int MaxNumSequences() const { return m_maxNumSequences; }
+
+
+  /**
+   * Return the number of units in the hidden layer.
+   */
+  int GetHiddenSize() const { return m_sizeHidden; }
+
+
+  /**
+   * Return the number of units in the feature (e.g., topic) layer.
+   */
+  int GetFeatureSize() const { return m_sizeFeature; }
+
+
+  /**
+   * Return the number of units in the optional hidden compression layer.
+   */
+  int GetCompressSize() const { return m_sizeCompress; }
+
+
+  /**
+   * Return the number of word classes.
+   */
+  int GetNumClasses() const { return m_sizeClasses; }
+
+
+  /**
+   * Return the number of word outputs stored per sequence.
+   */
+  int GetMaxClassSize() const { return m_sizeMaxClass; }
+
+
+  /**
+   * Copy the state of one sequence to another row of the batch
+   * (used to keep the active sequences in the first rows).
+   */
+  void MoveSequence(int idxFrom, int idxTo) {
+    CopyRow(WordHistory, c_maxNGramOrder, idxFrom, idxTo);
+    CopyRow(FeatureLayer, m_sizeFeature, idxFrom, idxTo);
+    CopyRow(RecurrentLayer, m_sizeHidden, idxFrom, idxTo);
+    CopyRow(HiddenLayer, m_sizeHidden, idxFrom, idxTo);
+    CopyRow(CompressLayer, m_sizeCompress, idxFrom, idxTo);
+    CopyRow(ClassLayer, m_sizeClasses, idxFrom, idxTo);
+    CopyRow(WordLayer, m_sizeMaxClass, idxFrom, idxTo);
+    TargetClass[idxTo] = TargetClass[idxFrom];
+  }
+
+protected:
+
+  /**
+   * Copy one row of a matrix to another row.
+   */
+  template <typename T>
+  static void CopyRow(std::vector<T> &matrix, int width,
+                      int idxFrom, int idxTo) {
+    std::copy(matrix.begin() + idxFrom * width,
+              matrix.begin() + (idxFrom + 1) * width,
+              matrix.begin() + idxTo * width);
+  }
+
+  // Maximum number of sequences
+  int m_maxNumSequences;
+  // Number of hidden nodes
+  int m_sizeHidden;
+  // Number of features
+  int m_sizeFeature;
+  // Number of classes
+  int m_sizeClasses;
+  // Number of compression nodes
+  int m_sizeCompress;
+  // Size of the largest word class
+  int m_sizeMaxClass;
 };
+typedef RnnBatchStateT<double> RnnBatchState;
 
 
-class RnnBptt {
+/**
+ * Memory of the last steps of the RNN, for back-propagation through time.
+ * It is a circular buffer: step 0 is the current time step, step 1
+ * the previous one, etc. Moving to the next time step only moves the head
+ * of the buffer, instead of shifting the whole history.
+ */
+template <typename Scalar>
+class RnnBpttT {
 public:
 
   /**
    * Constructor
    */
-  RnnBptt(int sizeVocabulary, int sizeHidden, int sizeFeature,
-          int numBpttSteps, int bpttBlockSize)
+  RnnBpttT(int sizeVocabulary, int sizeHidden, int sizeFeature,
+           int numBpttSteps, int bpttBlockSize)
   : m_bpttSteps(numBpttSteps), m_bpttBlock(bpttBlockSize),
-  m_sizeHidden(sizeHidden), m_sizeFeature(sizeFeature),
-  m_steps(0) {
-    Reset();
+  m_steps(0), m_sizeHidden(sizeHidden), m_sizeFeature(sizeFeature),
+  m_capacity(std::max(numBpttSteps + bpttBlockSize, 1)), m_head(0) {
+    History.assign(m_capacity, -1);
+    FeatureLayer.assign(m_capacity * m_sizeFeature, 0);
+    HiddenLayer.assign(m_capacity * m_sizeHidden, 0);
+    HiddenGradient.assign(m_capacity * m_sizeHidden, 0);
     WeightsInput2Hidden.assign(sizeVocabulary * sizeHidden, 0);
     WeightsRecurrent2Hidden.assign(sizeHidden * sizeHidden, 0);
     WeightsFeature2Hidden.assign(sizeFeature * sizeHidden, 0);
@@ -187,45 +446,33 @@ public:
 
 
   /**
-   * Reset the BPTT memory
+   * Reset the BPTT memory (without reallocating it)
    */
   void Reset() {
     m_steps = 0;
-    History.assign(m_bpttSteps + m_bpttBlock + 10, -1);
-    FeatureLayer.assign((m_bpttSteps + m_bpttBlock + 2) * m_sizeFeature, 0);
-    HiddenLayer.assign((m_bpttSteps + m_bpttBlock + 1) * m_sizeHidden, 0);
-    HiddenGradient.assign((m_bpttSteps + m_bpttBlock + 1) * m_sizeHidden, 0);
+    m_head = 0;
+    std::fill(History.begin(), History.end(), -1);
+    std::fill(FeatureLayer.begin(), FeatureLayer.end(), 0);
+    std::fill(HiddenLayer.begin(), HiddenLayer.end(), 0);
+    std::fill(HiddenGradient.begin(), HiddenGradient.end(), 0);
   }
 
 
   /**
-   * Shift the BPTT memory by one
+   * Move the BPTT memory to the next time step: the previous steps
+   * are now one step further in the past, and the current step
+   * starts as a copy of the previous one, with the last word
    */
   void Shift(int lastWord) {
     if (m_bpttSteps > 0) {
-      // Shift the history of words
-      for (int a = m_bpttSteps + m_bpttBlock - 1; a > 0; a--) {
-        History[a] = History[a - 1];
-      }
-      History[0] = lastWord;
-
-      // Shift the history of hidden layer activations
-      for (int a = m_bpttSteps + m_bpttBlock - 1; a > 0; a--) {
-        for (int b = 0; b < m_sizeHidden; b++) {
-          HiddenLayer[a * m_sizeHidden + b] =
-          HiddenLayer[(a - 1) * m_sizeHidden + b];
-          HiddenGradient[a * m_sizeHidden + b] =
-          HiddenGradient[(a - 1) * m_sizeHidden + b];
-        }
-      }
-
-      // Shift the history of feature activations
-      for (int a = m_bpttSteps + m_bpttBlock - 1; a > 0; a--) {
-        for (int b = 0; b < m_sizeFeature; b++) {
-          FeatureLayer[a * m_sizeFeature + b] =
-          FeatureLayer[(a - 1) * m_sizeFeature + b];
-        }
-      }
+      m_head = (m_head + m_capacity - 1) % m_capacity;
+      WordAt(0) = lastWord;
+      std::copy(HiddenLayerAt(1), HiddenLayerAt(1) + m_sizeHidden,
+                HiddenLayerAt(0));
+      std::copy(HiddenGradientAt(1), HiddenGradientAt(1) + m_sizeHidden,
+                HiddenGradientAt(0));
+      std::copy(FeatureLayerAt(1), FeatureLayerAt(1) + m_sizeFeature,
+                FeatureLayerAt(0));
     }
     // Keep track of the number of that can be considered for BPTT
     m_steps++;
@@ -233,21 +480,44 @@ public:
   }
 
 
+  /**
+   * Word, hidden layer activations and gradients, and features
+   * at a given number of steps in the past (0 is the current step)
+   */
+  int &WordAt(int step) { return History[Slot(step)]; }
+  Scalar *HiddenLayerAt(int step) {
+    return &HiddenLayer[Slot(step) * m_sizeHidden];
+  }
+  Scalar *HiddenGradientAt(int step) {
+    return &HiddenGradient[Slot(step) * m_sizeHidden];
+  }
+  Scalar *FeatureLayerAt(int step) {
+    return &FeatureLayer[Slot(step) * m_sizeFeature];
+  }
+
+
+  // Gradients to the weights, to be added to the SGD gradients
+  std::vector<Scalar> WeightsInput2Hidden;
+  std::vector<Scalar> WeightsRecurrent2Hidden;
+  std::vector<Scalar> WeightsFeature2Hidden;
+
+
+protected:
+
+  /**
+   * Slot of the circular buffer storing a given step in the past
+   */
+  int Slot(int step) const { return (m_head + step) % m_capacity; }
+
   // Word history
   std::vector<int> History;
   // History of feature inputs
-  std::vector<double> FeatureLayer;
+  std::vector<Scalar> FeatureLayer;
   // History of hidden layer inputs
-  std::vector<double> HiddenLayer;
+  std::vector<Scalar> HiddenLayer;
   // History of gradients to the hidden layer
-  std::vector<double> HiddenGradient;
-  // Gradients to the weights, to be added to the SGD gradients
-  std::vector<double> WeightsInput2Hidden;
-  std::vector<double> WeightsRecurrent2Hidden;
-  std::vector<double> WeightsFeature2Hidden;
-
+  std::vector<Scalar> HiddenGradient;
 
-protected:
   // Number of steps gradients are back-propagated through time
   int m_bpttSteps;
   // How many steps (words) do we wait between consecutive BPTT?
@@ -258,6 +528,10 @@ protected:
   int m_sizeHidden;
   // Number of features
   int m_sizeFeature;
+  // Number of steps stored in the circular buffer, and slot of step 0
+  int m_capacity;
+  int m_head;
 };
+typedef RnnBpttT<double> RnnBptt;
 
 #endif
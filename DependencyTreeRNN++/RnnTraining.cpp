@@ -41,19 +41,20 @@
 #include <sstream>
 #include <fstream>
 #include <climits>
+#include <atomic>
+#include <mutex>
 
 #include <math.h>
 #include <time.h>
 #include <assert.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "Utils.h"
 #include "RnnLib.h"
 #include "RnnState.h"
 #include "RnnTraining.h"
 #include "CorpusWordReader.h"
-// Include BLAS
-extern "C" {
-#include <cblas.h>
-}
+#include "Blas.h"
 
 using namespace std;
 
@@ -74,6 +75,26 @@ int RnnLMTraining::ReadWordIndexFromFile(WordReader &reader) {
 }
 
 
+/**
+ * Assign the words of the vocabulary to classes (frequency-based
+ * or cost-optimal) and print the expected cost of the softmax
+ * per word token; with cost-optimal classes, also suggest
+ * the number of classes minimizing that cost.
+ */
+void RnnLMTraining::AssignWordsToClasses() {
+  m_vocab.SetCostOptimalClasses(m_useCostOptimalClasses);
+  m_vocab.AssignWordsToClasses();
+  printf("Expected softmax cost per word: %.1f\n",
+         m_vocab.ExpectedSoftmaxCost());
+  if (m_useCostOptimalClasses) {
+    double cost = 0;
+    int numClasses = m_vocab.SuggestNumClasses(&cost);
+    printf("Suggested number of classes: %d (expected cost %.1f)\n",
+           numClasses, cost);
+  }
+}
+
+
 /**
  * Before learning the RNN model, we need to learn the vocabulary
  * from the corpus. Note that the word classes may have been initialized
@@ -116,15 +137,15 @@ bool RnnLMTraining::LearnVocabularyFromTrainFile(int numClasses) {
   // Filter out words with fewer than specified mininum number of occurrences
   // and replace them by <unk>
   for (int k = 0; k < vocab.GetVocabularySize(); k++) {
-    int count = vocab.m_vocabularyStorage[k].cn;
+    int count = vocab.GetWordCount(k);
     if (count >= m_minWordOccurrences) {
-      string word = vocab.m_vocabularyStorage[k].word;
+      string word = vocab.GetNthWord(k);
       m_vocab.AddWordToVocabulary(word);
       m_vocab.SetWordCount(word, count);
     } else {
       m_vocab.AddWordToVocabulary("<unk>");
       m_oov = m_vocab.SearchWordInVocabulary("<unk>");
-      int prevCount = m_vocab.m_vocabularyStorage[m_oov].cn;
+      int prevCount = m_vocab.GetWordCount(m_oov);
       m_vocab.SetWordCount("<unk>", prevCount + count);
     }
   }
@@ -132,7 +153,7 @@ bool RnnLMTraining::LearnVocabularyFromTrainFile(int numClasses) {
   // Simply sort the words by frequency, making sure that </s> is first
   m_vocab.SortVocabularyByFrequency();
   // Assign the words to classes
-  m_vocab.AssignWordsToClasses();
+  AssignWordsToClasses();
 
   // Note the <unk> (OOV) tag
   m_oov = m_vocab.SearchWordInVocabulary("<unk>");
@@ -149,9 +170,23 @@ bool RnnLMTraining::LearnVocabularyFromTrainFile(int numClasses) {
  * Once we train the RNN model, it is nice to save it to a text or binary file
  */
 bool RnnLMTraining::SaveRnnModelToFile() {
-  FILE *fo = fopen(m_rnnModelFile.c_str(), "wb");
+  return SaveRnnModelToFile(m_rnnModelFile, CurrentTrainingProgress(),
+                            m_weights, m_state.HiddenLayer);
+}
+
+
+/**
+ * Save the RNN model, with given training progress, weights
+ * and hidden layer, to a temporary file that is then renamed
+ */
+bool RnnLMTraining::SaveRnnModelToFile(const string &filename,
+                                       const TrainingProgress &progress,
+                                       const RnnWeights &weights,
+                                       const vector<double> &hiddenLayer) {
+  string tmpFilename = filename + ".tmp";
+  FILE *fo = fopen(tmpFilename.c_str(), "wb");
   if (fo == NULL) {
-    printf("Cannot create file %s\n", m_rnnModelFile.c_str());
+    printf("Cannot create file %s\n", tmpFilename.c_str());
     return false;
   }
   fprintf(fo, "version: %d\n", m_rnnModelVersion);
@@ -161,9 +196,10 @@ bool RnnLMTraining::SaveRnnModelToFile() {
   fprintf(fo, "validation data file: %s\n\n", m_validationFile.c_str());
   
   fprintf(fo, "last probability of validation data: %f\n", 0.0);
-  fprintf(fo, "number of finished iterations: %d\n", m_iteration);
+  fprintf(fo, "number of finished iterations: %d\n", progress.iteration);
   
-  fprintf(fo, "current position in training data: %ld\n", m_currentPosTrainFile);
+  fprintf(fo, "current position in training data: %ld\n",
+          progress.currentPosTrainFile);
   fprintf(fo, "current probability of training data: %f\n", 0.0);
   // dummy used for backward compatibility
   int anti_k = 0;
@@ -197,8 +233,9 @@ bool RnnLMTraining::SaveRnnModelToFile() {
           m_areSentencesIndependent ? 1 : 0);
   
   fprintf(fo, "starting learning rate: %f\n", m_initialLearningRate);
-  fprintf(fo, "current learning rate: %f\n", m_learningRate);
-  fprintf(fo, "learning rate decrease: %d\n", m_doStartReducingLearningRate);
+  fprintf(fo, "current learning rate: %f\n", progress.learningRate);
+  fprintf(fo, "learning rate decrease: %d\n",
+          progress.doStartReducingLearningRate);
   fprintf(fo, "\n");
   
   // Save the vocabulary, one word per line
@@ -207,32 +244,229 @@ bool RnnLMTraining::SaveRnnModelToFile() {
 
   int sizeHidden = GetHiddenSize();
   printf("Saving %d hidden activations...\n", sizeHidden);
-  SaveBinaryVector(fo, sizeHidden, m_state.HiddenLayer);
+  SaveBinaryVector(fo, sizeHidden, hiddenLayer);
 
   // Save all the weights
-  m_weights.Save(fo);
+  weights.Save(fo);
 
   // Save the feature matrix
   if (m_featureMatrixUsed) {
     int sizeFeature = GetFeatureSize();
     printf("Saving %dx%d feature matrix...\n", sizeFeature, sizeVocabulary);
-    SaveBinaryMatrix(fo, sizeFeature, sizeVocabulary, m_featureMatrix);
+    // The matrix is stored word by word, and saved topic by topic
+    vector<double> featureMatrixInFile;
+    TransposeMatrix(&m_featureMatrix[0], sizeVocabulary, sizeFeature,
+                    featureMatrixInFile);
+    SaveBinaryMatrix(fo, sizeVocabulary, sizeFeature, featureMatrixInFile);
+  }
+
+  // Make sure that the file is complete on disk before replacing the model
+  bool isSaved = (fflush(fo) == 0) && (fsync(fileno(fo)) == 0);
+  isSaved = (fclose(fo) == 0) && isSaved;
+  isSaved = isSaved && (rename(tmpFilename.c_str(), filename.c_str()) == 0);
+  if (!isSaved) {
+    printf("Cannot write file %s\n", filename.c_str());
   }
-  fclose(fo);
+  return isSaved;
+}
+
 
+/**
+ * Copy the weights, the hidden layer and the progress of the training,
+ * and save them in a background thread while the training goes on.
+ * The copy of the weights is freed once it is saved.
+ */
+bool RnnLMTraining::SaveSnapshotInBackground(bool isBestModel,
+                                             const string &checkpointPosition,
+                                             bool isOptional) {
+  if (isOptional && m_isSnapshotSaving) {
+    return false;
+  }
+  WaitForSnapshot();
+  // Copying the weights is much faster than writing them,
+  // which is done by the background thread. The optional snapshots
+  // are taken by a training thread, while the other threads keep
+  // updating the weights: the background thread copies them too,
+  // so that this training thread goes on at once.
+  bool isCopiedInBackground = isOptional;
+  if (!isCopiedInBackground) {
+    m_snapshotWeights = m_weights;
+  }
+  m_snapshotHiddenLayer = m_state.HiddenLayer;
+  m_snapshotProgress = CurrentTrainingProgress();
+  m_isSnapshotSaving = true;
+  m_snapshotThread = thread([this, isBestModel, checkpointPosition,
+                             isCopiedInBackground]() {
+    if (isCopiedInBackground) {
+      m_snapshotWeights = m_weights;
+    }
+    if (isBestModel) {
+      SaveRnnModelToFile(m_rnnModelFile, m_snapshotProgress,
+                         m_snapshotWeights, m_snapshotHiddenLayer);
+      SaveWordEmbeddings(m_rnnModelFile + ".word_embeddings.txt",
+                         m_snapshotWeights);
+    }
+    if (!checkpointPosition.empty()) {
+      // The position of the trainer is written once the checkpoint
+      // model is complete, and identifies it by its progress
+      string filename = CheckpointFilename();
+      string tmpFilename = filename + ".txt.tmp";
+      if (SaveRnnModelToFile(filename, m_snapshotProgress,
+                             m_snapshotWeights, m_snapshotHiddenLayer)) {
+        FILE *fo = fopen(tmpFilename.c_str(), "w");
+        bool isSaved = (fo != NULL) &&
+        (fputs(checkpointPosition.c_str(), fo) >= 0) &&
+        (fflush(fo) == 0) && (fsync(fileno(fo)) == 0);
+        isSaved = (fo != NULL) && (fclose(fo) == 0) && isSaved;
+        isSaved = isSaved &&
+        (rename(tmpFilename.c_str(), (filename + ".txt").c_str()) == 0);
+        if (!isSaved) {
+          printf("Cannot write file %s.txt\n", filename.c_str());
+        }
+      }
+    }
+    // Free the copy of the weights until the next snapshot
+    m_snapshotWeights = RnnWeights(1, 1, 0, 1, 0, 0, false);
+    m_isSnapshotSaving = false;
+  });
   return true;
 }
 
 
+/**
+ * Remove the checkpoint files, once the training is over
+ */
+void RnnLMTraining::RemoveCheckpoint() const {
+  string filename = CheckpointFilename();
+  remove(filename.c_str());
+  remove((filename + ".txt").c_str());
+}
+
+
+/**
+ * Append a row to the profile of the training, if it is enabled
+ */
+void RnnLMTraining::LogProfile(const string &progress,
+                               double wordsPerSecond) const {
+  if (!Profiler::IsEnabled()) {
+    return;
+  }
+  string filename = m_rnnModelFile + ".profile.csv";
+  LogWriter::Instance().Append(filename,
+                               Profiler::Instance().FormatRow(filename,
+                                                              m_iteration,
+                                                              progress,
+                                                              SecondsSince(m_trainingStart),
+                                                              wordsPerSecond));
+}
+
+
+/**
+ * Save the RNN model to a memory-mapped model file: binary header,
+ * text section with the vocabulary, then aligned blocks of floats
+ */
+bool RnnLMTraining::SaveMappedRnnModelToFile(const string &filename) {
+  FILE *fo = fopen(filename.c_str(), "wb");
+  if (fo == NULL) {
+    printf("Cannot create file %s\n", filename.c_str());
+    return false;
+  }
+  MappedModelHeader header = MappedModelHeader();
+  memcpy(header.magic, c_mappedModelMagic, sizeof(header.magic));
+  header.version = c_mappedModelVersion;
+  header.sizeVocabulary = GetVocabularySize();
+  header.sizeHidden = GetHiddenSize();
+  header.sizeFeature = GetFeatureSize();
+  header.sizeClasses = GetNumClasses();
+  header.sizeCompress = GetCompressSize();
+  header.orderDirectConnection = GetOrderDirectConnection();
+  header.numBpttSteps = m_numBpttSteps;
+  header.bpttBlockSize = m_bpttBlockSize;
+  header.iteration = m_iteration;
+  header.featureMatrixUsed = m_featureMatrixUsed ? 1 : 0;
+  header.usesClassFile = m_usesClassFile ? 1 : 0;
+  header.areSentencesIndependent = m_areSentencesIndependent ? 1 : 0;
+  header.doStartReducingLearningRate = m_doStartReducingLearningRate ? 1 : 0;
+  header.sizeDirectConnection = GetNumDirectConnection();
+  header.numTrainWords = m_numTrainWords;
+  header.currentPosTrainFile = m_currentPosTrainFile;
+  header.featureGammaCoeff = m_featureGammaCoeff;
+  header.initialLearningRate = m_initialLearningRate;
+  header.learningRate = m_learningRate;
+
+  // The header is written again once the offsets of the sections are known
+  bool isSaved = (fwrite(&header, sizeof(header), 1, fo) == 1);
+
+  // Save the file names and the vocabulary, one word per line
+  header.offsetText = ftell(fo);
+  fprintf(fo, "training data file: %s\n", m_trainFile.c_str());
+  fprintf(fo, "validation data file: %s\n", m_validationFile.c_str());
+  m_vocab.Save(fo);
+
+  // Save the hidden activations, the weights and the feature matrix
+  long long offset = SaveAlignedBinaryBlock(fo, GetHiddenSize(),
+                                            &m_state.HiddenLayer[0],
+                                            c_weightBlockAlignment);
+  isSaved = isSaved && (offset >= 0);
+  header.offsetHiddenLayer = offset;
+  printf("Saving the weights in %d-byte aligned blocks...\n",
+         c_weightBlockAlignment);
+  if (IsModelMapped()) {
+    isSaved = isSaved && m_weightsFloat.SaveAligned(fo, header.offsetWeights);
+  } else {
+    isSaved = isSaved && m_weights.SaveAligned(fo, header.offsetWeights);
+  }
+  if (m_featureMatrixUsed) {
+    // The matrix is stored word by word, and saved topic by topic
+    vector<double> featureMatrixInFile;
+    TransposeMatrix(&m_featureMatrix[0], GetVocabularySize(), GetFeatureSize(),
+                    featureMatrixInFile);
+    offset = SaveAlignedBinaryBlock(fo,
+                                    (long long)GetFeatureSize() *
+                                    GetVocabularySize(),
+                                    &featureMatrixInFile[0],
+                                    c_weightBlockAlignment);
+    isSaved = isSaved && (offset >= 0);
+    header.offsetFeatureMatrix = offset;
+  }
+  isSaved = isSaved && (AlignFilePosition(fo, c_weightBlockAlignment) >= 0);
+
+  // Save the complete header
+  isSaved = isSaved && (fseek(fo, 0, SEEK_SET) == 0) &&
+  (fwrite(&header, sizeof(header), 1, fo) == 1);
+  isSaved = (fclose(fo) == 0) && isSaved;
+  if (!isSaved) {
+    printf("Cannot write file %s\n", filename.c_str());
+  }
+  return isSaved;
+}
+
+
+/**
+ * Convert the RNN model to the other file format
+ */
+bool RnnLMTraining::ConvertRnnModelFile(const string &filename) {
+  if (!IsModelMapped()) {
+    printf("Saving memory-mapped model to %s...\n", filename.c_str());
+    return SaveMappedRnnModelToFile(filename);
+  }
+  // Copy the mapped weights to the double-precision weights
+  printf("Saving model to %s...\n", filename.c_str());
+  m_weights = RnnWeights(m_weightsFloat);
+  m_rnnModelFile = filename;
+  return SaveRnnModelToFile();
+}
+
+
 /**
  * Cleans all activations and error vectors, in the input, hidden,
  * compression, feature and output layers, and resets word history
  */
 void RnnLMTraining::ResetAllRnnActivations(RnnState &state) const {
-  // Completely reset the input layer and its gradients
-  state.InputLayer.assign(GetInputSize(), 0.0);
-  state.InputGradient.assign(GetInputSize(), 0.0);
-  
+  // The one-hot input layer is given by the last word,
+  // and the gradients are reset only in a training state
+  bool isTrainingState = state.IsTrainingState();
+
   // Set hidden unit activations to 1.0
   // then the hidden layer to the input (i.e., recurrent connection)
   // Reset the word history
@@ -248,16 +482,20 @@ void RnnLMTraining::ResetAllRnnActivations(RnnState &state) const {
   // Reset the hidden layer again, this time to 0
   // TODO: could function ResetHiddenRnnStateAndWordHistory do that?
   state.HiddenLayer.assign(GetHiddenSize(), 0.0);
-  state.HiddenGradient.assign(GetHiddenSize(), 0.0);
   
-  // Reset the compression layer and its gradients
+  // Reset the compression layer
   // TODO: could function ResetHiddenRnnStateAndWordHistory do that?
   state.CompressLayer.assign(GetCompressSize(), 0.0);
-  state.CompressGradient.assign(GetCompressSize(), 0.0);
   
-  // Reset the output layer and its gradients
-  state.OutputLayer.assign(GetOutputSize(), 0.0);
-  state.OutputGradient.assign(GetOutputSize(), 0.0);
+  // Reset the output layer
+  state.OutputLayer.assign(state.OutputLayer.size(), 0.0);
+
+  // Reset the gradients
+  if (isTrainingState) {
+    state.HiddenGradient.assign(GetHiddenSize(), 0.0);
+    state.CompressGradient.assign(GetCompressSize(), 0.0);
+    state.OutputGradient.assign(GetOutputSize(), 0.0);
+  }
   
   // Reset the vector of feature vectors
   state.FeatureLayer.assign(GetFeatureSize(), 0.0);
@@ -266,27 +504,274 @@ void RnnLMTraining::ResetAllRnnActivations(RnnState &state) const {
 
 /**
  * One step of backpropagation of the errors through the RNN
- * (optionally, backpropagation through time, BPTT) and of gradient descent.
+ * and of gradient descent, using the kernel selected
+ * for the configuration of the model (see SelectKernels).
+ * With a sampled softmax, the words sampled for the forward step
+ * are then discarded, so that the state computes all the outputs.
  */
 void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWord,
-                                                                  int word) {
-  // No learning step if OOV word
+                                                                  int word,
+                                                                  double learningRate,
+                                                                  long wordCounter,
+                                                                  RnnState &state,
+                                                                  RnnBptt &bpttState) {
+  (this->*m_backwardKernel)(contextWord, word, learningRate, wordCounter,
+                            state, bpttState);
+  // The sampled words (if any) are only used by the forward
+  // and backward steps of that word
+  state.SampledWords.clear();
+  state.SampledLogCounts.clear();
+}
+
+
+/**
+ * Backpropagation of the errors of the outputs of one step
+ * and gradient descent on the output weights, using the kernel
+ * selected for the configuration of the model (see SelectKernels).
+ * The gradient w.r.t. the hidden layer is left in the state
+ * (it is zero for an OOV word), and the sampled words are discarded.
+ */
+void RnnLMTraining::BackPropagateOutputErrors(int word,
+                                              double learningRate,
+                                              long wordCounter,
+                                              RnnState &state) {
   if (word == -1) {
-    return;
+    state.HiddenGradient.assign(GetHiddenSize(), 0);
+  } else {
+    ScopedTimer timer(c_profileBackward);
+    (this->*m_outputBackwardKernel)(word, learningRate, wordCounter, state);
   }
-  
+  state.SampledWords.clear();
+  state.SampledLogCounts.clear();
+}
+
+
+/**
+ * Backpropagation through time over the tree of the unrolls of a sentence.
+ * The nodes are visited in reverse order, so that each step has received
+ * the gradients of all its descendants before sending them to its parent.
+ * The gradients are kept by distance to the step that sent them,
+ * so that they go back through at most as many steps as with BPTT
+ * (one step without BPTT). The column of the input word is updated
+ * at each step, the recurrent and feature weights once per tree,
+ * with the regularization of all the steps.
+ */
+void RnnLMTraining::BackPropagateThroughUnrollTree(UnrollTree &tree,
+                                                   double learningRate,
+                                                   RnnBptt &bpttState) {
+  ScopedTimer timer(c_profileBptt);
+
   // Learning rates, with and without regularization
-  double beta = m_regularizationRate * m_learningRate;
-  double alpha = m_learningRate;
-  // Regularization is done every 10th step
-  double coeffSGD = ((m_wordCounter % 10) == 0) ? (1.0 - beta) : 1.0;
-  
+  double beta = m_regularizationRate * learningRate;
+  double alpha = learningRate;
+
   // Matrix sizes
   int sizeInput = GetInputSize();
   int sizeFeature = GetFeatureSize();
-  int sizeOutput = GetOutputSize();
   int sizeHidden = GetHiddenSize();
-  int sizeCompress = GetCompressSize();
+
+  int numSteps = max(m_numBpttSteps, 1);
+  int numRegularizations = 0;
+  vector<double> gradient(sizeHidden);
+  vector<double> sumGradients(sizeHidden);
+  for (int k = tree.NumNodes() - 1; k > tree.Root(); k--) {
+    UnrollTree::Node &node = tree.GetNode(k);
+    UnrollTree::Node &parent = tree.GetNode(node.parent);
+
+    // Gradient w.r.t. the hidden layer, for each distance
+    // to the steps that sent it, and sent back to the parent step
+    sumGradients.assign(sizeHidden, 0);
+    for (int distance = 0; distance < node.numGradients; distance++) {
+      vector<double> &nodeGradient = node.gradients[distance];
+      for (int a = 0; a < sizeHidden; a++) {
+        double dLdSa = node.hidden[a];
+        gradient[a] = nodeGradient[a] * dLdSa * (1 - dLdSa);
+        sumGradients[a] += gradient[a];
+      }
+      if ((distance + 1 < numSteps) && (node.parent != tree.Root())) {
+        GradientMatrixXvectorBlas(tree.GetGradient(node.parent, distance + 1,
+                                                   sizeHidden),
+                                  gradient,
+                                  m_weights.Recurrent2Hidden,
+                                  sizeHidden,
+                                  0,
+                                  sizeHidden);
+      }
+    }
+
+    // Regularization is done every 10th step (not on OOV words)
+    bool isRegularized =
+    (node.targetWord != -1) && ((node.wordCounter % 10) == 0);
+    double coeffSGD = isRegularized ? (1.0 - beta) : 1.0;
+    if (isRegularized) {
+      numRegularizations++;
+    }
+
+    // Backprop and weight update hidden -> input
+    // (the input is one-hot: only the column of the input word changes)
+    int a = node.inputWord;
+    if (a != -1) {
+      for (int b = 0; b < sizeHidden; b++) {
+        int idx = a + b * sizeInput;
+        m_weights.Input2Hidden[idx] =
+        alpha * sumGradients[b] + coeffSGD * m_weights.Input2Hidden[idx];
+      }
+    }
+
+    // Backprop hidden -> recurrent and hidden -> feature,
+    // accumulated over the tree
+    MultiplyMatrixXmatrixBlas(sumGradients,
+                              parent.hidden,
+                              bpttState.WeightsRecurrent2Hidden,
+                              alpha,
+                              1.0,
+                              sizeHidden,
+                              1,
+                              sizeHidden,
+                              0,
+                              sizeHidden);
+    if (sizeFeature > 0) {
+      MultiplyMatrixXmatrixBlas(sumGradients,
+                                node.feature,
+                                bpttState.WeightsFeature2Hidden,
+                                alpha,
+                                1.0,
+                                sizeHidden,
+                                1,
+                                sizeFeature,
+                                0,
+                                sizeHidden);
+    }
+  }
+
+  // Weight update for recurrent and feature-hidden weights,
+  // using the gradients accumulated over the tree
+  double coeffSGD = pow(1.0 - beta, numRegularizations);
+  AddMatrixToMatrixBlas(bpttState.WeightsRecurrent2Hidden,
+                        m_weights.Recurrent2Hidden,
+                        1.0,
+                        coeffSGD,
+                        sizeHidden,
+                        sizeHidden);
+  bpttState.WeightsRecurrent2Hidden.assign(sizeHidden * sizeHidden, 0);
+  if (sizeFeature > 0) {
+    AddMatrixToMatrixBlas(bpttState.WeightsFeature2Hidden,
+                          m_weights.Features2Hidden,
+                          1.0,
+                          coeffSGD,
+                          sizeHidden,
+                          sizeFeature);
+    bpttState.WeightsFeature2Hidden.assign(sizeHidden * sizeFeature, 0);
+  }
+}
+
+
+/**
+ * Backward kernel for a given size of the hidden layer (0 for any size),
+ * for the rest of the configuration of the model and the use of BPTT
+ */
+template <int SizeHidden>
+RnnLMTraining::BackwardKernel
+RnnLMTraining::SelectBackwardKernel(bool hasCompress,
+                                    int featureMode,
+                                    bool hasDirect,
+                                    bool hasBptt) const {
+#define BACKWARD_KERNELS(compress, features) \
+{{&RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescentKernel<SizeHidden, compress, features, false, false>, \
+  &RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescentKernel<SizeHidden, compress, features, false, true>}, \
+ {&RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescentKernel<SizeHidden, compress, features, true, false>, \
+  &RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescentKernel<SizeHidden, compress, features, true, true>}}
+  static const BackwardKernel kernels[2][c_numFeatureKernelModes][2][2] = {
+    {BACKWARD_KERNELS(false, c_kernelNoFeatures),
+     BACKWARD_KERNELS(false, c_kernelFeatures2Hidden),
+     BACKWARD_KERNELS(false, c_kernelFeatures2HiddenAndOutput)},
+    {BACKWARD_KERNELS(true, c_kernelNoFeatures),
+     BACKWARD_KERNELS(true, c_kernelFeatures2Hidden),
+     BACKWARD_KERNELS(true, c_kernelFeatures2HiddenAndOutput)}
+  };
+#undef BACKWARD_KERNELS
+  return kernels[hasCompress][featureMode][hasDirect][hasBptt];
+}
+
+
+/**
+ * Output backward kernel for a given size of the hidden layer
+ * (0 for any size), for the rest of the configuration of the model
+ */
+template <int SizeHidden>
+RnnLMTraining::OutputBackwardKernel
+RnnLMTraining::SelectOutputBackwardKernel(bool hasCompress,
+                                          int featureMode,
+                                          bool hasDirect) const {
+#define OUTPUT_BACKWARD_KERNELS(compress, features) \
+{&RnnLMTraining::BackPropagateOutputErrorsKernel<SizeHidden, compress, features, false>, \
+ &RnnLMTraining::BackPropagateOutputErrorsKernel<SizeHidden, compress, features, true>}
+  static const OutputBackwardKernel kernels[2][c_numFeatureKernelModes][2] = {
+    {OUTPUT_BACKWARD_KERNELS(false, c_kernelNoFeatures),
+     OUTPUT_BACKWARD_KERNELS(false, c_kernelFeatures2Hidden),
+     OUTPUT_BACKWARD_KERNELS(false, c_kernelFeatures2HiddenAndOutput)},
+    {OUTPUT_BACKWARD_KERNELS(true, c_kernelNoFeatures),
+     OUTPUT_BACKWARD_KERNELS(true, c_kernelFeatures2Hidden),
+     OUTPUT_BACKWARD_KERNELS(true, c_kernelFeatures2HiddenAndOutput)}
+  };
+#undef OUTPUT_BACKWARD_KERNELS
+  return kernels[hasCompress][featureMode][hasDirect];
+}
+
+
+/**
+ * Select the forward kernels, then the backward kernels
+ * specialized on the configuration of the model and the use of BPTT
+ */
+void RnnLMTraining::SelectKernels() {
+  RnnLM::SelectKernels();
+  bool hasCompress = (GetCompressSize() > 0);
+  int featureMode = GetFeatureKernelMode();
+  bool hasDirect = (GetNumDirectConnection() > 0);
+  bool hasBptt = (m_numBpttSteps > 1);
+#define SELECT_BACKWARD_KERNEL(sizeHidden) \
+m_backwardKernel = SelectBackwardKernel<sizeHidden>(hasCompress, featureMode, \
+                                                    hasDirect, hasBptt); \
+m_outputBackwardKernel = \
+SelectOutputBackwardKernel<sizeHidden>(hasCompress, featureMode, hasDirect);
+  switch (GetHiddenSize()) {
+    case 50: SELECT_BACKWARD_KERNEL(50); break;
+    case 100: SELECT_BACKWARD_KERNEL(100); break;
+    case 200: SELECT_BACKWARD_KERNEL(200); break;
+    case 300: SELECT_BACKWARD_KERNEL(300); break;
+    default: SELECT_BACKWARD_KERNEL(0); break;
+  }
+#undef SELECT_BACKWARD_KERNEL
+}
+
+
+/**
+ * Backpropagation of the errors of the outputs of one step
+ * and gradient descent on the output weights (and on the direct
+ * n-gram connections), down to the gradient w.r.t. the hidden layer,
+ * which is left in the state.
+ * The weights are updated in place (without locks),
+ * so that several threads can train the same model (Hogwild).
+ * The configuration of the model is given by the template parameters:
+ * the size of the hidden layer is a constant unless SizeHidden is 0.
+ */
+template <int SizeHidden, bool HasCompress, int FeatureMode, bool HasDirect>
+void RnnLMTraining::BackPropagateOutputErrorsKernel(int word,
+                                                    double learningRate,
+                                                    long wordCounter,
+                                                    RnnState &state) {
+  // Learning rates, with and without regularization
+  double beta = m_regularizationRate * learningRate;
+  double alpha = learningRate;
+  // Regularization is done every 10th step
+  double coeffSGD = ((wordCounter % 10) == 0) ? (1.0 - beta) : 1.0;
+  
+  // Matrix sizes
+  const int sizeFeature =
+  (FeatureMode != c_kernelNoFeatures) ? GetFeatureSize() : 0;
+  int sizeOutput = GetOutputSize();
+  const int sizeHidden = (SizeHidden > 0) ? SizeHidden : GetHiddenSize();
+  const int sizeCompress = HasCompress ? GetCompressSize() : 0;
   int sizeVocabulary = GetVocabularySize();
   int sizeDirectConnection = GetNumDirectConnection();
   int orderDirectConnection = GetOrderDirectConnection();
@@ -297,6 +782,10 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
   int idxWordClass = m_vocab.GetNthWordInClass(targetClass, 0);
   // Number of words in that class
   int numWordsInClass = m_vocab.SizeTargetClass(targetClass);
+  // With a sampled softmax, only the sampled words of the class
+  // have outputs, and only their weights are updated
+  bool isSampled = !state.SampledWords.empty();
+  int numSampled = static_cast<int>(state.SampledWords.size());
 
   // Backprop starts with computing the error vectors (gradients w.r.t. loss)
   // for the words in the vocabulary, i.e.,
@@ -308,47 +797,74 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
   // diff(log P(word_i)) / diff(Output_k) = diff(Output(word_i)) / diff(Output_k)
   //   - diff(log sum_j exp(Output(word_j))) / diff(Output_k)
   // 1) Backprop on words within the target class
-  for (int c = 0; c < numWordsInClass; c++) {
-    int a = m_vocab.GetNthWordInClass(targetClass, c);
-    m_state.OutputGradient[a] = (0 - m_state.OutputLayer[a]);
+  // (or on the sampled words, with a sampled softmax)
+  if (isSampled) {
+    for (int k = 0; k < numSampled; k++) {
+      int a = state.SampledWords[k];
+      state.OutputGradient[a] = (0 - state.OutputLayer[a]);
+    }
+  } else {
+    for (int c = 0; c < numWordsInClass; c++) {
+      int a = m_vocab.GetNthWordInClass(targetClass, c);
+      state.OutputGradient[a] = (0 - state.OutputLayer[a]);
+    }
   }
-  m_state.OutputGradient[word] = (1 - m_state.OutputLayer[word]);
+  state.OutputGradient[word] = (1 - state.OutputLayer[word]);
   
   // 2) Backprop on all classes
   for (int a = sizeVocabulary; a < sizeOutput; a++) {
-    m_state.OutputGradient[a] = (0 - m_state.OutputLayer[a]);
+    state.OutputGradient[a] = (0 - state.OutputLayer[a]);
   }
   int wordClassIdx = targetClass + sizeVocabulary;
-  m_state.OutputGradient[wordClassIdx] = (1 - m_state.OutputLayer[wordClassIdx]);
+  state.OutputGradient[wordClassIdx] = (1 - state.OutputLayer[wordClassIdx]);
   
   // Reset gradients on hidden layers
-  m_state.HiddenGradient.assign(sizeHidden, 0);
-  m_state.CompressGradient.assign(sizeCompress, 0);
+  state.HiddenGradient.assign(sizeHidden, 0);
+  state.CompressGradient.assign(sizeCompress, 0);
   
+  // Blocks of direct connections updated since the last averaging
+  // of the weights of the nodes of a cluster (if any)
+  unsigned char *touchedBlocks =
+  m_directNGramTouched.empty() ? NULL : &m_directNGramTouched[0];
+
   // learn direct connections between words
-  if (sizeDirectConnection > 0) {
-    if (word != -1) {
-      unsigned long long hash[c_maxNGramOrder];
-      for (int a = 0; a < orderDirectConnection; a++) {
-        hash[a] = 0;
-      }
-      for (int a = 0; a < orderDirectConnection; a++) {
-        int b = 0;
-        if ((a > 0) && (m_state.WordHistory[a-1] == -1)) {
+  // (using the n-gram context computed by the forward propagation)
+  if (HasDirect && isSampled) {
+    // The n-grams of a sampled word are shifted by its position
+    // in the class, as long as they do not wrap around
+    ScopedTimer timerNGram(c_profileNGram);
+    for (int k = 0; k < numSampled; k++) {
+      int a = state.SampledWords[k];
+      unsigned long long position = a - idxWordClass;
+      for (int b = 0; b < orderDirectConnection; b++) {
+        unsigned long long index = state.NGrams.wordHashes[b] + position;
+        if (state.NGrams.wordHashes[b] &&
+            (index < (unsigned long long)sizeDirectConnection)) {
+          m_weights.DirectNGram[index] +=
+          alpha * state.OutputGradient[a] - m_weights.DirectNGram[index]*beta;
+          if (touchedBlocks != NULL) {
+            touchedBlocks[index >> c_directNGramSyncBlockShift] = 1;
+          }
+        } else {
           break;
         }
-        hash[a] = c_Primes[0]*c_Primes[1]*(unsigned long long)(targetClass+1);
-        for (b=1; b<=a; b++) {
-          hash[a]+=c_Primes[(a*c_Primes[b]+b)%c_PrimesSize]*(unsigned long long)(m_state.WordHistory[b-1]+1);
-        }
-        hash[a] = (hash[a]%(sizeDirectConnection/2))+(sizeDirectConnection)/2;
       }
+    }
+  } else if (HasDirect) {
+    ScopedTimer timerNGram(c_profileNGram);
+    if (word != -1) {
+      unsigned long long hash[c_maxNGramOrder];
+      copy(state.NGrams.wordHashes,
+           state.NGrams.wordHashes + orderDirectConnection, hash);
       for (int c = 0; c < numWordsInClass; c++) {
         int a = m_vocab.GetNthWordInClass(targetClass, c);
         for (int b = 0; b < orderDirectConnection; b++) {
           if (hash[b]) {
             m_weights.DirectNGram[hash[b]] +=
-            alpha * m_state.OutputGradient[a] - m_weights.DirectNGram[hash[b]]*beta;
+            alpha * state.OutputGradient[a] - m_weights.DirectNGram[hash[b]]*beta;
+            if (touchedBlocks != NULL) {
+              touchedBlocks[hash[b] >> c_directNGramSyncBlockShift] = 1;
+            }
             hash[b]++;
             hash[b] = hash[b]%sizeDirectConnection;
           } else {
@@ -360,22 +876,19 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
   }
   //
   // learn direct connections to classes
-  if (sizeDirectConnection > 0) {
-    unsigned long long hash[c_maxNGramOrder] = {0};
-    for (int a = 0; a < orderDirectConnection; a++) {
-      int b = 0;
-      if (a>0) if (m_state.WordHistory[a-1] == -1) break;
-      hash[a] = c_Primes[0]*c_Primes[1];
-      for (b=1; b<=a; b++) {
-        hash[a] += c_Primes[(a*c_Primes[b]+b)%c_PrimesSize]*(unsigned long long)(m_state.WordHistory[b-1]+1);
-      }
-      hash[a] = hash[a]%(sizeDirectConnection/2);
-    }
+  if (HasDirect) {
+    ScopedTimer timerNGram(c_profileNGram);
+    unsigned long long hash[c_maxNGramOrder];
+    copy(state.NGrams.classHashes,
+         state.NGrams.classHashes + orderDirectConnection, hash);
     for (int a = sizeVocabulary; a < sizeOutput; a++) {
       for (int b = 0; b < orderDirectConnection; b++) {
         if (hash[b]) {
           m_weights.DirectNGram[hash[b]] +=
-          alpha * m_state.OutputGradient[a] - m_weights.DirectNGram[hash[b]]*beta;
+          alpha * state.OutputGradient[a] - m_weights.DirectNGram[hash[b]]*beta;
+          if (touchedBlocks != NULL) {
+            touchedBlocks[hash[b] >> c_directNGramSyncBlockShift] = 1;
+          }
           hash[b]++;
         } else {
           break;
@@ -384,36 +897,50 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     }
   }
   
-  if (sizeCompress > 0) {
-    // Back-propagate gradients coming from loss on words in target class
-    // w.r.t. the compression layer
-    GradientMatrixXvectorBlas(m_state.CompressGradient,
-                              m_state.OutputGradient,
-                              m_weights.Compress2Output,
-                              sizeCompress,
-                              idxWordClass,
-                              idxWordClass + numWordsInClass);
-    
-    // Back-propagate gradients coming from loss on words in target class
-    // w.r.t. the weights V between the compression layer and the output word layer
-    // V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
-    //   <- (1-beta) * V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
-    //      + alpha * dOut[[classIdx, classIdx+numWordsClass], 1] * c(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.CompressLayer,
-                              m_weights.Compress2Output,
-                              alpha,
-                              coeffSGD,
-                              sizeOutput,
-                              1,
-                              sizeCompress,
-                              idxWordClass,
-                              idxWordClass + numWordsInClass);
+  if (HasCompress) {
+    if (isSampled) {
+      // Same as below, on the rows of the sampled words only
+      GradientSampledRowsXvectorBlas(state.CompressGradient,
+                                     state,
+                                     m_weights.Compress2Output,
+                                     sizeCompress);
+      UpdateSampledRowsBlas(state,
+                            state.CompressLayer,
+                            m_weights.Compress2Output,
+                            alpha,
+                            coeffSGD,
+                            sizeCompress);
+    } else {
+      // Back-propagate gradients coming from loss on words in target class
+      // w.r.t. the compression layer
+      GradientMatrixXvectorBlas(state.CompressGradient,
+                                state.OutputGradient,
+                                m_weights.Compress2Output,
+                                sizeCompress,
+                                idxWordClass,
+                                idxWordClass + numWordsInClass);
+
+      // Back-propagate gradients coming from loss on words in target class
+      // w.r.t. the weights V between the compression layer and the output word layer
+      // V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
+      //   <- (1-beta) * V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
+      //      + alpha * dOut[[classIdx, classIdx+numWordsClass], 1] * c(t)[1, [1, sizeHidden]]
+      MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                                state.CompressLayer,
+                                m_weights.Compress2Output,
+                                alpha,
+                                coeffSGD,
+                                sizeOutput,
+                                1,
+                                sizeCompress,
+                                idxWordClass,
+                                idxWordClass + numWordsInClass);
+    }
     
     // Back-propagate gradients coming from loss on word classes
     // w.r.t. the compression layer
-    GradientMatrixXvectorBlas(m_state.CompressGradient,
-                              m_state.OutputGradient,
+    GradientMatrixXvectorBlas(state.CompressGradient,
+                              state.OutputGradient,
                               m_weights.Compress2Output,
                               sizeCompress,
                               sizeVocabulary,
@@ -424,8 +951,8 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // V[[sizeVocabulary, sizeOutput] x [1, sizeHidden]]
     //   <- (1-beta) * V[[sizeVocabulary, sizeOutput] x [1, sizeHidden]]
     //      + alpha * dOut[[sizeVocabulary, sizeOutput], 1] * c(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.CompressLayer,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.CompressLayer,
                               m_weights.Compress2Output,
                               alpha,
                               coeffSGD,
@@ -437,8 +964,8 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     
     // Back-propagate gradients coming from loss on compression layer
     // w.r.t. the hidden layer
-    GradientMatrixXvectorBlas(m_state.HiddenGradient,
-                              m_state.CompressGradient,
+    GradientMatrixXvectorBlas(state.HiddenGradient,
+                              state.CompressGradient,
                               m_weights.Hidden2Output,
                               sizeHidden,
                               0,
@@ -449,8 +976,8 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // V[[1, sizeHidden] x [1, sizeHidden]]
     //   <- (1-beta) * V[[1, sizeHidden] x [1, sizeHidden]]
     //      + alpha * dc(t)[[1, sizeHidden], 1] * h(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.CompressGradient,
-                              m_state.HiddenLayer,
+    MultiplyMatrixXmatrixBlas(state.CompressGradient,
+                              state.HiddenLayer,
                               m_weights.Hidden2Output,
                               alpha,
                               1.0,
@@ -460,35 +987,49 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
                               0,
                               sizeHidden);
   } else {
-    // Back-propagate gradients coming from loss on words in target class
-    // w.r.t. the hidden layer
-    GradientMatrixXvectorBlas(m_state.HiddenGradient,
-                              m_state.OutputGradient,
-                              m_weights.Hidden2Output,
-                              sizeHidden,
-                              idxWordClass,
-                              idxWordClass + numWordsInClass);
-    
-    // Back-propagate gradients coming from loss on words in target class
-    // w.r.t. the weights V between the hidden layer and the output word layer
-    // V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
-    //   <- (1-beta) * V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
-    //      + alpha * dOut[[classIdx, classIdx+numWordsClass], 1] * h(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.HiddenLayer,
-                              m_weights.Hidden2Output,
-                              alpha,
-                              coeffSGD,
-                              sizeOutput,
-                              1,
-                              sizeHidden,
-                              idxWordClass,
-                              idxWordClass + numWordsInClass);
+    if (isSampled) {
+      // Same as below, on the rows of the sampled words only
+      GradientSampledRowsXvectorBlas(state.HiddenGradient,
+                                     state,
+                                     m_weights.Hidden2Output,
+                                     sizeHidden);
+      UpdateSampledRowsBlas(state,
+                            state.HiddenLayer,
+                            m_weights.Hidden2Output,
+                            alpha,
+                            coeffSGD,
+                            sizeHidden);
+    } else {
+      // Back-propagate gradients coming from loss on words in target class
+      // w.r.t. the hidden layer
+      GradientMatrixXvectorBlas(state.HiddenGradient,
+                                state.OutputGradient,
+                                m_weights.Hidden2Output,
+                                sizeHidden,
+                                idxWordClass,
+                                idxWordClass + numWordsInClass);
+
+      // Back-propagate gradients coming from loss on words in target class
+      // w.r.t. the weights V between the hidden layer and the output word layer
+      // V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
+      //   <- (1-beta) * V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
+      //      + alpha * dOut[[classIdx, classIdx+numWordsClass], 1] * h(t)[1, [1, sizeHidden]]
+      MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                                state.HiddenLayer,
+                                m_weights.Hidden2Output,
+                                alpha,
+                                coeffSGD,
+                                sizeOutput,
+                                1,
+                                sizeHidden,
+                                idxWordClass,
+                                idxWordClass + numWordsInClass);
+    }
     
     // Back-propagate gradients coming from loss on word classes
     // w.r.t. the hidden layer
-    GradientMatrixXvectorBlas(m_state.HiddenGradient,
-                              m_state.OutputGradient,
+    GradientMatrixXvectorBlas(state.HiddenGradient,
+                              state.OutputGradient,
                               m_weights.Hidden2Output,
                               sizeHidden,
                               sizeVocabulary,
@@ -499,8 +1040,8 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // V[[sizeVocabulary, sizeOutput] x [1, sizeHidden]]
     //   <- (1-beta) * V[[sizeVocabulary, sizeOutput] x [1, sizeHidden]]
     //      + alpha * dOut[[sizeVocabulary, sizeOutput], 1] * h(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.HiddenLayer,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.HiddenLayer,
                               m_weights.Hidden2Output,
                               alpha,
                               coeffSGD,
@@ -511,30 +1052,40 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
                               sizeOutput);
   }
   
-  if ((sizeFeature > 0) && m_useFeatures2Output) {
+  if (FeatureMode == c_kernelFeatures2HiddenAndOutput) {
     // Back-propagate gradients coming from loss on words in target class
     // w.r.t. the weights V between the hidden layer and the output word layer
     // G[[classIdx, classIdx+numWordsClass] x [1, sizeFeature]]
     //   <- G[[classIdx, classIdx+numWordsClass] x [1, sizeFeature]]
     //      + alpha * dOut[[classIdx, classIdx+numWordsClass], 1] * f(t)[1, [1, sizeFeature]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.FeatureLayer,
-                              m_weights.Features2Output,
-                              alpha,
-                              1.0,
-                              sizeOutput,
-                              1,
-                              sizeFeature,
-                              idxWordClass,
-                              idxWordClass + numWordsInClass);
+    // (only the rows of the sampled words, with a sampled softmax)
+    if (isSampled) {
+      UpdateSampledRowsBlas(state,
+                            state.FeatureLayer,
+                            m_weights.Features2Output,
+                            alpha,
+                            1.0,
+                            sizeFeature);
+    } else {
+      MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                                state.FeatureLayer,
+                                m_weights.Features2Output,
+                                alpha,
+                                1.0,
+                                sizeOutput,
+                                1,
+                                sizeFeature,
+                                idxWordClass,
+                                idxWordClass + numWordsInClass);
+    }
     
     // Back-propagate gradients coming from loss on word classes
     // w.r.t. the direct weights G between the feature layer and the output word layer
     // G[[sizeVocabulary, sizeOutput] x [1, sizeFeature]]
     //   <- G[[sizeVocabulary, sizeOutput] x [1, sizeFeature]]
     //      + alpha * dOut[[sizeVocabulary, sizeOutput], 1] * f(t)[1, [1, sizeFeature]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.FeatureLayer,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.FeatureLayer,
                               m_weights.Features2Output,
                               alpha,
                               1.0,
@@ -544,31 +1095,76 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
                               sizeVocabulary,
                               sizeOutput);
   }
+}
+
+
+/**
+ * One step of backpropagation of the errors through the RNN
+ * (optionally, backpropagation through time, BPTT) and of gradient descent.
+ * The state and BPTT memory are those of the calling thread,
+ * whereas the weights are updated in place (without locks),
+ * so that several threads can train the same model (Hogwild).
+ * The configuration of the model is given by the template parameters:
+ * the size of the hidden layer is a constant unless SizeHidden is 0.
+ */
+template <int SizeHidden, bool HasCompress, int FeatureMode,
+          bool HasDirect, bool HasBptt>
+void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescentKernel(int contextWord,
+                                                                        int word,
+                                                                        double learningRate,
+                                                                        long wordCounter,
+                                                                        RnnState &state,
+                                                                        RnnBptt &bpttState) {
+  // No learning step if OOV word
+  if (word == -1) {
+    return;
+  }
+  ScopedTimer timer(c_profileBackward);
+
+  // Backprop of the errors of the outputs, and SGD on the output weights
+  BackPropagateOutputErrorsKernel<SizeHidden, HasCompress, FeatureMode,
+                                  HasDirect>(word, learningRate,
+                                             wordCounter, state);
+  
+  // Learning rates, with and without regularization
+  double beta = m_regularizationRate * learningRate;
+  double alpha = learningRate;
+  // Regularization is done every 10th step
+  double coeffSGD = ((wordCounter % 10) == 0) ? (1.0 - beta) : 1.0;
+  
+  // Matrix sizes
+  int sizeInput = GetInputSize();
+  const int sizeFeature =
+  (FeatureMode != c_kernelNoFeatures) ? GetFeatureSize() : 0;
+  const int sizeHidden = (SizeHidden > 0) ? SizeHidden : GetHiddenSize();
 
-  if (m_numBpttSteps <= 1) {
+  // Back-propagation to the hidden and input layers (through time)
+  ScopedTimer timerBptt(c_profileBptt);
+  if (!HasBptt) {
     // If BPTT == 1, do normal BP
 
     // Gradient w.r.t. hidden layer
     for (int a = 0; a < sizeHidden; a++) {
-      double dLdSa = m_state.HiddenLayer[a];
-      m_state.HiddenGradient[a] =
-      m_state.HiddenGradient[a] * dLdSa * (1 - dLdSa);
+      double dLdSa = state.HiddenLayer[a];
+      state.HiddenGradient[a] =
+      state.HiddenGradient[a] * dLdSa * (1 - dLdSa);
     }
     
     // Backprop and weight update hidden(t) -> input(t)
+    // (the input is one-hot: only the column of the context word changes)
     int a = contextWord;
     if (a != -1) {
       for (int b = 0; b < sizeHidden; b++) {
         int node = a + b * sizeInput;
         m_weights.Input2Hidden[node] =
-        alpha * m_state.HiddenGradient[b] * m_state.InputLayer[a]
+        alpha * state.HiddenGradient[b]
         + coeffSGD * m_weights.Input2Hidden[node];
       }
     }
     
     // Backprop and weight update hidden(t) -> hidden(t-1)
-    MultiplyMatrixXmatrixBlas(m_state.HiddenGradient,
-                              m_state.RecurrentLayer,
+    MultiplyMatrixXmatrixBlas(state.HiddenGradient,
+                              state.RecurrentLayer,
                               m_weights.Recurrent2Hidden,
                               alpha,
                               coeffSGD,
@@ -579,8 +1175,8 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
                               sizeHidden);
     
     // Backprop and weight update hidden(t) -> feature(t)
-    MultiplyMatrixXmatrixBlas(m_state.HiddenGradient,
-                              m_state.FeatureLayer,
+    MultiplyMatrixXmatrixBlas(state.HiddenGradient,
+                              state.FeatureLayer,
                               m_weights.Features2Hidden,
                               alpha,
                               coeffSGD,
@@ -591,59 +1187,63 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
                               sizeHidden);
   } else {
     // BPTT
+    double *bpttHiddenLayer = bpttState.HiddenLayerAt(0);
+    double *bpttHiddenGradient = bpttState.HiddenGradientAt(0);
+    double *bpttFeatureLayer = bpttState.FeatureLayerAt(0);
     for (int b = 0; b < sizeHidden; b++) {
-      m_bpttVectors.HiddenLayer[b] = m_state.HiddenLayer[b];
+      bpttHiddenLayer[b] = state.HiddenLayer[b];
     }
     for (int b = 0; b < sizeHidden; b++) {
-      m_bpttVectors.HiddenGradient[b] = m_state.HiddenGradient[b];
+      bpttHiddenGradient[b] = state.HiddenGradient[b];
     }
     for (int b = 0; b < sizeFeature; b++) {
-      m_bpttVectors.FeatureLayer[b] = m_state.FeatureLayer[b];
+      bpttFeatureLayer[b] = state.FeatureLayer[b];
     }
 
-    if (((m_wordCounter % m_bpttBlockSize) == 0) ||
+    if (((wordCounter % m_bpttBlockSize) == 0) ||
         (m_areSentencesIndependent && (word == 0))) {
-      for (int step = 0; step < m_bpttVectors.NumSteps() - 2; step++) {
+      for (int step = 0; step < bpttState.NumSteps() - 2; step++) {
         // Gradient w.r.t. hidden layer
         for (int a = 0; a < sizeHidden; a++) {
-          double dLdSa = m_state.HiddenLayer[a];
-          m_state.HiddenGradient[a] =
-          m_state.HiddenGradient[a] * dLdSa * (1 - dLdSa);
+          double dLdSa = state.HiddenLayer[a];
+          state.HiddenGradient[a] =
+          state.HiddenGradient[a] * dLdSa * (1 - dLdSa);
         }
 
-        if (sizeFeature > 0) {
+        if (FeatureMode != c_kernelNoFeatures) {
           // Backprop and weight update hidden(t) -> feature(t)
+          double *bpttFeatureLayerAtStep = bpttState.FeatureLayerAt(step);
           for (int b = 0; b < sizeHidden; b++) {
             for (int a = 0; a < sizeFeature; a++) {
-              m_bpttVectors.WeightsFeature2Hidden[a + b * sizeFeature] +=
-              alpha * m_state.HiddenGradient[b] *
-              m_bpttVectors.FeatureLayer[a + step * sizeFeature];
+              bpttState.WeightsFeature2Hidden[a + b * sizeFeature] +=
+              alpha * state.HiddenGradient[b] *
+              bpttFeatureLayerAtStep[a];
             }
           }
         }
 
         // Backprop and weight update hidden -> input
-        int a = m_bpttVectors.History[step];
+        int a = bpttState.WordAt(step);
         if (a != -1) {
           for (int b = 0; b < sizeHidden; b++)
           {
-            m_bpttVectors.WeightsInput2Hidden[a + b * sizeInput] +=
-            alpha * m_state.HiddenGradient[b];
+            bpttState.WeightsInput2Hidden[a + b * sizeInput] +=
+            alpha * state.HiddenGradient[b];
           }
         }
         
         // Backprop and weight update hidden -> recurrent
-        m_state.HiddenGradient.assign(sizeHidden, 0);
-        GradientMatrixXvectorBlas(m_state.RecurrentGradient,
-                                  m_state.HiddenGradient,
+        state.HiddenGradient.assign(sizeHidden, 0);
+        GradientMatrixXvectorBlas(state.RecurrentGradient,
+                                  state.HiddenGradient,
                                   m_weights.Recurrent2Hidden,
                                   sizeHidden,
                                   0,
                                   sizeHidden);
         
-        MultiplyMatrixXmatrixBlas(m_state.HiddenGradient,
-                                  m_state.RecurrentLayer,
-                                  m_bpttVectors.WeightsRecurrent2Hidden,
+        MultiplyMatrixXmatrixBlas(state.HiddenGradient,
+                                  state.RecurrentLayer,
+                                  bpttState.WeightsRecurrent2Hidden,
                                   alpha,
                                   1.0,
                                   sizeHidden,
@@ -653,63 +1253,66 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
                                   sizeHidden);
         
         // Backpropagate error from time T-n to T-n-1
+        double *bpttHiddenGradientBefore = bpttState.HiddenGradientAt(step + 1);
         for (int a = 0; a < sizeHidden; a++) {
-          m_state.HiddenGradient[a] =
-          m_state.RecurrentGradient[a] +
-          m_bpttVectors.HiddenGradient[(step+1) * sizeHidden+a];
+          state.HiddenGradient[a] =
+          state.RecurrentGradient[a] + bpttHiddenGradientBefore[a];
         }
         
-        if (step < m_bpttVectors.NumSteps() - 3) {
+        if (step < bpttState.NumSteps() - 3) {
+          double *bpttHiddenLayerBefore = bpttState.HiddenLayerAt(step + 1);
+          double *bpttRecurrentLayerBefore = bpttState.HiddenLayerAt(step + 2);
           for (int a = 0; a < sizeHidden; a++) {
-            m_state.HiddenLayer[a] =
-            m_bpttVectors.HiddenLayer[(step+1) * sizeHidden+a];
-            m_state.RecurrentLayer[a] =
-            m_bpttVectors.HiddenLayer[(step+2) * sizeHidden+a];
+            state.HiddenLayer[a] = bpttHiddenLayerBefore[a];
+            state.RecurrentLayer[a] = bpttRecurrentLayerBefore[a];
           }
         }
       }
 
       // Reset BPTT accumulated gradients
-      for (int a = 0; a < m_bpttVectors.NumSteps() * sizeHidden; a++) {
-        m_bpttVectors.HiddenGradient[a] = 0;
+      for (int step = 0; step < bpttState.NumSteps(); step++) {
+        double *bpttHiddenGradientAtStep = bpttState.HiddenGradientAt(step);
+        for (int a = 0; a < sizeHidden; a++) {
+          bpttHiddenGradientAtStep[a] = 0;
+        }
       }
       
       // Restore hidden layer after BPTT
       for (int b = 0; b < sizeHidden; b++) {
-        m_state.HiddenLayer[b] = m_bpttVectors.HiddenLayer[b];
+        state.HiddenLayer[b] = bpttHiddenLayer[b];
       }
       
       // Weight update for recurrent weights, using BPTT accumulated gradients
-      AddMatrixToMatrixBlas(m_bpttVectors.WeightsRecurrent2Hidden,
+      AddMatrixToMatrixBlas(bpttState.WeightsRecurrent2Hidden,
                             m_weights.Recurrent2Hidden,
                             1.0,
                             coeffSGD,
                             sizeHidden,
                             sizeHidden);
-      m_bpttVectors.WeightsRecurrent2Hidden.assign(sizeHidden * sizeHidden, 0);
+      bpttState.WeightsRecurrent2Hidden.assign(sizeHidden * sizeHidden, 0);
       
       // Weight update for feature-hidden weights, using BPTT accumulated grads
-      if (sizeFeature > 0) {
-        AddMatrixToMatrixBlas(m_bpttVectors.WeightsFeature2Hidden,
+      if (FeatureMode != c_kernelNoFeatures) {
+        AddMatrixToMatrixBlas(bpttState.WeightsFeature2Hidden,
                               m_weights.Features2Hidden,
                               1.0,
                               coeffSGD,
                               sizeHidden,
                               sizeFeature);
-        m_bpttVectors.WeightsFeature2Hidden.assign(sizeHidden * sizeFeature, 0);
+        bpttState.WeightsFeature2Hidden.assign(sizeHidden * sizeFeature, 0);
       }
       
       // Weight update for input weights, using BPTT accumulated gradients
-      for (int step = 0; step < m_bpttVectors.NumSteps() - 2; step++) {
-        int wordAtStep = m_bpttVectors.History[step];
+      for (int step = 0; step < bpttState.NumSteps() - 2; step++) {
+        int wordAtStep = bpttState.WordAt(step);
         if (wordAtStep != -1) {
           for (int b = 0; b < sizeHidden; b++)
           {
             int node = wordAtStep + b * sizeInput;
             m_weights.Input2Hidden[node] =
-            m_bpttVectors.WeightsInput2Hidden[node]
+            bpttState.WeightsInput2Hidden[node]
             + coeffSGD * m_weights.Input2Hidden[node];
-            m_bpttVectors.WeightsInput2Hidden[node] = 0;
+            bpttState.WeightsInput2Hidden[node] = 0;
           }
         }
       }
@@ -719,9 +1322,346 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
 
 
 /**
- * Train a Recurrent Neural Network model on a test file
+ * Read the next sentence (line) from a text file, as word indices,
+ * and the feature vectors of its words if a feature file is used.
+ * Returns false at the end of the file.
+ */
+bool RnnLMTraining::ReadSentenceFromFile(WordReader &reader,
+                                         FeatureFileReader *featureReader,
+                                         vector<int> &sentence,
+                                         vector<double> &features) {
+  sentence.clear();
+  features.clear();
+  int sizeFeature = GetFeatureSize();
+  // Each line of the file ends with </s> (word index 0)
+  int word = 0;
+  bool isFeatureRead = (featureReader != NULL);
+  do {
+    word = ReadWordIndexFromFile(reader);
+    if (word <= m_eof) {
+      break;
+    }
+    sentence.push_back(word);
+    if (isFeatureRead) {
+      features.resize(sentence.size() * sizeFeature);
+      if (!featureReader->Read(&features[(sentence.size() - 1) * sizeFeature],
+                               sizeFeature)) {
+        // Reached end of file: the words left keep the last feature vector
+        features.resize((sentence.size() - 1) * sizeFeature);
+        isFeatureRead = false;
+      }
+    }
+  } while (word != 0);
+  return !sentence.empty();
+}
+
+
+/**
+ * Signature of a word index stream: vocabulary,
+ * and size and modification time of the text and feature files
+ */
+unsigned long long
+RnnLMTraining::WordIndexStreamSignature(const string &textFile,
+                                        const string &featureFile) const {
+  unsigned long long hash = m_vocab.Signature();
+  const unsigned long long prime = 1099511628211ULL;
+  auto hashFile = [&hash, prime](const string &filename) {
+    struct stat info;
+    long long values[2] = {-1, -1};
+    if (!filename.empty() && (stat(filename.c_str(), &info) == 0)) {
+      values[0] = (long long)info.st_size;
+      values[1] = (long long)info.st_mtime;
+    }
+    const unsigned char *bytes = (const unsigned char *)values;
+    for (size_t k = 0; k < sizeof(values); k++) {
+      hash = (hash ^ bytes[k]) * prime;
+    }
+  };
+  hashFile(textFile);
+  hashFile(featureFile);
+  return hash;
+}
+
+
+/**
+ * Compile a text file (and its feature file, if any)
+ * into a word index stream file: the words are looked up once,
+ * and the feature vectors are stored along with their tokens
+ */
+bool RnnLMTraining::CompileWordIndexStream(const string &textFile,
+                                           const string &featureFile,
+                                           const string &filename,
+                                           unsigned long long signature) {
+  int sizeFeature = GetFeatureSize();
+  FeatureFileReader featureReader;
+  if (!featureFile.empty() && (featureReader.Open(featureFile) != sizeFeature)) {
+    printf("Mismatch between feature vector size in model file and feature file %s\n",
+           featureFile.c_str());
+    return false;
+  }
+  string tmpFilename = filename + ".tmp";
+  FILE *fo = fopen(tmpFilename.c_str(), "wb");
+  if (fo == NULL) {
+    cerr << "Cannot write word index stream " << tmpFilename << endl;
+    return false;
+  }
+  WordIndexStreamHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, c_wordIndexStreamMagic, sizeof(header.magic));
+  header.version = c_wordIndexStreamVersion;
+  header.sizeFeature = sizeFeature;
+  header.signature = signature;
+  bool ok = (fwrite(&header, sizeof(header), 1, fo) == 1);
+
+  // Word indices of the sentences, each ending with </s>
+  WordReader reader(textFile);
+  vector<int> sentence;
+  vector<double> features;
+  while (ok && ReadSentenceFromFile(reader, NULL, sentence, features)) {
+    ok = (fwrite(&sentence[0], sizeof(int), sentence.size(), fo)
+          == sentence.size());
+    header.numTokens += (long long)sentence.size();
+    header.numSentences++;
+  }
+  long long zero = 0;
+  size_t padding =
+  WordIndexStream::WordsSize(header.numTokens) - sizeof(int) * header.numTokens;
+  ok = ok && (fwrite(&zero, 1, padding, fo) == padding);
+
+  // One feature vector per token, as long as there are vectors left
+  if (featureReader.IsOpen()) {
+    vector<float> feature(sizeFeature);
+    while (ok && (header.numFeatureVectors < header.numTokens) &&
+           featureReader.Read(&feature[0], sizeFeature)) {
+      ok = (fwrite(&feature[0], sizeof(float), sizeFeature, fo)
+            == (size_t)sizeFeature);
+      header.numFeatureVectors++;
+    }
+    featureReader.Close();
+  }
+
+  // Write the counts in the header
+  ok = ok && (fseek(fo, 0, SEEK_SET) == 0) &&
+  (fwrite(&header, sizeof(header), 1, fo) == 1);
+  ok = (fclose(fo) == 0) && ok;
+  if (ok) {
+    ok = (rename(tmpFilename.c_str(), filename.c_str()) == 0);
+  }
+  if (!ok) {
+    cerr << "Failed writing word index stream " << filename << endl;
+    remove(tmpFilename.c_str());
+  }
+  return ok;
+}
+
+
+/**
+ * Map the word index stream of a text file (and of its feature file,
+ * if any), compiling it first if it does not exist or is stale.
+ * Returns false if the word index streams are not used.
+ */
+bool RnnLMTraining::OpenWordIndexStream(const string &textFile,
+                                        const string &featureFile,
+                                        WordIndexStream &stream) {
+  if (m_binaryTextPath.empty()) {
+    return false;
+  }
+  string basename(textFile);
+  size_t sep = textFile.find_last_of("\\/");
+  if (sep != string::npos) {
+    basename = textFile.substr(sep + 1);
+  }
+  string filename(m_binaryTextPath);
+  if (filename[filename.size() - 1] != '/') {
+    filename += "/";
+  }
+  filename += basename + ".idx";
+  unsigned long long signature = WordIndexStreamSignature(textFile, featureFile);
+  int sizeFeature = GetFeatureSize();
+  if (!stream.Open(filename, signature, sizeFeature)) {
+    if (!CompileWordIndexStream(textFile, featureFile, filename, signature) ||
+        !stream.Open(filename, signature, sizeFeature)) {
+      return false;
+    }
+    Log("Compiled word index stream " + filename + "\n");
+  }
+  Log("Mapped word index stream " + filename + " (" +
+      ConvString((size_t)stream.NumSentences()) + " sentences; " +
+      ConvString((size_t)stream.NumTokens()) + " tokens)\n");
+  return true;
+}
+
+
+/**
+ * Prepare the sampled softmax (if any) for the training threads
+ * of an epoch: unigram distribution of the words within their class,
+ * and generator of each thread
+ */
+void RnnLMTraining::PrepareSampledSoftmax(vector<TrainingWorker> &workers) {
+  if (m_numSampledWords == 0) {
+    return;
+  }
+  // Cumulative counts of the words (at least 1) within their class
+  int sizeVocabulary = GetVocabularySize();
+  m_sampledCumulativeCounts.assign(sizeVocabulary, 0);
+  for (int idxClass = 0; idxClass < GetNumClasses(); idxClass++) {
+    double sum = 0;
+    for (int c = 0; c < m_vocab.SizeTargetClass(idxClass); c++) {
+      int word = m_vocab.GetNthWordInClass(idxClass, c);
+      sum += max(m_vocab.GetWordCount(word), 1);
+      m_sampledCumulativeCounts[word] = sum;
+    }
+  }
+  // Each thread samples its own sequence of words
+  for (size_t k = 0; k < workers.size(); k++) {
+    workers[k].randomState = 0x9E3779B97F4A7C15ULL * (k + 1) + m_iteration;
+  }
+}
+
+
+/**
+ * Sample the words of the target class of a word whose outputs
+ * are computed by the sampled softmax, into the state of a training
+ * thread: the word itself, then the distinct words drawn from the
+ * unigram distribution of the class (other than the word).
+ * No word is sampled (exact softmax) if the class is small enough.
+ */
+void RnnLMTraining::SampleWordsInTargetClass(int word,
+                                             TrainingWorker &worker) const {
+  RnnState &state = worker.state;
+  state.SampledWords.clear();
+  state.SampledLogCounts.clear();
+  if ((m_numSampledWords == 0) || (word < 0)) {
+    return;
+  }
+  int targetClass = m_vocab.WordIndex2Class(word);
+  int numWordsInClass = m_vocab.SizeTargetClass(targetClass);
+  if (numWordsInClass <= m_numSampledWords + 1) {
+    return;
+  }
+  // The words of a class are contiguous, and so are their cumulative counts
+  int idxWordClass = m_vocab.GetNthWordInClass(targetClass, 0);
+  const double *cumulative = &m_sampledCumulativeCounts[idxWordClass];
+  double countClass = cumulative[numWordsInClass - 1];
+
+  state.SampledWords.push_back(word);
+  for (int k = 0; k < m_numSampledWords; k++) {
+    // Draw a word of the class (xorshift generator)
+    unsigned long long &random = worker.randomState;
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    double draw = (random >> 11) * (countClass / 9007199254740992.0);
+    int position = static_cast<int>(upper_bound(cumulative,
+                                                cumulative + numWordsInClass,
+                                                draw) - cumulative);
+    int sampledWord = idxWordClass + min(position, numWordsInClass - 1);
+    if (find(state.SampledWords.begin(), state.SampledWords.end(),
+             sampledWord) == state.SampledWords.end()) {
+      state.SampledWords.push_back(sampledWord);
+    }
+  }
+  // Expected number of times that each word appears in the sample,
+  // where P(w) is its unigram probability in the class:
+  // 1 - (1 - P(w))^numSampledWords
+  for (size_t k = 0; k < state.SampledWords.size(); k++) {
+    int position = state.SampledWords[k] - idxWordClass;
+    double count = cumulative[position] -
+    ((position > 0) ? cumulative[position - 1] : 0);
+    double expectedCount =
+    -expm1(m_numSampledWords * log1p(-count / countClass));
+    state.SampledLogCounts.push_back(log(expectedCount));
+  }
+}
+
+
+/**
+ * Train the RNN on one sentence, using the state of a training thread
+ */
+void RnnLMTraining::TrainOnSentence(const vector<int> &sentence,
+                                    const vector<double> &features,
+                                    TrainingWorker &worker) {
+  RnnState &state = worker.state;
+  int sizeFeature = GetFeatureSize();
+  for (size_t idxWord = 0; idxWord < sentence.size(); idxWord++) {
+    int targetWord = sentence[idxWord];
+
+    // Use the pre-computed feature file?
+    if (features.size() >= (idxWord + 1) * sizeFeature) {
+      for (int a = 0; a < sizeFeature; a++) {
+        state.FeatureLayer[a] = features[idxWord * sizeFeature + a];
+      }
+    }
+    // Use the topic-model features coming from a word embedding matrix?
+    if (m_featureMatrixUsed) {
+      UpdateFeatureVectorUsingTopicModel(worker.contextWord, state);
+    }
+
+    // Run one step of the RNN
+    // (on the sampled words of the target class, with a sampled softmax)
+    {
+      ScopedTimer timer(c_profileForward);
+      SampleWordsInTargetClass(targetWord, worker);
+      ForwardPropagateOneStep(worker.contextWord, targetWord, state);
+    }
+
+    // For perplexity, we do not to count OOV or beginning of sentence
+    if ((targetWord >= 0) && (targetWord != m_oov)) {
+      // Compute the log-probability of the current word
+      worker.logProbability += log10(GetWordProbability(state, targetWord));
+      worker.wordCounter++;
+    }
+
+    // Safety check (that log-likelihood does not diverge)
+    assert(!(worker.logProbability != worker.logProbability));
+
+    // Shift memory needed for BPTT to next time step
+    worker.bptt.Shift(worker.contextWord);
+
+    // Back-propagate the error and run one step of
+    // stochastic gradient descent (SGD) using optional
+    // back-propagation through time (BPTT)
+    BackPropagateErrorsThenOneStepGradientDescent(worker.contextWord,
+                                                  targetWord,
+                                                  m_learningRate,
+                                                  worker.wordCounter,
+                                                  state,
+                                                  worker.bptt);
+
+    // Store the current state s(t) at the end of the input layer vector
+    // so that it can be used as s(t-1) at the next step
+    ForwardPropagateRecurrentConnectionOnly(state);
+
+    // Rotate the word history by one
+    ForwardPropagateWordHistory(state, worker.contextWord, targetWord);
+
+    // Did we reach the end of the sentence?
+    // If so, we need to reset the state of the neural net
+    if (m_areSentencesIndependent && (targetWord == 0)) {
+      ResetHiddenRnnStateAndWordHistory(state);
+    }
+  }
+}
+
+
+/**
+ * Train a Recurrent Neural Network model on a test file.
+ * With several threads, each thread trains on its own sentences,
+ * with its own state, and all update the same weights (Hogwild).
  */
 bool RnnLMTraining::TrainRnnModel() {
+  // The weights of memory-mapped model files are read-only
+  if (IsModelMapped()) {
+    cerr << "Cannot train a memory-mapped model, convert it first\n";
+    return false;
+  }
+  // The threads take turns reading the next sentence of the file:
+  // the state can only be carried over from one line to the next
+  // with a single thread
+  if ((m_numThreads > 1) && !m_areSentencesIndependent) {
+    cerr << "Training on dependent sentences needs a single thread\n";
+    return false;
+  }
   // Reset the log-likelihood to ginourmous value
   double lastValidLogProbability = -1E37;
   double lastValidAccuracy = 0;
@@ -731,6 +1671,7 @@ bool RnnLMTraining::TrainRnnModel() {
   m_wordCounter = (int)m_currentPosTrainFile;
   // Keep track of the initial learning rate
   m_initialLearningRate = m_learningRate;
+  m_trainingStart = chrono::steady_clock::now();
 
   // Log file
   string logFilename = m_rnnModelFile + ".log.txt";
@@ -743,16 +1684,20 @@ bool RnnLMTraining::TrainRnnModel() {
   // and there is a feature file
   bool isFeatureFileUsed =
   ((!m_featureMatrixUsed) && !m_featureFile.empty());
-  FILE *featureFileId = NULL;
-  int sizeFeature = GetFeatureSize();
-  
+  FeatureFileReader featureReader;
+
+  // Read the training text (and features) from its word index stream,
+  // compiled at the first epoch, rather than from the text file
+  WordIndexStream streamTrain;
+  bool isStreamUsed =
+  OpenWordIndexStream(m_trainFile, isFeatureFileUsed ? m_featureFile : "",
+                      streamTrain);
+
   bool loopEpochs = true;
   while (loopEpochs) {
-    // Reset the log-likelihood of the current iteration
-    double trainLogProbability = 0.0;
-    
     // Create a word reader on the training file
     WordReader wordReaderTrain(m_trainFile);
+    streamTrain.Rewind();
     // Print current epoch and learning rate
     Log("Iter: " + ConvString(m_iteration) +
         " Alpha: " + ConvString(m_learningRate) + "\n");
@@ -760,100 +1705,90 @@ bool RnnLMTraining::TrainRnnModel() {
     // Reset everything, including word history
     ResetAllRnnActivations(m_state);
     
-    // Ugly way to open the feature vector file
-    if (isFeatureFileUsed) {
-      featureFileId = fopen(m_featureFile.c_str(), "rb");
-      int dummySizeFeature;
-      fread(&dummySizeFeature, sizeof(dummySizeFeature), 1, featureFileId);
+    // Open the feature vector file, read by large blocks
+    if (isFeatureFileUsed && !isStreamUsed) {
+      featureReader.Open(m_featureFile);
     }
+    FeatureFileReader *featureReaderTrain =
+    featureReader.IsOpen() ? &featureReader : NULL;
     
-    // Last word set to end of sentence
-    int contextWord = 0;
-    // Current word
-    int targetWord = 0;
-        
+    // Each training thread starts from the same state
+    // (where the last word is set to end of sentence)
+    // and owns its copy of that state and of the BPTT memory
+    vector<TrainingWorker> workers(m_numThreads,
+                                   TrainingWorker(m_state, m_bpttVectors,
+                                                  m_wordCounter));
+    PrepareSampledSoftmax(workers);
+    // The threads take turns reading the next sentence from the file
+    mutex readerMutex;
+    // Total number of words trained on, across threads
+    long numWordsBefore = m_wordCounter;
+    atomic<long> numWordsTrained(m_wordCounter);
+
     // Start an iteration
-    clock_t start = clock();
-    bool loopTrain = true;
-    while (loopTrain) {
-      // Read next word
-      targetWord = ReadWordIndexFromFile(wordReaderTrain);
-      loopTrain = (targetWord > m_eof);
-
-      if (loopTrain) {
-        // Use the pre-computed feature file?
-        if (isFeatureFileUsed) {
-          LoadFeatureVectorAtCurrentWord(featureFileId, m_state);
-        }
-        // Use the topic-model features coming from a word embedding matrix?
-        if (m_featureMatrixUsed) {
-          UpdateFeatureVectorUsingTopicModel(contextWord, m_state);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    RunInParallel(m_numThreads, [&](int idxWorker) {
+      TrainingWorker &worker = workers[idxWorker];
+      vector<int> sentence;
+      vector<double> features;
+      bool loopTrain = true;
+      while (loopTrain) {
+        // Read next sentence
+        {
+          lock_guard<mutex> lock(readerMutex);
+          ScopedTimer timer(c_profileIO);
+          loopTrain = isStreamUsed ?
+          streamTrain.ReadSentence(sentence, features) :
+          ReadSentenceFromFile(wordReaderTrain, featureReaderTrain,
+                               sentence, features);
         }
-        
-        // Run one step of the RNN
-        ForwardPropagateOneStep(contextWord, targetWord, m_state);
-        
-        // For perplexity, we do not to count OOV or beginning of sentence
-        if ((targetWord >= 0) && (targetWord != m_oov)) {
-          // Compute the log-probability of the current word
-          int targetClass = m_vocab.WordIndex2Class(targetWord);
-          int outputNodeClass = targetClass + GetVocabularySize();
-          double condProbaClass = m_state.OutputLayer[outputNodeClass];
-          double condProbaWordGivenClass =  m_state.OutputLayer[targetWord];
-          trainLogProbability +=
-          log10(condProbaClass * condProbaWordGivenClass);
-          m_wordCounter++;
+        if (!loopTrain) {
+          break;
         }
-        
-        // Safety check (that log-likelihood does not diverge)
-        assert(!(trainLogProbability != trainLogProbability));
 
-        // Shift memory needed for BPTT to next time step
-        m_bpttVectors.Shift(contextWord);
-
-        // Back-propagate the error and run one step of
-        // stochastic gradient descent (SGD) using optional
-        // back-propagation through time (BPTT)
-        BackPropagateErrorsThenOneStepGradientDescent(contextWord, targetWord);
-        
-        // Store the current state s(t) at the end of the input layer vector
-        // so that it can be used as s(t-1) at the next step
-        ForwardPropagateRecurrentConnectionOnly(m_state);
-        
-        // Rotate the word history by one
-        ForwardPropagateWordHistory(m_state, contextWord, targetWord);
-        
-        // Did we reach the end of the sentence?
-        // If so, we need to reset the state of the neural net
-        if (m_areSentencesIndependent && (targetWord == 0)) {
-          ResetHiddenRnnStateAndWordHistory(m_state);
+        // Train on that sentence, updating the shared weights
+        long wordCounterBefore = worker.wordCounter;
+        TrainOnSentence(sentence, features, worker);
+        long numWords = worker.wordCounter - wordCounterBefore;
+        long numWordsTotal = (numWordsTrained += numWords);
+
+        // Verbose (the entropy is estimated on that thread only)
+        if ((numWordsTotal / 10000) != ((numWordsTotal - numWords) / 10000)) {
+          long numWordsWorker = worker.wordCounter;
+          double entropy =
+          -worker.logProbability/log10((double)2) / numWordsWorker;
+          double perplexity =
+          ExponentiateBase10(-worker.logProbability / (double)numWordsWorker);
+          lock_guard<mutex> lock(readerMutex);
+          Log("Iter," + ConvString(m_iteration) +
+              ",Alpha," + ConvString(m_learningRate) +
+              ",Perc," + ConvString(100 * numWordsTotal / m_numTrainWords) +
+              ",TRAINent," + ConvString(entropy) +
+              ",TRAINppx," + ConvString(perplexity) +
+              ",words/sec," +
+              ConvString((numWordsTotal - numWordsBefore) /
+                         SecondsSince(start)) + "\n",
+              logFilename);
+          LogProfile(ConvString(100 * numWordsTotal / m_numTrainWords),
+                     (numWordsTotal - numWordsBefore) / SecondsSince(start));
         }
       }
+    });
 
-      // Verbose
-      if ((m_wordCounter % 10000 == 0) && (m_wordCounter > 0)) {
-        clock_t now = clock();
-        double entropy = -trainLogProbability/log10((double)2) / m_wordCounter;
-        double perplexity =
-          ExponentiateBase10(-trainLogProbability / (double)m_wordCounter);
-        Log("Iter," + ConvString(m_iteration) +
-            ",Alpha," + ConvString(m_learningRate) +
-            ",Perc," + ConvString(100 * m_wordCounter / m_numTrainWords) +
-            ",TRAINent," + ConvString(entropy) +
-            ",TRAINppx," + ConvString(perplexity) +
-            ",words/sec," +
-            ConvString(1000000 * (m_wordCounter/((double)(now-start)))) + "\n",
-            logFilename);
-      }
+    // Gather the counters of all the threads,
+    // and keep the state of the first thread
+    m_wordCounter = numWordsTrained;
+    double trainLogProbability = 0.0;
+    for (int k = 0; k < m_numThreads; k++) {
+      trainLogProbability += workers[k].logProbability;
     }
+    m_state = workers[0].state;
+    m_bpttVectors = workers[0].bptt;
     
     // Close the feature file
-    if (isFeatureFileUsed) {
-      fclose(featureFileId);
-    }
+    featureReader.Close();
     
     // Verbose
-    clock_t now = clock();
     double trainEntropy = -trainLogProbability/log10((double)2) / m_wordCounter;
     double trainPerplexity =
     ExponentiateBase10(-trainLogProbability / (double)m_wordCounter);
@@ -863,19 +1798,25 @@ bool RnnLMTraining::TrainRnnModel() {
         ",TRAINent," + ConvString(trainEntropy) +
         ",TRAINppx," + ConvString(trainPerplexity) +
         ",words/sec," +
-        ConvString(1000000 * (m_wordCounter/((double)(now-start)))) + "\n",
+        ConvString((m_wordCounter - numWordsBefore) / SecondsSince(start)) +
+        "\n",
         logFilename);
+    LogProfile("100", (m_wordCounter - numWordsBefore) / SecondsSince(start));
     
     // Validation
     vector<double> sentenceScores;
     double validLogProbability, validEntropy, validAccuracy, validPerplexity;
-    TestRnnModel(m_validationFile,
-                 m_featureValidationFile,
-                 sentenceScores,
-                 validLogProbability,
-                 validPerplexity,
-                 validEntropy,
-                 validAccuracy);
+    {
+      ScopedTimer timer(c_profileValidation);
+      TestRnnModel(m_validationFile,
+                   m_featureValidationFile,
+                   sentenceScores,
+                   validLogProbability,
+                   validPerplexity,
+                   validEntropy,
+                   validAccuracy);
+    }
+    LogProfile("valid", 0);
     Log("Iter," + ConvString(m_iteration) +
         ",Alpha," + ConvString(m_learningRate) +
         ",VALIDacc," + ConvString(validAccuracy) +
@@ -886,7 +1827,6 @@ bool RnnLMTraining::TrainRnnModel() {
     // Reset the position in the training file
     m_wordCounter = 0;
     m_currentPosTrainFile = 0;
-    trainLogProbability = 0;
     
     // Shall we start reducing the learning rate?
     if (m_correctSentenceLabels.size() > 0) {
@@ -916,23 +1856,25 @@ bool RnnLMTraining::TrainRnnModel() {
       lastValidAccuracy = validAccuracy;
       validLogProbability = 0;
       m_iteration++;
-      // Save the best model
+      // Save the best model, in the background
       if (validAccuracy > bestValidAccuracy) {
-        SaveRnnModelToFile();
-        SaveWordEmbeddings(m_rnnModelFile + ".word_embeddings.txt");
-        Log("Saved the best model so far\n");
+        SaveSnapshotInBackground(true, "", false);
+        Log("Saving the best model so far\n");
         bestValidAccuracy = validAccuracy;
         bestValidLogProbability = validLogProbability;
       }
     }
   }
+  WaitForSnapshot();
 
   return true;
 }
 
 
 /**
- * Test a Recurrent Neural Network model on a test file
+ * Test a Recurrent Neural Network model on a test file.
+ * Independent sentences are scored in parallel, each thread
+ * with its own state, and their scores are gathered in order.
  */
 bool RnnLMTraining::TestRnnModel(const string &testFile,
                                  const string &featureFile,
@@ -942,6 +1884,10 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
                                  double &entropy,
                                  double &accuracy) {
   Log("RnnTrainingLM::testNet()\n");
+  // The weights of memory-mapped model files exist only in single precision
+  if (IsModelMapped()) {
+    m_useFloat32 = true;
+  }
 
   // Scores file
   string scoresFilename = m_rnnModelFile + ".scores.";
@@ -957,17 +1903,23 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
   // and there is a feature file
   bool isFeatureFileUsed =
   ((!m_featureMatrixUsed) && !featureFile.empty());
-  FILE *featureFileId = NULL;
+  FeatureFileReader featureReader;
   int sizeFeature = GetFeatureSize();
-  // Ugly way to open the feature vector file
-  if (isFeatureFileUsed) {
+
+  // Read the test text (and features) from its word index stream,
+  // if the text files are compiled, rather than from the text file
+  WordIndexStream streamTest;
+  bool isStreamUsed =
+  OpenWordIndexStream(testFile, isFeatureFileUsed ? featureFile : "",
+                      streamTest);
+
+  // Open the feature vector file, read by large blocks
+  if (isFeatureFileUsed && !isStreamUsed) {
     if (featureFile.empty()) {
       printf("Feature file for the test data is needed to evaluate this model (use -features <FILE>)\n");
       return false;
     }
-    featureFileId = fopen(featureFile.c_str(), "rb");
-    int a;
-    fread(&a, sizeof(a), 1, featureFileId);
+    int a = featureReader.Open(featureFile);
     if (a != sizeFeature) {
       printf("Mismatch between feature vector size in model file and feature file (model uses %d features, in %s found %d features)\n", sizeFeature, m_featureFile.c_str(), a);
       return false;
@@ -981,11 +1933,8 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
   // Create a word reader on the test file
   WordReader wordReaderTest(testFile);
   
-  // Last word set to end of sentence
-  int contextWord = 0;
   // Reset the log-likelihood
   logProbability = 0.0;
-  double sentenceLogProbability = 0.0;
   // Reset the word counter
   int uniqueWordCounter = 0;
   int numUnk = 0;
@@ -997,82 +1946,150 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
   if (m_areSentencesIndependent) {
     ResetHiddenRnnStateAndWordHistory(m_state);
   }
+
+  // Each evaluation thread has its own state and last word
+  // (set to end of sentence), and the weights are shared.
+  // The float32 engine uses single-precision states and weights.
+  int numThreads = NumEvaluationThreads(m_areSentencesIndependent);
+  vector<RnnState> states;
+  vector<RnnStateT<float> > statesFloat;
+  if (m_useFloat32) {
+    UpdateSinglePrecisionWeights();
+    statesFloat.assign(numThreads, RnnStateT<float>(m_state));
+  } else {
+    states.assign(numThreads, m_state);
+  }
+  vector<int> contextWords(numThreads, 0);
+
+  // The candidates of each n-best list are scored by the same thread,
+  // which caches the states along their shared prefixes (unless
+  // the features come from a file or from the topic model,
+  // or in debug mode, where the words are logged in order)
+  bool useNBest = ((m_nBestSize > 1) && m_areSentencesIndependent &&
+                   !isFeatureFileUsed && !m_featureMatrixUsed && !m_debugMode);
+  vector<PrefixStateTrie> prefixTries;
+  vector<PrefixStateTrieT<float> > prefixTriesFloat;
+  if (useNBest && m_useFloat32) {
+    prefixTriesFloat.resize(numThreads);
+  } else if (useNBest) {
+    prefixTries.resize(numThreads);
+  }
+  // Counters of forward steps saved by the cache
+  long numTokensProcessed = 0;
+  long numTokensCached = 0;
+
+  // Otherwise, independent sentences can be forward-propagated in lockstep,
+  // by batches (unless the features come from the topic model,
+  // or in debug mode, where the words are logged in order)
+  bool useBatches = ((m_batchSize > 1) && m_areSentencesIndependent &&
+                     !m_featureMatrixUsed && !m_debugMode && !useNBest);
+  vector<RnnBatchState> batches;
+  vector<RnnBatchStateT<float> > batchesFloat;
+  if (useBatches && m_useFloat32) {
+    batchesFloat.assign(numThreads,
+                        RnnBatchStateT<float>(m_batchSize, GetHiddenSize(),
+                                              GetFeatureSize(), GetNumClasses(),
+                                              GetCompressSize(),
+                                              m_vocab.GetMaxClassSize()));
+  } else if (useBatches) {
+    batches.assign(numThreads,
+                   RnnBatchState(m_batchSize, GetHiddenSize(),
+                                 GetFeatureSize(), GetNumClasses(),
+                                 GetCompressSize(),
+                                 m_vocab.GetMaxClassSize()));
+  }
   
-  // Iterate over the test file
+  // Iterate over the test file, by chunks of sentences
+  // (made of whole n-best lists) that are scored in parallel
+  const int sizeChunk = max(1, 10000 / m_nBestSize) * m_nBestSize;
+  vector<vector<int> > sentences(sizeChunk);
+  vector<vector<double> > features(sizeChunk);
   bool loopTest = true;
   while (loopTest) {
-    // Get the index of the next word (or -1 if OOV or -2 if end of file)
-    int targetWord = ReadWordIndexFromFile(wordReaderTest);
-    loopTest = (targetWord > m_eof);
-    
-    if (loopTest) {
-      // Use the pre-computed feature file?
-      if (isFeatureFileUsed) {
-        LoadFeatureVectorAtCurrentWord(featureFileId, m_state);
+    int numSentences = 0;
+    while ((numSentences < sizeChunk) &&
+           (isStreamUsed ?
+            streamTest.ReadSentence(sentences[numSentences],
+                                    features[numSentences]) :
+            ReadSentenceFromFile(wordReaderTest,
+                                 featureReader.IsOpen() ? &featureReader : NULL,
+                                 sentences[numSentences],
+                                 features[numSentences]))) {
+      numSentences++;
+    }
+    loopTest = (numSentences == sizeChunk);
+
+    // Score the sentences of the chunk
+    vector<SentenceEvaluation> evaluations(numSentences);
+    atomic<int> nextSentence(0);
+    RunInParallel(numThreads, [&](int idxWorker) {
+      if (useNBest) {
+        // Take the next n-best list of the chunk
+        int idxList;
+        while ((idxList = nextSentence++) * m_nBestSize < numSentences) {
+          int first = idxList * m_nBestSize;
+          int numCandidates = min(m_nBestSize, numSentences - first);
+          if (m_useFloat32) {
+            TestOnNBestList(sentences, first, numCandidates,
+                            statesFloat[idxWorker], prefixTriesFloat[idxWorker],
+                            evaluations);
+          } else {
+            TestOnNBestList(sentences, first, numCandidates,
+                            states[idxWorker], prefixTries[idxWorker],
+                            evaluations);
+          }
+        }
+        return;
       }
-      // Use the topic-model features coming from a word embedding matrix?
-      if (m_featureMatrixUsed) {
-        UpdateFeatureVectorUsingTopicModel(contextWord, m_state);
+      if (useBatches && m_useFloat32) {
+        TestOnSentencesInBatch(sentences, features, numSentences,
+                               nextSentence, batchesFloat[idxWorker],
+                               evaluations);
+        return;
+      } else if (useBatches) {
+        TestOnSentencesInBatch(sentences, features, numSentences,
+                               nextSentence, batches[idxWorker],
+                               evaluations);
+        return;
       }
-      
-      // Run one step of the RNN
-      ForwardPropagateOneStep(contextWord, targetWord, m_state);
-      
-      // For perplexity, we do not count OOV words and beginning of sentence...
-      if ((targetWord >= 0) && (targetWord != m_oov)) {
-        // Compute the log-probability of the current word
-        int targetClass = m_vocab.WordIndex2Class(targetWord);
-        int outputNodeClass = targetClass + GetVocabularySize();
-        double condProbaClass = m_state.OutputLayer[outputNodeClass];
-        double condProbaWordGivenClass =  m_state.OutputLayer[targetWord];
-        double logProbabilityWord =
-        log10(condProbaClass * condProbaWordGivenClass);
+      int k;
+      while ((k = nextSentence++) < numSentences) {
+        if (m_useFloat32) {
+          TestOnSentence(sentences[k], features[k], contextWords[idxWorker],
+                         statesFloat[idxWorker], evaluations[k]);
+        } else {
+          TestOnSentence(sentences[k], features[k], contextWords[idxWorker],
+                         states[idxWorker], evaluations[k]);
+        }
+      }
+    });
+
+    // Gather the scores in the order of the sentences
+    for (int k = 0; k < numSentences; k++) {
+      double sentenceLogProbability = 0.0;
+      for (size_t j = 0; j < evaluations[k].logProbabilities.size(); j++) {
+        double logProbabilityWord = evaluations[k].logProbabilities[j];
         logProbability += logProbabilityWord;
         sentenceLogProbability += logProbabilityWord;
         uniqueWordCounter++;
-
-        // Verbose
-        if (m_debugMode) {
-          Log(ConvString(targetWord) + "\t" +
-              ConvString(logProbabilityWord) + "\t" +
-              m_vocab.Word2WordIndex(contextWord) + "\t" +
-              m_vocab.Word2WordIndex(targetWord) + "\t" +
-              ConvString(m_vocab.WordIndex2Class(targetWord)) + "\t" +
-              ConvString(m_vocab.WordIndex2Class(contextWord)) + "\n");
-        }
-      } else {
-        if (m_debugMode) {
-          // Out-of-vocabulary words have probability 0 and index -1
-          Log("-1\t0\t" +
-              m_vocab.Word2WordIndex(contextWord) + "\t" +
-              m_vocab.Word2WordIndex(targetWord) + "\t-1\t-1\n");
-        }
-        numUnk++;
       }
-      
-      // Store the current state s(t) at the end of the input layer vector
-      // so that it can be used as s(t-1) at the next step
-      ForwardPropagateRecurrentConnectionOnly(m_state);
-      
-      // Rotate the word history by one
-      ForwardPropagateWordHistory(m_state, contextWord, targetWord);
-      
+      numUnk += evaluations[k].numUnk;
+      numTokensProcessed += evaluations[k].numTokensProcessed;
+      numTokensCached += evaluations[k].numTokensCached;
+
       // Did we reach the end of the sentence?
-      // If so, we need to reset the state of the neural net
-      // and to save the current sentence score
-      if (m_areSentencesIndependent && (targetWord == 0)) {
-        ResetHiddenRnnStateAndWordHistory(m_state);
+      // If so, save the current sentence score
+      if (m_areSentencesIndependent && (sentences[k].back() == 0)) {
         sentenceScores.push_back(sentenceLogProbability);
         // Write the sentence score to a file
         Log(ConvString(sentenceLogProbability) + "\n", scoresFilename);
-        sentenceLogProbability = 0.0;
       }
     }
   }
+  LogWriter::Instance().Close(scoresFilename);
+  m_state = m_useFloat32 ? RnnState(statesFloat[0]) : states[0];
   
-  if (isFeatureFileUsed) {
-    fclose(featureFileId);
-  }
+  featureReader.Close();
   
   // Log file
   string logFilename = m_rnnModelFile + ".test.log.txt";
@@ -1090,6 +2107,13 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
   -logProbability / log10((double)2) / uniqueWordCounter;
   Log("PPL net (perplexity without OOV): " + ConvString(perplexity) + "\n",
       logFilename);
+  if (useNBest) {
+    double hitRate = (numTokensProcessed == 0) ? 0 :
+      (double)numTokensCached / numTokensProcessed;
+    Log("N-best prefix cache: " + ConvString(numTokensCached) + " out of " +
+        ConvString(numTokensProcessed) + " tokens reused (hit rate " +
+        ConvString(hitRate * 100) + "%)\n", logFilename);
+  }
 
   // Load the labels
   LoadCorrectSentenceLabels(m_fileCorrectSentenceLabels);
@@ -1102,6 +2126,359 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
 }
 
 
+/**
+ * Score the words of one test sentence, using the state
+ * of an evaluation thread (the weights are only read)
+ */
+template <typename Scalar>
+void RnnLMTraining::TestOnSentence(const vector<int> &sentence,
+                                   const vector<double> &features,
+                                   int &contextWord,
+                                   RnnStateT<Scalar> &state,
+                                   SentenceEvaluation &evaluation) {
+  int sizeFeature = GetFeatureSize();
+  for (size_t idxWord = 0; idxWord < sentence.size(); idxWord++) {
+    int targetWord = sentence[idxWord];
+
+    // Use the pre-computed feature file?
+    if (features.size() >= (idxWord + 1) * sizeFeature) {
+      for (int a = 0; a < sizeFeature; a++) {
+        state.FeatureLayer[a] = features[idxWord * sizeFeature + a];
+      }
+    }
+    // Use the topic-model features coming from a word embedding matrix?
+    if (m_featureMatrixUsed) {
+      UpdateFeatureVectorUsingTopicModel(contextWord, state);
+    }
+    
+    // Run one step of the RNN
+    ForwardPropagateOneStep(contextWord, targetWord, state);
+    
+    // For perplexity, we do not count OOV words and beginning of sentence...
+    if ((targetWord >= 0) && (targetWord != m_oov)) {
+      // Compute the log-probability of the current word
+      double logProbabilityWord =
+      log10(GetWordProbability(state, targetWord));
+      evaluation.logProbabilities.push_back(logProbabilityWord);
+
+      // Verbose
+      if (m_debugMode) {
+        Log(ConvString(targetWord) + "\t" +
+            ConvString(logProbabilityWord) + "\t" +
+            m_vocab.Word2WordIndex(contextWord) + "\t" +
+            m_vocab.Word2WordIndex(targetWord) + "\t" +
+            ConvString(m_vocab.WordIndex2Class(targetWord)) + "\t" +
+            ConvString(m_vocab.WordIndex2Class(contextWord)) + "\n");
+      }
+    } else {
+      if (m_debugMode) {
+        // Out-of-vocabulary words have probability 0 and index -1
+        Log("-1\t0\t" +
+            m_vocab.Word2WordIndex(contextWord) + "\t" +
+            m_vocab.Word2WordIndex(targetWord) + "\t-1\t-1\n");
+      }
+      evaluation.numUnk++;
+    }
+    
+    // Store the current state s(t) at the end of the input layer vector
+    // so that it can be used as s(t-1) at the next step
+    ForwardPropagateRecurrentConnectionOnly(state);
+    
+    // Rotate the word history by one
+    ForwardPropagateWordHistory(state, contextWord, targetWord);
+    
+    // Did we reach the end of the sentence?
+    // If so, we need to reset the state of the neural net
+    if (m_areSentencesIndependent && (targetWord == 0)) {
+      ResetHiddenRnnStateAndWordHistory(state);
+    }
+  }
+}
+
+
+/**
+ * Score the words of test sentences, forward-propagated in lockstep
+ * as a batch, using the batch state of an evaluation thread
+ * (the weights are only read). Each sequence of the batch starts
+ * from a reset state; the thread takes the next sentence of the chunk
+ * whenever a sentence of the batch is finished, and the batch shrinks
+ * only when there are no sentences left.
+ */
+template <typename Scalar>
+void RnnLMTraining::TestOnSentencesInBatch(const vector<vector<int> > &sentences,
+                                           const vector<vector<double> > &features,
+                                           int numSentences,
+                                           atomic<int> &nextSentence,
+                                           RnnBatchStateT<Scalar> &batch,
+                                           vector<SentenceEvaluation> &evaluations) {
+  int sizeFeature = GetFeatureSize();
+  int maxNumSequences = batch.MaxNumSequences();
+  // Sentence, position in the sentence and last word of each sequence
+  vector<int> idxSentences(maxNumSequences);
+  vector<size_t> positions(maxNumSequences);
+  vector<int> contextWords(maxNumSequences);
+  vector<int> lastWords;
+  vector<int> words;
+  int numSequences = 0;
+  bool hasSentencesLeft = true;
+  while (true) {
+    // Fill the batch with the next sentences of the chunk
+    while (hasSentencesLeft && (numSequences < maxNumSequences)) {
+      int k = nextSentence++;
+      if (k >= numSentences) {
+        hasSentencesLeft = false;
+        break;
+      }
+      // The last word is reset to </s> (end of sentence)
+      idxSentences[numSequences] = k;
+      positions[numSequences] = 0;
+      contextWords[numSequences] = 0;
+      ResetHiddenRnnStateAndWordHistory(batch, numSequences);
+      numSequences++;
+    }
+    if (numSequences == 0) {
+      break;
+    }
+
+    // Inputs and target words of the sequences
+    lastWords.resize(numSequences);
+    words.resize(numSequences);
+    for (int r = 0; r < numSequences; r++) {
+      int k = idxSentences[r];
+      size_t idxWord = positions[r];
+      lastWords[r] = contextWords[r];
+      words[r] = sentences[k][idxWord];
+      // Use the pre-computed feature file?
+      if (features[k].size() >= (idxWord + 1) * sizeFeature) {
+        copy(features[k].begin() + idxWord * sizeFeature,
+             features[k].begin() + (idxWord + 1) * sizeFeature,
+             batch.FeatureLayer.begin() + r * sizeFeature);
+      }
+    }
+
+    // Run one step of the RNN on all the sequences
+    ForwardPropagateBatch(lastWords, words, batch);
+
+    for (int r = 0; r < numSequences; r++) {
+      int targetWord = words[r];
+      SentenceEvaluation &evaluation = evaluations[idxSentences[r]];
+      // For perplexity, we do not count OOV words and beginning of sentence...
+      if ((targetWord >= 0) && (targetWord != m_oov)) {
+        // Compute the log-probability of the current word
+        double logProbabilityWord =
+        log10(GetWordProbabilityInBatch(batch, r, targetWord));
+        evaluation.logProbabilities.push_back(logProbabilityWord);
+      } else {
+        evaluation.numUnk++;
+      }
+    }
+
+    // Store the current states s(t) as s(t-1) for the next step
+    ForwardPropagateRecurrentConnectionOnly(batch, numSequences);
+
+    for (int r = 0; r < numSequences; r++) {
+      // Rotate the word history by one
+      ForwardPropagateWordHistory(batch, r, contextWords[r], words[r]);
+      // Did we reach the end of the sentence?
+      // If so, we need to reset the state of the neural net
+      if (words[r] == 0) {
+        ResetHiddenRnnStateAndWordHistory(batch, r);
+      }
+      positions[r]++;
+    }
+
+    // Remove the finished sentences from the batch,
+    // replacing them by the last sequences
+    for (int r = numSequences - 1; r >= 0; r--) {
+      if (positions[r] == sentences[idxSentences[r]].size()) {
+        numSequences--;
+        if (r != numSequences) {
+          batch.MoveSequence(numSequences, r);
+          idxSentences[r] = idxSentences[numSequences];
+          positions[r] = positions[numSequences];
+          contextWords[r] = contextWords[numSequences];
+        }
+      }
+    }
+  }
+}
+
+
+/**
+ * Score the candidate sentences of an n-best list, using the state
+ * and prefix trie of an evaluation thread (the weights are only read).
+ * Each candidate starts from a reset state, and the trie caches the state
+ * after each of its words: the words shared with the prefix of a previous
+ * candidate of the list are simply accounted for, and the RNN restarts
+ * from the state cached at the point where the candidate diverges.
+ */
+template <typename Scalar>
+void RnnLMTraining::TestOnNBestList(const vector<vector<int> > &sentences,
+                                    int idxFirstSentence,
+                                    int numCandidates,
+                                    RnnStateT<Scalar> &state,
+                                    PrefixStateTrieT<Scalar> &prefixTrie,
+                                    vector<SentenceEvaluation> &evaluations) {
+  prefixTrie.Clear();
+  for (int k = idxFirstSentence; k < idxFirstSentence + numCandidates; k++) {
+    const vector<int> &sentence = sentences[k];
+    SentenceEvaluation &evaluation = evaluations[k];
+    // The last word is reset to </s> (end of sentence)
+    ResetHiddenRnnStateAndWordHistory(state);
+    int contextWord = 0;
+    // Position in the prefix trie, and are we still
+    // following a prefix that has already been computed?
+    int trieNode = prefixTrie.Root();
+    bool isPrefixCached = true;
+
+    for (size_t idxWord = 0; idxWord < sentence.size(); idxWord++) {
+      int targetWord = sentence[idxWord];
+      evaluation.numTokensProcessed++;
+
+      if (isPrefixCached) {
+        int child = prefixTrie.FindChild(trieNode, contextWord, 0, targetWord);
+        if (child >= 0) {
+          // The state after that word has already been computed
+          // for a previous candidate: simply account for the word
+          evaluation.numTokensCached++;
+          trieNode = child;
+          if ((targetWord >= 0) && (targetWord != m_oov)) {
+            evaluation.logProbabilities.push_back(prefixTrie.LogProbability(child));
+          } else {
+            evaluation.numUnk++;
+          }
+          contextWord = targetWord;
+          continue;
+        }
+        // The remainder of the candidate needs to be computed,
+        // starting from the state cached at the deepest node
+        isPrefixCached = false;
+        if (trieNode != prefixTrie.Root()) {
+          prefixTrie.RestoreState(trieNode, state);
+        }
+      }
+
+      // Run one step of the RNN
+      int lastWord = contextWord;
+      ForwardPropagateOneStep(contextWord, targetWord, state);
+
+      // For perplexity, we do not count OOV words and beginning of sentence...
+      double logProbabilityWord = 0;
+      if ((targetWord >= 0) && (targetWord != m_oov)) {
+        logProbabilityWord = log10(GetWordProbability(state, targetWord));
+        evaluation.logProbabilities.push_back(logProbabilityWord);
+      } else {
+        evaluation.numUnk++;
+      }
+
+      // Store the current state s(t) as s(t-1) for the next step
+      // and rotate the word history by one
+      ForwardPropagateRecurrentConnectionOnly(state);
+      ForwardPropagateWordHistory(state, contextWord, targetWord);
+
+      // Cache the state after the current word in the prefix trie
+      trieNode = prefixTrie.AddChild(trieNode, lastWord, 0, targetWord,
+                                     state, logProbabilityWord);
+    }
+  }
+}
+
+
+/**
+ * Prepare the evaluation states of the threads of the scoring server
+ * (each sentence is scored independently, starting from a reset state)
+ */
+void RnnLMTraining::PrepareScoringWorkers(int numWorkers) {
+  // The weights of memory-mapped model files exist only in single precision
+  if (IsModelMapped()) {
+    m_useFloat32 = true;
+  }
+  ResetAllRnnActivations(m_state);
+  ForwardPropagateRecurrentConnectionOnly(m_state);
+  ResetHiddenRnnStateAndWordHistory(m_state);
+
+  // Each thread of the server has its own state, or batch state,
+  // and the weights are shared
+  m_scoringStates.clear();
+  m_scoringStatesFloat.clear();
+  m_scoringBatches.clear();
+  m_scoringBatchesFloat.clear();
+  if (m_useFloat32) {
+    UpdateSinglePrecisionWeights();
+    m_scoringStatesFloat.assign(numWorkers, RnnStateT<float>(m_state));
+  } else {
+    m_scoringStates.assign(numWorkers, m_state);
+  }
+  // The topic-model features are not supported by the batches
+  if ((m_batchSize > 1) && !m_featureMatrixUsed && m_useFloat32) {
+    m_scoringBatchesFloat.assign(numWorkers,
+                                 RnnBatchStateT<float>(m_batchSize, GetHiddenSize(),
+                                                       GetFeatureSize(),
+                                                       GetNumClasses(),
+                                                       GetCompressSize(),
+                                                       m_vocab.GetMaxClassSize()));
+  } else if ((m_batchSize > 1) && !m_featureMatrixUsed) {
+    m_scoringBatches.assign(numWorkers,
+                            RnnBatchState(m_batchSize, GetHiddenSize(),
+                                          GetFeatureSize(), GetNumClasses(),
+                                          GetCompressSize(),
+                                          m_vocab.GetMaxClassSize()));
+  }
+}
+
+
+/**
+ * Score a batch of requests of the scoring server, using the
+ * evaluation state of one of its threads: the sentences are
+ * forward-propagated in lockstep when the batch size allows it
+ */
+void RnnLMTraining::ScoreRequests(const vector<ScoringRequest *> &requests,
+                                  int idxWorker) {
+  // Look up the words of each sentence, which ends with </s>
+  int numSentences = (int)(requests.size());
+  vector<vector<int> > sentences(numSentences);
+  vector<vector<double> > features(numSentences);
+  for (int k = 0; k < numSentences; k++) {
+    if (requests[k]->text.empty() && !requests[k]->unrolls.empty()) {
+      requests[k]->error = "the model expects a sentence, not unrolls";
+    }
+    istringstream words(requests[k]->text);
+    string word;
+    while (words >> word) {
+      sentences[k].push_back(m_vocab.SearchWordInVocabulary(word));
+    }
+    sentences[k].push_back(0);
+  }
+
+  vector<SentenceEvaluation> evaluations(numSentences);
+  atomic<int> nextSentence(0);
+  if (!m_scoringBatchesFloat.empty()) {
+    TestOnSentencesInBatch(sentences, features, numSentences, nextSentence,
+                           m_scoringBatchesFloat[idxWorker], evaluations);
+  } else if (!m_scoringBatches.empty()) {
+    TestOnSentencesInBatch(sentences, features, numSentences, nextSentence,
+                           m_scoringBatches[idxWorker], evaluations);
+  } else {
+    for (int k = 0; k < numSentences; k++) {
+      // Each sentence starts from a reset state and last word </s>
+      int contextWord = 0;
+      if (m_useFloat32) {
+        ResetHiddenRnnStateAndWordHistory(m_scoringStatesFloat[idxWorker]);
+        TestOnSentence(sentences[k], features[k], contextWord,
+                       m_scoringStatesFloat[idxWorker], evaluations[k]);
+      } else {
+        ResetHiddenRnnStateAndWordHistory(m_scoringStates[idxWorker]);
+        TestOnSentence(sentences[k], features[k], contextWord,
+                       m_scoringStates[idxWorker], evaluations[k]);
+      }
+    }
+  }
+  for (int k = 0; k < numSentences; k++) {
+    requests[k]->evaluation.logProbabilities.swap(evaluations[k].logProbabilities);
+    requests[k]->evaluation.numUnk = evaluations[k].numUnk;
+  }
+}
+
 /**
  * Load a file containing the classification labels
  */
@@ -1156,20 +2533,11 @@ double RnnLMTraining::AccuracyNBestList(std::vector<double> scores,
  * Read the feature vector for the current word
  * in the train/test/valid file and update the feature vector
  * in the state
- * TODO: convert to ifstream
  */
-bool RnnLMTraining::LoadFeatureVectorAtCurrentWord(FILE *f,
+bool RnnLMTraining::LoadFeatureVectorAtCurrentWord(FeatureFileReader &reader,
                                                    RnnState &state) {
-  int sizeFeature = GetFeatureSize();
-  for (int a = 0; a < sizeFeature; a++) {
-    float fl;
-    if (fread(&fl, sizeof(fl), 1, f) != 1) {
-      // reached end of file
-      return false;
-    }
-    m_state.FeatureLayer[a] = fl;
-  }
-  return true;
+  // Returns false when the end of file is reached
+  return reader.Read(&state.FeatureLayer[0], GetFeatureSize());
 }
 
 
@@ -1177,6 +2545,10 @@ bool RnnLMTraining::LoadFeatureVectorAtCurrentWord(FILE *f,
  * Simply write the word projections/embeddings to a text file.
  */
 void RnnLMTraining::SaveWordEmbeddings(const string &filename) {
+  SaveWordEmbeddings(filename, m_weights);
+}
+void RnnLMTraining::SaveWordEmbeddings(const string &filename,
+                                       const RnnWeights &weights) {
   FILE *fid = fopen(filename.c_str(), "wb");
   
   fprintf(fid, "%d %d\n", GetVocabularySize(), GetHiddenSize());
@@ -1184,7 +2556,7 @@ void RnnLMTraining::SaveWordEmbeddings(const string &filename) {
   for (int a = 0; a < GetVocabularySize(); a++) {
     fprintf(fid, "%s ", m_vocab.GetNthWord(a).c_str());
     for (int b = 0; b < GetHiddenSize(); b++) {
-      fprintf(fid, "%lf ", m_weights.Input2Hidden[a + b * GetInputSize()]);
+      fprintf(fid, "%lf ", weights.Input2Hidden[a + b * GetInputSize()]);
     }
     fprintf(fid, "\n");
   }
@@ -1201,21 +2573,22 @@ void RnnLMTraining::SaveWordEmbeddings(const string &filename) {
  * The operation can done on a contiguous subset of indices
  * j in [idxYFrom, idxYTo[ of vector y.
  */
-void RnnLMTraining::GradientMatrixXvectorBlas(vector<double> &vectorX,
-                                              vector<double> &vectorY,
-                                              vector<double> &matrixA,
+template <typename Scalar>
+void RnnLMTraining::GradientMatrixXvectorBlas(vector<Scalar> &vectorX,
+                                              vector<Scalar> &vectorY,
+                                              vector<Scalar> &matrixA,
                                               int widthMatrix,
                                               int idxYFrom,
                                               int idxYTo) const {
-  double *vecX = &vectorX[0];
+  Scalar *vecX = &vectorX[0];
   int idxAFrom = idxYFrom * widthMatrix;
-  double *matA = &matrixA[idxAFrom];
+  Scalar *matA = &matrixA[idxAFrom];
   int heightMatrix = idxYTo - idxYFrom;
-  double *vecY = &vectorY[idxYFrom];
-  cblas_dgemv(CblasRowMajor, CblasTrans,
-              heightMatrix, widthMatrix, 1.0, matA, widthMatrix,
-              vecY, 1,
-              1.0, vecX, 1);
+  Scalar *vecY = &vectorY[idxYFrom];
+  CblasGemv(CblasRowMajor, CblasTrans,
+            heightMatrix, widthMatrix, 1.0, matA, widthMatrix,
+            vecY, 1,
+            1.0, vecX, 1);
   // The point of gradient cutoff is to avoid too large values
   // being sent down the RNN, making the learning unstable
   if (m_gradientCutoff > 0) {
@@ -1231,15 +2604,71 @@ void RnnLMTraining::GradientMatrixXvectorBlas(vector<double> &vectorX,
 }
 
 
+/**
+ * Matrix-vector multiplication routine, as GradientMatrixXvectorBlas,
+ * restricted to the rows of the sampled words of the state:
+ * computes x <- x + A' * y over these rows only
+ */
+template <typename Scalar>
+void RnnLMTraining::GradientSampledRowsXvectorBlas(vector<Scalar> &vectorX,
+                                                   const RnnState &state,
+                                                   vector<Scalar> &matrixA,
+                                                   int widthMatrix) const {
+  for (size_t k = 0; k < state.SampledWords.size(); k++) {
+    int word = state.SampledWords[k];
+    CblasAxpy(widthMatrix, state.OutputGradient[word],
+              &matrixA[(long long)word * widthMatrix], 1,
+              &vectorX[0], 1);
+  }
+  // The point of gradient cutoff is to avoid too large values
+  // being sent down the RNN, making the learning unstable
+  if (m_gradientCutoff > 0) {
+    for (int a = 0; a < widthMatrix; a++) {
+      if (vectorX[a] > m_gradientCutoff) {
+        vectorX[a] = m_gradientCutoff;
+      }
+      if (vectorX[a] < -m_gradientCutoff) {
+        vectorX[a] = -m_gradientCutoff;
+      }
+    }
+  }
+}
+
+
+/**
+ * Update of the rows of the sampled words of the state in a matrix
+ * of output weights, as MultiplyMatrixXmatrixBlas on these rows only:
+ * C_w <- alpha * dOut_w * x + beta * C_w
+ */
+template <typename Scalar>
+void RnnLMTraining::UpdateSampledRowsBlas(const RnnState &state,
+                                          vector<Scalar> &vectorX,
+                                          vector<Scalar> &matrixC,
+                                          double alpha,
+                                          double beta,
+                                          int widthMatrix) const {
+  for (size_t k = 0; k < state.SampledWords.size(); k++) {
+    int word = state.SampledWords[k];
+    Scalar *row = &matrixC[(long long)word * widthMatrix];
+    if (beta != 1.0) {
+      CblasScal(widthMatrix, beta, row, 1);
+    }
+    CblasAxpy(widthMatrix, alpha * state.OutputGradient[word],
+              &vectorX[0], 1, row, 1);
+  }
+}
+
+
 /**
  * Matrix-matrix multiplication routine using BLAS.
  * Computes C <- alpha * A * B + beta * C.
  * The operation can done on a contiguous subset of row indices
  * j in [idxRowCFrom, idxRowCTo[ in matrix A and C.
  */
-void RnnLMTraining::MultiplyMatrixXmatrixBlas(std::vector<double> &matrixA,
-                                              std::vector<double> &matrixB,
-                                              std::vector<double> &matrixC,
+template <typename Scalar>
+void RnnLMTraining::MultiplyMatrixXmatrixBlas(std::vector<Scalar> &matrixA,
+                                              std::vector<Scalar> &matrixB,
+                                              std::vector<Scalar> &matrixC,
                                               double alpha,
                                               double beta,
                                               int numRowsA,
@@ -1250,13 +2679,13 @@ void RnnLMTraining::MultiplyMatrixXmatrixBlas(std::vector<double> &matrixA,
   int idxCFrom = idxRowCFrom * numColsC;
   int idxAFrom = idxRowCFrom * numRowsB;
   int heighMatrixAC = idxRowCTo - idxRowCFrom;
-  double *matA = &matrixA[idxAFrom];
-  double *matB = &matrixB[0];
-  double *matC = &matrixC[idxCFrom];
-  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-              heighMatrixAC, numColsC, numRowsB,
-              alpha, matA, 1, matB, numColsC,
-              beta, matC, numColsC);
+  Scalar *matA = &matrixA[idxAFrom];
+  Scalar *matB = &matrixB[0];
+  Scalar *matC = &matrixC[idxCFrom];
+  CblasGemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+            heighMatrixAC, numColsC, numRowsB,
+            alpha, matA, 1, matB, numColsC,
+            beta, matC, numColsC);
   
 }
 
@@ -1265,18 +2694,19 @@ void RnnLMTraining::MultiplyMatrixXmatrixBlas(std::vector<double> &matrixA,
  * Matrix-matrix or vector-vector addition routine using BLAS.
  * Computes Y <- alpha * X + beta * Y.
  */
-void RnnLMTraining::AddMatrixToMatrixBlas(std::vector<double> &matrixX,
-                                          std::vector<double> &matrixY,
+template <typename Scalar>
+void RnnLMTraining::AddMatrixToMatrixBlas(std::vector<Scalar> &matrixX,
+                                          std::vector<Scalar> &matrixY,
                                           double alpha,
                                           double beta,
                                           int numRows,
                                           int numCols) const {
-  double *matX = &matrixX[0];
-  double *matY = &matrixY[0];
+  Scalar *matX = &matrixX[0];
+  Scalar *matY = &matrixY[0];
   int numElem = numRows * numCols;
   // Scale matrix Y?
   if (beta != 1.0) {
-    cblas_dscal(numElem, beta, matY, 1);
+    CblasScal(numElem, beta, matY, 1);
   }
-  cblas_daxpy(numElem, alpha, matX, 1, matY, 1);
+  CblasAxpy(numElem, alpha, matX, 1, matY, 1);
 }
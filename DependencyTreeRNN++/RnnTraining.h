@@ -41,10 +41,100 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
 #include "CorpusWordReader.h"
+#include "WordIndexStream.h"
 #include "Utils.h"
 #include "RnnLib.h"
 #include "RnnState.h"
+#include "PrefixStateTrie.h"
+#include "UnrollTree.h"
+#include "Profiler.h"
+
+
+/**
+ * Training thread: it owns its RNN state (with gradients) and BPTT memory,
+ * and keeps its own counters during an epoch
+ */
+struct TrainingWorker {
+  TrainingWorker(const RnnState &initialState,
+                 const RnnBptt &initialBptt,
+                 long initialWordCounter)
+  : state(initialState), bptt(initialBptt),
+  contextWord(0), wordCounter(initialWordCounter),
+  numUniqueWords(0), logProbability(0.0), randomState(1) {
+    state.AllocateTrainingBuffers();
+  }
+
+  // State and BPTT memory of the RNN in that thread
+  RnnState state;
+  RnnBptt bptt;
+  // Last word, used as context for the next word
+  int contextWord;
+  // Counter of words, used to schedule regularization and BPTT
+  long wordCounter;
+  // Number of unique word tokens and their log-likelihood
+  long numUniqueWords;
+  double logProbability;
+  // Generator of the words sampled by the sampled softmax (xorshift)
+  unsigned long long randomState;
+};
+
+
+/**
+ * Evaluation of one test sentence by a thread: the log-probabilities
+ * of its (unique) word tokens, in the order in which they are scored,
+ * and the number of tokens that are not scored (OOV)
+ */
+struct SentenceEvaluation {
+  SentenceEvaluation()
+  : numUnk(0), numTokensProcessed(0), numTokensCached(0) { }
+
+  std::vector<double> logProbabilities;
+  long numUnk;
+  // Number of tokens processed, and reused from a cache of states
+  long numTokensProcessed;
+  long numTokensCached;
+};
+
+
+/**
+ * Progress of the training stored in the header of the model files
+ */
+struct TrainingProgress {
+  int iteration;
+  long currentPosTrainFile;
+  double learningRate;
+  bool doStartReducingLearningRate;
+};
+
+
+struct ServerConnection;
+
+/**
+ * Request of the scoring server: one sentence, given as text
+ * (sequential models) or as the JSON list of its unrolls
+ * (dependency tree models), and its evaluation once scored
+ */
+struct ScoringRequest {
+  ScoringRequest() : connection(NULL) { }
+
+  // JSON value identifying the request, sent back with the response
+  std::string id;
+  // Sentence as text, or as the JSON list of its unrolls
+  std::string text;
+  std::string unrolls;
+  // Time at which the request was read
+  std::chrono::steady_clock::time_point arrival;
+  // Connection to which the response is sent
+  ServerConnection *connection;
+  // Evaluation of the sentence, or error message
+  SentenceEvaluation evaluation;
+  std::string error;
+};
 
 
 /**
@@ -63,13 +153,28 @@ public:
   // otherwise simply set its filename
   : RnnLM(filename, doLoadModel),
   m_debugMode(debugMode),
+  m_numThreads(1),
+  m_batchSize(1),
+  m_nBestSize(1),
+  m_useFloat32(false),
+  m_checkpointInterval(0),
+  m_numSampledWords(0),
+  m_snapshotWeights(1, 1, 0, 1, 0, 0, false),
+  m_isSnapshotSaving(false),
   m_wordCounter(0),
   m_minWordOccurrences(5),
   m_oov(1),
   m_eof(-2),
+  m_useCostOptimalClasses(false),
   m_fileCorrectSentenceLabels("") {
     Log("RnnLMTraining: debug mode is " + ConvString(debugMode) + "\n");
+    SelectKernels();
   }
+
+  /**
+   * Destructor: wait for the model being saved in the background
+   */
+  ~RnnLMTraining() { WaitForSnapshot(); }
   
   void SetTrainFile(const std::string &str) { m_trainFile = str; }
   
@@ -90,6 +195,13 @@ public:
   void SetFeatureMatrixFile(const std::string &str) {
     m_featureMatrixFile = str;
   }
+
+  /**
+   * Set the directory where the sequential text files (and their feature
+   * vectors) are compiled once into word index streams,
+   * which are then memory-mapped instead of reading the text
+   */
+  void SetBinaryTextPath(const std::string &path) { m_binaryTextPath = path; }
   
   void SetUnkPenalty(double penalty) { m_logProbabilityPenaltyUnk = penalty; }
   
@@ -118,6 +230,7 @@ public:
     m_bpttVectors = RnnBptt(GetVocabularySize(), GetHiddenSize(),
                             GetFeatureSize(),
                             m_numBpttSteps, m_bpttBlockSize);
+    SelectKernels();
   }
   
   /**
@@ -131,6 +244,54 @@ public:
   }
   
   void SetDebugMode(bool mode) { m_debugMode = mode; }
+
+  /**
+   * Set the number of threads that train the model in parallel,
+   * each on its own books or sentences, updating the weights without locks,
+   * and that evaluate the model on independent sentences
+   */
+  void SetNumThreads(int val) { m_numThreads = (val < 1) ? 1 : val; }
+
+  /**
+   * Set the number of independent sentences that each evaluation thread
+   * forward-propagates in lockstep, as a batch.
+   */
+  void SetBatchSize(int val) { m_batchSize = (val < 1) ? 1 : val; }
+
+  /**
+   * Set the number of consecutive candidate sentences in each n-best list
+   * of the test text (e.g., 5 for the sentence completion questions).
+   * Each list is scored by one evaluation thread, which computes once
+   * the RNN states along the words shared by the prefixes of its candidates.
+   */
+  void SetNBestSize(int val) { m_nBestSize = (val < 1) ? 1 : val; }
+
+  /**
+   * Evaluate the model with the single-precision (float32) engine:
+   * weights and activations in float, log-probabilities in double.
+   */
+  void SetFloat32Engine(bool val) { m_useFloat32 = val; }
+
+  /**
+   * Set the number of books after which the training on dependency
+   * parse trees saves a checkpoint of the model in the background
+   * (0: no checkpoints). The training resumes from the last
+   * checkpoint, in the middle of its epoch.
+   */
+  void SetCheckpointInterval(int numBooks) {
+    m_checkpointInterval = (numBooks < 0) ? 0 : numBooks;
+  }
+
+  /**
+   * Train with a sampled softmax over the words of the target class:
+   * at each word, besides the target word, numWords words of its class
+   * are sampled from their unigram distribution, and only the outputs
+   * of these words are computed and updated (0: exact softmax).
+   * The class softmax and the evaluation remain exact.
+   */
+  void SetNumSampledWords(int numWords) {
+    m_numSampledWords = (numWords < 0) ? 0 : numWords;
+  }
   
   void SetFeatureGamma(double val) { m_featureGammaCoeff = val; }
   
@@ -158,6 +319,20 @@ public:
     m_minWordOccurrences = val;
   }
 
+  /**
+   * Assign the words to classes minimizing the expected cost
+   * of the softmax (instead of frequency-based classes)
+   * when learning the vocabulary
+   */
+  void SetCostOptimalClasses(bool val) { m_useCostOptimalClasses = val; }
+
+  /**
+   * Write the classes of words to a file in the format read by ReadClasses
+   */
+  bool ExportClasses(const std::string &filename) const {
+    return m_vocab.ExportClasses(filename);
+  }
+
   /**
    * Read the classes from a file in the following format:
    * word [TAB] class_index
@@ -172,11 +347,36 @@ public:
    * Once we train the RNN model, it is nice to save it to a text or binary file
    */
   bool SaveRnnModelToFile();
+
+  /**
+   * Save the RNN model, with given training progress, weights
+   * and hidden layer, to a temporary file that is then renamed,
+   * so that a crash never leaves a truncated model file
+   */
+  bool SaveRnnModelToFile(const std::string &filename,
+                          const TrainingProgress &progress,
+                          const RnnWeights &weights,
+                          const std::vector<double> &hiddenLayer);
+
+  /**
+   * Save the RNN model to a memory-mapped model file
+   * (see MappedModelHeader), in single precision.
+   */
+  bool SaveMappedRnnModelToFile(const std::string &filename);
+
+  /**
+   * Convert the RNN model to the other file format and save it to a file:
+   * a model loaded from a memory-mapped file is saved in the default
+   * format, and vice versa.
+   */
+  bool ConvertRnnModelFile(const std::string &filename);
   
   /**
    * Simply write the word projections/embeddings to a text file.
    */
   void SaveWordEmbeddings(const std::string &filename);
+  void SaveWordEmbeddings(const std::string &filename,
+                          const RnnWeights &weights);
   
   /**
    * Main function to test the RNN model
@@ -193,6 +393,13 @@ public:
    * Load a file containing the classification labels
    */
   void LoadCorrectSentenceLabels(const std::string &labelFile);
+
+  /**
+   * Compute the accuracy of selecting the top candidate (based on score)
+   * among n-best lists
+   */
+  double AccuracyNBestList(std::vector<double> scores,
+                           std::vector<int> &correctClasses) const;
   
 protected:
   
@@ -217,27 +424,302 @@ protected:
    * e.g., based on maximum entropy features on word bigrams)
    */
   void SortVocabularyByClass();
+
+  /**
+   * Assign the words of the vocabulary to classes (frequency-based
+   * or cost-optimal) and print the expected cost of the softmax
+   */
+  void AssignWordsToClasses();
   
+  /**
+   * Read the next sentence (line) from a text file, as word indices,
+   * and the feature vectors of its words if a feature file is used.
+   * Returns false at the end of the file.
+   */
+  bool ReadSentenceFromFile(WordReader &reader,
+                            FeatureFileReader *featureReader,
+                            std::vector<int> &sentence,
+                            std::vector<double> &features);
+
+  /**
+   * Map the word index stream of a text file (and of its feature file,
+   * if any), compiling it first if it does not exist or is stale.
+   * Returns false if the word index streams are not used.
+   */
+  bool OpenWordIndexStream(const std::string &textFile,
+                           const std::string &featureFile,
+                           WordIndexStream &stream);
+
+  /**
+   * Compile a text file (and its feature file, if any)
+   * into a word index stream file
+   */
+  bool CompileWordIndexStream(const std::string &textFile,
+                              const std::string &featureFile,
+                              const std::string &filename,
+                              unsigned long long signature);
+
+  /**
+   * Signature of a word index stream: vocabulary,
+   * and size and modification time of the text and feature files
+   */
+  unsigned long long WordIndexStreamSignature(const std::string &textFile,
+                                              const std::string &featureFile) const;
+
+  /**
+   * Train the RNN on one sentence, using the state of a training thread
+   */
+  void TrainOnSentence(const std::vector<int> &sentence,
+                       const std::vector<double> &features,
+                       TrainingWorker &worker);
+
+  /**
+   * Score the words of one test sentence, using the state
+   * of an evaluation thread (the weights are only read)
+   */
+  template <typename Scalar>
+  void TestOnSentence(const std::vector<int> &sentence,
+                      const std::vector<double> &features,
+                      int &contextWord,
+                      RnnStateT<Scalar> &state,
+                      SentenceEvaluation &evaluation);
+
+  /**
+   * Score the words of test sentences, forward-propagated in lockstep
+   * as a batch, using the batch state of an evaluation thread.
+   * The thread takes the next sentence of the chunk whenever
+   * a sentence of the batch is finished.
+   */
+  template <typename Scalar>
+  void TestOnSentencesInBatch(const std::vector<std::vector<int> > &sentences,
+                              const std::vector<std::vector<double> > &features,
+                              int numSentences,
+                              std::atomic<int> &nextSentence,
+                              RnnBatchStateT<Scalar> &batch,
+                              std::vector<SentenceEvaluation> &evaluations);
+
+  /**
+   * Score the candidate sentences of an n-best list, using the state
+   * and prefix trie of an evaluation thread: the states along the words
+   * shared with the prefix of a previous candidate are not recomputed.
+   */
+  template <typename Scalar>
+  void TestOnNBestList(const std::vector<std::vector<int> > &sentences,
+                       int idxFirstSentence,
+                       int numCandidates,
+                       RnnStateT<Scalar> &state,
+                       PrefixStateTrieT<Scalar> &prefixTrie,
+                       std::vector<SentenceEvaluation> &evaluations);
+
+public:
+
+  /**
+   * Prepare the evaluation states of the threads of the scoring server
+   * (each sentence is scored independently, starting from a reset state)
+   */
+  virtual void PrepareScoringWorkers(int numWorkers);
+
+  /**
+   * Score a batch of requests of the scoring server, using the
+   * evaluation state of one of its threads: the sentences are
+   * forward-propagated in lockstep when the batch size allows it
+   */
+  virtual void ScoreRequests(const std::vector<ScoringRequest *> &requests,
+                             int idxWorker);
+
+protected:
+
+  /**
+   * Progress of the training, as stored in the model files
+   */
+  TrainingProgress CurrentTrainingProgress() const {
+    TrainingProgress progress;
+    progress.iteration = m_iteration;
+    progress.currentPosTrainFile = m_currentPosTrainFile;
+    progress.learningRate = m_learningRate;
+    progress.doStartReducingLearningRate = m_doStartReducingLearningRate;
+    return progress;
+  }
+
+  /**
+   * Name of the checkpoint model file, followed by the file (.txt)
+   * with the position of the trainer within the epoch
+   */
+  std::string CheckpointFilename() const {
+    return m_rnnModelFile + ".checkpoint";
+  }
+
+  /**
+   * Copy the weights, the hidden layer and the progress of the training,
+   * and save them in a background thread while the training goes on:
+   * as the best model so far (with its word embeddings) and/or
+   * as a checkpoint followed by the position of the trainer
+   * (if that position is given). The weights are copied without locks,
+   * like they are updated by the training threads, by the background
+   * thread for an optional snapshot, and freed once saved.
+   * If the previous snapshot is still being saved, an optional snapshot
+   * is skipped (and false is returned), otherwise it waits.
+   */
+  bool SaveSnapshotInBackground(bool isBestModel,
+                                const std::string &checkpointPosition,
+                                bool isOptional);
+
+  /**
+   * Wait for the snapshot being saved in the background, if any
+   */
+  void WaitForSnapshot() {
+    if (m_snapshotThread.joinable()) {
+      m_snapshotThread.join();
+    }
+  }
+
+  /**
+   * Remove the checkpoint files, once the training is over
+   */
+  void RemoveCheckpoint() const;
+
+  /**
+   * If the profiling is enabled, append a row to the profile
+   * of the training (<model>.profile.csv): the wall-clock time
+   * since the training started, the words trained on per second
+   * and the time spent in each phase of the training so far
+   */
+  void LogProfile(const std::string &progress, double wordsPerSecond) const;
+
+  /**
+   * Number of threads used for evaluation: sentences are scored
+   * in parallel only when they are independent and not in debug mode
+   * (so that the verbose output follows the order of the words)
+   */
+  int NumEvaluationThreads(bool areSentencesIndependent) const {
+    return (areSentencesIndependent && !m_debugMode) ? m_numThreads : 1;
+  }
+
   /**
    * One step of backpropagation of the errors through the RNN
-   * (optionally, backpropagation through time, BPTT) and of gradient descent.
+   * (optionally, backpropagation through time, BPTT) and of gradient descent,
+   * using the state and BPTT memory of the calling thread.
+   */
+  void BackPropagateErrorsThenOneStepGradientDescent(int contextWord,
+                                                     int word,
+                                                     double learningRate,
+                                                     long wordCounter,
+                                                     RnnState &state,
+                                                     RnnBptt &bpttState);
+
+  /**
+   * Backpropagation of the errors of the outputs of one step and gradient
+   * descent on the output weights, using the state of the calling thread:
+   * the gradient w.r.t. the hidden layer is left in the state
+   * (first part of BackPropagateErrorsThenOneStepGradientDescent).
    */
-  void BackPropagateErrorsThenOneStepGradientDescent(int last_word, int word);
+  void BackPropagateOutputErrors(int word,
+                                 double learningRate,
+                                 long wordCounter,
+                                 RnnState &state);
+
+  /**
+   * Backpropagation through time over the tree of the unrolls
+   * of a sentence, once the forward pass and BackPropagateOutputErrors
+   * have run on all its steps: the gradients w.r.t. the hidden layers
+   * of all the descendant steps are accumulated at each step before
+   * being sent back to its parent, then the input, recurrent and feature
+   * weights are updated once for the whole tree.
+   */
+  void BackPropagateThroughUnrollTree(UnrollTree &tree,
+                                      double learningRate,
+                                      RnnBptt &bpttState);
+
+  /**
+   * Kernel of BackPropagateErrorsThenOneStepGradientDescent, specialized
+   * at compile time on the configuration of the model, as the forward
+   * kernels (see SelectKernels), and on the use of BPTT
+   */
+  template <int SizeHidden, bool HasCompress, int FeatureMode,
+            bool HasDirect, bool HasBptt>
+  void BackPropagateErrorsThenOneStepGradientDescentKernel(int contextWord,
+                                                           int word,
+                                                           double learningRate,
+                                                           long wordCounter,
+                                                           RnnState &state,
+                                                           RnnBptt &bpttState);
+  template <int SizeHidden, bool HasCompress, int FeatureMode, bool HasDirect>
+  void BackPropagateOutputErrorsKernel(int word,
+                                       double learningRate,
+                                       long wordCounter,
+                                       RnnState &state);
+
+  /**
+   * Type of the backward kernels, and backward kernel for a given size
+   * of the hidden layer (0 for any size), for the rest of the configuration
+   */
+  typedef void (RnnLMTraining::*BackwardKernel)(int, int, double, long,
+                                                RnnState &, RnnBptt &);
+  template <int SizeHidden>
+  BackwardKernel SelectBackwardKernel(bool hasCompress,
+                                      int featureMode,
+                                      bool hasDirect,
+                                      bool hasBptt) const;
+  typedef void (RnnLMTraining::*OutputBackwardKernel)(int, double, long,
+                                                      RnnState &);
+  template <int SizeHidden>
+  OutputBackwardKernel SelectOutputBackwardKernel(bool hasCompress,
+                                                  int featureMode,
+                                                  bool hasDirect) const;
+
+  /**
+   * Select the forward kernels and the backward kernel
+   * specialized on the configuration of the model
+   */
+  virtual void SelectKernels();
+
+  /**
+   * Prepare the sampled softmax (if any) for the training threads
+   * of an epoch: unigram distribution of the words within their class,
+   * and generator of each thread
+   */
+  void PrepareSampledSoftmax(std::vector<TrainingWorker> &workers);
+
+  /**
+   * Sample the words of the target class of a word whose outputs
+   * are computed by the sampled softmax, into the state of a training
+   * thread: the word itself, then the distinct words drawn from the
+   * unigram distribution of the class (other than the word).
+   * No word is sampled (exact softmax) if the class is small enough.
+   */
+  void SampleWordsInTargetClass(int word, TrainingWorker &worker) const;
+
+  /**
+   * Matrix-vector multiplication routine, as GradientMatrixXvectorBlas,
+   * restricted to the rows of the sampled words of the state:
+   * computes x <- x + A' * y over these rows only
+   */
+  template <typename Scalar>
+  void GradientSampledRowsXvectorBlas(std::vector<Scalar> &vectorX,
+                                      const RnnState &state,
+                                      std::vector<Scalar> &matrixA,
+                                      int widthMatrix) const;
+
+  /**
+   * Update of the rows of the sampled words of the state in a matrix
+   * of output weights, as MultiplyMatrixXmatrixBlas on these rows only:
+   * C_w <- alpha * dOut_w * x + beta * C_w
+   */
+  template <typename Scalar>
+  void UpdateSampledRowsBlas(const RnnState &state,
+                             std::vector<Scalar> &vectorX,
+                             std::vector<Scalar> &matrixC,
+                             double alpha,
+                             double beta,
+                             int widthMatrix) const;
   
   /**
    * Read the feature vector for the current word
    * in the train/test/valid file and update the feature vector
    * in the state
-   * TODO: convert to ifstream
-   */
-  bool LoadFeatureVectorAtCurrentWord(FILE *f, RnnState &state);
-  
-  /**
-   * Compute the accuracy of selecting the top candidate (based on score)
-   * among n-best lists
    */
-  double AccuracyNBestList(std::vector<double> scores,
-                           std::vector<int> &correctClasses) const;
+  bool LoadFeatureVectorAtCurrentWord(FeatureFileReader &reader,
+                                      RnnState &state);
   
   /**
    * Cleans all activations and error vectors, in the input, hidden,
@@ -253,9 +735,10 @@ protected:
    * The operation can done on a contiguous subset of indices
    * j in [idxYFrom, idxYTo[ of vector y.
    */
-  void GradientMatrixXvectorBlas(std::vector<double> &vectorX,
-                                 std::vector<double> &vectorY,
-                                 std::vector<double> &matrixA,
+  template <typename Scalar>
+  void GradientMatrixXvectorBlas(std::vector<Scalar> &vectorX,
+                                 std::vector<Scalar> &vectorY,
+                                 std::vector<Scalar> &matrixA,
                                  int widthMatrix,
                                  int idxYFrom,
                                  int idxYTo) const;
@@ -266,9 +749,10 @@ protected:
    * The operation can done on a contiguous subset of row indices
    * j in [idxRowCFrom, idxRowCTo[ in matrix A and C.
    */
-  void MultiplyMatrixXmatrixBlas(std::vector<double> &matrixA,
-                                 std::vector<double> &matrixB,
-                                 std::vector<double> &matrixC,
+  template <typename Scalar>
+  void MultiplyMatrixXmatrixBlas(std::vector<Scalar> &matrixA,
+                                 std::vector<Scalar> &matrixB,
+                                 std::vector<Scalar> &matrixC,
                                  double alpha,
                                  double beta,
                                  int numRowsA,
@@ -281,8 +765,9 @@ protected:
    * Matrix-matrix or vector-vector addition routine using BLAS.
    * Computes Y <- alpha * X + beta * Y.
    */
-  void AddMatrixToMatrixBlas(std::vector<double> &matrixX,
-                             std::vector<double> &matrixY,
+  template <typename Scalar>
+  void AddMatrixToMatrixBlas(std::vector<Scalar> &matrixX,
+                             std::vector<Scalar> &matrixY,
                              double alpha,
                              double beta,
                              int numRows,
@@ -292,9 +777,46 @@ protected:
   
   // Are we in debug mode?
   bool m_debugMode;
+
+  // Number of training threads
+  int m_numThreads;
+
+  // Number of sentences forward-propagated in lockstep during evaluation
+  int m_batchSize;
+
+  // Number of candidate sentences in each n-best list of the test text
+  int m_nBestSize;
+
+  // Is the model evaluated with the single-precision engine?
+  bool m_useFloat32;
+
+  // Number of books between two checkpoints (0: no checkpoints)
+  int m_checkpointInterval;
+
+  // Number of words sampled in the target class at each training word
+  // (0: exact softmax), and cumulative unigram counts of the words
+  // within their class
+  int m_numSampledWords;
+  std::vector<double> m_sampledCumulativeCounts;
+
+  // Snapshot of the model saved in the background (the weights
+  // are empty when no snapshot is being saved), and its thread
+  RnnWeights m_snapshotWeights;
+  std::vector<double> m_snapshotHiddenLayer;
+  TrainingProgress m_snapshotProgress;
+  std::thread m_snapshotThread;
+  std::atomic<bool> m_isSnapshotSaving;
+
+  // Time at which the training started (for the profile)
+  std::chrono::steady_clock::time_point m_trainingStart;
   
   // Word counter
   long m_wordCounter;
+
+  // Backward kernels (full step, and outputs only), specialized
+  // on the configuration of the model (see SelectKernels)
+  BackwardKernel m_backwardKernel;
+  OutputBackwardKernel m_outputBackwardKernel;
   
   // Index of the OOV (<unk>) word
   int m_oov;
@@ -305,11 +827,27 @@ protected:
   // Minimum number of word occurrences
   int m_minWordOccurrences;
 
+  // Are the classes of words minimizing the expected cost of the softmax?
+  bool m_useCostOptimalClasses;
+
+  // Blocks of direct n-gram connections updated since the last averaging
+  // of the weights of the nodes of a cluster (empty unless in a cluster)
+  std::vector<unsigned char> m_directNGramTouched;
+
   // Classification labels
   std::vector<int> m_correctSentenceLabels;
   
   // File containing the correct classification labels
   std::string m_fileCorrectSentenceLabels;
+
+  // Directory of the word index streams of the text files
+  std::string m_binaryTextPath;
+
+  // Evaluation states of the threads of the scoring server
+  std::vector<RnnState> m_scoringStates;
+  std::vector<RnnStateT<float> > m_scoringStatesFloat;
+  std::vector<RnnBatchState> m_scoringBatches;
+  std::vector<RnnBatchStateT<float> > m_scoringBatchesFloat;
 };
 
 #endif /* defined(__DependencyTreeRNN____RnnTraining__) */
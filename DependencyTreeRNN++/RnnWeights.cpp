@@ -36,6 +36,8 @@
 
 #include <stdio.h>
 #include <vector>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 #include <assert.h>
@@ -47,12 +49,14 @@ using namespace std;
 /**
  * Constructor
  */
-RnnWeights::RnnWeights(int sizeVocabulary,
-                       int sizeHidden,
-                       int sizeFeature,
-                       int sizeClasses,
-                       int sizeCompress,
-                       long long sizeDirectConnection)
+template <typename Scalar>
+RnnWeightsT<Scalar>::RnnWeightsT(int sizeVocabulary,
+                                 int sizeHidden,
+                                 int sizeFeature,
+                                 int sizeClasses,
+                                 int sizeCompress,
+                                 long long sizeDirectConnection,
+                                 bool doAllocate)
 : m_sizeVocabulary(sizeVocabulary),
 m_sizeHidden(sizeHidden),
 m_sizeFeature(sizeFeature),
@@ -60,10 +64,23 @@ m_sizeClasses(sizeClasses),
 m_sizeCompress(sizeCompress),
 m_sizeDirectConnection(sizeDirectConnection),
 m_sizeInput(sizeVocabulary),
-m_sizeOutput(sizeVocabulary + sizeClasses) {
+m_sizeOutput(sizeVocabulary + sizeClasses),
+m_isMapped(false),
+m_mappedDirectNGram(NULL),
+m_mappedDirectNGramFloat16(NULL),
+m_mappedDirectNGramInt8(NULL),
+m_mappedDirectNGramScales(NULL),
+m_isDirectNGramInPlace(false),
+m_directNGramPrecision(c_directNGramFloat32) {
+  for (int block = 0; block < c_blockDirectNGram; block++) {
+    m_mappedBlocks[block] = NULL;
+  }
 
   // Sanity check
   assert(sizeClasses <= sizeVocabulary);
+  if (!doAllocate) {
+    return;
+  }
   cout << "RnnWeights: allocate " << m_sizeInput << " inputs ("
   << sizeVocabulary << " words), "
   << m_sizeClasses << " classes, "
@@ -100,13 +117,144 @@ m_sizeOutput(sizeVocabulary + sizeClasses) {
 
   // Initialize the direct n-gram connections
   DirectNGram.assign(m_sizeDirectConnection, 0.0);
-} // RnnWeights()
+} // RnnWeightsT()
+
+
+/**
+ * Conversion from weights of another precision
+ */
+template <typename Scalar>
+template <typename OtherScalar>
+RnnWeightsT<Scalar>::RnnWeightsT(const RnnWeightsT<OtherScalar> &other,
+                                 bool doShareDirectNGram)
+: m_sizeVocabulary(other.m_sizeVocabulary),
+m_sizeHidden(other.m_sizeHidden),
+m_sizeFeature(other.m_sizeFeature),
+m_sizeClasses(other.m_sizeClasses),
+m_sizeCompress(other.m_sizeCompress),
+m_sizeDirectConnection(other.m_sizeDirectConnection),
+m_sizeInput(other.m_sizeInput),
+m_sizeOutput(other.m_sizeOutput),
+m_isMapped(false),
+m_mappedDirectNGram(NULL),
+m_mappedDirectNGramFloat16(NULL),
+m_mappedDirectNGramInt8(NULL),
+m_mappedDirectNGramScales(NULL),
+m_isDirectNGramInPlace(false),
+m_directNGramPrecision(other.m_directNGramPrecision) {
+  // The weights are copied from the vectors or from the mapped file
+  for (int block = 0; block < c_blockDirectNGram; block++) {
+    const OtherScalar *weights = other.GetBlock(block);
+    long long size = other.IsMapped() ?
+    other.GetBlockSize(block) : other.GetBlockVector(block).size();
+    GetBlockVector(block).assign(weights, weights + size);
+    m_mappedBlocks[block] = NULL;
+  }
+  // The direct n-gram connections are already in single precision
+  // (or quantized): use them in place, or copy them
+  long long size = m_sizeDirectConnection;
+  switch (m_directNGramPrecision) {
+    case c_directNGramFloat16:
+      if (doShareDirectNGram) {
+        m_mappedDirectNGramFloat16 = other.GetDirectNGramFloat16();
+      } else {
+        const unsigned short *connections = other.GetDirectNGramFloat16();
+        m_directNGramFloat16.assign(connections, connections + size);
+      }
+      break;
+    case c_directNGramInt8:
+      if (doShareDirectNGram) {
+        m_mappedDirectNGramInt8 = other.GetDirectNGramInt8();
+        m_mappedDirectNGramScales = other.GetDirectNGramScales();
+      } else {
+        const signed char *connections = other.GetDirectNGramInt8();
+        const float *scales = other.GetDirectNGramScales();
+        m_directNGramInt8.assign(connections, connections + size);
+        m_directNGramScales.assign(scales,
+                                   scales + GetNumDirectNGramInt8Blocks());
+      }
+      break;
+    default:
+      if (doShareDirectNGram) {
+        m_mappedDirectNGram = other.GetDirectNGram();
+      } else {
+        // Weights that are not allocated have no connections
+        const float *connections = other.GetDirectNGram();
+        if (!other.IsDirectNGramInPlace()) {
+          size = other.DirectNGram.size();
+        }
+        DirectNGram.assign(connections, connections + size);
+      }
+      break;
+  }
+  m_isDirectNGramInPlace = doShareDirectNGram;
+} // RnnWeightsT()
+
+
+/**
+ * Vector storing a block of weights
+ */
+template <typename Scalar>
+std::vector<Scalar> &RnnWeightsT<Scalar>::GetBlockVector(int block) {
+  switch (block) {
+    case c_blockInput2Hidden: return Input2Hidden;
+    case c_blockRecurrent2Hidden: return Recurrent2Hidden;
+    case c_blockFeatures2Hidden: return Features2Hidden;
+    case c_blockFeatures2Output: return Features2Output;
+    case c_blockHidden2Output: return Hidden2Output;
+    default: return Compress2Output;
+  }
+}
+template <typename Scalar>
+const std::vector<Scalar> &RnnWeightsT<Scalar>::GetBlockVector(int block) const {
+  return const_cast<RnnWeightsT<Scalar> *>(this)->GetBlockVector(block);
+}
+
+
+/**
+ * Read-only access to a block of weights,
+ * in its vector or in the memory-mapped file
+ */
+template <typename Scalar>
+const Scalar *RnnWeightsT<Scalar>::GetBlock(int block) const {
+  if (m_isMapped) {
+    return m_mappedBlocks[block];
+  }
+  const std::vector<Scalar> &weights = GetBlockVector(block);
+  return weights.empty() ? NULL : &weights[0];
+}
+
+
+/**
+ * Number of weights in a block, given the dimensions of the network
+ */
+template <typename Scalar>
+long long RnnWeightsT<Scalar>::GetBlockSize(int block) const {
+  switch (block) {
+    case c_blockInput2Hidden:
+      return (long long)m_sizeInput * m_sizeHidden;
+    case c_blockRecurrent2Hidden:
+      return (long long)m_sizeHidden * m_sizeHidden;
+    case c_blockFeatures2Hidden:
+      return (long long)m_sizeFeature * m_sizeHidden;
+    case c_blockFeatures2Output:
+      return (long long)m_sizeFeature * m_sizeOutput;
+    case c_blockHidden2Output:
+      return (long long)m_sizeHidden *
+      ((m_sizeCompress > 0) ? m_sizeCompress : m_sizeOutput);
+    case c_blockCompress2Output:
+      return (long long)m_sizeCompress * m_sizeOutput;
+    default:
+      return m_sizeDirectConnection;
+  }
+}
 
 
 /**
  * Clear all the weights (before loading a new copy), to save memory
  */
-void RnnWeights::Clear() {
+template <typename Scalar>
+void RnnWeightsT<Scalar>::Clear() {
   Input2Hidden.clear();
   Recurrent2Hidden.clear();
   Features2Hidden.clear();
@@ -118,13 +266,18 @@ void RnnWeights::Clear() {
     Compress2Output.clear();
   }
   DirectNGram.clear();
+  m_directNGramFloat16.clear();
+  m_directNGramInt8.clear();
+  m_directNGramScales.clear();
+  m_directNGramPrecision = c_directNGramFloat32;
 }
 
 
 /**
  * Load the weights matrices from a file
  */
-void RnnWeights::Load(FILE *fi) {
+template <typename Scalar>
+void RnnWeightsT<Scalar>::Load(FILE *fi) {
   // Read the weights of input -> hidden connections
   Log("Reading " + ConvString(m_sizeHidden) +
       "x" + ConvString(m_sizeInput) + " input->hidden weights...\n");
@@ -168,7 +321,8 @@ void RnnWeights::Load(FILE *fi) {
 /**
  * Save the weights matrices to a file
  */
-void RnnWeights::Save(FILE *fo) {
+template <typename Scalar>
+void RnnWeightsT<Scalar>::Save(FILE *fo) const {
   string logFilename = "log_saving.txt";
   // Save the weights U: input -> hidden (i.e., the word embeddings)
   Log("Saving " + ConvString(m_sizeHidden) + "x" + ConvString(m_sizeInput) +
@@ -204,18 +358,136 @@ void RnnWeights::Save(FILE *fo) {
     // Save the direct connections
     Log("Saving " + ConvString(m_sizeDirectConnection) +
         " n-gram connections...\n", logFilename);
-    for (long long aa = 0; aa < m_sizeDirectConnection; aa++) {
-      float fl = (float)(DirectNGram[aa]);
-      fwrite(&fl, 4, 1, fo);
-    }
+    SaveBinaryVector(fo, m_sizeDirectConnection, DirectNGram);
   }
 } // void Save()
 
 
+/**
+ * Save the weights matrices in single precision, in blocks aligned
+ * on c_weightBlockAlignment bytes, and return the offsets of the blocks
+ */
+template <typename Scalar>
+bool RnnWeightsT<Scalar>::SaveAligned(FILE *fo,
+                                      unsigned long long *offsets) const {
+  for (int block = 0; block < c_numWeightBlocks; block++) {
+    long long size = GetBlockSize(block);
+    long long offset = (block == c_blockDirectNGram) ?
+    SaveAlignedBinaryBlock(fo, size, GetDirectNGram(), c_weightBlockAlignment) :
+    SaveAlignedBinaryBlock(fo, size, GetBlock(block), c_weightBlockAlignment);
+    if (offset < 0) {
+      return false;
+    }
+    offsets[block] = offset;
+  }
+  return true;
+} // bool SaveAligned()
+
+
+/**
+ * Quantize the direct n-gram connections to half precision
+ * or to 8-bit integers, with one scale per block of connections
+ */
+template <typename Scalar>
+double RnnWeightsT<Scalar>::QuantizeDirectNGram(DirectNGramPrecision precision) {
+  const float *directNGram = GetDirectNGram();
+  long long size = m_sizeDirectConnection;
+  if ((precision == m_directNGramPrecision) || (size == 0)) {
+    return 0;
+  }
+  assert(m_directNGramPrecision == c_directNGramFloat32);
+  double maxError = 0;
+  if (precision == c_directNGramFloat16) {
+    m_directNGramFloat16.resize(size);
+    for (long long k = 0; k < size; k++) {
+      m_directNGramFloat16[k] = FloatToHalf(directNGram[k]);
+      double error = HalfToFloat(m_directNGramFloat16[k]) - directNGram[k];
+      maxError = std::max(maxError, std::fabs(error));
+    }
+  } else {
+    long long numBlocks = GetNumDirectNGramInt8Blocks();
+    m_directNGramInt8.resize(size);
+    m_directNGramScales.resize(numBlocks);
+    for (long long block = 0; block < numBlocks; block++) {
+      long long idxFrom = block * c_directNGramInt8BlockSize;
+      long long idxTo = std::min(size, idxFrom + c_directNGramInt8BlockSize);
+      // The scale maps the largest connection of the block to 127
+      float maxValue = 0;
+      for (long long k = idxFrom; k < idxTo; k++) {
+        maxValue = std::max(maxValue, std::fabs(directNGram[k]));
+      }
+      float scale = maxValue / 127;
+      m_directNGramScales[block] = scale;
+      for (long long k = idxFrom; k < idxTo; k++) {
+        int value = (scale > 0) ? (int)std::floor(directNGram[k] / scale + 0.5) : 0;
+        value = std::max(-127, std::min(127, value));
+        m_directNGramInt8[k] = static_cast<signed char>(value);
+        double error = value * scale - directNGram[k];
+        maxError = std::max(maxError, std::fabs(error));
+      }
+    }
+  }
+  // Release the single-precision connections
+  std::vector<float>().swap(DirectNGram);
+  m_mappedDirectNGram = NULL;
+  m_isDirectNGramInPlace = false;
+  m_directNGramPrecision = precision;
+  return maxError;
+} // double QuantizeDirectNGram()
+
+
+/**
+ * Number of bytes used by the direct n-gram connections
+ */
+template <typename Scalar>
+long long RnnWeightsT<Scalar>::GetDirectNGramMemory() const {
+  switch (m_directNGramPrecision) {
+    case c_directNGramFloat16:
+      return m_sizeDirectConnection * (long long)sizeof(unsigned short);
+    case c_directNGramInt8:
+      return m_sizeDirectConnection * (long long)sizeof(signed char) +
+      GetNumDirectNGramInt8Blocks() * (long long)sizeof(float);
+    default:
+      return m_sizeDirectConnection * (long long)sizeof(float);
+  }
+} // long long GetDirectNGramMemory()
+
+
+/**
+ * Use in place the single-precision weights of a memory-mapped file
+ */
+template <>
+bool RnnWeightsT<float>::Map(const char *data,
+                             size_t size,
+                             const unsigned long long *offsets) {
+  const float *blocks[c_numWeightBlocks];
+  for (int block = 0; block < c_numWeightBlocks; block++) {
+    unsigned long long sizeBlock = GetBlockSize(block) * sizeof(float);
+    if ((offsets[block] % c_weightBlockAlignment) ||
+        (offsets[block] > size) || (sizeBlock > size - offsets[block])) {
+      Log("Block " + ConvString(block) + " of weights out of the file\n");
+      return false;
+    }
+    blocks[block] = (sizeBlock > 0) ?
+    reinterpret_cast<const float *>(data + offsets[block]) : NULL;
+  }
+  for (int block = 0; block < c_blockDirectNGram; block++) {
+    std::vector<float>().swap(GetBlockVector(block));
+    m_mappedBlocks[block] = blocks[block];
+  }
+  std::vector<float>().swap(DirectNGram);
+  m_mappedDirectNGram = blocks[c_blockDirectNGram];
+  m_isDirectNGramInPlace = true;
+  m_isMapped = true;
+  return true;
+} // bool Map()
+
+
 /**
  * Debug function
  */
-void RnnWeights::Debug() {
+template <typename Scalar>
+void RnnWeightsT<Scalar>::Debug() {
   Log("input2hidden: " + ConvString(m_sizeInput) + "x" +
       ConvString(m_sizeHidden) + " " +
       ConvString(Input2Hidden[(m_sizeInput-1)*(m_sizeHidden-1)]) + "\n");
@@ -237,3 +509,13 @@ void RnnWeights::Debug() {
     Log("direct: " + ConvString(m_sizeDirectConnection) + " " +
       ConvString(DirectNGram[m_sizeDirectConnection-1]) + "\n");
 } // void Debug()
+
+
+// Weights in double precision (training and default engine)
+// and in single precision
+template class RnnWeightsT<double>;
+template class RnnWeightsT<float>;
+template RnnWeightsT<float>::RnnWeightsT(const RnnWeightsT<double> &other,
+                                         bool doShareDirectNGram);
+template RnnWeightsT<double>::RnnWeightsT(const RnnWeightsT<float> &other,
+                                          bool doShareDirectNGram);
@@ -38,6 +38,7 @@
 #define DependencyTreeRNN_RnnWeights_h
 
 #include <stdio.h>
+#include <stddef.h>
 #include <vector>
 #include <sstream>
 #include "Utils.h"
@@ -54,20 +55,81 @@ const unsigned int c_PrimesSize = sizeof(c_Primes)/sizeof(c_Primes[0]);
 
 
 /**
- * Weights of an RNN
+ * Blocks of weights, in the order in which they are stored in model files
+ * (the weight matrices, then the direct n-gram connections)
  */
-class RnnWeights {
+enum RnnWeightBlock {
+  c_blockInput2Hidden = 0,
+  c_blockRecurrent2Hidden,
+  c_blockFeatures2Hidden,
+  c_blockFeatures2Output,
+  c_blockHidden2Output,
+  c_blockCompress2Output,
+  c_blockDirectNGram,
+  c_numWeightBlocks
+};
+
+
+/**
+ * Alignment (in bytes) of the blocks of weights in memory-mapped
+ * model files: one cache line, enough for any vector instruction
+ */
+const int c_weightBlockAlignment = 64;
+
+
+/**
+ * Storage of the direct n-gram connections: single precision
+ * (for training), or quantized to save memory at inference time,
+ * to half precision or to 8-bit integers with one scale
+ * per block of c_directNGramInt8BlockSize connections
+ */
+enum DirectNGramPrecision {
+  c_directNGramFloat32 = 0,
+  c_directNGramFloat16,
+  c_directNGramInt8
+};
+const int c_directNGramInt8BlockShift = 8;
+const int c_directNGramInt8BlockSize = 1 << c_directNGramInt8BlockShift;
+
+
+/**
+ * Blocks of direct n-gram connections exchanged between the nodes
+ * of a cluster (the trainer marks the blocks it updates)
+ */
+const int c_directNGramSyncBlockShift = 6;
+const int c_directNGramSyncBlockSize = 1 << c_directNGramSyncBlockShift;
+
+
+/**
+ * Weights of an RNN, stored as doubles (RnnWeights) or as floats,
+ * for the single-precision engine. Single-precision weights can also
+ * be used in place from a memory-mapped model file.
+ */
+template <typename Scalar>
+class RnnWeightsT {
 public:
 
   /**
-   * Constructor
+   * Constructor (the weights are not allocated if !doAllocate,
+   * e.g., before mapping them from a file)
    */
-  RnnWeights(int sizeVocabulary,
-             int sizeHidden,
-             int sizeFeature,
-             int sizeClasses,
-             int sizeCompress,
-             long long sizeDirectConnection);
+  RnnWeightsT(int sizeVocabulary,
+              int sizeHidden,
+              int sizeFeature,
+              int sizeClasses,
+              int sizeCompress,
+              long long sizeDirectConnection,
+              bool doAllocate = true);
+
+  /**
+   * Conversion from weights of another precision. The direct n-gram
+   * connections are the same in both precisions: if doShareDirectNGram,
+   * they are used in place from the other weights (which must outlive
+   * these weights, and keep them in place) instead of being copied.
+   */
+  template <typename OtherScalar>
+  explicit RnnWeightsT(const RnnWeightsT<OtherScalar> &other,
+                       bool doShareDirectNGram = false);
 
   /**
    * Load the weights matrices from a file
@@ -82,30 +144,134 @@ public:
   /**
    * Save the weights matrices to a file
    */
-  void Save(FILE *fo);
+  void Save(FILE *fo) const;
+
+  /**
+   * Save the weights matrices in single precision, each block aligned
+   * on c_weightBlockAlignment bytes in the file, and return the offsets
+   * of the blocks (layout of the memory-mapped model files)
+   */
+  bool SaveAligned(FILE *fo, unsigned long long *offsets) const;
+
+  /**
+   * Quantize the direct n-gram connections to half precision or
+   * to 8-bit integers (the single-precision connections are freed),
+   * for inference only: the weights cannot be trained or saved afterwards.
+   * Returns the largest absolute quantization error.
+   */
+  double QuantizeDirectNGram(DirectNGramPrecision precision);
+
+  /**
+   * Use in place the blocks of single-precision weights found at
+   * the given offsets of a memory-mapped file (the vectors are emptied).
+   * Returns false if a block is misaligned or outside of the file.
+   * Defined only for float weights.
+   */
+  bool Map(const char *data, size_t size, const unsigned long long *offsets);
+
+  /**
+   * Are the weights used in place from a memory-mapped file?
+   */
+  bool IsMapped() const { return m_isMapped; }
+
+  /**
+   * Read-only access to the weight matrices, used by the forward propagation:
+   * a block points either to its vector below, or to the memory-mapped
+   * file when the weights are mapped (NULL if the block is empty).
+   */
+  const Scalar *GetBlock(int block) const;
+  const Scalar *GetInput2Hidden() const {
+    return GetBlock(c_blockInput2Hidden);
+  }
+  const Scalar *GetRecurrent2Hidden() const {
+    return GetBlock(c_blockRecurrent2Hidden);
+  }
+  const Scalar *GetFeatures2Hidden() const {
+    return GetBlock(c_blockFeatures2Hidden);
+  }
+  const Scalar *GetFeatures2Output() const {
+    return GetBlock(c_blockFeatures2Output);
+  }
+  const Scalar *GetHidden2Output() const {
+    return GetBlock(c_blockHidden2Output);
+  }
+  const Scalar *GetCompress2Output() const {
+    return GetBlock(c_blockCompress2Output);
+  }
+
+  /**
+   * Read-only access to the direct n-gram connections, depending on
+   * their precision: single-precision values (vector or mapped file),
+   * half-precision values, or 8-bit integers and their block scales
+   */
+  DirectNGramPrecision GetDirectNGramPrecision() const {
+    return m_directNGramPrecision;
+  }
+  const float *GetDirectNGram() const {
+    if (m_isDirectNGramInPlace) {
+      return m_mappedDirectNGram;
+    }
+    return DirectNGram.empty() ? NULL : &DirectNGram[0];
+  }
+  const unsigned short *GetDirectNGramFloat16() const {
+    if (m_isDirectNGramInPlace) {
+      return m_mappedDirectNGramFloat16;
+    }
+    return &m_directNGramFloat16[0];
+  }
+  const signed char *GetDirectNGramInt8() const {
+    if (m_isDirectNGramInPlace) {
+      return m_mappedDirectNGramInt8;
+    }
+    return &m_directNGramInt8[0];
+  }
+  const float *GetDirectNGramScales() const {
+    if (m_isDirectNGramInPlace) {
+      return m_mappedDirectNGramScales;
+    }
+    return &m_directNGramScales[0];
+  }
+
+  /**
+   * Are the direct n-gram connections used in place, from a memory-mapped
+   * file or from the weights these were converted from?
+   */
+  bool IsDirectNGramInPlace() const { return m_isDirectNGramInPlace; }
+
+  /**
+   * Return the number of bytes used by the direct n-gram connections
+   */
+  long long GetDirectNGramMemory() const;
+
+  /**
+   * Return the number of weights in a block,
+   * given the dimensions of the network
+   */
+  long long GetBlockSize(int block) const;
 
   // Weights between input and hidden layer
-  std::vector<double> Input2Hidden;
+  std::vector<Scalar> Input2Hidden;
   // Weights between former hidden state and current hidden layer
-  std::vector<double> Recurrent2Hidden;
+  std::vector<Scalar> Recurrent2Hidden;
   // weights between features and hidden layer
-  std::vector<double> Features2Hidden;
+  std::vector<Scalar> Features2Hidden;
   // Weights between features and output layer
-  std::vector<double> Features2Output;
+  std::vector<Scalar> Features2Output;
   // Weights between hidden and output layer (or hidden and compression if compression>0)
-  std::vector<double> Hidden2Output;
+  std::vector<Scalar> Hidden2Output;
   // Optional weights between compression and output layer
-  std::vector<double> Compress2Output;
+  std::vector<Scalar> Compress2Output;
   // Direct parameters between input and output layer
-  // (similar to Maximum Entropy model parameters)
-  std::vector<double> DirectNGram;
+  // (similar to Maximum Entropy model parameters),
+  // stored in single precision, even when training
+  std::vector<float> DirectNGram;
 
   /**
    * Return the number of direct connections between input words
    * and the output word (i.e., n-gram features)
    */
   int GetNumDirectConnection() const {
-    return static_cast<int>(DirectNGram.size());
+    return static_cast<int>(m_sizeDirectConnection);
   } // int GetNumDirectConnections()
 
   /**
@@ -121,6 +287,20 @@ public:
   
 protected:
 
+  /**
+   * Vector storing a block of weights
+   */
+  std::vector<Scalar> &GetBlockVector(int block);
+  const std::vector<Scalar> &GetBlockVector(int block) const;
+
+  /**
+   * Number of blocks of 8-bit direct n-gram connections (one scale each)
+   */
+  long long GetNumDirectNGramInt8Blocks() const {
+    return (m_sizeDirectConnection + c_directNGramInt8BlockSize - 1) /
+    c_directNGramInt8BlockSize;
+  }
+
   /**
    * Dimensions of the network
    */
@@ -132,6 +312,43 @@ protected:
   long long m_sizeDirectConnection;
   int m_sizeInput;
   int m_sizeOutput;
-}; // class RnnWeights
+
+  /**
+   * Blocks of weights in a memory-mapped file (if m_isMapped)
+   */
+  const Scalar *m_mappedBlocks[c_blockDirectNGram];
+  bool m_isMapped;
+
+  /**
+   * Direct n-gram connections used in place (if m_isDirectNGramInPlace),
+   * in a memory-mapped file or in the weights these were converted from,
+   * in their precision
+   */
+  const float *m_mappedDirectNGram;
+  const unsigned short *m_mappedDirectNGramFloat16;
+  const signed char *m_mappedDirectNGramInt8;
+  const float *m_mappedDirectNGramScales;
+  bool m_isDirectNGramInPlace;
+
+  /**
+   * Quantized direct n-gram connections
+   */
+  DirectNGramPrecision m_directNGramPrecision;
+  std::vector<unsigned short> m_directNGramFloat16;
+  std::vector<signed char> m_directNGramInt8;
+  std::vector<float> m_directNGramScales;
+
+  template <typename OtherScalar> friend class RnnWeightsT;
+}; // class RnnWeightsT
+typedef RnnWeightsT<double> RnnWeights;
+
+
+/**
+ * Only single-precision weights can be mapped from a file
+ */
+template <>
+bool RnnWeightsT<float>::Map(const char *data,
+                             size_t size,
+                             const unsigned long long *offsets);
 
 #endif
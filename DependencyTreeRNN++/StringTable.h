@@ -0,0 +1,159 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___StringTable_h
+#define DependencyTreeRNN___StringTable_h
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Table of interned strings (words or labels) with dense ids:
+ * the characters of all the strings are stored one after the other
+ * (each one ending with '\0') in a single arena, the id of a string
+ * is the order in which it was inserted, and a single open-addressing
+ * hash table (with linear probing) maps the strings to their ids.
+ * Per-id information (counts, classes...) is meant to be kept
+ * by the users of the table in vectors indexed by the ids.
+ */
+class StringTable {
+public:
+
+  /**
+   * Constructor: the table is empty
+   */
+  StringTable() { Clear(); }
+
+  /**
+   * Remove all the strings
+   */
+  void Clear() {
+    m_arena.clear();
+    m_offsets.assign(1, 0);
+    m_hashes.clear();
+    m_slots.assign(c_minSlots, -1);
+  }
+
+  /**
+   * Number of strings in the table
+   */
+  int Size() const { return (int)(m_hashes.size()); }
+
+  /**
+   * Id of a string, or -1 if it is not in the table
+   */
+  int Find(const char *str, size_t length) const {
+    unsigned long long hash = Hash(str, length);
+    size_t mask = m_slots.size() - 1;
+    for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+      int id = m_slots[slot];
+      if (id < 0) {
+        return -1;
+      }
+      if ((m_hashes[id] == hash) && (Length(id) == length) &&
+          (memcmp(Data(id), str, length) == 0)) {
+        return id;
+      }
+    }
+  }
+  int Find(const std::string &str) const {
+    return Find(str.data(), str.size());
+  }
+
+  /**
+   * Id of a string, which is inserted at the end of the table if new
+   */
+  int Insert(const char *str, size_t length) {
+    unsigned long long hash = Hash(str, length);
+    size_t mask = m_slots.size() - 1;
+    size_t slot = hash & mask;
+    for (; m_slots[slot] >= 0; slot = (slot + 1) & mask) {
+      int id = m_slots[slot];
+      if ((m_hashes[id] == hash) && (Length(id) == length) &&
+          (memcmp(Data(id), str, length) == 0)) {
+        return id;
+      }
+    }
+    // Copy the string to the arena
+    int id = Size();
+    m_arena.insert(m_arena.end(), str, str + length);
+    m_arena.push_back('\0');
+    m_offsets.push_back(m_arena.size());
+    m_hashes.push_back(hash);
+    m_slots[slot] = id;
+    // Keep the hash table at most half full
+    if (2 * m_hashes.size() > m_slots.size()) {
+      Rehash(2 * m_slots.size());
+    }
+    return id;
+  }
+  int Insert(const std::string &str) {
+    return Insert(str.data(), str.size());
+  }
+
+  /**
+   * Characters (ending with '\0') and length of the string with a given id;
+   * the pointer is invalidated by the next insertion
+   */
+  const char *Data(int id) const { return &m_arena[m_offsets[id]]; }
+  size_t Length(int id) const {
+    return m_offsets[id + 1] - m_offsets[id] - 1;
+  }
+
+  /**
+   * Copy of the string with a given id
+   */
+  std::string String(int id) const {
+    return std::string(Data(id), Length(id));
+  }
+
+protected:
+
+  /**
+   * 64-bit FNV-1a hash of a string
+   */
+  static unsigned long long Hash(const char *str, size_t length) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t k = 0; k < length; k++) {
+      hash = (hash ^ (unsigned char)str[k]) * 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  /**
+   * Reallocate the hash table (the number of slots is a power of 2)
+   * and insert all the strings into it again
+   */
+  void Rehash(size_t numSlots) {
+    m_slots.assign(numSlots, -1);
+    size_t mask = numSlots - 1;
+    for (int id = 0; id < Size(); id++) {
+      size_t slot = m_hashes[id] & mask;
+      while (m_slots[slot] >= 0) {
+        slot = (slot + 1) & mask;
+      }
+      m_slots[slot] = id;
+    }
+  }
+
+  // Initial number of slots of the hash table
+  static const size_t c_minSlots = 64;
+
+  // Characters of the strings, and offset of each string in the arena
+  // (followed by the size of the arena)
+  std::vector<char> m_arena;
+  std::vector<size_t> m_offsets;
+
+  // Hash of each string
+  std::vector<unsigned long long> m_hashes;
+
+  // Open-addressing hash table: id of the string in each slot (-1 if empty)
+  std::vector<int> m_slots;
+};
+
+#endif
@@ -0,0 +1,184 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___UnrollTree_h
+#define DependencyTreeRNN___UnrollTree_h
+
+#include <vector>
+
+
+/**
+ * Tree of the unrolls of a sentence, for training. All unrolls start
+ * at ROOT, and the unrolls that share a prefix share its nodes.
+ * Each node is one step of the RNN: it predicts the target word
+ * of the token at a given position in the sentence, from the state
+ * of its parent and from an input word and label (the context word
+ * and label of the parent token in that unroll). The forward pass
+ * stores at each node the state of that step (hidden layer, feature layer
+ * and word history), and the backward pass accumulates there the gradients
+ * w.r.t. the hidden layer sent back by all the descendant steps,
+ * one per distance (in steps of BPTT) to the step that sent it.
+ * Parents always come before their children, so that the forward pass
+ * runs in the order of the nodes and the backward pass in reverse order.
+ * Nodes are recycled from one sentence to the next to avoid reallocations.
+ */
+class UnrollTree {
+public:
+
+  /**
+   * Node of the tree: one step of the RNN
+   */
+  struct Node {
+    int parent;
+    int position;
+    int inputWord;
+    int inputLabel;
+    int targetWord;
+    // Weight of the step in the gradient (see ComputeWeights)
+    double weight;
+    // Word counter of the step, used to schedule regularization
+    long wordCounter;
+    // State at that step
+    std::vector<double> hidden;
+    std::vector<double> feature;
+    std::vector<int> wordHistory;
+    // Gradients w.r.t. the hidden layer, by distance to the step
+    // that sent them, and number of distances used so far
+    std::vector<std::vector<double> > gradients;
+    int numGradients;
+    int firstChild;
+    int nextSibling;
+  };
+
+
+  /**
+   * Constructor: the tree only contains its root,
+   * which corresponds to the reset state of the RNN.
+   */
+  UnrollTree() : m_numNodes(0) {
+    Clear();
+  }
+
+
+  /**
+   * Remove all the nodes but the root (e.g., at the end of a sentence).
+   */
+  void Clear() {
+    m_numNodes = 1;
+    if (m_nodes.empty()) {
+      m_nodes.resize(1);
+    }
+    m_nodes[0].parent = -1;
+    m_nodes[0].position = -1;
+    m_nodes[0].numGradients = 0;
+    m_nodes[0].firstChild = -1;
+    m_nodes[0].nextSibling = -1;
+  }
+
+
+  /**
+   * Index of the root of the tree
+   */
+  int Root() const { return 0; }
+
+
+  /**
+   * Number of nodes in the tree, including the root
+   */
+  int NumNodes() const { return m_numNodes; }
+
+
+  /**
+   * Access to a node
+   */
+  Node &GetNode(int node) { return m_nodes[node]; }
+  const Node &GetNode(int node) const { return m_nodes[node]; }
+
+
+  /**
+   * Gradient w.r.t. the hidden layer of a node, sent by the steps
+   * at a given distance from it (zero until they add to it)
+   */
+  std::vector<double> &GetGradient(int node, int distance, int size) {
+    Node &n = m_nodes[node];
+    while (n.numGradients <= distance) {
+      if (n.numGradients == (int)n.gradients.size()) {
+        n.gradients.resize(n.numGradients + 1);
+      }
+      n.gradients[n.numGradients].assign(size, 0);
+      n.numGradients++;
+    }
+    return n.gradients[distance];
+  }
+
+
+  /**
+   * Look up the child of a node for the token at a given position,
+   * predicted from a given input word and label, and add it
+   * if it is not found. Returns the index of the child.
+   */
+  int FindOrAddChild(int node, int position, int inputWord, int inputLabel,
+                     int targetWord) {
+    int child = m_nodes[node].firstChild;
+    while (child >= 0) {
+      const Node &n = m_nodes[child];
+      if ((n.position == position) && (n.inputWord == inputWord) &&
+          (n.inputLabel == inputLabel)) {
+        return child;
+      }
+      child = n.nextSibling;
+    }
+    if (m_numNodes == (int)m_nodes.size()) {
+      m_nodes.resize(m_numNodes + 1);
+    }
+    child = m_numNodes++;
+    Node &n = m_nodes[child];
+    n.parent = node;
+    n.position = position;
+    n.inputWord = inputWord;
+    n.inputLabel = inputLabel;
+    n.targetWord = targetWord;
+    n.weight = 1.0;
+    n.wordCounter = 0;
+    n.numGradients = 0;
+    n.firstChild = -1;
+    n.nextSibling = m_nodes[node].firstChild;
+    m_nodes[node].firstChild = child;
+    return child;
+  }
+
+
+  /**
+   * Weight each step by the inverse of the number of steps that predict
+   * the token at the same position, so that each token of the sentence
+   * contributes exactly once to the gradient, whichever the number
+   * of unrolls that go through it.
+   */
+  void ComputeWeights() {
+    m_numNodesAtPosition.clear();
+    for (int k = 1; k < m_numNodes; k++) {
+      int position = m_nodes[k].position;
+      if (position >= (int)m_numNodesAtPosition.size()) {
+        m_numNodesAtPosition.resize(position + 1, 0);
+      }
+      m_numNodesAtPosition[position]++;
+    }
+    for (int k = 1; k < m_numNodes; k++) {
+      m_nodes[k].weight = 1.0 / m_numNodesAtPosition[m_nodes[k].position];
+    }
+  }
+
+protected:
+
+  // Storage of the nodes (the first one is the root)
+  std::vector<Node> m_nodes;
+  // Number of nodes currently in use
+  int m_numNodes;
+  // Number of nodes predicting the token at each position
+  std::vector<int> m_numNodesAtPosition;
+};
+
+#endif
@@ -39,6 +39,7 @@
 
 #include <stdio.h>
 #include <vector>
+#include <algorithm>
 
 #include <stdlib.h>
 #include <string.h>
@@ -46,39 +47,35 @@
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
+#include <chrono>
+#include <thread>
+#include "Logger.h"
 
 
 /**
- * Log to screen and to file (append)
+ * Log to screen and to file (append): the file is written
+ * in the background by the log writer, which keeps it open
  */
-static void Log(std::string str, std::string logFilename) {
-  std::ostringstream buf;
-  std::ofstream logFile(logFilename, std::fstream::app);
-  buf << str;
-  logFile << buf.str() << std::flush;
-  std::cout << buf.str() << std::flush;
-  buf.str("");
-  buf.clear();
+static void Log(const std::string &str, const std::string &logFilename) {
+  LogWriter::Instance().Append(logFilename, str);
+  std::cout << str;
 }
 
 
 /**
  * Log to screen only
  */
-static void Log(std::string str) {
-  std::ostringstream buf;
-  buf << str;
-  std::cout << buf.str() << std::flush;
-  buf.str("");
-  buf.clear();
+static void Log(const std::string &str) {
+  std::cout << str;
 }
 
 
 /**
  * Read a matrix of floats in binary format
  */
+template <typename Scalar>
 static void ReadBinaryMatrix(FILE *fi, int sizeIn, int sizeOut,
-                             std::vector<double> &vec) {
+                             std::vector<Scalar> &vec) {
   if (sizeIn * sizeOut == 0) {
     return;
   }
@@ -95,8 +92,9 @@ static void ReadBinaryMatrix(FILE *fi, int sizeIn, int sizeOut,
 /**
  * Read a vector of floats in binary format
  */
+template <typename Scalar>
 static void ReadBinaryVector(FILE *fi, long long size,
-                             std::vector<double> &vec) {
+                             std::vector<Scalar> &vec) {
   for (long long aa = 0; aa < size; aa++) {
     float val;
     fread(&val, 4, 1, fi);
@@ -105,32 +103,157 @@ static void ReadBinaryVector(FILE *fi, long long size,
 }
 
 
+/**
+ * Save a vector of floats in binary format,
+ * converted and written by chunks of floats
+ */
+template <typename Scalar>
+static void SaveBinaryVector(FILE *fo, long long size,
+                             const std::vector<Scalar> &vec) {
+  float buffer[4096];
+  for (long long aa = 0; aa < size; aa += 4096) {
+    long long sizeChunk = std::min(size - aa, (long long)4096);
+    for (long long k = 0; k < sizeChunk; k++) {
+      buffer[k] = (float)(vec[aa + k]);
+    }
+    fwrite(buffer, sizeof(float), sizeChunk, fo);
+  }
+}
+
+
+/**
+ * Transpose a matrix of sizeRows x sizeCols values stored row by row
+ * into a matrix of sizeCols x sizeRows values stored row by row
+ */
+template <typename ScalarIn, typename ScalarOut>
+static void TransposeMatrix(const ScalarIn *values, int sizeRows, int sizeCols,
+                            std::vector<ScalarOut> &transposed) {
+  transposed.resize((size_t)sizeRows * sizeCols);
+  for (int idxRow = 0; idxRow < sizeRows; idxRow++) {
+    for (int idxCol = 0; idxCol < sizeCols; idxCol++) {
+      transposed[(size_t)idxCol * sizeRows + idxRow] =
+      values[(size_t)idxRow * sizeCols + idxCol];
+    }
+  }
+}
+
+
 /**
  * Save a matrix of floats in binary format
+ * (stored contiguously, input index first)
  */
+template <typename Scalar>
 static void SaveBinaryMatrix(FILE *fo, int sizeIn, int sizeOut,
-                             const std::vector<double> &vec) {
-  if (sizeIn * sizeOut == 0) {
-    return;
+                             const std::vector<Scalar> &vec) {
+  SaveBinaryVector(fo, (long long)sizeIn * sizeOut, vec);
+}
+
+
+/**
+ * Pad a file with zeros up to the next position aligned
+ * on the given number of bytes, and return that position (-1 on error)
+ */
+static long long AlignFilePosition(FILE *fo, int alignment) {
+  long long position = ftell(fo);
+  while ((position >= 0) && (position % alignment)) {
+    if (fputc(0, fo) == EOF) {
+      return -1;
+    }
+    position++;
   }
-  for (int idxOut = 0; idxOut < sizeOut; idxOut++) {
-    for (int idxIn = 0; idxIn < sizeIn; idxIn++) {
-      float val = (float)(vec[idxIn + idxOut * sizeIn]);
-      fwrite(&val, 4, 1, fo);
+  return position;
+}
+
+
+/**
+ * Save a block of values as floats in binary format, starting at
+ * the next position of the file aligned on the given number of bytes.
+ * Returns the offset of the block in the file (-1 on error).
+ */
+template <typename Scalar>
+static long long SaveAlignedBinaryBlock(FILE *fo, long long size,
+                                        const Scalar *values, int alignment) {
+  long long offset = AlignFilePosition(fo, alignment);
+  if (offset < 0) {
+    return -1;
+  }
+  // Convert and write the values by chunks
+  const long long sizeChunk = 65536;
+  std::vector<float> chunk;
+  for (long long idxFrom = 0; idxFrom < size; idxFrom += sizeChunk) {
+    long long sizeFrom = (size - idxFrom < sizeChunk) ? size - idxFrom : sizeChunk;
+    chunk.assign(values + idxFrom, values + idxFrom + sizeFrom);
+    if (fwrite(&chunk[0], sizeof(float), sizeFrom, fo) != (size_t)sizeFrom) {
+      return -1;
     }
   }
+  return offset;
 }
 
 
 /**
- * Save a vector of floats in binary format
+ * Conversion of a float to a half-precision float (IEEE 754 binary16),
+ * rounded to the nearest, ties to even
  */
-static void SaveBinaryVector(FILE *fo, long long size,
-                             const std::vector<double> &vec) {
-  for (long long aa = 0; aa < size; aa++) {
-    float val = vec[aa];
-    fwrite(&val, 4, 1, fo);
+static inline unsigned short FloatToHalf(float value) {
+  unsigned int bits;
+  memcpy(&bits, &value, sizeof(bits));
+  unsigned int sign = (bits >> 16) & 0x8000;
+  unsigned int exponentFloat = (bits >> 23) & 0xff;
+  unsigned int mantissa = bits & 0x7fffff;
+  if (exponentFloat == 0xff) {
+    // Infinity or NaN
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  int exponent = (int)exponentFloat - 127 + 15;
+  if (exponent >= 31) {
+    // Overflow to infinity
+    return sign | 0x7c00;
+  }
+  unsigned int half, rest, halfway;
+  if (exponent <= 0) {
+    // Subnormal half-precision float (or zero)
+    if (exponent < -10) {
+      return sign;
+    }
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    half = mantissa >> shift;
+    rest = mantissa & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+  } else {
+    half = (exponent << 10) | (mantissa >> 13);
+    rest = mantissa & 0x1fff;
+    halfway = 0x1000;
+  }
+  // Rounding may carry over into the exponent, which is still correct
+  if ((rest > halfway) || ((rest == halfway) && (half & 1))) {
+    half++;
   }
+  return sign | half;
+}
+
+
+/**
+ * Conversion of a half-precision float (IEEE 754 binary16) to a float
+ */
+static inline float HalfToFloat(unsigned short half) {
+  unsigned int sign = (half & 0x8000) << 16;
+  unsigned int exponent = (half >> 10) & 0x1f;
+  unsigned int mantissa = half & 0x3ff;
+  unsigned int bits;
+  if (exponent == 0) {
+    // Zero or subnormal: mantissa * 2^-24
+    float value = mantissa * (1.0f / 16777216.0f);
+    return sign ? -value : value;
+  } else if (exponent == 31) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
 }
 
 
@@ -156,13 +279,43 @@ static double GenerateNormalRandomNumber() {
 /**
  * Randomize a vector with small numbers to get zero-mean random numbers
  */
-static void RandomizeVector(std::vector<double> &vec) {
+template <typename Scalar>
+static void RandomizeVector(std::vector<Scalar> &vec) {
   for (size_t k = 0; k < vec.size(); k++) {
     vec[k] = GenerateNormalRandomNumber();
   }
 }
 
 
+/**
+ * Wall-clock time (in seconds) elapsed since a given time point;
+ * unlike clock(), which sums the CPU time of all the threads
+ */
+static inline double SecondsSince(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+  std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+
+/**
+ * Run worker(k) for every k in [0, numWorkers[, each in its own thread.
+ * Worker 0 runs on the calling thread, so that a single worker
+ * does not start any thread. Returns once all the workers are done.
+ */
+template <typename Worker>
+static void RunInParallel(int numWorkers, Worker worker) {
+  std::vector<std::thread> threads;
+  for (int k = 1; k < numWorkers; k++) {
+    threads.push_back(std::thread(worker, k));
+  }
+  worker(0);
+  for (size_t k = 0; k < threads.size(); k++) {
+    threads[k].join();
+  }
+}
+
+
 /**
  * Convert int or double to string
  */
@@ -47,11 +47,13 @@
 /**
  * Constructor that reads the vocabulary and classes from the model file.
  */
-Vocabulary::Vocabulary(FILE *fi, int sizeVocabulary, int numClasses) {
+Vocabulary::Vocabulary(FILE *fi, int sizeVocabulary, int numClasses)
+: m_sharedWords(NULL) {
   // Read the vocabulary, stored in text format as following:
   // index_number count word_token class_number
   // There are tabs and spaces separating the 4 columns
-  m_vocabularyStorage.resize(sizeVocabulary);
+  m_wordCounts.resize(sizeVocabulary);
+  m_wordClasses.resize(sizeVocabulary);
   for (int a = 0; a < sizeVocabulary; a++) {
 
     // Read the word index and the word count
@@ -59,26 +61,19 @@ Vocabulary::Vocabulary(FILE *fi, int sizeVocabulary, int numClasses) {
     int wordCount;
     fscanf(fi, "%d%d", &wordIndex, &wordCount);
     assert(wordIndex == a);
-    m_vocabularyStorage[a].cn = wordCount;
-    m_vocabularyStorage[a].prob = 0;
+    m_wordCounts[a] = wordCount;
 
-    // Read the word token
+    // Read the word token and associate it to the word token number
     char buffer[2048] = {0};
-    if (fscanf(fi, "%s", &buffer))
-      m_vocabularyStorage[a].word = buffer;
-    std::string word = m_vocabularyStorage[a].word;
+    fscanf(fi, "%s", buffer);
+    m_words.Insert(buffer, strlen(buffer));
 
     // Read the class index
     int classIndex;
     fscanf(fi, "%d", &classIndex);
 
     // Store the class information
-    m_vocabularyStorage[a].classIndex = classIndex;
-    m_mapWord2Class[word] = classIndex;
-
-    // Associate the word (string) to the word token number using two maps
-    m_mapWord2Index[word] = wordIndex;
-    m_mapIndex2Word[wordIndex] = word;
+    m_wordClasses[a] = classIndex;
   }
 
   // Store which words are in which class, using a vector
@@ -98,45 +93,95 @@ void Vocabulary::Save(FILE *fo) {
   int sizeVocabulary = GetVocabularySize();
   fprintf(fo, "\nVocabulary:\n");
   for (int wordIndex = 0; wordIndex < sizeVocabulary; wordIndex++) {
-    int wordCount = m_vocabularyStorage[wordIndex].cn;
-    std::string word = m_vocabularyStorage[wordIndex].word;
-    int wordClass = m_vocabularyStorage[wordIndex].classIndex;
     fprintf(fo, "%6d\t%10d\t%s\t%d\n",
-            wordIndex, wordCount, word.c_str(), wordClass);
+            wordIndex, m_wordCounts[wordIndex], WordData(wordIndex),
+            m_wordClasses[wordIndex]);
   }
 }
 
 
 
 /**
- * Add a token (word or multi-word entity) to the vocabulary vector
- * and store it in the map from word string to word index
- * and in the map from word index to word string.
+ * Signature of the vocabulary used to index the words
+ * of the word index streams (64-bit FNV-1a hash of the words
+ * in index order)
+ */
+unsigned long long Vocabulary::Signature() const {
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned long long prime = 1099511628211ULL;
+  for (int k = 0; k < GetVocabularySize(); k++) {
+    const char *word = WordData(k);
+    size_t length = WordLength(k);
+    for (size_t j = 0; j < length; j++) {
+      hash = (hash ^ (unsigned char)word[j]) * prime;
+    }
+    hash = (hash ^ 0xFF) * prime;
+  }
+  return hash;
+}
+
+
+/**
+ * Add a token (word or multi-word entity) to the string table
+ * of the vocabulary, which maps word strings to word indices
+ * and word indices to word strings.
  */
 int Vocabulary::AddWordToVocabulary(const std::string& word)
 {
-  int index = SearchWordInVocabulary(word);
+  UnshareWords();
+  int index = m_words.Insert(word);
   // When a word is unknown, add it to the vocabulary
-  if (index == -1) {
-    // Initialize the word index, count and probability to 0
-    VocabWord w = VocabWord();
-    w.word = word;
-    w.prob = 0.0;
-    w.cn = 1;
-    index = static_cast<int>(m_vocabularyStorage.size());
-    m_vocabularyStorage.push_back(std::move(w));
-    // We need to store the word - index pair in the hash table word -> index
-    // but we will rewrite that map later after sorting the vocabulary by frequency
-    m_mapWord2Index[word] = index;
-    m_mapIndex2Word[index] = word;
+  if (index == static_cast<int>(m_wordCounts.size())) {
+    // Initialize the word count to 1
+    // (the word index will change after sorting the vocabulary by frequency)
+    m_wordCounts.push_back(1);
+    m_wordClasses.push_back(0);
   } else {
     // ... otherwise simply increase its count
-    m_vocabularyStorage[index].cn++;
+    m_wordCounts[index]++;
   }
   return (index);
 }
 
 
+/**
+ * Reference the words of a string table instead of copying them,
+ * e.g., the vocabulary of the training corpus of a tree model
+ * (which is already sorted by frequency).
+ */
+void Vocabulary::ShareWords(const StringTable &table,
+                            const std::vector<int> &tableIds) {
+  m_words.Clear();
+  m_sharedWords = &table;
+  m_sharedIds = tableIds;
+  m_sharedIndices.assign(table.Size(), -1);
+  for (int index = 0; index < (int)tableIds.size(); index++) {
+    m_sharedIndices[tableIds[index]] = index;
+  }
+  m_wordCounts.assign(tableIds.size(), 1);
+  m_wordClasses.assign(tableIds.size(), 0);
+}
+
+
+/**
+ * Copy the words of the shared string table into our own,
+ * in the order of the vocabulary.
+ */
+void Vocabulary::UnshareWords() {
+  if (m_sharedWords == NULL) {
+    return;
+  }
+  StringTable words;
+  for (int index = 0; index < GetVocabularySize(); index++) {
+    words.Insert(WordData(index), WordLength(index));
+  }
+  m_words = words;
+  m_sharedWords = NULL;
+  m_sharedIds.clear();
+  m_sharedIndices.clear();
+}
+
+
 /**
  * Manually set the word count.
  */
@@ -144,7 +189,7 @@ bool Vocabulary::SetWordCount(std::string word, int count) {
   int index = SearchWordInVocabulary(word);
   // When a word is unknown, add it to the vocabulary
   if (index > -1) {
-    m_vocabularyStorage[index].cn = count;
+    m_wordCounts[index] = count;
     return true;
   } else
     return false;
@@ -157,29 +202,32 @@ bool Vocabulary::SetWordCount(std::string word, int count) {
  * </s>, class 1 contains {the} or another, most frequent token,
  * class 2 contains a few very frequent tokens, etc...
  */
-bool OrderWordCounts(const VocabWord& a, const VocabWord& b) {
-  return a.cn > b.cn;
-}
 void Vocabulary::SortVocabularyByFrequency() {
   // Simply sort the words by frequency, making sure that </s> is first
   int indexEos = SearchWordInVocabulary("</s>");
-  int countEos = m_vocabularyStorage[indexEos].cn;
-  m_vocabularyStorage[indexEos].cn = INT_MAX;
-  std::sort(m_vocabularyStorage.begin(),
-            m_vocabularyStorage.end(),
-            OrderWordCounts);
-  m_vocabularyStorage[indexEos].cn = countEos;
-
-  // Rebuild the the maps of word <-> word index
-  m_mapWord2Index.clear();
-  m_mapIndex2Word.clear();
+  int countEos = m_wordCounts[indexEos];
+  m_wordCounts[indexEos] = INT_MAX;
+  std::vector<int> order(GetVocabularySize());
+  for (int index = 0; index < GetVocabularySize(); index++) {
+    order[index] = index;
+  }
+  const std::vector<int> &counts = m_wordCounts;
+  std::sort(order.begin(), order.end(),
+            [&counts](int a, int b) { return counts[a] > counts[b]; });
+
+  // Rebuild the string table of word <-> word index and the counts
+  StringTable words;
+  std::vector<int> wordCounts(GetVocabularySize());
   for (int index = 0; index < GetVocabularySize(); index++) {
-    std::string word = m_vocabularyStorage[index].word;
-    // Add the word to the hash table word -> index
-    m_mapWord2Index[word] = index;
-    // Add the word to the hash table index -> word
-    m_mapIndex2Word[index] = word;
+    words.Insert(WordData(order[index]), WordLength(order[index]));
+    wordCounts[index] = m_wordCounts[order[index]];
   }
+  wordCounts[indexEos] = countEos;
+  m_words = words;
+  m_sharedWords = NULL;
+  m_sharedIds.clear();
+  m_sharedIndices.clear();
+  m_wordCounts.swap(wordCounts);
 }
 
 
@@ -187,12 +235,12 @@ void Vocabulary::SortVocabularyByFrequency() {
  * Return the index of a word in the vocabulary, or -1 if OOV.
  */
 int Vocabulary::SearchWordInVocabulary(const std::string& word) const {
-  auto i = m_mapWord2Index.find(word);
-  if (i == m_mapWord2Index.end()) {
-    return -1;
-  } else {
-    return (i->second);
+  if (m_sharedWords != NULL) {
+    int id = m_sharedWords->Find(word);
+    return ((id >= 0) && (id < (int)m_sharedIndices.size())) ?
+      m_sharedIndices[id] : -1;
   }
+  return m_words.Find(word);
 }
 
 
@@ -220,7 +268,9 @@ bool Vocabulary::ReadClasses(const std::string &filename)
       return false;
     }
 
-    m_mapWord2Class[w] = clnum;
+    int index = m_classFileWords.Insert(w, strlen(w));
+    m_classFileClasses.resize(m_classFileWords.Size());
+    m_classFileClasses[index] = clnum;
     words.insert(w);
 
     max_class = (clnum > max_class) ? (clnum) : (max_class);
@@ -232,18 +282,19 @@ bool Vocabulary::ReadClasses(const std::string &filename)
     return false;
   }
 
-  if (m_mapWord2Class.size() == 0) {
+  if (m_classFileWords.Size() == 0) {
     printf("Error: Empty class file!\n");
     return false;
   }
 
   // </s> needs to have the highest class index because it needs to come first in the vocabulary...
   for (auto si=words.begin(); si!=words.end(); si++) {
-    if (m_mapWord2Class[*si] == eos_class) {
-      m_mapWord2Class[*si] = max_class;
+    int &wordClass = m_classFileClasses[m_classFileWords.Find(*si)];
+    if (wordClass == eos_class) {
+      wordClass = max_class;
     } else {
-      if (m_mapWord2Class[*si] == max_class) {
-        m_mapWord2Class[*si] = eos_class;
+      if (wordClass == max_class) {
+        wordClass = eos_class;
       }
     }
   }
@@ -264,44 +315,44 @@ void Vocabulary::AssignWordsToClasses() {
     int cnum = -1;
     int last = -1;
     for (int i = 0; i < sizeVocabulary; i++) {
-      if (m_vocabularyStorage[i].classIndex != last) {
-        last = m_vocabularyStorage[i].classIndex;
-        m_vocabularyStorage[i].classIndex = ++cnum;
+      if (m_wordClasses[i] != last) {
+        last = m_wordClasses[i];
+        m_wordClasses[i] = ++cnum;
       } else {
-        m_vocabularyStorage[i].classIndex = cnum;
+        m_wordClasses[i] = cnum;
       }
-      // Unused
-      m_vocabularyStorage[i].prob = 0.0;
     }
+  } else if (m_useCostOptimalClasses) {
+    // Cost-optimal classes: contiguous ranges of the words
+    // (sorted by frequency) minimizing the expected cost of the softmax
+    PartitionByCost(m_numClasses, false, &m_wordClasses);
   } else {
     // Frequency-based classes (povey-style)
     // Re-assign classes based on the sqrt(word_count / total_word_count)
     // so that the classes contain equal weight of word occurrences.
     int b = 0;
     for (int i = 0; i < sizeVocabulary; i++) {
-      b += m_vocabularyStorage[i].cn;
+      b += m_wordCounts[i];
     }
     double dd = 0;
     for (int i = 0; i < sizeVocabulary; i++) {
-      dd += sqrt(m_vocabularyStorage[i].cn/ (double)b);
+      dd += sqrt(m_wordCounts[i] / (double)b);
     }
     double df = 0;
     int a = 0;
     for (int i = 0; i < sizeVocabulary; i++) {
-      df += sqrt(m_vocabularyStorage[i].cn / (double)b)/dd;
+      df += sqrt(m_wordCounts[i] / (double)b)/dd;
       if (df > 1) {
         df = 1;
       }
       if (df > (a + 1) / (double)m_numClasses) {
-        m_vocabularyStorage[i].classIndex = a;
+        m_wordClasses[i] = a;
         if (a < m_numClasses - 1) {
           a++;
         }
       } else {
-        m_vocabularyStorage[i].classIndex = a;
+        m_wordClasses[i] = a;
       }
-      // Unused
-      m_vocabularyStorage[i].prob = 0.0;
     }
   }
 
@@ -323,7 +374,7 @@ void Vocabulary::StoreClassAssociations() {
   }
   for (int i = 0; i < GetVocabularySize(); i++) {
     // Assign each word into its class
-    int wordClass = m_vocabularyStorage[i].classIndex;
+    int wordClass = m_wordClasses[i];
     m_classWords[wordClass].push_back(i);
   }
 
@@ -332,3 +383,166 @@ void Vocabulary::StoreClassAssociations() {
     assert(!(m_classWords[i].empty()));
   }
 }
+
+
+/**
+ * Expected cost of the factorized softmax per word token,
+ * for the current classes: number of classes plus the size
+ * of the class of the target word, weighted by word frequency.
+ */
+double Vocabulary::ExpectedSoftmaxCost() const {
+  double total = 0;
+  for (int i = 0; i < GetVocabularySize(); i++) {
+    total += m_wordCounts[i];
+  }
+  double cost = m_numClasses;
+  for (size_t c = 0; c < m_classWords.size(); c++) {
+    double count = 0;
+    for (size_t k = 0; k < m_classWords[c].size(); k++) {
+      count += m_wordCounts[m_classWords[c][k]];
+    }
+    cost += (count / std::max(total, 1.0)) * m_classWords[c].size();
+  }
+  return cost;
+}
+
+
+/**
+ * Number of classes minimizing the expected cost of the softmax
+ * (using cost-optimal classes), and that cost.
+ */
+int Vocabulary::SuggestNumClasses(double *cost) const {
+  std::vector<double> costs =
+  PartitionByCost(GetVocabularySize(), true, NULL);
+  int best = (int)(std::min_element(costs.begin(), costs.end()) - costs.begin());
+  if (cost != NULL) {
+    *cost = costs[best];
+  }
+  return best + 1;
+}
+
+
+/**
+ * Write the classes of words to a file that can be read by ReadClasses:
+ * one word per line, followed by its class index.
+ */
+bool Vocabulary::ExportClasses(const std::string &filename) const {
+  FILE *fo = fopen(filename.c_str(), "w");
+  if (!fo) {
+    printf("Error: unable to open %s\n", filename.c_str());
+    return false;
+  }
+  for (int i = 0; i < GetVocabularySize(); i++) {
+    fprintf(fo, "%s\t%d\n", WordData(i), m_wordClasses[i]);
+  }
+  fclose(fo);
+  return true;
+}
+
+
+/**
+ * Contiguous partitions of the vocabulary (sorted by frequency)
+ * minimizing the expected cost of the softmax, i.e. the sum over classes
+ * of the probability of the class times its size (plus the number
+ * of classes), for 1 to maxNumClasses classes. Dynamic programming
+ * over the number of classes, where the cost of the best partition
+ * of each prefix of the vocabulary into k classes is computed from
+ * the partitions into k-1 classes. The cost of a class satisfies
+ * the quadrangle inequality, so the start of the last class
+ * of the best partition is monotonous in the size of the prefix,
+ * and each step is computed by divide and conquer in O(V log V).
+ * Returns the expected cost with 1 to maxNumClasses classes
+ * (stopping at the minimum, since the cost is convex, if asked),
+ * and stores the classes of the words with maxNumClasses classes
+ * if wordClasses is not NULL.
+ */
+std::vector<double> Vocabulary::PartitionByCost(int maxNumClasses,
+                                                bool stopAtMinimum,
+                                                std::vector<int> *wordClasses) const {
+  int sizeVocabulary = GetVocabularySize();
+  assert((maxNumClasses >= 1) && (maxNumClasses <= sizeVocabulary));
+
+  // Cumulated probability of the words
+  std::vector<double> cumulated(sizeVocabulary + 1, 0.0);
+  for (int i = 0; i < sizeVocabulary; i++) {
+    cumulated[i + 1] = cumulated[i] + m_wordCounts[i];
+  }
+  double total = std::max(cumulated[sizeVocabulary], 1.0);
+  for (int i = 0; i <= sizeVocabulary; i++) {
+    cumulated[i] /= total;
+  }
+
+  // Best partition of the words [0, j) into k classes:
+  // cost, and start of the last class
+  std::vector<double> previous(sizeVocabulary + 1);
+  std::vector<double> current(sizeVocabulary + 1);
+  std::vector<std::vector<int> > starts;
+  for (int j = 0; j <= sizeVocabulary; j++) {
+    previous[j] = cumulated[j] * j;
+  }
+  if (wordClasses != NULL) {
+    starts.push_back(std::vector<int>(sizeVocabulary + 1, 0));
+  }
+  std::vector<double> costs(1, 1 + previous[sizeVocabulary]);
+
+  // Ranges of prefixes [jMin, jMax] left to compute,
+  // with the range of the start of their last class
+  struct Range {
+    int jMin, jMax, iMin, iMax;
+  };
+  std::vector<Range> ranges;
+  for (int k = 2; k <= maxNumClasses; k++) {
+    std::vector<int> *start = NULL;
+    if (wordClasses != NULL) {
+      starts.push_back(std::vector<int>(sizeVocabulary + 1, 0));
+      start = &(starts.back());
+    }
+    Range all = {k, sizeVocabulary, k - 1, sizeVocabulary - 1};
+    ranges.push_back(all);
+    while (!ranges.empty()) {
+      Range range = ranges.back();
+      ranges.pop_back();
+      int j = (range.jMin + range.jMax) / 2;
+      int iBest = range.iMin;
+      double best = -1;
+      for (int i = range.iMin; i <= std::min(range.iMax, j - 1); i++) {
+        double cost = previous[i] + (cumulated[j] - cumulated[i]) * (j - i);
+        if ((best < 0) || (cost < best)) {
+          best = cost;
+          iBest = i;
+        }
+      }
+      current[j] = best;
+      if (start != NULL) {
+        (*start)[j] = iBest;
+      }
+      if (range.jMin < j) {
+        Range left = {range.jMin, j - 1, range.iMin, iBest};
+        ranges.push_back(left);
+      }
+      if (j < range.jMax) {
+        Range right = {j + 1, range.jMax, iBest, range.iMax};
+        ranges.push_back(right);
+      }
+    }
+    previous.swap(current);
+    costs.push_back(k + previous[sizeVocabulary]);
+    if (stopAtMinimum && (costs[k - 1] > costs[k - 2])) {
+      break;
+    }
+  }
+
+  // Follow the starts of the classes back from the whole vocabulary
+  if (wordClasses != NULL) {
+    wordClasses->resize(sizeVocabulary);
+    int end = sizeVocabulary;
+    for (int k = maxNumClasses; k >= 1; k--) {
+      int begin = starts[k - 1][end];
+      for (int i = begin; i < end; i++) {
+        (*wordClasses)[i] = k - 1;
+      }
+      end = begin;
+    }
+  }
+  return costs;
+}
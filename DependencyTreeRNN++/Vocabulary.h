@@ -39,25 +39,18 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <set>
-#include <unordered_map>
-
-
-/**
- * Element of vocabulary
- */
-struct VocabWord {
-  std::string word;
-  double prob;
-  int cn;
-  int classIndex;
-};
+#include "StringTable.h"
 
 
 /**
  * Class storing word in vocabulary, word classes
- * and hash tables to associate them
+ * and hash tables to associate them: the words are interned
+ * in a string table, either its own or that of a corpus of unrolls
+ * (see ShareWords), and their counts and classes are stored
+ * in arrays indexed by word
  */
 class Vocabulary {
 public:
@@ -66,7 +59,8 @@ public:
    * Constructor.
    */
   Vocabulary(int numClasses)
-  : m_numClasses(numClasses), m_useClassFile(false) {
+  : m_sharedWords(NULL), m_useClassFile(false),
+  m_useCostOptimalClasses(false), m_numClasses(numClasses) {
   }
 
   /**
@@ -84,11 +78,26 @@ public:
    */
   int SearchWordInVocabulary(const std::string& word) const;
 
+  /**
+   * Signature of the vocabulary used to index the words
+   * of the word index streams (64-bit FNV-1a hash of the words
+   * in index order)
+   */
+  unsigned long long Signature() const;
+
   /**
    * Add word to the vocabulary.
    */
   int AddWordToVocabulary(const std::string& word);
 
+  /**
+   * Reference the words of a string table (e.g., the vocabulary
+   * of a corpus) instead of copying them: word k of the vocabulary
+   * is the string of id tableIds[k] in the table, which must outlive
+   * the vocabulary and not change. The counts of the words are set to 1.
+   */
+  void ShareWords(const StringTable &table, const std::vector<int> &tableIds);
+
   /**
    * Sort the words in the vocabulary by frequency.
    */
@@ -104,11 +113,35 @@ public:
    */
   void AssignWordsToClasses();
 
+  /**
+   * Assign the words to classes that minimize the expected cost
+   * of the softmax (instead of the frequency-based classes).
+   */
+  void SetCostOptimalClasses(bool val) { m_useCostOptimalClasses = val; }
+
+  /**
+   * Expected cost of the factorized softmax per word token,
+   * for the current classes: number of classes plus the size
+   * of the class of the target word, weighted by word frequency.
+   */
+  double ExpectedSoftmaxCost() const;
+
+  /**
+   * Number of classes minimizing the expected cost of the softmax
+   * (using cost-optimal classes), and that cost.
+   */
+  int SuggestNumClasses(double *cost) const;
+
+  /**
+   * Write the classes of words to a file that can be read by ReadClasses.
+   */
+  bool ExportClasses(const std::string &filename) const;
+
   /**
    * Return the number of words/entity tokens in the vocabulary.
    */
   int GetVocabularySize() const {
-    return static_cast<int>(m_vocabularyStorage.size());
+    return (m_sharedWords != NULL) ? (int)m_sharedIds.size() : m_words.Size();
   }
 
   /**
@@ -116,18 +149,25 @@ public:
    */
   bool SetWordCount(std::string word, int count);
 
+  /**
+   * Return the count of a word (referenced by an index).
+   */
+  int GetWordCount(int word) const {
+    return m_wordCounts[word];
+  }
+
   /**
    * Return the n-th word in the vocabulary.
    */
   std::string GetNthWord(int word) const {
-    return m_vocabularyStorage[word].word;
+    return std::string(WordData(word), WordLength(word));
   }
 
   /**
    * Return the index of a given word in the vocabulary.
    */
   std::string Word2WordIndex(int word) const {
-    return m_vocabularyStorage[word].word;
+    return std::string(WordData(word), WordLength(word));
   }
 
   /**
@@ -137,11 +177,22 @@ public:
     return static_cast<int>(m_classWords[targetClass].size());
   }
 
+  /**
+   * Return the size of the largest word class.
+   */
+  int GetMaxClassSize() const {
+    size_t sizeMax = 0;
+    for (size_t c = 0; c < m_classWords.size(); c++) {
+      sizeMax = std::max(sizeMax, m_classWords[c].size());
+    }
+    return static_cast<int>(sizeMax);
+  }
+
   /**
    * Return the class index of a word (referenced by an index).
    */
   int WordIndex2Class(int word) const {
-    return m_vocabularyStorage[word].classIndex;
+    return m_wordClasses[word];
   }
 
   /**
@@ -153,28 +204,54 @@ public:
 
 public:
 
-  // Vocabulary storage
-  std::vector<VocabWord> m_vocabularyStorage;
+  // Vocabulary representation (word <-> index of the word),
+  // unless the words are shared with another string table
+  StringTable m_words;
 
-  // Vocabulary representation (word -> index of the word)
-  std::unordered_map<std::string, int> m_mapWord2Index;
+  // Shared table of the words (or NULL), table id of each word
+  // and word of each table id (-1 if not in the vocabulary)
+  const StringTable *m_sharedWords;
+  std::vector<int> m_sharedIds;
+  std::vector<int> m_sharedIndices;
 
-  // Inverse vocabulary representation (index of the word -> word)
-  std::unordered_map<int, std::string> m_mapIndex2Word;
+  // Count and class of each word (indexed by word)
+  std::vector<int> m_wordCounts;
+  std::vector<int> m_wordClasses;
 
-  // Hash table enabling a look-up of the class of a word
-  // (word -> word class)
-  std::unordered_map<std::string, int> m_mapWord2Class;
+  // Words of the class file and their classes
+  // (indexed by their position in that string table)
+  StringTable m_classFileWords;
+  std::vector<int> m_classFileClasses;
 
   // Information relative to the classes
   std::vector<std::vector<int> > m_classWords;
 
 protected:
   bool m_useClassFile;
+  bool m_useCostOptimalClasses;
   int m_numClasses;
 
   // Store information on which word is in which class
   void StoreClassAssociations();
+
+  // String of a word, in the shared table or in our own
+  const char *WordData(int word) const {
+    return (m_sharedWords != NULL) ?
+      m_sharedWords->Data(m_sharedIds[word]) : m_words.Data(word);
+  }
+  size_t WordLength(int word) const {
+    return (m_sharedWords != NULL) ?
+      m_sharedWords->Length(m_sharedIds[word]) : m_words.Length(word);
+  }
+
+  // Copy the shared words into our own table before modifying it
+  void UnshareWords();
+
+  // Contiguous partitions of the vocabulary minimizing the expected
+  // cost of the softmax, with up to maxNumClasses classes
+  std::vector<double> PartitionByCost(int maxNumClasses,
+                                      bool stopAtMinimum,
+                                      std::vector<int> *wordClasses) const;
 }; // class Vocabulary
 
 #endif
@@ -0,0 +1,179 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef DependencyTreeRNN___WordIndexStream_h
+#define DependencyTreeRNN___WordIndexStream_h
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include "MemoryMappedFile.h"
+
+
+/**
+ * Header of the word index stream files, followed by the word indices
+ * of the tokens (numTokens int, one sentence ending with </s>, index 0,
+ * after the other, -1 for OOV words), padding to 8 bytes, and the
+ * feature vectors of the first numFeatureVectors tokens
+ * (sizeFeature floats each, in the order of the tokens)
+ */
+struct WordIndexStreamHeader {
+  char magic[8];
+  int version;
+  int sizeFeature;
+  unsigned long long signature;
+  long long numTokens;
+  long long numSentences;
+  long long numFeatureVectors;
+};
+static const char c_wordIndexStreamMagic[8] = {'D', 'T', 'R', 'N', 'N', 'I', 'D', 'X'};
+static const int c_wordIndexStreamVersion = 1;
+
+
+/**
+ * Sequential text file (and its feature vectors, if any) compiled once
+ * into a binary file of word indices that is memory-mapped:
+ * sentences are read without tokenizing the text or looking up words,
+ * and each token comes with its own feature vector,
+ * so that words and features cannot drift apart.
+ */
+class WordIndexStream {
+public:
+
+  /**
+   * Constructor: the stream is not mapped
+   */
+  WordIndexStream()
+  : m_words(NULL), m_features(NULL), m_numTokens(0), m_numSentences(0),
+  m_numFeatureVectors(0), m_sizeFeature(0), m_position(0) { }
+
+  /**
+   * Map a word index stream file. Returns false if the file
+   * does not exist or is stale (other vocabulary, text or features).
+   */
+  bool Open(const std::string &filename, unsigned long long signature,
+            int sizeFeature) {
+    Close();
+    if (!m_file.Open(filename)) {
+      return false;
+    }
+    WordIndexStreamHeader header;
+    if (m_file.Size() < sizeof(header)) {
+      Close();
+      return false;
+    }
+    memcpy(&header, m_file.Data(), sizeof(header));
+    if ((memcmp(header.magic, c_wordIndexStreamMagic,
+                sizeof(header.magic)) != 0) ||
+        (header.version != c_wordIndexStreamVersion) ||
+        (header.signature != signature) ||
+        (header.sizeFeature != sizeFeature) ||
+        (header.numTokens < 0) || (header.numFeatureVectors < 0) ||
+        (header.numFeatureVectors > header.numTokens) ||
+        (m_file.Size() != Size(header))) {
+      Close();
+      return false;
+    }
+    const char *data = m_file.Data() + sizeof(header);
+    m_words = reinterpret_cast<const int *>(data);
+    m_features =
+    reinterpret_cast<const float *>(data + WordsSize(header.numTokens));
+    m_numTokens = header.numTokens;
+    m_numSentences = header.numSentences;
+    m_numFeatureVectors = header.numFeatureVectors;
+    m_sizeFeature = sizeFeature;
+    m_position = 0;
+    // Start paging in the stream
+    m_file.WillNeed();
+    return true;
+  }
+
+  /**
+   * Unmap the stream
+   */
+  void Close() {
+    m_file.Close();
+    m_words = NULL;
+    m_features = NULL;
+    m_numTokens = 0;
+    m_numSentences = 0;
+    m_numFeatureVectors = 0;
+    m_position = 0;
+  }
+
+  /**
+   * Is the stream mapped?
+   */
+  bool IsOpen() const { return (m_words != NULL); }
+
+  /**
+   * Number of tokens (including </s>) and of sentences
+   */
+  long long NumTokens() const { return m_numTokens; }
+  long long NumSentences() const { return m_numSentences; }
+
+  /**
+   * Go back to the first sentence
+   */
+  void Rewind() { m_position = 0; }
+
+  /**
+   * Read the next sentence (ending with </s>) as word indices,
+   * and the feature vectors of its words if there are any.
+   * Returns false at the end of the stream.
+   */
+  bool ReadSentence(std::vector<int> &sentence,
+                    std::vector<double> &features) {
+    sentence.clear();
+    features.clear();
+    while (m_position < m_numTokens) {
+      int word = m_words[m_position];
+      sentence.push_back(word);
+      if (m_position < m_numFeatureVectors) {
+        const float *feature = m_features + m_position * m_sizeFeature;
+        features.insert(features.end(), feature, feature + m_sizeFeature);
+      }
+      m_position++;
+      if (word == 0) {
+        break;
+      }
+    }
+    return !sentence.empty();
+  }
+
+  /**
+   * Size of the word indices, padded to 8 bytes
+   */
+  static size_t WordsSize(long long numTokens) {
+    return ((sizeof(int) * (size_t)numTokens + 7) / 8) * 8;
+  }
+
+  /**
+   * Size of a word index stream file
+   */
+  static size_t Size(const WordIndexStreamHeader &header) {
+    return sizeof(header) + WordsSize(header.numTokens) +
+    sizeof(float) * (size_t)header.numFeatureVectors * header.sizeFeature;
+  }
+
+protected:
+
+  // Mapped file, word indices and feature vectors
+  MemoryMappedFile m_file;
+  const int *m_words;
+  const float *m_features;
+
+  // Number of tokens, sentences and feature vectors
+  long long m_numTokens;
+  long long m_numSentences;
+  long long m_numFeatureVectors;
+  int m_sizeFeature;
+
+  // Position of the next token
+  long long m_position;
+};
+
+#endif
@@ -41,13 +41,20 @@
 #include <fstream>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <assert.h>
 #include <vector>
+#include <memory>
+#include <algorithm>
 #include <time.h>
+#include <unistd.h>
 
 #include "CommandLineParser.h"
 #include "RnnDependencyTreeLib.h"
 #include "RnnTraining.h"
+#include "RnnServer.h"
+#include "RnnEnsemble.h"
+#include "Blas.h"
 
 using namespace std;
 
@@ -62,11 +69,103 @@ bool checkFile(string filename, string msg) {
 }
 
 
+/**
+ * Serve scoring requests with a loaded model, on the standard input
+ * or on a TCP port
+ */
+static int serve(RnnLMTraining &model, const string &serverAddress,
+                 int numThreads, int batchSize, int queueSize, int fdOutput) {
+  RnnServer server(model, numThreads, batchSize, queueSize);
+  bool ok = false;
+  if (serverAddress == "stdin") {
+    ok = server.ServeStream(STDIN_FILENO, fdOutput);
+  } else {
+    ok = server.ServeSocket(atoi(serverAddress.c_str()));
+  }
+  return ok ? 0 : 1;
+}
+
+
+/**
+ * Options that may differ between the models trained together:
+ * architecture and training of each model (the corpus is shared)
+ */
+static const char *const c_trainedModelOptions[] = {
+  "rnnlm", "hidden", "class", "class-assignment", "export-classes",
+  "compression", "direct", "direct-order", "bptt", "bptt-block",
+  "alpha", "beta", "gradient-cutoff", "min-improvement", "independent",
+  "feature-gamma", "threads", "sampled-softmax", "tree-training"
+};
+
+
+/**
+ * Options that may differ between the models of an ensemble:
+ * each model, its kind and how it reads the test data
+ * (the sentence labels are shared)
+ */
+static const char *const c_ensembleModelOptions[] = {
+  "rnnlm", "feature-labels-type", "vocab", "test", "path-json-books",
+  "path-bin-books", "prefix-cache", "batch", "float32", "direct-precision"
+};
+
+
+/**
+ * Read the configurations of several models (trained together, or
+ * in an ensemble), one model per line of the file (empty lines and lines
+ * starting with # are skipped): the options of a line
+ * (e.g., -rnnlm h200.model -hidden 200 -threads 4), among those
+ * which may differ between the models, override those
+ * of the command line, for that model only
+ */
+static bool readModelConfigurations(const string &filename,
+                                    const CommandLineParser &parser,
+                                    const char *const modelOptions[],
+                                    size_t numModelOptions,
+                                    vector<CommandLineParser> &configurations) {
+  ifstream configStream(filename);
+  string line;
+  while (getline(configStream, line)) {
+    istringstream lineStream(line);
+    // The first element stands for the name of the program
+    vector<string> tokens(1, filename);
+    string token;
+    while (lineStream >> token) {
+      tokens.push_back(token);
+    }
+    if ((tokens.size() == 1) || (tokens[1][0] == '#')) {
+      continue;
+    }
+    for (size_t k = 1; k < tokens.size(); k += 2) {
+      bool isModelOption = false;
+      for (size_t j = 0; j < numModelOptions; j++) {
+        isModelOption |= (tokens[k] == string("-") + modelOptions[j]);
+      }
+      if (!isModelOption) {
+        cout << "ERROR: " << tokens[k] << " cannot differ between models\n";
+        return false;
+      }
+    }
+    vector<char *> list;
+    for (size_t k = 0; k < tokens.size(); k++) {
+      list.push_back(&tokens[k][0]);
+    }
+    CommandLineParser configuration(parser);
+    if (!configuration.Parse(&list[0], (int)list.size())) {
+      return false;
+    }
+    configurations.push_back(configuration);
+  }
+  return !configurations.empty();
+}
+
+
 int main(int argc, char *argv[]) {
   // Command line arguments
   CommandLineParser parser;
   parser.Register("debug", "bool",
                   "Debugging level", "false");
+  parser.Register("profile", "bool",
+                  "Time the phases of the training (forward and back-propagation, BPTT, direct n-gram connections, reading the data and validation) and append them regularly to the file <model>.profile.csv", "false");
   parser.Register("train", "string",
                   "Training data file (pure text)");
   parser.Register("valid", "string",
@@ -77,6 +176,8 @@ int main(int argc, char *argv[]) {
                   "Validation/test sentence labels file (pure text)");
   parser.Register("path-json-books", "string",
                   "Path to the book JSON files", "./");
+  parser.Register("path-bin-books", "string",
+                  "Path where the JSON books (or the sequential text files and their features) are compiled (once) into binary books (or word index streams) that are memory-mapped at every epoch");
   parser.Register("rnnlm", "string",
                   "RNN language model file to use (save in training / read in test)");
   parser.Register("vocab", "string",
@@ -96,6 +197,11 @@ int main(int argc, char *argv[]) {
                   "Number of classes", "200");
   parser.Register("class-file", "string",
                   "File specifying the class of each word");
+  parser.Register("class-assignment", "string",
+                  "Assignment of the words to classes: frequency = equal sqrt-frequency mass in each class, cost = minimize the expected cost of the softmax (and suggest the number of classes)",
+                  "frequency");
+  parser.Register("export-classes", "string",
+                  "File where the classes of words are written (format of -class-file)");
   parser.Register("gradient-cutoff", "double",
                   "decay weight for features matrix", "15");
   parser.Register("independent", "bool",
@@ -118,10 +224,50 @@ int main(int argc, char *argv[]) {
                   "Number of steps to propagate error back in time", "4");
   parser.Register("bptt-block", "int",
                   "Number of time steps after which the error is backpropagated through time", "10");
+  parser.Register("sampled-softmax", "int",
+                  "Number of words sampled from the unigram distribution of the class of each training word, whose outputs are the only ones computed and updated within that class (0 = exact softmax); the class softmax and the evaluation remain exact, and the training entropy is that of the sampled softmax", "0");
+  parser.Register("tree-training", "bool",
+                  "Train on dependency parse trees over the tree of the unrolls of each sentence: the steps shared by several unrolls are run once, weighted by the inverse of the number of steps predicting the same token, and the gradients of all the unrolls are backpropagated through time together before one update of the recurrent weights per sentence", "false");
   parser.Register("unk-penalty", "double",
                   "Penalty to add to <unk> in rescoring; normalizes type vs. token distinction", "-11");
   parser.Register("min-word-occurrence", "int",
                   "Mininum word occurrence to include word into vocabulary", "3");
+  parser.Register("threads", "int",
+                  "Number of threads training the model in parallel (with lock-free updates of the weights) and evaluating independent sentences in parallel; training on sequential text with independent=false needs a single thread", "1");
+  parser.Register("checkpoint-books", "int",
+                  "Number of books after which the training on dependency parse trees saves a checkpoint of the model in the background (0 = none); an interrupted training resumes from the last checkpoint, in the middle of its epoch", "0");
+  parser.Register("cluster", "string",
+                  "Address (host:port) of the first node of a cluster training on dependency parse trees: each node trains with its threads on its shard of the books, and the nodes periodically average their weights");
+  parser.Register("cluster-nodes", "int",
+                  "Number of nodes of the cluster", "1");
+  parser.Register("cluster-rank", "int",
+                  "Rank of this node in the cluster (the first node, of rank 0, validates and saves the model)", "0");
+  parser.Register("cluster-sync-books", "int",
+                  "Number of books trained on by each node of the cluster between two averagings of the weights (0 = once per epoch)", "0");
+  parser.Register("models", "string",
+                  "File of the models trained together on dependency parse trees, reading each book once for all the models: one model per line, with the options that differ from the command line (e.g., -rnnlm h200.model -hidden 200 -threads 4)");
+  parser.Register("ensemble", "string",
+                  "File of the models of an ensemble scoring the test sentences in one process, reading the test data once for the models which read it the same way: one model per line, with the options that differ from the command line (e.g., -rnnlm tree.model -vocab tree.model.vocab.txt, or -rnnlm seq.model -feature-labels-type -1 -test test.txt); the scores of the ensemble are written to FILE.scores.txt");
+  parser.Register("batch", "int",
+                  "Number of independent sentences forward-propagated in lockstep by each thread when testing on sequential text", "1");
+  parser.Register("nbest", "int",
+                  "Number of consecutive candidate sentences of each n-best list when testing on sequential text (e.g., 5 for the sentence completion questions); the RNN states along the words shared by the candidates are computed once", "1");
+  parser.Register("prefix-cache", "bool",
+                  "Reuse the RNN states of unroll prefixes shared within a sentence when testing on dependency parse trees", "false");
+  parser.Register("float32", "bool",
+                  "Test the model with single-precision (float) weights and activations", "false");
+  parser.Register("direct-precision", "string",
+                  "Storage of the direct n-gram connections when testing: float32, float16 or int8 (8-bit integers with one scale per 256 connections)", "float32");
+  parser.Register("blas", "string",
+                  "Backend of the matrix products: library (the BLAS library linked with the program) or reference (plain loops in the calling thread)", "library");
+  parser.Register("blas-threads", "int",
+                  "Number of threads of the BLAS library (OpenBLAS or MKL) within each matrix product (0 = one thread when the program runs several threads or models, otherwise the default of the library)", "0");
+  parser.Register("convert-model", "string",
+                  "Convert the RNN model file to the other format (memory-mapped float32 or default) and save it to this file");
+  parser.Register("server", "string",
+                  "Serve line-delimited JSON scoring requests with the loaded model, on the standard input (stdin) or on a TCP port; -threads and -batch set the number of threads and of requests scored together");
+  parser.Register("server-queue", "int",
+                  "Maximum number of requests waiting in the queue of the scoring server", "1024");
   
   // Parse the command line arguments
   bool status = parser.Parse(argv, argc);
@@ -132,7 +278,40 @@ int main(int argc, char *argv[]) {
   // Set debug mode
   bool debugMode = false;
   parser.Get("debug", debugMode);
+  // Time the phases of the training
+  bool isProfiled = false;
+  parser.Get("profile", isProfiled);
+  Profiler::IsEnabled() = isProfiled;
   
+  // Search for the file to which the RNN model is converted
+  string convertedModelFilename;
+  bool isConvertSet = parser.Get("convert-model", convertedModelFilename);
+
+  // Search for the address of the scoring server
+  string serverAddress;
+  bool isServerSet = parser.Get("server", serverAddress);
+  if (isServerSet && (serverAddress != "stdin") &&
+      ((atoi(serverAddress.c_str()) <= 0) ||
+       (atoi(serverAddress.c_str()) > 65535))) {
+    cout << "ERROR: server must be stdin or a TCP port number\n";
+    return 1;
+  }
+  int serverQueueSize = 1024;
+  parser.Get("server-queue", serverQueueSize);
+  // On the standard input, the standard output is kept for the responses
+  // of the server, and everything else is logged to the standard error
+  int fdServerOutput = STDOUT_FILENO;
+  if (isServerSet && (serverAddress == "stdin")) {
+    fdServerOutput = RnnServer::DetachStandardOutput();
+  }
+
+  // Search for the file of the models of an ensemble
+  string ensembleFilename;
+  bool isEnsembleSet = parser.Get("ensemble", ensembleFilename);
+  if (isEnsembleSet) {
+    if (!checkFile(ensembleFilename, "ensemble")) { return 1; }
+  }
+
   // Search for train file
   string trainFilename;
   bool isTrainDataSet = parser.Get("train", trainFilename);
@@ -155,7 +334,8 @@ int main(int argc, char *argv[]) {
   if (isTestDataSet) {
     if (!checkFile(testFilename, "test data")) { return 1; }
   }
-  if (!isTestDataSet && !isTrainDataSet) {
+  if (!isTestDataSet && !isTrainDataSet && !isConvertSet && !isServerSet &&
+      !isEnsembleSet) {
     cout << "ERROR: training or testing file must be specified!\n";
     return 1;
   }
@@ -165,40 +345,92 @@ int main(int argc, char *argv[]) {
   if (isSentenceLabelsSet) {
     if (!checkFile(sentenceLabelsFilename, "sentence labels")) { return 1; }
   }
-  if (!isTestDataSet && !isTrainDataSet) {
+  if (!isTestDataSet && !isTrainDataSet && !isConvertSet && !isServerSet &&
+      !isEnsembleSet) {
     cout << "ERROR: training or testing file must be specified!\n";
     return 1;
   }
   // Search for the RNN model file
   string rnnModelFilename;
   bool isRnnModelSet = parser.Get("rnnlm", rnnModelFilename);
-  if (!isRnnModelSet) {
+  // Search for the file of the models trained together
+  string modelsFilename;
+  bool isModelsSet = parser.Get("models", modelsFilename);
+  if (isModelsSet) {
+    if (!checkFile(modelsFilename, "models")) { return 1; }
+  }
+  if (!isRnnModelSet && !isModelsSet && !isEnsembleSet) {
     cout << "ERROR: RNN model file not specified\n";
     return 1;
   }
+  // Search for the cluster of nodes training together
+  string clusterAddress;
+  bool isClusterSet = parser.Get("cluster", clusterAddress);
+  int clusterNodes = 1;
+  parser.Get("cluster-nodes", clusterNodes);
+  int clusterRank = 0;
+  parser.Get("cluster-rank", clusterRank);
+  int clusterSyncBooks = 0;
+  parser.Get("cluster-sync-books", clusterSyncBooks);
+  string clusterHost;
+  int clusterPort = 0;
+  if (isClusterSet) {
+    size_t colon = clusterAddress.rfind(':');
+    if (colon != string::npos) {
+      clusterHost = clusterAddress.substr(0, colon);
+      clusterPort = atoi(clusterAddress.c_str() + colon + 1);
+    }
+    if (clusterHost.empty() || (clusterPort <= 0) || (clusterPort > 65535)) {
+      cout << "ERROR: cluster must be host:port\n";
+      return 1;
+    }
+    if ((clusterNodes < 1) || (clusterRank < 0) ||
+        (clusterRank >= clusterNodes) || (clusterSyncBooks < 0)) {
+      cout << "ERROR: invalid cluster-nodes, cluster-rank or cluster-sync-books\n";
+      return 1;
+    }
+    // Only the first node saves the model: the other nodes
+    // keep their files (e.g., logs) next to it
+    if (clusterRank > 0) {
+      rnnModelFilename += ".node" + to_string(clusterRank);
+    }
+  }
   bool isRnnModelPresent = false;
   ifstream checkStream(rnnModelFilename);
   if (checkStream) {
     cout << "RNN model file exists\n";
     isRnnModelPresent = true;
   }
-  if (isRnnModelSet && isTestDataSet && !isRnnModelPresent) {
+  if (isRnnModelSet && (isTestDataSet || isConvertSet || isServerSet) &&
+      !isRnnModelPresent) {
     cout << "ERROR: RNN model file not found!\n";
     return 1;
   }
+
+  // Convert the RNN model file to the other format
+  if (isConvertSet) {
+    RnnLMTraining model(rnnModelFilename, true, debugMode);
+    return model.ConvertRnnModelFile(convertedModelFilename) ? 0 : 1;
+  }
   // Search for the JSON book files path
   string jsonPathname;
   bool isJsonPathSet = parser.Get("path-json-books", jsonPathname);
   if (isJsonPathSet) {
     if (!checkFile(jsonPathname, "JSON book path")) { return 1; }
   }
+  // Search for the binary book files path
+  string binaryBookPathname;
+  bool isBinaryBookPathSet = parser.Get("path-bin-books", binaryBookPathname);
+  if (isBinaryBookPathSet) {
+    if (!checkFile(binaryBookPathname, "binary book path")) { return 1; }
+  }
   // Search for file containing the vocabulary
   string vocabularyFilename;
   bool isVocabularySet = parser.Get("vocab", vocabularyFilename);
   if (isVocabularySet) {
     if (!checkFile(vocabularyFilename, "vocabulary")) { return 1; }
   }
-  if (!isTestDataSet && !isTrainDataSet) {
+  if (!isTestDataSet && !isTrainDataSet && !isServerSet && !isEnsembleSet) {
     cout << "ERROR: training or testing file must be specified!\n";
     return 1;
   }
@@ -245,6 +477,18 @@ int main(int argc, char *argv[]) {
   if (isClassFileSet) {
     if (!checkFile(classFilename, "class data")) { return 1; }
   }
+  // Set the assignment of words to classes
+  string classAssignment = "frequency";
+  parser.Get("class-assignment", classAssignment);
+  if ((classAssignment != "frequency") && (classAssignment != "cost")) {
+    cout << "ERROR: class assignment must be frequency or cost\n";
+    return 1;
+  }
+  bool useCostOptimalClasses = (classAssignment == "cost");
+  // Set the file where the classes are exported
+  string exportClassesFilename;
+  bool isExportClassesSet =
+  parser.Get("export-classes", exportClassesFilename);
   
   // Set gradient cutoff
   double gradientCutoff = 15;
@@ -299,14 +543,121 @@ int main(int argc, char *argv[]) {
   if (bpttBlock < 1) {
     bpttBlock = 1;
   }
+  // Number of words sampled in the class of each training word
+  int numSampledWords = 0;
+  parser.Get("sampled-softmax", numSampledWords);
+  if (numSampledWords < 0) {
+    cerr << "Number of sampled words must be non-negative; saw: "
+    << numSampledWords << endl;
+    return 1;
+  }
+  // Train over the trees of the unrolls of the sentences
+  bool useTreeTraining = false;
+  parser.Get("tree-training", useTreeTraining);
   // Penalty for <unk>
   double unkPenalty = -11;
   parser.Get("unk-penalty", unkPenalty);
   // Minimum word occurrence
   int minWordOccurrence = 3;
   parser.Get("min-word-occurrence", minWordOccurrence);
+  // Number of training threads
+  int numThreads = 1;
+  parser.Get("threads", numThreads);
+  if (numThreads < 1) {
+    cerr << "Number of threads must be positive; saw: " << numThreads << endl;
+    return 1;
+  }
+  // Number of sentences evaluated in lockstep
+  int batchSize = 1;
+  parser.Get("batch", batchSize);
+  if (batchSize < 1) {
+    cerr << "Batch size must be positive; saw: " << batchSize << endl;
+    return 1;
+  }
+  // Number of books between two checkpoints of the training
+  int checkpointInterval = 0;
+  parser.Get("checkpoint-books", checkpointInterval);
+  if (checkpointInterval < 0) {
+    cerr << "Checkpoint interval must be non-negative; saw: "
+    << checkpointInterval << endl;
+    return 1;
+  }
+  // Number of candidate sentences in each n-best list
+  int nBestSize = 1;
+  parser.Get("nbest", nBestSize);
+  if (nBestSize < 1) {
+    cerr << "N-best list size must be positive; saw: " << nBestSize << endl;
+    return 1;
+  }
+  // Cache of states along shared unroll prefixes
+  bool usePrefixCache = false;
+  parser.Get("prefix-cache", usePrefixCache);
+  // Single-precision evaluation engine
+  bool useFloat32 = false;
+  parser.Get("float32", useFloat32);
+  // Storage of the direct n-gram connections when testing
+  string directPrecisionName = "float32";
+  parser.Get("direct-precision", directPrecisionName);
+  DirectNGramPrecision directPrecision = c_directNGramFloat32;
+  if (directPrecisionName == "float16") {
+    directPrecision = c_directNGramFloat16;
+  } else if (directPrecisionName == "int8") {
+    directPrecision = c_directNGramInt8;
+  } else if (directPrecisionName != "float32") {
+    cout << "ERROR: direct-precision must be float32, float16 or int8\n";
+    return 1;
+  }
+  // Backend of the matrix products, and threads of the BLAS library
+  string blasBackendName = "library";
+  parser.Get("blas", blasBackendName);
+  if (!SetBlasBackend(blasBackendName)) {
+    cout << "ERROR: blas must be library or reference\n";
+    return 1;
+  }
+  int numBlasThreads = 0;
+  parser.Get("blas-threads", numBlasThreads);
+  if (numBlasThreads < 0) {
+    cerr << "Number of BLAS threads must be non-negative; saw: "
+    << numBlasThreads << endl;
+    return 1;
+  }
+  if (numBlasThreads > 0) {
+    if (!SetBlasThreads(numBlasThreads)) {
+      cout << "The BLAS library does not control its number of threads\n";
+    }
+  } else if ((numThreads > 1) || isModelsSet || isEnsembleSet) {
+    SetBlasThreads(1);
+  }
+
+  // Serve scoring requests with a model trained on dependency parse trees
+  if (isServerSet && (featureDepLabelsType >= 0)) {
+    RnnTreeLM model(rnnModelFilename, true, debugMode);
+    // Read the vocabulary
+    if (!isVocabularySet) {
+      cerr << "Need to specify vocabulary file\n";
+      return 1;
+    }
+    model.ImportVocabularyFromFile(vocabularyFilename, model.GetNumClasses());
+    model.SetDependencyLabelType(featureDepLabelsType);
+    model.SetPrefixCache(usePrefixCache);
+    model.SetFloat32Engine(useFloat32);
+    model.QuantizeDirectNGram(directPrecision);
+    return serve(model, serverAddress, numThreads, batchSize,
+                 serverQueueSize, fdServerOutput);
+  }
+
+  // Serve scoring requests with a model trained on sequential text
+  if (isServerSet) {
+    RnnLMTraining model(rnnModelFilename, true, debugMode);
+    model.SetBatchSize(batchSize);
+    model.SetFloat32Engine(useFloat32);
+    model.QuantizeDirectNGram(directPrecision);
+    return serve(model, serverAddress, numThreads, batchSize,
+                 serverQueueSize, fdServerOutput);
+  }
   
-  if (isTrainDataSet && isRnnModelSet && (featureDepLabelsType < 0)) {
+  if (isTrainDataSet && isRnnModelSet && !isModelsSet &&
+      (featureDepLabelsType < 0)) {
     // Construct the RNN object, setting the filename, without loading anything
     RnnLMTraining model(rnnModelFilename, isRnnModelPresent, debugMode);
 
@@ -343,9 +694,15 @@ int main(int argc, char *argv[]) {
     } else {
       // Set the minimum number of word occurrence
       model.SetMinWordOccurrence(minWordOccurrence);
+      // Set the assignment of words to classes
+      model.SetCostOptimalClasses(useCostOptimalClasses);
       // Extract the vocabulary from the training file
       model.LearnVocabularyFromTrainFile(numClasses);
     }
+    // Export the classes of words
+    if (isExportClassesSet) {
+      model.ExportClasses(exportClassesFilename);
+    }
 
     // Initialize the model...
     int sizeVocabulary = model.GetVocabularySize();
@@ -381,12 +738,179 @@ int main(int argc, char *argv[]) {
       model.SetBPTTBlock(bpttBlock);
       model.SetIndependent(independent);
     }
+    // Set the number of training threads
+    model.SetNumThreads(numThreads);
+    // Sample the words of the class of each training word
+    model.SetNumSampledWords(numSampledWords);
+    // Set the number of validation sentences evaluated in lockstep
+    model.SetBatchSize(batchSize);
+    // Compile the text files into word index streams
+    model.SetBinaryTextPath(binaryBookPathname);
     
     // Train the model
-    model.TrainRnnModel();
+    if (!model.TrainRnnModel()) {
+      return 1;
+    }
   }
   
-  if (isTrainDataSet && isRnnModelSet && (featureDepLabelsType >= 0)) {
+  // Train several models together on dependency parse trees
+  if (isTrainDataSet && isModelsSet) {
+    if ((featureDepLabelsType < 0) || isClusterSet || isClassFileSet) {
+      cout << "ERROR: models are trained together on dependency parse trees,"
+      << " without cluster nor class file\n";
+      return 1;
+    }
+    vector<CommandLineParser> configurations;
+    if (!readModelConfigurations(modelsFilename, parser, c_trainedModelOptions,
+                                 sizeof(c_trainedModelOptions) / sizeof(char *),
+                                 configurations)) {
+      cout << "ERROR: invalid models file " << modelsFilename << "\n";
+      return 1;
+    }
+    vector<unique_ptr<RnnTreeLM> > models;
+    vector<RnnTreeLM *> modelPointers;
+    vector<string> modelFilenames;
+    for (size_t k = 0; k < configurations.size(); k++) {
+      CommandLineParser &options = configurations[k];
+      string modelFilename;
+      if (!options.Get("rnnlm", modelFilename) ||
+          (find(modelFilenames.begin(), modelFilenames.end(),
+                modelFilename) != modelFilenames.end())) {
+        cout << "ERROR: each model must have its own RNN model file\n";
+        return 1;
+      }
+      modelFilenames.push_back(modelFilename);
+      ifstream modelStream(modelFilename);
+      bool isModelPresent = (bool)modelStream;
+      if (isModelPresent) {
+        cout << "RNN model file " << modelFilename << " exists\n";
+      }
+      // Architecture and training parameters of this model
+      int modelClasses = 200;
+      options.Get("class", modelClasses);
+      string modelClassAssignment = "frequency";
+      options.Get("class-assignment", modelClassAssignment);
+      string modelExportClassesFilename;
+      bool isModelExportClassesSet =
+      options.Get("export-classes", modelExportClassesFilename);
+      int modelHidden = 100;
+      options.Get("hidden", modelHidden);
+      int modelCompression = 0;
+      options.Get("compression", modelCompression);
+      int modelDirect = 0;
+      options.Get("direct", modelDirect);
+      long long modelDirectConnections = modelDirect * 1000000LL;
+      int modelDirectOrder = 3;
+      options.Get("direct-order", modelDirectOrder);
+      int modelBptt = 4;
+      options.Get("bptt", modelBptt);
+      modelBptt = max(modelBptt + 1, 1);
+      int modelBpttBlock = 10;
+      options.Get("bptt-block", modelBpttBlock);
+      modelBpttBlock = max(modelBpttBlock, 1);
+      double modelLearningRate = 0.1;
+      options.Get("alpha", modelLearningRate);
+      double modelRegularization = 0.0000001;
+      options.Get("beta", modelRegularization);
+      double modelGradientCutoff = 15;
+      options.Get("gradient-cutoff", modelGradientCutoff);
+      double modelMinImprovement = 1.01;
+      options.Get("min-improvement", modelMinImprovement);
+      bool modelIndependent = true;
+      options.Get("independent", modelIndependent);
+      double modelFeatureGamma = 0.9;
+      options.Get("feature-gamma", modelFeatureGamma);
+      int modelThreads = 1;
+      options.Get("threads", modelThreads);
+      int modelSampledWords = 0;
+      options.Get("sampled-softmax", modelSampledWords);
+      bool modelTreeTraining = false;
+      options.Get("tree-training", modelTreeTraining);
+      if ((modelDirectConnections < 0) ||
+          (modelDirectOrder > c_maxNGramOrder) || (modelDirectOrder < 0) ||
+          (modelThreads < 1) || (modelSampledWords < 0) ||
+          ((modelClassAssignment != "frequency") &&
+                                 (modelClassAssignment != "cost"))) {
+        cout << "ERROR: invalid options for model " << (k + 1) << "\n";
+        return 1;
+      }
+
+      // Construct the RNN object, setting the filename, without loading anything
+      models.push_back(unique_ptr<RnnTreeLM>(new RnnTreeLM(modelFilename,
+                                                           isModelPresent,
+                                                           debugMode)));
+      RnnTreeLM &model = *models.back();
+      modelPointers.push_back(&model);
+      model.SetTrainFile(trainFilename);
+      string filename;
+      string pathname(jsonPathname);
+      // The first model reads the books of the training corpus
+      // for all the models
+      if (k == 0) {
+        ifstream trainFileStream(trainFilename);
+        while (trainFileStream >> filename) {
+          model.AddBookTrain(pathname + filename);
+        }
+      }
+      model.SetValidFile(validFilename);
+      ifstream valid_file_stream(validFilename);
+      while (valid_file_stream >> filename) {
+        model.AddBookTestValid(pathname + filename);
+      }
+      model.SetSentenceLabelsFile(sentenceLabelsFilename);
+      model.SetBinaryBookPath(binaryBookPathname);
+
+      // The first model reads the vocabulary, the others copy it
+      model.SetCostOptimalClasses(modelClassAssignment == "cost");
+      if (k > 0) {
+        model.CopyVocabularyFrom(*models[0], modelClasses);
+      } else if (isVocabularySet) {
+        model.ImportVocabularyFromFile(vocabularyFilename, modelClasses);
+      } else {
+        model.SetMinWordOccurrence(minWordOccurrence);
+        model.LearnVocabularyFromTrainFile(modelClasses);
+      }
+      if (isModelExportClassesSet) {
+        model.ExportClasses(modelExportClassesFilename);
+      }
+
+      // Initialize the model, unless its training is restarting
+      int sizeVocabLabels =
+      (featureDepLabelsType == 2) ? model.GetLabelSize() : 0;
+      if (!isModelPresent) {
+        model.InitializeRnnModel(model.GetVocabularySize(),
+                                 modelHidden,
+                                 sizeVocabLabels,
+                                 modelClasses,
+                                 modelCompression,
+                                 modelDirectConnections,
+                                 modelDirectOrder);
+        model.SetLearningRate(modelLearningRate);
+        model.SetGradientCutoff(modelGradientCutoff);
+        model.SetRegularization(modelRegularization);
+        model.SetMinImprovement(modelMinImprovement);
+        model.SetNumStepsBPTT(modelBptt);
+        model.SetBPTTBlock(modelBpttBlock);
+        model.SetIndependent(modelIndependent);
+      } else {
+        assert(model.GetHiddenSize() == modelHidden);
+        assert(model.GetFeatureSize() == sizeVocabLabels);
+      }
+      model.SetDependencyLabelType(featureDepLabelsType);
+      model.SetFeatureGamma(modelFeatureGamma);
+      model.SetNumThreads(modelThreads);
+      model.SetNumSampledWords(modelSampledWords);
+      model.SetTreeTraining(modelTreeTraining);
+    }
+
+    // Train the models
+    if (!RnnTreeLM::TrainRnnModels(modelPointers)) {
+      return 1;
+    }
+  }
+
+  if (isTrainDataSet && isRnnModelSet && !isModelsSet &&
+      (featureDepLabelsType >= 0)) {
     // Construct the RNN object, setting the filename, without loading anything
     RnnTreeLM model(rnnModelFilename, isRnnModelPresent, debugMode);
 
@@ -409,12 +933,16 @@ int main(int argc, char *argv[]) {
     }
     // Set the sentence labels for validation or test
     model.SetSentenceLabelsFile(sentenceLabelsFilename);
+    // Cache the books as binary books
+    model.SetBinaryBookPath(binaryBookPathname);
 
     // Read the vocabulary and word classes
     if (isClassFileSet) {
       // Do we use custom classes?
       model.ReadClasses(classFilename);
     } else {
+      // Set the assignment of words to classes
+      model.SetCostOptimalClasses(useCostOptimalClasses);
       if (isVocabularySet) {
         model.ImportVocabularyFromFile(vocabularyFilename, numClasses);
       } else {
@@ -424,6 +952,10 @@ int main(int argc, char *argv[]) {
         model.LearnVocabularyFromTrainFile(numClasses);
       }
     }
+    // Export the classes of words
+    if (isExportClassesSet) {
+      model.ExportClasses(exportClassesFilename);
+    }
 
     // Initialize the model...
     int sizeVocabulary = model.GetVocabularySize();
@@ -468,13 +1000,31 @@ int main(int argc, char *argv[]) {
       model.SetBPTTBlock(bpttBlock);
       model.SetIndependent(independent);
     }
+    // Set the number of training threads
+    model.SetNumThreads(numThreads);
+    // Sample the words of the class of each training word
+    model.SetNumSampledWords(numSampledWords);
+    // Train over the trees of the unrolls of the sentences
+    model.SetTreeTraining(useTreeTraining);
+    // Save checkpoints every few books, and resume from the last one
+    model.SetCheckpointInterval(checkpointInterval);
+    // Train as one node of a cluster
+    unique_ptr<RnnCluster> cluster;
+    if (isClusterSet) {
+      cluster.reset(new RnnCluster(clusterRank, clusterNodes,
+                                   clusterHost, clusterPort));
+      model.SetCluster(cluster.get(), clusterSyncBooks);
+    }
 
     // Train the model
-    model.TrainRnnModel();
+    if (!model.TrainRnnModel()) {
+      return 1;
+    }
   }
 
   // Test the RNN on the dataset using models trained on dependency parse trees
-  if (isTestDataSet && isRnnModelSet && (featureDepLabelsType >= 0)) {
+  if (isTestDataSet && isRnnModelSet && !isEnsembleSet &&
+      (featureDepLabelsType >= 0)) {
     RnnTreeLM model(rnnModelFilename, true, debugMode);
 
     // Read the vocabulary
@@ -496,6 +1046,16 @@ int main(int argc, char *argv[]) {
     model.SetSentenceLabelsFile(sentenceLabelsFilename);
     // Set the type of dependency labels
     model.SetDependencyLabelType(featureDepLabelsType);
+    // Reuse the states of shared unroll prefixes
+    model.SetPrefixCache(usePrefixCache);
+    // Set the number of evaluation threads
+    model.SetNumThreads(numThreads);
+    // Evaluate in single precision?
+    model.SetFloat32Engine(useFloat32);
+    // Quantize the direct n-gram connections?
+    model.QuantizeDirectNGram(directPrecision);
+    // Cache the books as binary books
+    model.SetBinaryBookPath(binaryBookPathname);
 
     // Test the RNN on the test data
     vector<double> sentenceScores;
@@ -510,13 +1070,26 @@ int main(int argc, char *argv[]) {
   }
   
   // Test the RNN on the dataset using models trained on sequential text
-  if (isTestDataSet && isRnnModelSet && (featureDepLabelsType < 0)) {
+  if (isTestDataSet && isRnnModelSet && !isEnsembleSet &&
+      (featureDepLabelsType < 0)) {
     RnnLMTraining model(rnnModelFilename, true, debugMode);
 
     // Add the book names to the test corpus
     model.SetValidFile(testFilename);
     // Set the sentence labels for validation or test
     model.SetSentenceLabelsFile(sentenceLabelsFilename);
+    // Set the number of evaluation threads
+    model.SetNumThreads(numThreads);
+    // Set the number of sentences evaluated in lockstep
+    model.SetBatchSize(batchSize);
+    // Set the number of candidate sentences in each n-best list
+    model.SetNBestSize(nBestSize);
+    // Compile the text files into word index streams
+    model.SetBinaryTextPath(binaryBookPathname);
+    // Evaluate in single precision?
+    model.SetFloat32Engine(useFloat32);
+    // Quantize the direct n-gram connections?
+    model.QuantizeDirectNGram(directPrecision);
 
     // Test the RNN on the test data
     vector<double> sentenceScores;
@@ -530,5 +1103,91 @@ int main(int argc, char *argv[]) {
                        accuracy);
   }
 
+  // Score the test data with an ensemble of models
+  if (isEnsembleSet) {
+    vector<CommandLineParser> configurations;
+    if (!readModelConfigurations(ensembleFilename, parser,
+                                 c_ensembleModelOptions,
+                                 sizeof(c_ensembleModelOptions) / sizeof(char *),
+                                 configurations)) {
+      cout << "ERROR: invalid ensemble file " << ensembleFilename << "\n";
+      return 1;
+    }
+    vector<unique_ptr<RnnLMTraining> > models;
+    RnnEnsemble ensemble(numThreads);
+    for (size_t k = 0; k < configurations.size(); k++) {
+      CommandLineParser &options = configurations[k];
+      string modelFilename, modelTestFilename;
+      if (!options.Get("rnnlm", modelFilename) ||
+          !checkFile(modelFilename, "RNN model") ||
+          !options.Get("test", modelTestFilename) ||
+          !checkFile(modelTestFilename, "test data")) {
+        cout << "ERROR: each model of the ensemble needs a model file"
+        << " and test data\n";
+        return 1;
+      }
+      int modelLabelsType = 0;
+      options.Get("feature-labels-type", modelLabelsType);
+      bool modelFloat32 = false;
+      options.Get("float32", modelFloat32);
+      string modelPrecisionName = "float32";
+      options.Get("direct-precision", modelPrecisionName);
+      DirectNGramPrecision modelPrecision = c_directNGramFloat32;
+      if (modelPrecisionName == "float16") {
+        modelPrecision = c_directNGramFloat16;
+      } else if (modelPrecisionName == "int8") {
+        modelPrecision = c_directNGramInt8;
+      }
+      string modelBinaryBookPathname;
+      options.Get("path-bin-books", modelBinaryBookPathname);
+
+      if (modelLabelsType >= 0) {
+        // Model trained on dependency parse trees, with its vocabulary
+        // (by default, the one exported by the training)
+        RnnTreeLM *model = new RnnTreeLM(modelFilename, true, debugMode);
+        models.push_back(unique_ptr<RnnLMTraining>(model));
+        string modelVocabularyFilename;
+        if (!options.Get("vocab", modelVocabularyFilename)) {
+          modelVocabularyFilename = modelFilename + ".vocab.txt";
+        }
+        if (!checkFile(modelVocabularyFilename, "vocabulary")) { return 1; }
+        model->ImportVocabularyFromFile(modelVocabularyFilename,
+                                        model->GetNumClasses());
+        string pathname;
+        options.Get("path-json-books", pathname);
+        ifstream test_file_stream(modelTestFilename);
+        string filename;
+        while (test_file_stream >> filename) {
+          model->AddBookTestValid(pathname + filename);
+        }
+        model->SetDependencyLabelType(modelLabelsType);
+        bool modelPrefixCache = false;
+        options.Get("prefix-cache", modelPrefixCache);
+        model->SetPrefixCache(modelPrefixCache);
+        model->SetBinaryBookPath(modelBinaryBookPathname);
+        ensemble.AddTreeModel(model);
+      } else {
+        // Model trained on sequential text (independent sentences)
+        RnnLMTraining *model = new RnnLMTraining(modelFilename, true, debugMode);
+        models.push_back(unique_ptr<RnnLMTraining>(model));
+        int modelBatchSize = 1;
+        options.Get("batch", modelBatchSize);
+        model->SetBatchSize(modelBatchSize);
+        ensemble.AddSequentialModel(model, modelTestFilename);
+      }
+      RnnLMTraining &model = *models.back();
+      // Evaluate in single precision?
+      model.SetFloat32Engine(modelFloat32);
+      // Quantize the direct n-gram connections?
+      model.QuantizeDirectNGram(modelPrecision);
+    }
+
+    // Score the test data with all the models
+    if (!ensemble.TestEnsemble(sentenceLabelsFilename,
+                               ensembleFilename + ".scores.txt")) {
+      return 1;
+    }
+  }
+
   return 0;
 }